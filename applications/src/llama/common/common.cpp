@@ -510,10 +510,29 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
             params.dump_kv_cache = true;
         } else if (arg == "-nkvo" || arg == "--no-kv-offload") {
             params.no_kv_offload = true;
+        } else if (arg == "--no-fuse-ops") {
+            params.no_fuse_ops = true;
+        } else if (arg == "-fa" || arg == "--flash-attn") {
+            params.flash_attn = true;
+        } else if (arg == "--no-graph-cache") {
+            params.no_graph_cache = true;
+        } else if (arg == "--huge-pages") {
+            params.huge_pages = true;
         } else if (arg == "-ctk" || arg == "--cache-type-k") {
             params.cache_type_k = argv[++i];
         } else if (arg == "-ctv" || arg == "--cache-type-v") {
             params.cache_type_v = argv[++i];
+        } else if (arg == "--wait-policy") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            std::string value(argv[i]);
+            /**/ if (value == "default") { params.wait_policy = GGML_WAIT_POLICY_DEFAULT; }
+            else if (value == "spin")    { params.wait_policy = GGML_WAIT_POLICY_SPIN; }
+            else if (value == "yield")   { params.wait_policy = GGML_WAIT_POLICY_YIELD; }
+            else if (value == "sleep")   { params.wait_policy = GGML_WAIT_POLICY_SPIN_SLEEP; }
+            else { invalid_param = true; break; }
         } else if (arg == "--multiline-input") {
             params.multiline_input = true;
         } else if (arg == "--simple-io") {
@@ -588,8 +607,26 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
 #endif // GGML_USE_CUBLAS
         } else if (arg == "--no-mmap") {
             params.use_mmap = false;
+        } else if (arg == "--load-threads") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_threads_load = std::stoi(argv[i]);
         } else if (arg == "--numa") {
             params.numa = true;
+        } else if (arg == "--repack") {
+            params.repack = true;
+        } else if (arg == "--repack-cache") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.repack       = true;
+            params.repack_cache = argv[i];
+        } else if (arg == "--numa-split") {
+            params.numa       = true;
+            params.numa_split = true;
         } else if (arg == "--verbose-prompt") {
             params.verbose_prompt = true;
         } else if (arg == "-r" || arg == "--reverse-prompt") {
@@ -886,10 +923,15 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     }
     if (llama_mmap_supported()) {
         printf("  --no-mmap             do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
+        printf("  --load-threads N      number of threads reading the model with --no-mmap (default: %d)\n", params.n_threads_load);
+        printf("  --repack              interleave the rows of the Q4_0/Q8_0 weights for faster matrix products, needs --no-mmap\n");
+        printf("  --repack-cache FNAME  like --repack, and keep the repacked weights in FNAME to skip repacking on the next loads\n");
     }
     printf("  --numa                attempt optimizations that help on some NUMA systems\n");
     printf("                        if run without this previously, it is recommended to drop the system page cache before using this\n");
     printf("                        see https://github.com/ggerganov/llama.cpp/issues/1437\n");
+    printf("  --numa-split          like --numa, and place the rows of each weight matrix on the node whose threads compute them\n");
+    printf("                        use a thread count that is a multiple of the number of nodes\n");
 #ifdef LLAMA_SUPPORTS_GPU_OFFLOAD
     printf("  -ngl N, --n-gpu-layers N\n");
     printf("                        number of layers to store in VRAM\n");
@@ -909,10 +951,17 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("                        verbose print of the KV cache\n");
     printf("  -nkvo, --no-kv-offload\n");
     printf("                        disable KV offload\n");
+    printf("  --no-fuse-ops         compute the norm and the matmul input conversion separately, to compare results\n");
+    printf("  -fa, --flash-attn     compute attention in one fused op without materializing KQ (CPU only)\n");
+    printf("  --no-graph-cache      rebuild the compute graph for every batch instead of reusing it\n");
+    printf("  --huge-pages          back the KV cache, the compute buffer and the weights (with --no-mmap) with huge pages\n");
+    printf("                        (Linux, not used when CUDA allocates pinned host memory for them)\n");
     printf("  -ctk TYPE, --cache-type-k TYPE\n");
     printf("                        KV cache data type for K (default: %s)\n", params.cache_type_k.c_str());
     printf("  -ctv TYPE, --cache-type-v TYPE\n");
-    printf("                        KV cache data type for V (default: %s)\n", params.cache_type_v.c_str());
+    printf("                        KV cache data type for V, quantized types require -fa (default: %s)\n", params.cache_type_v.c_str());
+    printf("  --wait-policy {default,spin,yield,sleep}\n");
+    printf("                        how idle CPU threads wait for each other, sleep spins briefly and then blocks (default: default)\n");
     printf("  --simple-io           use basic IO for better compatibility in subprocesses and limited consoles\n");
     printf("  --lora FNAME          apply LoRA adapter (implies --no-mmap)\n");
     printf("  --lora-scaled FNAME S apply LoRA adapter with user defined scaling S (implies --no-mmap)\n");
@@ -1016,8 +1065,13 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     }
     mparams.main_gpu        = params.main_gpu;
     mparams.tensor_split    = params.tensor_split;
+    mparams.n_threads_load  = params.n_threads_load;
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
+    mparams.numa_split      = params.numa_split;
+    mparams.huge_pages      = params.huge_pages;
+    mparams.repack          = params.repack;
+    mparams.repack_cache    = params.repack_cache.empty() ? NULL : params.repack_cache.c_str();
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
     } else {
@@ -1071,10 +1125,16 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.yarn_beta_slow    = params.yarn_beta_slow;
     cparams.yarn_orig_ctx     = params.yarn_orig_ctx;
     cparams.offload_kqv       = !params.no_kv_offload;
+    cparams.fuse_ops          = !params.no_fuse_ops;
+    cparams.flash_attn        = params.flash_attn;
+    cparams.graph_cache       = !params.no_graph_cache;
+    cparams.huge_pages        = params.huge_pages;
 
     cparams.type_k = kv_cache_type_from_str(params.cache_type_k);
     cparams.type_v = kv_cache_type_from_str(params.cache_type_v);
 
+    cparams.wait_policy = params.wait_policy;
+
     return cparams;
 }
 
@@ -1159,22 +1219,24 @@ std::vector<llama_token> llama_tokenize(
   const struct llama_context * ctx,
            const std::string & text,
                         bool   add_bos,
-                        bool   special) {
-    return llama_tokenize(llama_get_model(ctx), text, add_bos, special);
+                        bool   special,
+                         int   n_threads) {
+    return llama_tokenize(llama_get_model(ctx), text, add_bos, special, n_threads);
 }
 
 std::vector<llama_token> llama_tokenize(
     const struct llama_model * model,
            const std::string & text,
                         bool   add_bos,
-                        bool   special) {
+                        bool   special,
+                         int   n_threads) {
     // upper limit for the number of tokens
     int n_tokens = text.length() + add_bos;
     std::vector<llama_token> result(n_tokens);
-    n_tokens = llama_tokenize(model, text.data(), text.length(), result.data(), result.size(), add_bos, special);
+    n_tokens = llama_tokenize_parallel(model, text.data(), text.length(), result.data(), result.size(), add_bos, special, n_threads);
     if (n_tokens < 0) {
         result.resize(-n_tokens);
-        int check = llama_tokenize(model, text.data(), text.length(), result.data(), result.size(), add_bos, special);
+        int check = llama_tokenize_parallel(model, text.data(), text.length(), result.data(), result.size(), add_bos, special, n_threads);
         GGML_ASSERT(check == -n_tokens);
     } else {
         result.resize(n_tokens);
@@ -1448,6 +1510,7 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "grammar-file: # never logged, see grammar instead. Can still be specified for input.\n");
     fprintf(stream, "hellaswag: %s # default: false\n", params.hellaswag ? "true" : "false");
     fprintf(stream, "hellaswag_tasks: %zu # default: 400\n", params.hellaswag_tasks);
+    fprintf(stream, "huge_pages: %s # default: false\n", params.huge_pages ? "true" : "false");
 
     const auto logit_bias_eos = sparams.logit_bias.find(llama_token_eos(llama_get_model(lctx)));
     const bool ignore_eos = logit_bias_eos != sparams.logit_bias.end() && logit_bias_eos->second == -INFINITY;
@@ -1494,12 +1557,14 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "model_draft: %s # default:\n", params.model_draft.c_str());
     fprintf(stream, "multiline_input: %s # default: false\n", params.multiline_input ? "true" : "false");
     fprintf(stream, "n_gpu_layers: %d # default: -1\n", params.n_gpu_layers);
+    fprintf(stream, "n_threads_load: %d # default: 4\n", params.n_threads_load);
     fprintf(stream, "n_predict: %d # default: -1 (unlimited)\n", params.n_predict);
     fprintf(stream, "n_probs: %d # only used by server binary, default: 0\n", sparams.n_probs);
     fprintf(stream, "no_mmap: %s # default: false\n", !params.use_mmap ? "true" : "false");
     fprintf(stream, "no_mul_mat_q: %s # default: false\n", !params.mul_mat_q ? "true" : "false");
     fprintf(stream, "no_penalize_nl: %s # default: false\n", !sparams.penalize_nl ? "true" : "false");
     fprintf(stream, "numa: %s # default: false\n", params.numa ? "true" : "false");
+    fprintf(stream, "numa_split: %s # default: false\n", params.numa_split ? "true" : "false");
     fprintf(stream, "ppl_output_type: %d # default: 0\n", params.ppl_output_type);
     fprintf(stream, "ppl_stride: %d # default: 0\n", params.ppl_stride);
     fprintf(stream, "presence_penalty: %f # default: 0.0\n", sparams.penalty_present);
@@ -1509,6 +1574,8 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "prompt_cache_ro: %s # default: false\n", params.prompt_cache_ro ? "true" : "false");
     dump_vector_int_yaml(stream, "prompt_tokens", prompt_tokens);
     fprintf(stream, "random_prompt: %s # default: false\n", params.random_prompt ? "true" : "false");
+    fprintf(stream, "repack: %s # default: false\n", params.repack ? "true" : "false");
+    fprintf(stream, "repack_cache: %s\n", params.repack_cache.c_str());
     fprintf(stream, "repeat_penalty: %f # default: 1.1\n", sparams.penalty_repeat);
 
     fprintf(stream, "reverse_prompt:\n");
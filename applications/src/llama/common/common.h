@@ -61,6 +61,7 @@ struct gpt_params {
     int32_t n_gpu_layers_draft              = -1;    // number of layers to store in VRAM for the draft model (-1 - use default)
     int32_t main_gpu                        = 0;     // the GPU that is used for scratch and small tensors
     float   tensor_split[LLAMA_MAX_DEVICES] = {0};   // how split tensors should be distributed across GPUs
+    int32_t n_threads_load                  = 4;     // number of threads reading the model file with --no-mmap
     int32_t n_beams                         = 0;     // if non-zero then use beam search of given width.
     float   rope_freq_base                  = 0.0f;  // RoPE base frequency
     float   rope_freq_scale                 = 0.0f;  // RoPE frequency scaling factor
@@ -92,6 +93,8 @@ struct gpt_params {
     std::vector<std::tuple<std::string, float>> lora_adapter; // lora adapter path with user defined scale
     std::string lora_base  = "";                              // base model path for the lora adapter
 
+    std::string repack_cache = "";                            // file keeping the repacked weights between runs
+
     int  ppl_stride        = 0;     // stride for perplexity calculations. If left at 0, the pre-existing approach will be used.
     int  ppl_output_type   = 0;     // = 0 -> ppl output is as usual, = 1 -> ppl output is num_tokens, ppl, one per line
                                     //                                       (which is more convenient to use for plotting)
@@ -121,14 +124,22 @@ struct gpt_params {
     bool use_mmap          = true;  // use mmap for faster loads
     bool use_mlock         = false; // use mlock to keep model in memory
     bool numa              = false; // attempt optimizations that help on some NUMA systems
+    bool numa_split        = false; // place the rows of the weights on the NUMA nodes of the threads that compute them
     bool verbose_prompt    = false; // print prompt tokens before generation
     bool infill            = false; // use infill mode
     bool dump_kv_cache     = false; // dump the KV cache contents for debugging purposes
     bool no_kv_offload     = false; // disable KV offloading
+    bool no_fuse_ops       = false; // disable fusing the norm with the matmul input conversion
+    bool flash_attn        = false; // use the fused attention op
+    bool no_graph_cache    = false; // rebuild the graph for every batch
+    bool huge_pages        = false; // back the weights (with --no-mmap), the KV cache and the compute buffer with huge pages
+    bool repack            = false; // interleave the rows of the weights for the CPU (with --no-mmap)
 
     std::string cache_type_k = "f16"; // KV cache data type for the K
     std::string cache_type_v = "f16"; // KV cache data type for the V
 
+    enum ggml_wait_policy wait_policy = GGML_WAIT_POLICY_DEFAULT; // how idle CPU threads wait for each other
+
     // multimodal models (see examples/llava)
     std::string mmproj = ""; // path to multimodal projector
     std::string image  = ""; // path to an image file
@@ -179,17 +190,20 @@ void llama_batch_add(
 
 // tokenizes a string into a vector of tokens
 // should work similar to Python's `tokenizer.encode`
+// long texts are tokenized on n_threads threads, see llama_tokenize_parallel
 std::vector<llama_token> llama_tokenize(
   const struct llama_context * ctx,
            const std::string & text,
                         bool   add_bos,
-                        bool   special = false);
+                        bool   special   = false,
+                         int   n_threads = 1);
 
 std::vector<llama_token> llama_tokenize(
     const struct llama_model * model,
            const std::string & text,
                         bool   add_bos,
-                        bool   special = false);
+                        bool   special   = false,
+                         int   n_threads = 1);
 
 // tokenizes a token into a piece
 // should work similar to Python's `tokenizer.id_to_piece`
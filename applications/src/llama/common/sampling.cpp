@@ -1,5 +1,11 @@
 #include "sampling.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
 struct llama_sampling_context * llama_sampling_init(const struct llama_sampling_params & params) {
     struct llama_sampling_context * result = new llama_sampling_context();
 
@@ -123,11 +129,10 @@ std::string llama_sampling_order_print(const llama_sampling_params & params) {
 // no reasons to expose this function in header
 static void sampler_queue(
                    struct llama_context * ctx_main,
+                                    int   n_vocab,
             const llama_sampling_params & params,
                  llama_token_data_array & cur_p,
                                  size_t & min_keep) {
-    const int n_vocab = llama_n_vocab(llama_get_model(ctx_main));
-
     const float         temp              = params.temp;
     const int32_t       top_k             = params.top_k <= 0 ? n_vocab : params.top_k;
     const float         top_p             = params.top_p;
@@ -149,11 +154,170 @@ static void sampler_queue(
     }
 }
 
-llama_token llama_sampling_sample(
+// apply the repetition penalties in place to the logits of the tokens in the penalty window,
+// keeping the original values in penalty_saved so they can be restored afterwards
+// same arithmetic as llama_sample_repetition_penalties, but without touching the rest of the vocabulary
+static void sampler_penalties_apply(
+        struct llama_sampling_context * ctx_sampling,
+                                float * logits,
+                                  int   n_vocab,
+                          llama_token   token_nl,
+                              int32_t   penalty_last_n) {
+    const llama_sampling_params & params = ctx_sampling->params;
+
+    const float penalty_repeat  = params.penalty_repeat;
+    const float penalty_freq    = params.penalty_freq;
+    const float penalty_present = params.penalty_present;
+
+    auto & tokens = ctx_sampling->penalty_tokens;
+    auto & saved  = ctx_sampling->penalty_saved;
+
+    saved.clear();
+
+    if (penalty_last_n == 0 || (penalty_repeat == 1.0f && penalty_freq == 0.0f && penalty_present == 0.0f)) {
+        return;
+    }
+
+    const auto & prev = ctx_sampling->prev;
+
+    tokens.assign(prev.end() - penalty_last_n, prev.end());
+    std::sort(tokens.begin(), tokens.end());
+
+    for (size_t i = 0; i < tokens.size(); ) {
+        const llama_token id = tokens[i];
+
+        size_t j = i + 1;
+        while (j < tokens.size() && tokens[j] == id) {
+            j++;
+        }
+
+        const int count = j - i;
+        i = j;
+
+        if (id < 0 || id >= n_vocab || (id == token_nl && !params.penalize_nl)) {
+            continue;
+        }
+
+        float logit = logits[id];
+        saved.push_back(llama_token_data{id, logit, 0.0f});
+
+        if (logit <= 0) {
+            logit *= penalty_repeat;
+        } else {
+            logit /= penalty_repeat;
+        }
+
+        logit -= float(count) * penalty_freq + float(count > 0) * penalty_present;
+
+        logits[id] = logit;
+    }
+}
+
+static void sampler_penalties_restore(struct llama_sampling_context * ctx_sampling, float * logits) {
+    for (const auto & td : ctx_sampling->penalty_saved) {
+        logits[td.id] = td.logit;
+    }
+}
+
+// first index of the largest logit, as llama_sample_token_greedy would pick it
+static llama_token sampler_argmax(const float * logits, int n_vocab) {
+    llama_token result = 0;
+
+    for (llama_token i = 1; i < n_vocab; i++) {
+        if (logits[i] > logits[result]) {
+            result = i;
+        }
+    }
+
+    return result;
+}
+
+// select the k largest logits into cur in descending order without building the full candidate array
+// a min-heap holds the best k seen so far, and blocks of logits that are all below its smallest element
+// are skipped with a single vectorizable test
+// returns false if equal logits make the selection or its order differ from llama_sample_top_k's,
+// in which case the caller falls back to the full sort
+static bool sampler_top_k_fused(const float * logits, int n_vocab, int k, std::vector<llama_token_data> & cur) {
+    const int block = 16;
+
+    auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
+
+    cur.clear();
+
+    for (llama_token i = 0; i < k; i++) {
+        cur.push_back(llama_token_data{i, logits[i], 0.0f});
+    }
+
+    std::make_heap(cur.begin(), cur.end(), comp);
+
+    float thold = cur.front().logit;
+
+    auto insert = [&](llama_token i) {
+        std::pop_heap(cur.begin(), cur.end(), comp);
+        cur.back() = llama_token_data{i, logits[i], 0.0f};
+        std::push_heap(cur.begin(), cur.end(), comp);
+        thold = cur.front().logit;
+    };
+
+    llama_token i = k;
+
+    for (; i + block <= n_vocab; i += block) {
+        int any = 0;
+        for (int j = 0; j < block; j++) {
+            any |= logits[i + j] > thold;
+        }
+
+        if (!any) {
+            continue;
+        }
+
+        for (int j = 0; j < block; j++) {
+            if (logits[i + j] > thold) {
+                insert(i + j);
+            }
+        }
+    }
+
+    for (; i < n_vocab; i++) {
+        if (logits[i] > thold) {
+            insert(i);
+        }
+    }
+
+    // a logit outside the selection equal to the smallest selected one
+    int n_ge = 0;
+    for (llama_token i = 0; i < n_vocab; i++) {
+        n_ge += logits[i] >= thold;
+    }
+
+    if (n_ge != k) {
+        return false;
+    }
+
+    std::sort_heap(cur.begin(), cur.end(), comp);
+
+    for (int i = 1; i < k; i++) {
+        if (cur[i - 1].logit == cur[i].logit) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// apply the logit bias, cfg, penalties, grammar and the sampler queue to the logits, leaving the candidates
+// for the final draw in cur
+// this step does not consume the rng of ctx_main: sampling time is accounted to ctx_time, which may be
+// nullptr, so that sequences without cfg and grammar can be prepared concurrently
+static llama_token_data_array sampler_prepare(
                   struct llama_sampling_context * ctx_sampling,
                   struct llama_context * ctx_main,
+                  struct llama_context * ctx_time,
                   struct llama_context * ctx_cfg,
-                  const int idx) {
+                  float * logits,
+                  std::vector<llama_token_data> & cur) {
     const llama_sampling_params & params = ctx_sampling->params;
 
     const int n_vocab = llama_n_vocab(llama_get_model(ctx_main));
@@ -164,22 +328,52 @@ llama_token llama_sampling_sample(
     const float   penalty_freq    = params.penalty_freq;
     const float   penalty_present = params.penalty_present;
     const int     mirostat        = params.mirostat;
-    const float   mirostat_tau    = params.mirostat_tau;
-    const float   mirostat_eta    = params.mirostat_eta;
     const bool    penalize_nl     = params.penalize_nl;
 
     auto & prev = ctx_sampling->prev;
-    auto & cur  = ctx_sampling->cur;
 
-    llama_token id = 0;
-
-    float * logits = llama_get_logits_ith(ctx_main, idx);
+    size_t min_keep = std::max(1, params.n_probs);
 
     // apply params.logit_bias map
     for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++) {
         logits[it->first] += it->second;
     }
 
+    // without cfg and grammar, greedy sampling and sampler sequences starting with top_k only need the
+    // few best logits: select them directly from the logits instead of sorting the whole vocabulary
+    const bool fused = !ctx_cfg && ctx_sampling->grammar == NULL && penalty_last_n <= (int32_t) prev.size() &&
+        (temp == 0.0 || (temp > 0.0 && mirostat == 0 && !params.samplers_sequence.empty() && params.samplers_sequence[0] == 'k'));
+
+    if (fused) {
+        int top_k = params.top_k <= 0 ? n_vocab : params.top_k;
+        top_k = std::max(top_k, (int) min_keep);
+        top_k = std::min(top_k, n_vocab);
+
+        sampler_penalties_apply(ctx_sampling, logits, n_vocab, llama_token_nl(llama_get_model(ctx_main)), penalty_last_n);
+
+        bool ok = true;
+        if (temp == 0.0) {
+            const llama_token best = sampler_argmax(logits, n_vocab);
+            cur.clear();
+            cur.push_back(llama_token_data{best, logits[best], 0.0f});
+        } else {
+            ok = top_k < n_vocab && sampler_top_k_fused(logits, n_vocab, top_k, cur);
+        }
+
+        sampler_penalties_restore(ctx_sampling, logits);
+
+        if (ok) {
+            llama_token_data_array cur_p = { cur.data(), cur.size(), true };
+
+            if (temp > 0.0) {
+                // top_k is a no-op on the already selected candidates
+                sampler_queue(ctx_time, n_vocab, params, cur_p, min_keep);
+            }
+
+            return cur_p;
+        }
+    }
+
     cur.clear();
 
     for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
@@ -196,7 +390,7 @@ llama_token llama_sampling_sample(
     if (!prev.empty()) {
         const float nl_logit = logits[llama_token_nl(llama_get_model(ctx_main))];
 
-        llama_sample_repetition_penalties(ctx_main, &cur_p,
+        llama_sample_repetition_penalties(ctx_time, &cur_p,
                 prev.data() + prev.size() - penalty_last_n,
                 penalty_last_n, penalty_repeat, penalty_freq, penalty_present);
 
@@ -216,7 +410,34 @@ llama_token llama_sampling_sample(
 
     if (temp < 0.0) {
         // greedy sampling, with probs
-        llama_sample_softmax(ctx_main, &cur_p);
+        llama_sample_softmax(ctx_time, &cur_p);
+    } else if (temp > 0.0) {
+        if (mirostat == 1 || mirostat == 2) {
+            llama_sample_temp(ctx_time, &cur_p, temp);
+        } else {
+            // temperature sampling
+            sampler_queue(ctx_time, n_vocab, params, cur_p, min_keep);
+        }
+    }
+
+    return cur_p;
+}
+
+// pick the token from the prepared candidates - this is the only step that uses the rng of ctx_main
+static llama_token sampler_draw(
+                  struct llama_sampling_context * ctx_sampling,
+                  struct llama_context * ctx_main,
+                  llama_token_data_array & cur_p) {
+    const llama_sampling_params & params = ctx_sampling->params;
+
+    const float temp         = params.temp;
+    const int   mirostat     = params.mirostat;
+    const float mirostat_tau = params.mirostat_tau;
+    const float mirostat_eta = params.mirostat_eta;
+
+    llama_token id = 0;
+
+    if (temp < 0.0) {
         id = cur_p.data[0].id;
     } else if (temp == 0.0) {
         // greedy sampling, no probs
@@ -224,17 +445,10 @@ llama_token llama_sampling_sample(
     } else {
         if (mirostat == 1) {
             const int mirostat_m = 100;
-            llama_sample_temp(ctx_main, &cur_p, temp);
             id = llama_sample_token_mirostat(ctx_main, &cur_p, mirostat_tau, mirostat_eta, mirostat_m, &ctx_sampling->mirostat_mu);
         } else if (mirostat == 2) {
-            llama_sample_temp(ctx_main, &cur_p, temp);
             id = llama_sample_token_mirostat_v2(ctx_main, &cur_p, mirostat_tau, mirostat_eta, &ctx_sampling->mirostat_mu);
         } else {
-            // temperature sampling
-            size_t min_keep = std::max(1, params.n_probs);
-
-            sampler_queue(ctx_main, params, cur_p, min_keep);
-
             id = llama_sample_token(ctx_main, &cur_p);
 
             //{
@@ -255,6 +469,170 @@ llama_token llama_sampling_sample(
     return id;
 }
 
+llama_token llama_sampling_sample(
+                  struct llama_sampling_context * ctx_sampling,
+                  struct llama_context * ctx_main,
+                  struct llama_context * ctx_cfg,
+                  const int idx) {
+    float * logits = llama_get_logits_ith(ctx_main, idx);
+
+    llama_token_data_array cur_p = sampler_prepare(ctx_sampling, ctx_main, ctx_main, ctx_cfg, logits, ctx_sampling->cur);
+
+    return sampler_draw(ctx_sampling, ctx_main, cur_p);
+}
+
+struct llama_batch_sampler {
+    std::vector<std::thread> workers;
+
+    std::mutex              mutex;
+    std::condition_variable cv_work;
+    std::condition_variable cv_done;
+
+    // the workers run work(ith) once per generation
+    std::function<void(int)> work;
+    uint64_t generation = 0;
+    int      n_busy     = 0;
+    bool     quit       = false;
+
+    // candidates of each thread, shared by the sequences it prepares
+    std::vector<std::vector<llama_token_data>> scratch;
+
+    std::vector<llama_token_data_array> cur_ps;
+};
+
+static void batch_sampler_worker(llama_batch_sampler * bsmpl, int ith) {
+    uint64_t generation = 0;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(bsmpl->mutex);
+            bsmpl->cv_work.wait(lock, [&] { return bsmpl->quit || bsmpl->generation != generation; });
+            if (bsmpl->quit) {
+                return;
+            }
+            generation = bsmpl->generation;
+        }
+
+        bsmpl->work(ith);
+
+        {
+            std::lock_guard<std::mutex> lock(bsmpl->mutex);
+            if (--bsmpl->n_busy == 0) {
+                bsmpl->cv_done.notify_one();
+            }
+        }
+    }
+}
+
+struct llama_batch_sampler * llama_batch_sampler_init(int n_threads) {
+    n_threads = std::max(1, n_threads);
+
+    struct llama_batch_sampler * result = new llama_batch_sampler();
+
+    result->scratch.resize(n_threads);
+
+    result->workers.reserve(n_threads - 1);
+    for (int i = 1; i < n_threads; i++) {
+        result->workers.emplace_back(batch_sampler_worker, result, i);
+    }
+
+    return result;
+}
+
+void llama_batch_sampler_free(struct llama_batch_sampler * bsmpl) {
+    if (bsmpl == nullptr) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(bsmpl->mutex);
+        bsmpl->quit = true;
+    }
+    bsmpl->cv_work.notify_all();
+
+    for (auto & w : bsmpl->workers) {
+        w.join();
+    }
+
+    delete bsmpl;
+}
+
+std::vector<llama_token> llama_sampling_sample_batch(
+                           struct llama_batch_sampler * bsmpl,
+        const std::vector<llama_sampling_context *> & ctx_samplings,
+                           struct llama_context * ctx_main,
+                            const std::vector<int> & idxs) {
+    GGML_ASSERT(ctx_samplings.size() == idxs.size());
+
+    const int n_seq = ctx_samplings.size();
+
+    auto & cur_ps = bsmpl->cur_ps;
+    cur_ps.resize(n_seq);
+
+    // sequences with a grammar need ctx_main to prepare, so they are prepared serially below
+    std::atomic<int> next(0);
+
+    auto compute = [&](int ith) {
+        std::vector<llama_token_data> & scratch = bsmpl->scratch[ith];
+
+        for (int i = next++; i < n_seq; i = next++) {
+            llama_sampling_context * ctx_sampling = ctx_samplings[i];
+
+            if (ctx_sampling->grammar != NULL) {
+                continue;
+            }
+
+            float * logits = llama_get_logits_ith(ctx_main, idxs[i]);
+
+            const llama_token_data_array cur_p = sampler_prepare(ctx_sampling, ctx_main, nullptr, nullptr, logits, scratch);
+
+            ctx_sampling->cur.assign(cur_p.data, cur_p.data + cur_p.size);
+
+            cur_ps[i] = { ctx_sampling->cur.data(), ctx_sampling->cur.size(), cur_p.sorted };
+        }
+    };
+
+    // a single sequence is not worth waking the workers for
+    const int n_workers = n_seq > 1 ? (int) bsmpl->workers.size() : 0;
+
+    if (n_workers > 0) {
+        {
+            std::lock_guard<std::mutex> lock(bsmpl->mutex);
+            bsmpl->work   = compute;
+            bsmpl->n_busy = n_workers;
+            bsmpl->generation++;
+        }
+        bsmpl->cv_work.notify_all();
+    }
+
+    compute(0);
+
+    if (n_workers > 0) {
+        std::unique_lock<std::mutex> lock(bsmpl->mutex);
+        bsmpl->cv_done.wait(lock, [&] { return bsmpl->n_busy == 0; });
+        bsmpl->work = nullptr;
+    }
+
+    for (int i = 0; i < n_seq; i++) {
+        llama_sampling_context * ctx_sampling = ctx_samplings[i];
+
+        if (ctx_sampling->grammar != NULL) {
+            float * logits = llama_get_logits_ith(ctx_main, idxs[i]);
+
+            cur_ps[i] = sampler_prepare(ctx_sampling, ctx_main, ctx_main, nullptr, logits, ctx_sampling->cur);
+        }
+    }
+
+    // draw in sequence order so that the rng is consumed exactly as by consecutive llama_sampling_sample calls
+    std::vector<llama_token> result(n_seq);
+
+    for (int i = 0; i < n_seq; i++) {
+        result[i] = sampler_draw(ctx_samplings[i], ctx_main, cur_ps[i]);
+    }
+
+    return result;
+}
+
 void llama_sampling_accept(
         struct llama_sampling_context * ctx_sampling,
         struct llama_context * ctx_main,
@@ -55,6 +55,10 @@ struct llama_sampling_context {
     // TODO: replace with ring-buffer
     std::vector<llama_token>      prev;
     std::vector<llama_token_data> cur;
+
+    // scratch for the fused top-k path, reused across calls
+    std::vector<llama_token>      penalty_tokens;
+    std::vector<llama_token_data> penalty_saved;
 };
 
 #include "common.h"
@@ -107,6 +111,32 @@ llama_token llama_sampling_sample(
         struct llama_context * ctx_cfg,
         int idx = 0);
 
+// worker threads and scratch buffers of llama_sampling_sample_batch, kept across calls
+struct llama_batch_sampler;
+
+// Create n_threads - 1 worker threads, the calling thread is the first one
+struct llama_batch_sampler * llama_batch_sampler_init(int n_threads);
+
+void llama_batch_sampler_free(struct llama_batch_sampler * bsmpl);
+
+// sample one token for each of several sequences decoded in the same batch, with per-sequence parameters
+// returns the same tokens as calling llama_sampling_sample(ctx_samplings[i], ctx_main, nullptr, idxs[i])
+// for each i in turn: the candidates are prepared on the threads of bsmpl, then the tokens are drawn in order
+// sequences with a grammar are prepared on the calling thread
+// the sampling contexts and the logit indices must be distinct
+//
+// required:
+//  - bsmpl:         batch sampler, used by one call at a time
+//  - ctx_samplings: sampling context of each sequence
+//  - ctx_main:      context holding the logits
+//  - idxs:          sample sequence i from llama_get_logits_ith(ctx_main, idxs[i])
+//
+std::vector<llama_token> llama_sampling_sample_batch(
+        struct llama_batch_sampler * bsmpl,
+        const std::vector<llama_sampling_context *> & ctx_samplings,
+        struct llama_context * ctx_main,
+        const std::vector<int> & idxs);
+
 void llama_sampling_accept(
         struct llama_sampling_context * ctx_sampling,
         struct llama_context * ctx_main,
@@ -246,7 +246,9 @@ int main(int argc, char ** argv) {
         if (params.chatml) {
             params.prompt = "<|im_start|>system\n" + params.prompt + "<|im_end|>";
         }
-        embd_inp = ::llama_tokenize(ctx, params.prompt, add_bos, true);
+        // long prompts are tokenized on the batch threads
+        const int n_threads_tokenize = params.n_threads_batch == -1 ? params.n_threads : params.n_threads_batch;
+        embd_inp = ::llama_tokenize(ctx, params.prompt, add_bos, true, n_threads_tokenize);
     } else {
         LOG("use session tokens\n");
         embd_inp = session_tokens;
@@ -852,7 +854,7 @@ int main(int argc, char ** argv) {
 
     if (!path_session.empty() && params.prompt_cache_all && !params.prompt_cache_ro) {
         LOG_TEE("\n%s: saving final output to session file '%s'\n", __func__, path_session.c_str());
-        llama_save_session_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
+        llama_append_session_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
     }
 
     llama_print_timings(ctx);
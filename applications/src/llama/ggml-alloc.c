@@ -24,11 +24,21 @@ static size_t aligned_offset(const void * buffer, size_t offset, size_t alignmen
     return offset + align;
 }
 
+#define N_FREE_BINS 64 // size classes of the free blocks, by the position of the highest bit of the size
+#define FREE_BINS_MIN_BLOCKS 32 // below this number of free blocks, the best fit is found with a linear scan
+
 struct free_block {
     void * addr;
     size_t size;
+    int bin;  // size class, -1 if the block is not in a bin
+    int prev; // neighbours in the list of the bin, -1 at the ends
+    int next;
 };
 
+// the free blocks live in a pool of MAX_FREE_BLOCKS entries
+// their indices are kept ordered by address, so that the neighbours of a freed tensor are found by binary search
+// with many blocks, every block but the last one is also in the list of its size class, where the best fit is searched
+// the last block is the last resort of the allocations, as it usually holds the unused end of the buffer
 struct ggml_tallocr {
     struct ggml_backend_buffer * buffer;
     bool buffer_owned;
@@ -37,6 +47,11 @@ struct ggml_tallocr {
 
     int n_free_blocks;
     struct free_block free_blocks[MAX_FREE_BLOCKS];
+    int free_order[MAX_FREE_BLOCKS]; // indices of the free blocks by address
+    int free_pool[MAX_FREE_BLOCKS];  // unused entries of free_blocks, [0, MAX_FREE_BLOCKS - n_free_blocks)
+    int free_bins[N_FREE_BINS];      // first block of each size class, -1 if none
+    uint64_t free_bins_used;         // mask of the size classes that have blocks
+    bool free_bins_on;               // whether the blocks are in the size classes
 
     size_t max_size;
 
@@ -79,6 +94,190 @@ static bool ggml_is_view(struct ggml_tensor * t) {
     return t->view_src != NULL;
 }
 
+static int free_block_bin(size_t size) {
+    uint64_t x = size;
+    int bin = 0;
+    for (int shift = 32; shift > 0; shift /= 2) {
+        if (x >> shift) {
+            x >>= shift;
+            bin += shift;
+        }
+    }
+    return bin;
+}
+
+static void free_block_bin_insert(ggml_tallocr_t alloc, int ib) {
+    struct free_block * block = &alloc->free_blocks[ib];
+
+    if (!alloc->free_bins_on) {
+        block->bin = -1;
+        return;
+    }
+
+    block->bin  = free_block_bin(block->size);
+    block->prev = -1;
+    block->next = alloc->free_bins[block->bin];
+    if (block->next != -1) {
+        alloc->free_blocks[block->next].prev = ib;
+    }
+    alloc->free_bins[block->bin] = ib;
+    alloc->free_bins_used |= 1ull << block->bin;
+}
+
+static void free_block_bin_remove(ggml_tallocr_t alloc, int ib) {
+    struct free_block * block = &alloc->free_blocks[ib];
+
+    if (block->bin == -1) {
+        return;
+    }
+    if (block->prev != -1) {
+        alloc->free_blocks[block->prev].next = block->next;
+    } else {
+        alloc->free_bins[block->bin] = block->next;
+        if (block->next == -1) {
+            alloc->free_bins_used &= ~(1ull << block->bin);
+        }
+    }
+    if (block->next != -1) {
+        alloc->free_blocks[block->next].prev = block->prev;
+    }
+    block->bin = -1;
+}
+
+// move a block to the size class of its new size, the last block is not in any
+static void free_block_resized(ggml_tallocr_t alloc, int ib) {
+    if (alloc->free_blocks[ib].bin != -1) {
+        free_block_bin_remove(alloc, ib);
+        free_block_bin_insert(alloc, ib);
+    }
+}
+
+// the last block leaves its size class and the previous last block, if it is not the last anymore, enters its own
+static void free_block_last_changed(ggml_tallocr_t alloc, int ib_last_old) {
+    const int ib_last = alloc->n_free_blocks > 0 ? alloc->free_order[alloc->n_free_blocks - 1] : -1;
+
+    if (ib_last == ib_last_old) {
+        return;
+    }
+    if (ib_last != -1) {
+        free_block_bin_remove(alloc, ib_last);
+    }
+    if (ib_last_old != -1 && alloc->free_blocks[ib_last_old].size > 0 && alloc->free_blocks[ib_last_old].bin == -1) {
+        free_block_bin_insert(alloc, ib_last_old);
+    }
+}
+
+// put the blocks in the size classes when there are many, and take them out when there are few again
+static void free_block_bins_update(ggml_tallocr_t alloc) {
+    if (!alloc->free_bins_on && alloc->n_free_blocks >= FREE_BINS_MIN_BLOCKS) {
+        alloc->free_bins_on = true;
+        for (int i = 0; i < alloc->n_free_blocks - 1; i++) {
+            free_block_bin_insert(alloc, alloc->free_order[i]);
+        }
+    } else if (alloc->free_bins_on && alloc->n_free_blocks < FREE_BINS_MIN_BLOCKS/2) {
+        for (int i = 0; i < alloc->n_free_blocks; i++) {
+            free_block_bin_remove(alloc, alloc->free_order[i]);
+        }
+        alloc->free_bins_on = false;
+    }
+}
+
+// insert a block at position pos of the address order
+static void free_block_insert(ggml_tallocr_t alloc, int pos, void * addr, size_t size) {
+    GGML_ASSERT(alloc->n_free_blocks < MAX_FREE_BLOCKS && "out of free blocks");
+
+    const int ib_last_old = alloc->n_free_blocks > 0 ? alloc->free_order[alloc->n_free_blocks - 1] : -1;
+
+    const int ib = alloc->free_pool[MAX_FREE_BLOCKS - alloc->n_free_blocks - 1];
+
+    alloc->free_blocks[ib] = (struct free_block) { addr, size, -1, -1, -1 };
+
+    memmove(&alloc->free_order[pos + 1], &alloc->free_order[pos], (alloc->n_free_blocks - pos)*sizeof(int));
+    alloc->free_order[pos] = ib;
+    alloc->n_free_blocks++;
+
+    if (pos < alloc->n_free_blocks - 1) {
+        free_block_bin_insert(alloc, ib);
+    }
+    free_block_last_changed(alloc, ib_last_old);
+    free_block_bins_update(alloc);
+}
+
+// remove the block at position pos of the address order
+static void free_block_remove(ggml_tallocr_t alloc, int pos) {
+    const int ib_last_old = alloc->free_order[alloc->n_free_blocks - 1];
+
+    const int ib = alloc->free_order[pos];
+
+    free_block_bin_remove(alloc, ib);
+    alloc->free_blocks[ib].size = 0;
+
+    alloc->n_free_blocks--;
+    memmove(&alloc->free_order[pos], &alloc->free_order[pos + 1], (alloc->n_free_blocks - pos)*sizeof(int));
+    alloc->free_pool[MAX_FREE_BLOCKS - alloc->n_free_blocks - 1] = ib;
+
+    free_block_last_changed(alloc, ib_last_old);
+    free_block_bins_update(alloc);
+}
+
+// position in the address order of the first block after addr
+static int free_block_upper_bound(ggml_tallocr_t alloc, const void * addr) {
+    int lo = 0;
+    int hi = alloc->n_free_blocks;
+    while (lo < hi) {
+        const int mid = (lo + hi)/2;
+        if ((const char *) alloc->free_blocks[alloc->free_order[mid]].addr <= (const char *) addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// the smallest block of at least size bytes besides the last block, the one with the highest address among equals
+static int free_block_best_fit(ggml_tallocr_t alloc, size_t size) {
+    if (!alloc->free_bins_on) {
+        int best = -1;
+        for (int i = 0; i < alloc->n_free_blocks - 1; i++) {
+            const int ib = alloc->free_order[i];
+            const struct free_block * block = &alloc->free_blocks[ib];
+            if (block->size >= size && (best == -1 || block->size <= alloc->free_blocks[best].size)) {
+                best = ib;
+            }
+        }
+        return best;
+    }
+
+    const int bin0 = free_block_bin(size);
+
+    uint64_t used = alloc->free_bins_used >> bin0;
+
+    for (int bin = bin0; used != 0; bin++, used >>= 1) {
+        if (!(used & 1)) {
+            continue;
+        }
+
+        int best = -1;
+        for (int ib = alloc->free_bins[bin]; ib != -1; ib = alloc->free_blocks[ib].next) {
+            const struct free_block * block = &alloc->free_blocks[ib];
+            if (block->size < size) {
+                continue;
+            }
+            if (best == -1 || block->size < alloc->free_blocks[best].size ||
+                (block->size == alloc->free_blocks[best].size && (char *) block->addr > (char *) alloc->free_blocks[best].addr)) {
+                best = ib;
+            }
+        }
+        if (best != -1) {
+            // the blocks of the next size classes are larger
+            return best;
+        }
+    }
+
+    return -1;
+}
+
 void ggml_tallocr_alloc(ggml_tallocr_t alloc, struct ggml_tensor * tensor) {
     GGML_ASSERT(!ggml_is_view(tensor)); // views generally get data pointer from one of their sources
     GGML_ASSERT(tensor->data == NULL); // avoid allocating tensor which already has memory allocated
@@ -88,29 +287,21 @@ void ggml_tallocr_alloc(ggml_tallocr_t alloc, struct ggml_tensor * tensor) {
 
     AT_PRINTF("%s: allocating %s (%zu bytes) - ", __func__, tensor->name, size);
 
-    size_t max_avail = 0;
-
     // find the best fitting free block besides the last block
-    int best_fit_block = -1;
-    size_t best_fit_size = SIZE_MAX;
-    for (int i = 0; i < alloc->n_free_blocks - 1; i++) {
-        struct free_block * block = &alloc->free_blocks[i];
-        max_avail = MAX(max_avail, block->size);
-        if (block->size >= size && block->size <= best_fit_size) {
-            best_fit_block = i;
-            best_fit_size = block->size;
-        }
-    }
+    int best_fit_block = free_block_best_fit(alloc, size);
 
     AT_PRINTF("block %d\n", best_fit_block);
 
     if (best_fit_block == -1) {
         // the last block is our last resort
-        struct free_block * block = &alloc->free_blocks[alloc->n_free_blocks - 1];
-        max_avail = MAX(max_avail, block->size);
-        if (block->size >= size) {
-            best_fit_block = alloc->n_free_blocks - 1;
+        const int ib_last = alloc->n_free_blocks > 0 ? alloc->free_order[alloc->n_free_blocks - 1] : -1;
+        if (ib_last != -1 && alloc->free_blocks[ib_last].size >= size) {
+            best_fit_block = ib_last;
         } else {
+            size_t max_avail = 0;
+            for (int i = 0; i < alloc->n_free_blocks; i++) {
+                max_avail = MAX(max_avail, alloc->free_blocks[alloc->free_order[i]].size);
+            }
             fprintf(stderr, "%s: not enough space in the buffer (needed %zu, largest block available %zu)\n",
                     __func__, size, max_avail);
             GGML_ASSERT(!"not enough space in the buffer");
@@ -122,11 +313,10 @@ void ggml_tallocr_alloc(ggml_tallocr_t alloc, struct ggml_tensor * tensor) {
     block->addr = (char*)block->addr + size;
     block->size -= size;
     if (block->size == 0) {
-        // remove block if empty
-        alloc->n_free_blocks--;
-        for (int j = best_fit_block; j < alloc->n_free_blocks; j++) {
-            alloc->free_blocks[j] = alloc->free_blocks[j+1];
-        }
+        // remove block if empty, the next block starts after its end
+        free_block_remove(alloc, free_block_upper_bound(alloc, block->addr) - 1);
+    } else {
+        free_block_resized(alloc, best_fit_block);
     }
 
     tensor->data = addr;
@@ -152,7 +342,6 @@ void ggml_tallocr_alloc(ggml_tallocr_t alloc, struct ggml_tensor * tensor) {
     alloc->max_size = MAX(alloc->max_size, (char*)addr - (char*)alloc->base + size);
 }
 
-// this is a very naive implementation, but for our case the number of free blocks should be very small
 static void ggml_tallocr_free_tensor(ggml_tallocr_t alloc, struct ggml_tensor * tensor) {
     if (ggml_tallocr_is_own(alloc, tensor) == false) {
         // the tensor was not allocated in this buffer
@@ -172,63 +361,54 @@ static void ggml_tallocr_free_tensor(ggml_tallocr_t alloc, struct ggml_tensor *
     remove_allocated_tensor(alloc, tensor);
 #endif
 
-    // see if we can merge with an existing block
-    for (int i = 0; i < alloc->n_free_blocks; i++) {
-        struct free_block * block = &alloc->free_blocks[i];
-        // check if ptr is at the end of the block
-        if ((char*)block->addr + block->size == ptr) {
-            block->size += size;
-            // check if we can merge with the next block
-            if (i < alloc->n_free_blocks - 1 && (char*)block->addr + block->size == alloc->free_blocks[i+1].addr) {
-                block->size += alloc->free_blocks[i+1].size;
-                alloc->n_free_blocks--;
-                for (int j = i+1; j < alloc->n_free_blocks; j++) {
-                    alloc->free_blocks[j] = alloc->free_blocks[j+1];
-                }
-            }
-            return;
-        }
-        // check if ptr is at the beginning of the block
-        if ((char*)ptr + size == block->addr) {
-            block->addr = ptr;
-            block->size += size;
-            // check if we can merge with the previous block
-            if (i > 0 && (char*)alloc->free_blocks[i-1].addr + alloc->free_blocks[i-1].size == block->addr) {
-                alloc->free_blocks[i-1].size += block->size;
-                alloc->n_free_blocks--;
-                for (int j = i; j < alloc->n_free_blocks; j++) {
-                    alloc->free_blocks[j] = alloc->free_blocks[j+1];
-                }
-            }
-            return;
+    // the free blocks before and after ptr
+    const int pos = free_block_upper_bound(alloc, ptr);
+
+    struct free_block * prev = pos > 0                    ? &alloc->free_blocks[alloc->free_order[pos - 1]] : NULL;
+    struct free_block * next = pos < alloc->n_free_blocks ? &alloc->free_blocks[alloc->free_order[pos]]     : NULL;
+
+    const bool merge_prev = prev && (char*)prev->addr + prev->size == ptr;
+    const bool merge_next = next && (char*)ptr + size == next->addr;
+
+    if (merge_prev) {
+        // ptr is at the end of the previous block, which may now reach the next block
+        prev->size += size;
+        if (merge_next) {
+            prev->size += next->size;
+            free_block_remove(alloc, pos);
         }
+        free_block_resized(alloc, alloc->free_order[pos - 1]);
+        return;
+    }
+    if (merge_next) {
+        // ptr is at the beginning of the next block
+        next->addr = ptr;
+        next->size += size;
+        free_block_resized(alloc, alloc->free_order[pos]);
+        return;
     }
+
     // otherwise, add a new block
-    GGML_ASSERT(alloc->n_free_blocks < MAX_FREE_BLOCKS && "out of free blocks");
-    // insert the new block in the correct position to keep the array sorted by address (to make merging blocks faster)
-    int insert_pos = 0;
-    while (insert_pos < alloc->n_free_blocks && alloc->free_blocks[insert_pos].addr < ptr) {
-        insert_pos++;
-    }
-    // shift all blocks from insert_pos onward to make room for the new block
-    for (int i = alloc->n_free_blocks; i > insert_pos; i--) {
-        alloc->free_blocks[i] = alloc->free_blocks[i-1];
-    }
-    // insert the new block
-    alloc->free_blocks[insert_pos].addr = ptr;
-    alloc->free_blocks[insert_pos].size = size;
-    alloc->n_free_blocks++;
+    free_block_insert(alloc, pos, ptr, size);
 }
 
 void ggml_tallocr_reset(ggml_tallocr_t alloc) {
-    alloc->n_free_blocks = 1;
+    alloc->n_free_blocks  = 0;
+    alloc->free_bins_used = 0;
+    alloc->free_bins_on   = false;
+    for (int i = 0; i < MAX_FREE_BLOCKS; i++) {
+        alloc->free_pool[i] = MAX_FREE_BLOCKS - 1 - i;
+    }
+    for (int i = 0; i < N_FREE_BINS; i++) {
+        alloc->free_bins[i] = -1;
+    }
+
     size_t align_offset = aligned_offset(alloc->base, 0, alloc->alignment);
-    alloc->free_blocks[0].addr = (char *)alloc->base + align_offset;
 
     if (alloc->measure) {
-        alloc->free_blocks[0].size = SIZE_MAX/2; // restrict maximum size of a measure allocator to half size_t max to avoid overflows
+        free_block_insert(alloc, 0, (char *)alloc->base + align_offset, SIZE_MAX/2); // restrict maximum size of a measure allocator to half size_t max to avoid overflows
     } else {
-        alloc->free_blocks[0].size = ggml_backend_buffer_get_size(alloc->buffer) - align_offset;
+        free_block_insert(alloc, 0, (char *)alloc->base + align_offset, ggml_backend_buffer_get_size(alloc->buffer) - align_offset);
     }
 }
 
@@ -242,9 +422,14 @@ ggml_tallocr_t ggml_tallocr_new(void * data, size_t size, size_t alignment) {
         /*.buffer_owned  = */ true,
         /*.base          = */ ggml_backend_buffer_get_base(buffer),
         /*.alignment     = */ alignment,
-        /*.n_free_blocks = */ 0,
-        /*.free_blocks   = */ {{0}},
-        /*.max_size      = */ 0,
+        /*.n_free_blocks  = */ 0,
+        /*.free_blocks    = */ {{0}},
+        /*.free_order     = */ {0},
+        /*.free_pool      = */ {0},
+        /*.free_bins      = */ {0},
+        /*.free_bins_used = */ 0,
+        /*.free_bins_on   = */ false,
+        /*.max_size       = */ 0,
         /*.measure       = */ false,
 #ifdef GGML_ALLOCATOR_DEBUG
         /*.allocated_tensors = */ {0},
@@ -290,9 +475,14 @@ ggml_tallocr_t ggml_tallocr_new_from_buffer(struct ggml_backend_buffer * buffer)
         /*.buffer_owned  = */ false,
         /*.base          = */ ggml_backend_buffer_get_base(buffer),
         /*.alignment     = */ ggml_backend_buffer_get_alignment(buffer),
-        /*.n_free_blocks = */ 0,
-        /*.free_blocks   = */ {{0}},
-        /*.max_size      = */ 0,
+        /*.n_free_blocks  = */ 0,
+        /*.free_blocks    = */ {{0}},
+        /*.free_order     = */ {0},
+        /*.free_pool      = */ {0},
+        /*.free_bins      = */ {0},
+        /*.free_bins_used = */ 0,
+        /*.free_bins_on   = */ false,
+        /*.max_size       = */ 0,
         /*.measure       = */ false,
 #ifdef GGML_ALLOCATOR_DEBUG
         /*.allocated_tensors = */ {0},
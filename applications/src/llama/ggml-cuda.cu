@@ -8230,6 +8230,7 @@ bool ggml_cuda_can_mul_mat(const struct ggml_tensor * src0, const struct ggml_te
 
     // TODO: find the optimal values for these
     return (src0->type == GGML_TYPE_F32 || src0->type == GGML_TYPE_F16 || ggml_is_quantized(src0->type)) &&
+            !ggml_is_repacked(src0->type) &&
             src1->type == GGML_TYPE_F32 &&
              dst->type == GGML_TYPE_F32 &&
             (ne0 >= 32 && ne1 >= 32 && ne10 >= 32);
@@ -8905,6 +8906,8 @@ static size_t ggml_nbytes_split(const struct ggml_tensor * tensor, int nrows_spl
 }
 
 void ggml_cuda_transform_tensor(void * data, struct ggml_tensor * tensor) {
+    GGML_ASSERT(!ggml_is_repacked(tensor->type));
+
     const int64_t nrows = ggml_nrows(tensor);
 
     const int64_t ne0 = tensor->ne[0];
@@ -9198,6 +9201,11 @@ bool ggml_cuda_compute_forward(struct ggml_compute_params * params, struct ggml_
 #endif
             return false;
         }
+
+        // the interleaved rows of ggml_repack_tensor are only computed by the CPU
+        if (ggml_is_repacked(tensor->src[0]->type)) {
+            return false;
+        }
     }
 
     switch (tensor->op) {
@@ -9729,7 +9737,7 @@ static bool ggml_backend_cuda_supports_op(ggml_backend_t backend, const ggml_ten
                     a = op->src[2];
                     b = op->src[1];
                 }
-                if (a->ne[3] != b->ne[3]) {
+                if (a->ne[3] != b->ne[3] || ggml_is_repacked(a->type)) {
                     return false;
                 }
                 return true;
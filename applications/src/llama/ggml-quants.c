@@ -2378,6 +2378,334 @@ void quantize_row_q8_K(const float * restrict x, void * restrict y, int k) {
     quantize_row_q8_K_reference(x, y, k);
 }
 
+// x holds 4 rows of k values one after the other
+void repack_rows_q4_0x4(const block_q4_0 * restrict x, block_q4_0x4 * restrict y, int k) {
+    assert(k % QK4_0 == 0);
+    const int nb = k / QK4_0;
+
+    for (int i = 0; i < nb; i++) {
+        for (int r = 0; r < 4; ++r) {
+            y[i].d[r] = x[r*nb + i].d;
+            memcpy(y[i].qs + r*QK4_0/2, x[r*nb + i].qs, QK4_0/2);
+        }
+    }
+}
+
+void repack_rows_q8_0x4(const block_q8_0 * restrict x, block_q8_0x4 * restrict y, int k) {
+    assert(k % QK8_0 == 0);
+    const int nb = k / QK8_0;
+
+    for (int i = 0; i < nb; i++) {
+        for (int r = 0; r < 4; ++r) {
+            y[i].d[r] = x[r*nb + i].d;
+            memcpy(y[i].qs + r*QK8_0, x[r*nb + i].qs, QK8_0);
+        }
+    }
+}
+
+void pack_panel_q4_0(const void * restrict vx, size_t bx, void * restrict vy, int k) {
+    assert(k % QK4_0 == 0);
+    const int nb = k / QK4_0;
+
+    block_q8_panel * restrict y = vy;
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        const block_q4_0 * restrict x = (const block_q4_0 *) ((const char *) vx + r*bx);
+
+        for (int i = 0; i < nb; i++) {
+            y[i].d[r] = GGML_FP16_TO_FP32(x[i].d);
+            y[i].m[r] = 0.0f;
+
+            for (int j = 0; j < QK4_0/2; ++j) {
+                y[i].qs[r][j + 0      ] = (x[i].qs[j] & 0x0F) - 8;
+                y[i].qs[r][j + QK4_0/2] = (x[i].qs[j] >>   4) - 8;
+            }
+        }
+    }
+}
+
+void pack_panel_q4_1(const void * restrict vx, size_t bx, void * restrict vy, int k) {
+    assert(k % QK4_1 == 0);
+    const int nb = k / QK4_1;
+
+    block_q8_panel * restrict y = vy;
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        const block_q4_1 * restrict x = (const block_q4_1 *) ((const char *) vx + r*bx);
+
+        for (int i = 0; i < nb; i++) {
+            y[i].d[r] = GGML_FP16_TO_FP32(x[i].d);
+            y[i].m[r] = GGML_FP16_TO_FP32(x[i].m);
+
+            for (int j = 0; j < QK4_1/2; ++j) {
+                y[i].qs[r][j + 0      ] = x[i].qs[j] & 0x0F;
+                y[i].qs[r][j + QK4_1/2] = x[i].qs[j] >>   4;
+            }
+        }
+    }
+}
+
+void pack_panel_q5_0(const void * restrict vx, size_t bx, void * restrict vy, int k) {
+    assert(k % QK5_0 == 0);
+    const int nb = k / QK5_0;
+
+    block_q8_panel * restrict y = vy;
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        const block_q5_0 * restrict x = (const block_q5_0 *) ((const char *) vx + r*bx);
+
+        for (int i = 0; i < nb; i++) {
+            y[i].d[r] = GGML_FP16_TO_FP32(x[i].d);
+            y[i].m[r] = 0.0f;
+
+            uint32_t qh;
+            memcpy(&qh, x[i].qh, sizeof(qh));
+
+            for (int j = 0; j < QK5_0/2; ++j) {
+                const uint8_t xh_0 = ((qh >> (j +  0)) << 4) & 0x10;
+                const uint8_t xh_1 = ((qh >> (j + 12))     ) & 0x10;
+
+                y[i].qs[r][j + 0      ] = ((x[i].qs[j] & 0x0F) | xh_0) - 16;
+                y[i].qs[r][j + QK5_0/2] = ((x[i].qs[j] >>   4) | xh_1) - 16;
+            }
+        }
+    }
+}
+
+void pack_panel_q5_1(const void * restrict vx, size_t bx, void * restrict vy, int k) {
+    assert(k % QK5_1 == 0);
+    const int nb = k / QK5_1;
+
+    block_q8_panel * restrict y = vy;
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        const block_q5_1 * restrict x = (const block_q5_1 *) ((const char *) vx + r*bx);
+
+        for (int i = 0; i < nb; i++) {
+            y[i].d[r] = GGML_FP16_TO_FP32(x[i].d);
+            y[i].m[r] = GGML_FP16_TO_FP32(x[i].m);
+
+            uint32_t qh;
+            memcpy(&qh, x[i].qh, sizeof(qh));
+
+            for (int j = 0; j < QK5_1/2; ++j) {
+                const uint8_t xh_0 = ((qh >> (j +  0)) << 4) & 0x10;
+                const uint8_t xh_1 = ((qh >> (j + 12))     ) & 0x10;
+
+                y[i].qs[r][j + 0      ] = (x[i].qs[j] & 0x0F) | xh_0;
+                y[i].qs[r][j + QK5_1/2] = (x[i].qs[j] >>   4) | xh_1;
+            }
+        }
+    }
+}
+
+void pack_panel_q8_0(const void * restrict vx, size_t bx, void * restrict vy, int k) {
+    assert(k % QK8_0 == 0);
+    const int nb = k / QK8_0;
+
+    block_q8_panel * restrict y = vy;
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        const block_q8_0 * restrict x = (const block_q8_0 *) ((const char *) vx + r*bx);
+
+        for (int i = 0; i < nb; i++) {
+            y[i].d[r] = GGML_FP16_TO_FP32(x[i].d);
+            y[i].m[r] = 0.0f;
+
+            memcpy(y[i].qs[r], x[i].qs, QK8_0);
+        }
+    }
+}
+
+#if QK_K == 256
+// the quants of the super-block are unpacked in the order of dequantize_row_*, the scale of output j is scales[j/16]
+void pack_panel_q2_K(const void * restrict vx, size_t bx, void * restrict vy, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    block_q8_K_panel * restrict y = vy;
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        const block_q2_K * restrict x = (const block_q2_K *) ((const char *) vx + r*bx);
+
+        for (int i = 0; i < nb; i++) {
+            y[i].d[r]    = GGML_FP16_TO_FP32(x[i].d);
+            y[i].dmin[r] = GGML_FP16_TO_FP32(x[i].dmin);
+
+            for (int j = 0; j < QK_K/16; ++j) {
+                y[i].scales[r][j] = x[i].scales[j] & 0xF;
+                y[i].mins[r][j]   = x[i].scales[j] >>  4;
+            }
+
+            const uint8_t * q = x[i].qs;
+            uint8_t * restrict qs = y[i].qs[r];
+
+            for (int n = 0; n < QK_K; n += 128) {
+                for (int shift = 0; shift < 8; shift += 2) {
+                    for (int l = 0; l < 32; ++l) *qs++ = (q[l] >> shift) & 3;
+                }
+                q += 32;
+            }
+        }
+    }
+}
+
+void pack_panel_q3_K(const void * restrict vx, size_t bx, void * restrict vy, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    const uint32_t kmask1 = 0x03030303;
+    const uint32_t kmask2 = 0x0f0f0f0f;
+
+    uint32_t aux[4];
+    const int8_t * scales = (const int8_t*)aux;
+
+    block_q8_K_panel * restrict y = vy;
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        const block_q3_K * restrict x = (const block_q3_K *) ((const char *) vx + r*bx);
+
+        for (int i = 0; i < nb; i++) {
+            y[i].d[r]    = GGML_FP16_TO_FP32(x[i].d);
+            y[i].dmin[r] = GGML_FP16_TO_FP32(x[i].d);
+
+            memcpy(aux, x[i].scales, 12);
+            uint32_t tmp = aux[2];
+            aux[2] = ((aux[0] >> 4) & kmask2) | (((tmp >> 4) & kmask1) << 4);
+            aux[3] = ((aux[1] >> 4) & kmask2) | (((tmp >> 6) & kmask1) << 4);
+            aux[0] = (aux[0] & kmask2) | (((tmp >> 0) & kmask1) << 4);
+            aux[1] = (aux[1] & kmask2) | (((tmp >> 2) & kmask1) << 4);
+
+            // d*scale*(q - 4) with unsigned q
+            for (int j = 0; j < QK_K/16; ++j) {
+                y[i].scales[r][j] = scales[j] - 32;
+                y[i].mins[r][j]   = 4*y[i].scales[r][j];
+            }
+
+            const uint8_t * restrict q  = x[i].qs;
+            const uint8_t * restrict hm = x[i].hmask;
+            uint8_t m = 1;
+            uint8_t * restrict qs = y[i].qs[r];
+
+            for (int n = 0; n < QK_K; n += 128) {
+                for (int shift = 0; shift < 8; shift += 2) {
+                    for (int l = 0; l < 32; ++l) *qs++ = ((q[l] >> shift) & 3) + ((hm[l] & m) ? 4 : 0);
+                    m <<= 1;
+                }
+                q += 32;
+            }
+        }
+    }
+}
+
+void pack_panel_q4_K(const void * restrict vx, size_t bx, void * restrict vy, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    block_q8_K_panel * restrict y = vy;
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        const block_q4_K * restrict x = (const block_q4_K *) ((const char *) vx + r*bx);
+
+        for (int i = 0; i < nb; i++) {
+            y[i].d[r]    = GGML_FP16_TO_FP32(x[i].d);
+            y[i].dmin[r] = GGML_FP16_TO_FP32(x[i].dmin);
+
+            // the scales and mins are per group of 32 quants
+            for (int j = 0; j < QK_K/32; ++j) {
+                uint8_t sc, m;
+                get_scale_min_k4(j, x[i].scales, &sc, &m);
+                y[i].scales[r][2*j + 0] = y[i].scales[r][2*j + 1] = sc;
+                y[i].mins[r][2*j + 0]   = y[i].mins[r][2*j + 1]   = m;
+            }
+
+            const uint8_t * q = x[i].qs;
+            uint8_t * restrict qs = y[i].qs[r];
+
+            for (int j = 0; j < QK_K; j += 64) {
+                for (int l = 0; l < 32; ++l) *qs++ = q[l] & 0xF;
+                for (int l = 0; l < 32; ++l) *qs++ = q[l]  >> 4;
+                q += 32;
+            }
+        }
+    }
+}
+
+void pack_panel_q5_K(const void * restrict vx, size_t bx, void * restrict vy, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    block_q8_K_panel * restrict y = vy;
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        const block_q5_K * restrict x = (const block_q5_K *) ((const char *) vx + r*bx);
+
+        for (int i = 0; i < nb; i++) {
+            y[i].d[r]    = GGML_FP16_TO_FP32(x[i].d);
+            y[i].dmin[r] = GGML_FP16_TO_FP32(x[i].dmin);
+
+            // the scales and mins are per group of 32 quants
+            for (int j = 0; j < QK_K/32; ++j) {
+                uint8_t sc, m;
+                get_scale_min_k4(j, x[i].scales, &sc, &m);
+                y[i].scales[r][2*j + 0] = y[i].scales[r][2*j + 1] = sc;
+                y[i].mins[r][2*j + 0]   = y[i].mins[r][2*j + 1]   = m;
+            }
+
+            const uint8_t * ql = x[i].qs;
+            const uint8_t * qh = x[i].qh;
+            uint8_t u1 = 1, u2 = 2;
+            uint8_t * restrict qs = y[i].qs[r];
+
+            for (int j = 0; j < QK_K; j += 64) {
+                for (int l = 0; l < 32; ++l) *qs++ = (ql[l] & 0xF) + (qh[l] & u1 ? 16 : 0);
+                for (int l = 0; l < 32; ++l) *qs++ = (ql[l]  >> 4) + (qh[l] & u2 ? 16 : 0);
+                ql += 32;
+                u1 <<= 2; u2 <<= 2;
+            }
+        }
+    }
+}
+
+void pack_panel_q6_K(const void * restrict vx, size_t bx, void * restrict vy, int k) {
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    block_q8_K_panel * restrict y = vy;
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        const block_q6_K * restrict x = (const block_q6_K *) ((const char *) vx + r*bx);
+
+        for (int i = 0; i < nb; i++) {
+            y[i].d[r]    = GGML_FP16_TO_FP32(x[i].d);
+            y[i].dmin[r] = GGML_FP16_TO_FP32(x[i].d);
+
+            // d*scale*(q - 32) with unsigned q
+            for (int j = 0; j < QK_K/16; ++j) {
+                y[i].scales[r][j] = x[i].scales[j];
+                y[i].mins[r][j]   = 32*x[i].scales[j];
+            }
+
+            const uint8_t * restrict ql = x[i].ql;
+            const uint8_t * restrict qh = x[i].qh;
+            uint8_t * restrict qs = y[i].qs[r];
+
+            for (int n = 0; n < QK_K; n += 128) {
+                for (int l = 0; l < 32; ++l) {
+                    qs[l +  0] = (ql[l +  0] & 0xF) | (((qh[l] >> 0) & 3) << 4);
+                    qs[l + 32] = (ql[l + 32] & 0xF) | (((qh[l] >> 2) & 3) << 4);
+                    qs[l + 64] = (ql[l +  0]  >> 4) | (((qh[l] >> 4) & 3) << 4);
+                    qs[l + 96] = (ql[l + 32]  >> 4) | (((qh[l] >> 6) & 3) << 4);
+                }
+                qs += 128;
+                ql += 64;
+                qh += 32;
+            }
+        }
+    }
+}
+#endif
+
 //===================================== Dot ptoducts =================================
 
 //
@@ -3641,6 +3969,373 @@ void ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const void * restri
 #endif
 }
 
+// the interleaved kernels load every block of y once for the 4 rows
+// every row accumulates in the same order as the single row kernels, so the results do not depend on the layout
+void ggml_vec_dot_q4_0x4_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0x4 * restrict x = vx;
+    const block_q8_0   * restrict y = vy;
+
+#if defined(__AVX2__)
+    __m256 acc[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+
+    const __m256i off = _mm256_set1_epi8( 8 );
+
+    for (int i = 0; i < nb; ++i) {
+        const float dy = GGML_FP16_TO_FP32(y[i].d);
+
+        const __m256i by = _mm256_loadu_si256((const __m256i *)y[i].qs);
+
+        for (int r = 0; r < 4; ++r) {
+            const __m256 d = _mm256_set1_ps( GGML_FP16_TO_FP32(x[i].d[r]) * dy );
+
+            const __m256i bx = _mm256_sub_epi8( bytes_from_nibbles_32(x[i].qs + r*qk/2), off );
+
+            const __m256 q = mul_sum_i8_pairs_float(bx, by);
+
+            acc[r] = _mm256_fmadd_ps( d, q, acc[r] );
+        }
+    }
+
+    for (int r = 0; r < 4; ++r) {
+        s[r] = hsum_float_8(acc[r]);
+    }
+#else
+    // scalar
+    float sumf[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+    for (int i = 0; i < nb; i++) {
+        for (int r = 0; r < 4; ++r) {
+            const uint8_t * restrict qs = x[i].qs + r*qk/2;
+
+            int sumi = 0;
+
+            for (int j = 0; j < qk/2; ++j) {
+                const int v0 = (qs[j] & 0x0F) - 8;
+                const int v1 = (qs[j] >>   4) - 8;
+
+                sumi += (v0 * y[i].qs[j]) + (v1 * y[i].qs[j + qk/2]);
+            }
+
+            sumf[r] += sumi*GGML_FP16_TO_FP32(x[i].d[r])*GGML_FP16_TO_FP32(y[i].d);
+        }
+    }
+
+    for (int r = 0; r < 4; ++r) {
+        s[r] = sumf[r];
+    }
+#endif
+}
+
+void ggml_vec_dot_q8_0x4_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q8_0x4 * restrict x = vx;
+    const block_q8_0   * restrict y = vy;
+
+#if defined(__AVX2__)
+    __m256 acc[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+
+    for (int i = 0; i < nb; ++i) {
+        const float dy = GGML_FP16_TO_FP32(y[i].d);
+
+        const __m256i by = _mm256_loadu_si256((const __m256i *)y[i].qs);
+
+        for (int r = 0; r < 4; ++r) {
+            const __m256 d = _mm256_set1_ps( GGML_FP16_TO_FP32(x[i].d[r]) * dy );
+
+            const __m256i bx = _mm256_loadu_si256((const __m256i *)(x[i].qs + r*qk));
+
+            const __m256 q = mul_sum_i8_pairs_float(bx, by);
+
+            acc[r] = _mm256_fmadd_ps( d, q, acc[r] );
+        }
+    }
+
+    for (int r = 0; r < 4; ++r) {
+        s[r] = hsum_float_8(acc[r]);
+    }
+#else
+    // scalar
+    float sumf[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+    for (int i = 0; i < nb; i++) {
+        for (int r = 0; r < 4; ++r) {
+            const int8_t * restrict qs = x[i].qs + r*qk;
+
+            int sumi = 0;
+
+            for (int j = 0; j < qk; j++) {
+                sumi += qs[j]*y[i].qs[j];
+            }
+
+            sumf[r] += sumi*(GGML_FP16_TO_FP32(x[i].d[r])*GGML_FP16_TO_FP32(y[i].d));
+        }
+    }
+
+    for (int r = 0; r < 4; ++r) {
+        s[r] = sumf[r];
+    }
+#endif
+}
+
+// the panel kernels load every block of x and y once for the whole tile
+void ggml_gemm_q8_panel_q8_0(const int n, float * restrict s, size_t bs, const void * restrict vx, const void * restrict vy, size_t by) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q8_panel * restrict x = vx;
+    const block_q8_0     * restrict y[QK_PANEL_N] = { vy, (const block_q8_0 *) ((const char *) vy + by) };
+
+    static_assert(QK_PANEL_N == 2, "the tile kernels assume 2 rows of y");
+
+    float sumf[QK_PANEL][QK_PANEL_N];
+
+#if defined(__AVX2__)
+    __m256 acc[QK_PANEL][QK_PANEL_N];
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        acc[r][0] = acc[r][1] = _mm256_setzero_ps();
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        const float dy0 = GGML_FP16_TO_FP32(y[0][i].d);
+        const float dy1 = GGML_FP16_TO_FP32(y[1][i].d);
+
+        const __m256i qy0 = _mm256_loadu_si256((const __m256i *)y[0][i].qs);
+        const __m256i qy1 = _mm256_loadu_si256((const __m256i *)y[1][i].qs);
+
+        for (int r = 0; r < QK_PANEL; ++r) {
+            const __m256i qx = _mm256_loadu_si256((const __m256i *)x[i].qs[r]);
+
+            acc[r][0] = _mm256_fmadd_ps( _mm256_set1_ps(x[i].d[r]*dy0), mul_sum_i8_pairs_float(qx, qy0), acc[r][0] );
+            acc[r][1] = _mm256_fmadd_ps( _mm256_set1_ps(x[i].d[r]*dy1), mul_sum_i8_pairs_float(qx, qy1), acc[r][1] );
+        }
+    }
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        for (int c = 0; c < QK_PANEL_N; ++c) {
+            sumf[r][c] = hsum_float_8(acc[r][c]);
+        }
+    }
+#else
+    // scalar
+    for (int r = 0; r < QK_PANEL; ++r) {
+        for (int c = 0; c < QK_PANEL_N; ++c) {
+            sumf[r][c] = 0.0f;
+        }
+    }
+
+    for (int i = 0; i < nb; i++) {
+        for (int r = 0; r < QK_PANEL; ++r) {
+            for (int c = 0; c < QK_PANEL_N; ++c) {
+                int sumi = 0;
+
+                for (int j = 0; j < qk; j++) {
+                    sumi += x[i].qs[r][j]*y[c][i].qs[j];
+                }
+
+                sumf[r][c] += sumi*(x[i].d[r]*GGML_FP16_TO_FP32(y[c][i].d));
+            }
+        }
+    }
+#endif
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        for (int c = 0; c < QK_PANEL_N; ++c) {
+            s[c*bs + r] = sumf[r][c];
+        }
+    }
+}
+
+void ggml_gemm_q8_panel_q8_1(const int n, float * restrict s, size_t bs, const void * restrict vx, const void * restrict vy, size_t by) {
+    const int qk = QK8_1;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q8_panel * restrict x = vx;
+    const block_q8_1     * restrict y[QK_PANEL_N] = { vy, (const block_q8_1 *) ((const char *) vy + by) };
+
+    float sumf[QK_PANEL][QK_PANEL_N];
+    float summs[QK_PANEL][QK_PANEL_N];
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        for (int c = 0; c < QK_PANEL_N; ++c) {
+            summs[r][c] = 0.0f;
+        }
+    }
+
+#if defined(__AVX2__)
+    __m256 acc[QK_PANEL][QK_PANEL_N];
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        acc[r][0] = acc[r][1] = _mm256_setzero_ps();
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256i qy0 = _mm256_loadu_si256((const __m256i *)y[0][i].qs);
+        const __m256i qy1 = _mm256_loadu_si256((const __m256i *)y[1][i].qs);
+
+        for (int r = 0; r < QK_PANEL; ++r) {
+            // the quants of the types with a min are unsigned
+            const __m256i qx = _mm256_loadu_si256((const __m256i *)x[i].qs[r]);
+
+            acc[r][0] = _mm256_fmadd_ps( _mm256_set1_ps(x[i].d[r]*y[0][i].d), mul_sum_us8_pairs_float(qx, qy0), acc[r][0] );
+            acc[r][1] = _mm256_fmadd_ps( _mm256_set1_ps(x[i].d[r]*y[1][i].d), mul_sum_us8_pairs_float(qx, qy1), acc[r][1] );
+
+            summs[r][0] += x[i].m[r]*y[0][i].s;
+            summs[r][1] += x[i].m[r]*y[1][i].s;
+        }
+    }
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        for (int c = 0; c < QK_PANEL_N; ++c) {
+            sumf[r][c] = hsum_float_8(acc[r][c]);
+        }
+    }
+#else
+    // scalar
+    for (int r = 0; r < QK_PANEL; ++r) {
+        for (int c = 0; c < QK_PANEL_N; ++c) {
+            sumf[r][c] = 0.0f;
+        }
+    }
+
+    for (int i = 0; i < nb; i++) {
+        for (int r = 0; r < QK_PANEL; ++r) {
+            for (int c = 0; c < QK_PANEL_N; ++c) {
+                int sumi = 0;
+
+                for (int j = 0; j < qk; j++) {
+                    sumi += x[i].qs[r][j]*y[c][i].qs[j];
+                }
+
+                sumf[r][c]  += sumi*(x[i].d[r]*y[c][i].d);
+                summs[r][c] += x[i].m[r]*y[c][i].s;
+            }
+        }
+    }
+#endif
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        for (int c = 0; c < QK_PANEL_N; ++c) {
+            s[c*bs + r] = sumf[r][c] + summs[r][c];
+        }
+    }
+}
+
+// x = d*scale*q - dmin*min with unsigned q for every group of 16 quants: the integer sums of the groups are scaled
+// before they are converted to float, as in the vec_dot kernels of the k-quants, and the mins are applied with the
+// bsums of y - the quants of y can be -128, so x cannot give its sign to y as in the kernels of the 32 value blocks
+void ggml_gemm_q8_K_panel_q8_K(const int n, float * restrict s, size_t bs, const void * restrict vx, const void * restrict vy, size_t by) {
+    const int nb = n / QK_K;
+
+    assert(n % QK_K == 0);
+
+    const block_q8_K_panel * restrict x = vx;
+    const block_q8_K       * restrict y[QK_PANEL_N] = { vy, (const block_q8_K *) ((const char *) vy + by) };
+
+    float sumf[QK_PANEL][QK_PANEL_N];
+    float summs[QK_PANEL][QK_PANEL_N];
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        for (int c = 0; c < QK_PANEL_N; ++c) {
+            summs[r][c] = 0.0f;
+        }
+    }
+
+#if defined(__AVX2__)
+    __m256 acc[QK_PANEL][QK_PANEL_N];
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        acc[r][0] = acc[r][1] = _mm256_setzero_ps();
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        for (int r = 0; r < QK_PANEL; ++r) {
+            __m256i sumi0 = _mm256_setzero_si256();
+            __m256i sumi1 = _mm256_setzero_si256();
+
+            for (int j = 0; j < QK_K/32; ++j) {
+                // the scales of the two groups of 16 quants in the lower and upper lanes
+                const __m256i sc = MM256_SET_M128I(_mm_set1_epi16(x[i].scales[r][2*j + 1]), _mm_set1_epi16(x[i].scales[r][2*j + 0]));
+
+                const __m256i qx = _mm256_loadu_si256((const __m256i *)(x[i].qs[r] + 32*j));
+
+                const __m256i qy0 = _mm256_loadu_si256((const __m256i *)(y[0][i].qs + 32*j));
+                const __m256i qy1 = _mm256_loadu_si256((const __m256i *)(y[1][i].qs + 32*j));
+
+                sumi0 = _mm256_add_epi32(sumi0, _mm256_madd_epi16(_mm256_maddubs_epi16(qx, qy0), sc));
+                sumi1 = _mm256_add_epi32(sumi1, _mm256_madd_epi16(_mm256_maddubs_epi16(qx, qy1), sc));
+            }
+
+            acc[r][0] = _mm256_fmadd_ps(_mm256_set1_ps(x[i].d[r]*y[0][i].d), _mm256_cvtepi32_ps(sumi0), acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(_mm256_set1_ps(x[i].d[r]*y[1][i].d), _mm256_cvtepi32_ps(sumi1), acc[r][1]);
+
+            const __m256i mins = _mm256_loadu_si256((const __m256i *)x[i].mins[r]);
+
+            const int summ0 = hsum_i32_8(_mm256_madd_epi16(mins, _mm256_loadu_si256((const __m256i *)y[0][i].bsums)));
+            const int summ1 = hsum_i32_8(_mm256_madd_epi16(mins, _mm256_loadu_si256((const __m256i *)y[1][i].bsums)));
+
+            summs[r][0] += x[i].dmin[r]*y[0][i].d*summ0;
+            summs[r][1] += x[i].dmin[r]*y[1][i].d*summ1;
+        }
+    }
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        for (int c = 0; c < QK_PANEL_N; ++c) {
+            sumf[r][c] = hsum_float_8(acc[r][c]);
+        }
+    }
+#else
+    // scalar
+    for (int r = 0; r < QK_PANEL; ++r) {
+        for (int c = 0; c < QK_PANEL_N; ++c) {
+            sumf[r][c] = 0.0f;
+        }
+    }
+
+    for (int i = 0; i < nb; i++) {
+        for (int r = 0; r < QK_PANEL; ++r) {
+            for (int c = 0; c < QK_PANEL_N; ++c) {
+                int sumi = 0;
+                int summ = 0;
+
+                for (int j = 0; j < QK_K/16; ++j) {
+                    int sumg = 0;
+
+                    for (int l = 0; l < 16; ++l) {
+                        sumg += x[i].qs[r][16*j + l]*y[c][i].qs[16*j + l];
+                    }
+
+                    sumi += x[i].scales[r][j]*sumg;
+                    summ += x[i].mins[r][j]*y[c][i].bsums[j];
+                }
+
+                sumf[r][c]  += x[i].d[r]*y[c][i].d*sumi;
+                summs[r][c] += x[i].dmin[r]*y[c][i].d*summ;
+            }
+        }
+    }
+#endif
+
+    for (int r = 0; r < QK_PANEL; ++r) {
+        for (int c = 0; c < QK_PANEL_N; ++c) {
+            s[c*bs + r] = sumf[r][c] - summs[r][c];
+        }
+    }
+}
+
 #if QK_K == 256
 void ggml_vec_dot_q2_K_q8_K(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
 
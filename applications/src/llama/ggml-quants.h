@@ -54,6 +54,22 @@ typedef struct {
 } block_q8_1;
 static_assert(sizeof(block_q8_1) == 2*sizeof(float) + QK8_1, "wrong q8_1 block size/padding");
 
+//
+// Interleaved structures: block i of 4 consecutive rows, the quants of row r at qs[r*(size of the quants of a row)]
+//
+
+typedef struct {
+    ggml_fp16_t d[4];          // deltas
+    uint8_t qs[4 * QK4_0 / 2]; // nibbles / quants
+} block_q4_0x4;
+static_assert(sizeof(block_q4_0x4) == 4*sizeof(block_q4_0), "wrong q4_0x4 block size/padding");
+
+typedef struct {
+    ggml_fp16_t d[4];          // deltas
+    int8_t  qs[4 * QK8_0];     // quants
+} block_q8_0x4;
+static_assert(sizeof(block_q8_0x4) == 4*sizeof(block_q8_0), "wrong q8_0x4 block size/padding");
+
 //
 // Super-block quantization structures
 //
@@ -165,6 +181,30 @@ typedef struct {
 } block_q8_K;
 static_assert(sizeof(block_q8_K) == sizeof(float) + QK_K + QK_K/16*sizeof(int16_t), "wrong q8_K block size/padding");
 
+//
+// Panels for the quantized GEMM of mul_mat: block i of QK_PANEL rows, with the quants unpacked to bytes and the
+// scales to plain numbers, so that the tile kernels only have to multiply bytes
+//
+
+#define QK_PANEL   4 // rows per panel
+#define QK_PANEL_N 2 // rows of y per tile
+
+typedef struct {
+    float  d[QK_PANEL];         // deltas
+    float  m[QK_PANEL];         // mins, 0 for the types without a min
+    int8_t qs[QK_PANEL][QK8_0]; // quants, signed for the types without a min
+} block_q8_panel;
+static_assert(sizeof(block_q8_panel) == 2*QK_PANEL*sizeof(float) + QK_PANEL*QK8_0, "wrong q8 panel block size/padding");
+
+typedef struct {
+    float   d[QK_PANEL];                // super-block scales
+    float   dmin[QK_PANEL];             // super-block scales of the mins
+    int16_t scales[QK_PANEL][QK_K/16];  // scales of the groups of 16 quants
+    int16_t mins[QK_PANEL][QK_K/16];    // mins of the groups of 16 quants, the offset of the quants for the types without mins
+    uint8_t qs[QK_PANEL][QK_K];         // quants
+} block_q8_K_panel;
+static_assert(sizeof(block_q8_K_panel) == 2*QK_PANEL*sizeof(float) + QK_PANEL*(QK_K/8*sizeof(int16_t) + QK_K), "wrong q8_K panel block size/padding");
+
 
 // Quantization
 void quantize_row_q4_0_reference(const float * restrict x, block_q4_0 * restrict y, int k);
@@ -210,6 +250,23 @@ void dequantize_row_q5_K(const block_q5_K * restrict x, float * restrict y, int
 void dequantize_row_q6_K(const block_q6_K * restrict x, float * restrict y, int k);
 void dequantize_row_q8_K(const block_q8_K * restrict x, float * restrict y, int k);
 
+// Repacking of 4 consecutive rows of k values into the interleaved layout
+void repack_rows_q4_0x4(const block_q4_0 * restrict x, block_q4_0x4 * restrict y, int k);
+void repack_rows_q8_0x4(const block_q8_0 * restrict x, block_q8_0x4 * restrict y, int k);
+
+// Packing of QK_PANEL rows of k values with a stride of bx bytes into panels
+void pack_panel_q4_0(const void * restrict x, size_t bx, void * restrict y, int k);
+void pack_panel_q4_1(const void * restrict x, size_t bx, void * restrict y, int k);
+void pack_panel_q5_0(const void * restrict x, size_t bx, void * restrict y, int k);
+void pack_panel_q5_1(const void * restrict x, size_t bx, void * restrict y, int k);
+void pack_panel_q8_0(const void * restrict x, size_t bx, void * restrict y, int k);
+
+void pack_panel_q2_K(const void * restrict x, size_t bx, void * restrict y, int k);
+void pack_panel_q3_K(const void * restrict x, size_t bx, void * restrict y, int k);
+void pack_panel_q4_K(const void * restrict x, size_t bx, void * restrict y, int k);
+void pack_panel_q5_K(const void * restrict x, size_t bx, void * restrict y, int k);
+void pack_panel_q6_K(const void * restrict x, size_t bx, void * restrict y, int k);
+
 // Dot product
 void ggml_vec_dot_q4_0_q8_0(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 void ggml_vec_dot_q4_1_q8_1(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
@@ -217,6 +274,16 @@ void ggml_vec_dot_q5_0_q8_0(int n, float * restrict s, const void * restrict vx,
 void ggml_vec_dot_q5_1_q8_1(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 void ggml_vec_dot_q8_0_q8_0(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 
+// 4 results at s[0..3], one per row of the interleaved rows
+void ggml_vec_dot_q4_0x4_q8_0(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+void ggml_vec_dot_q8_0x4_q8_0(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+
+// QK_PANEL x QK_PANEL_N tile of a panel and QK_PANEL_N rows of y with a stride of by bytes, the result of row r
+// and y row c at s[c*bs + r]
+void ggml_gemm_q8_panel_q8_0(int n, float * restrict s, size_t bs, const void * restrict vx, const void * restrict vy, size_t by);
+void ggml_gemm_q8_panel_q8_1(int n, float * restrict s, size_t bs, const void * restrict vx, const void * restrict vy, size_t by);
+void ggml_gemm_q8_K_panel_q8_K(int n, float * restrict s, size_t bs, const void * restrict vx, const void * restrict vy, size_t by);
+
 void ggml_vec_dot_q2_K_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 void ggml_vec_dot_q3_K_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 void ggml_vec_dot_q4_K_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
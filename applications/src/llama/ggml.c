@@ -155,6 +155,14 @@ void ggml_print_backtrace(void) {
 #define GGML_VEC_DOT_UNROLL  2
 #define GGML_VEC_MAD_UNROLL  32
 
+// mul_mat GEMM path, see ggml_compute_forward_mul_mat_gemm()
+#define GGML_GEMM_MR          4          // src0 rows per register tile
+#define GGML_GEMM_NR          3          // src1 rows per register tile
+#define GGML_GEMM_L2_BYTES    (256*1024) // src0 block size, reused for all src1 rows of a thread
+#define GGML_GEMM_MIN_NE11    32         // use the GEMM path from this many src1 rows
+
+#define GGML_MUL_MAT_CHUNK_SIZE 64 // rows of src0 and src1 per work chunk of mul_mat
+
 //
 // logging
 //
@@ -391,6 +399,23 @@ int64_t ggml_cycles_per_ms(void) {
 
 static const size_t CACHE_LINE_SIZE_F32 = CACHE_LINE_SIZE/sizeof(float);
 
+struct ggml_compute_state_shared;
+
+// state shared by the tasks of a node, see ggml_compute_forward_mul_mat()
+struct ggml_compute_chunk {
+    struct ggml_compute_state_shared * shared; // graph compute the node belongs to
+    atomic_int current;  // next work chunk to compute
+    atomic_int n_ready;  // tasks that are done converting their share of src1
+    bool src1_ready;     // src1 is already in the work buffer, converted by an earlier node
+    char padding[CACHE_LINE_SIZE - sizeof(void *) - 2*sizeof(atomic_int) - sizeof(bool)];
+};
+
+// the tasks of the node run on threads of their own and can wait for each other
+static bool ggml_compute_chunk_concurrent(const struct ggml_compute_chunk * chunk, int nth);
+
+// wait until nth tasks of the node arrived, with the wait policy of the graph compute
+static void ggml_compute_chunk_barrier(struct ggml_compute_chunk * chunk, int nth);
+
 static void ggml_vec_dot_f32(const int n, float * restrict s, const float * restrict x, const float * restrict y);
 static void ggml_vec_dot_f16(const int n, float * restrict s, ggml_fp16_t * restrict x, ggml_fp16_t * restrict y);
 
@@ -579,9 +604,56 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .type_size                = sizeof(block_q8_K),
         .is_quantized             = true,
         .from_float               = quantize_row_q8_K,
-    }
+    },
+    [GGML_TYPE_Q4_0_4X] = {
+        .type_name                = "q4_0_4x",
+        .blck_size                = QK4_0,
+        .type_size                = sizeof(block_q4_0),
+        .is_quantized             = true,
+        .vec_dot                  = ggml_vec_dot_q4_0x4_q8_0,
+        .vec_dot_type             = GGML_TYPE_Q8_0,
+        .nrows                    = 4,
+    },
+    [GGML_TYPE_Q8_0_4X] = {
+        .type_name                = "q8_0_4x",
+        .blck_size                = QK8_0,
+        .type_size                = sizeof(block_q8_0),
+        .is_quantized             = true,
+        .vec_dot                  = ggml_vec_dot_q8_0x4_q8_0,
+        .vec_dot_type             = GGML_TYPE_Q8_0,
+        .nrows                    = 4,
+    },
+};
+
+// rows that one call of the vec_dot of the type computes
+static inline int64_t ggml_type_nrows(enum ggml_type type) {
+    return MAX(1, type_traits[type].nrows);
+}
+
+// quantized GEMM of mul_mat: src0 is packed to panels of QK_PANEL rows, see ggml_compute_forward_mul_mat_gemm()
+struct ggml_gemm_panel_traits {
+    void (*pack)(const void * restrict x, size_t bx, void * restrict y, int k);
+    void (*gemm)(int n, float * restrict s, size_t bs, const void * restrict x, const void * restrict y, size_t by);
+    size_t panel_size; // bytes of the panel of a block
+};
+
+static const struct ggml_gemm_panel_traits gemm_panel_traits[GGML_TYPE_COUNT] = {
+    [GGML_TYPE_Q4_0] = { pack_panel_q4_0, ggml_gemm_q8_panel_q8_0,   sizeof(block_q8_panel)   },
+    [GGML_TYPE_Q4_1] = { pack_panel_q4_1, ggml_gemm_q8_panel_q8_1,   sizeof(block_q8_panel)   },
+    [GGML_TYPE_Q5_0] = { pack_panel_q5_0, ggml_gemm_q8_panel_q8_0,   sizeof(block_q8_panel)   },
+    [GGML_TYPE_Q5_1] = { pack_panel_q5_1, ggml_gemm_q8_panel_q8_1,   sizeof(block_q8_panel)   },
+    [GGML_TYPE_Q8_0] = { pack_panel_q8_0, ggml_gemm_q8_panel_q8_0,   sizeof(block_q8_panel)   },
+#if QK_K == 256
+    [GGML_TYPE_Q2_K] = { pack_panel_q2_K, ggml_gemm_q8_K_panel_q8_K, sizeof(block_q8_K_panel) },
+    [GGML_TYPE_Q3_K] = { pack_panel_q3_K, ggml_gemm_q8_K_panel_q8_K, sizeof(block_q8_K_panel) },
+    [GGML_TYPE_Q4_K] = { pack_panel_q4_K, ggml_gemm_q8_K_panel_q8_K, sizeof(block_q8_K_panel) },
+    [GGML_TYPE_Q5_K] = { pack_panel_q5_K, ggml_gemm_q8_K_panel_q8_K, sizeof(block_q8_K_panel) },
+    [GGML_TYPE_Q6_K] = { pack_panel_q6_K, ggml_gemm_q8_K_panel_q8_K, sizeof(block_q8_K_panel) },
+#endif
 };
 
+static_assert(QK_PANEL == GGML_GEMM_MR, "the panels have to hold the rows of a GEMM tile");
+
 // For internal test use
 ggml_type_traits_t ggml_internal_get_type_traits(enum ggml_type type) {
     GGML_ASSERT(type < GGML_TYPE_COUNT);
@@ -1270,6 +1342,115 @@ inline static void ggml_vec_dot_f16_unroll(const int n, const int xs, float * re
     }
 }
 
+// compute a GGML_GEMM_MR x GGML_GEMM_NR tile of dot products at once:
+//   s[c*ss + r] = dot(x + r*xs, y + c*ys)
+// each loaded x and y vector is used GGML_GEMM_NR resp. GGML_GEMM_MR times from registers
+// strides are in elements
+static void ggml_vec_dot_f32_tile(const int n, float * restrict s, size_t ss, const float * restrict x, size_t xs, const float * restrict y, size_t ys) {
+#if defined(GGML_SIMD)
+    const int np = (n & ~(GGML_F32_EPR - 1));
+
+    GGML_F32_VEC sum[GGML_GEMM_MR][GGML_GEMM_NR];
+
+    for (int r = 0; r < GGML_GEMM_MR; ++r) {
+        for (int c = 0; c < GGML_GEMM_NR; ++c) {
+            sum[r][c] = GGML_F32_VEC_ZERO;
+        }
+    }
+
+    GGML_F32_VEC ay[GGML_GEMM_NR];
+
+    for (int i = 0; i < np; i += GGML_F32_EPR) {
+        for (int c = 0; c < GGML_GEMM_NR; ++c) {
+            ay[c] = GGML_F32_VEC_LOAD(y + c*ys + i);
+        }
+        for (int r = 0; r < GGML_GEMM_MR; ++r) {
+            const GGML_F32_VEC ax = GGML_F32_VEC_LOAD(x + r*xs + i);
+            for (int c = 0; c < GGML_GEMM_NR; ++c) {
+                sum[r][c] = GGML_F32_VEC_FMA(sum[r][c], ax, ay[c]);
+            }
+        }
+    }
+
+    for (int r = 0; r < GGML_GEMM_MR; ++r) {
+        for (int c = 0; c < GGML_GEMM_NR; ++c) {
+            GGML_F32_VEC acc[GGML_F32_ARR] = { GGML_F32_VEC_ZERO };
+            acc[0] = sum[r][c];
+
+            float sumf = 0.0f;
+            GGML_F32_VEC_REDUCE(sumf, acc);
+
+            // leftovers
+            for (int i = np; i < n; ++i) {
+                sumf += x[r*xs + i]*y[c*ys + i];
+            }
+
+            s[c*ss + r] = sumf;
+        }
+    }
+#else
+    for (int r = 0; r < GGML_GEMM_MR; ++r) {
+        for (int c = 0; c < GGML_GEMM_NR; ++c) {
+            ggml_vec_dot_f32(n, s + c*ss + r, x + r*xs, y + c*ys);
+        }
+    }
+#endif
+}
+
+static void ggml_vec_dot_f16_tile(const int n, float * restrict s, size_t ss, ggml_fp16_t * restrict x, size_t xs, ggml_fp16_t * restrict y, size_t ys) {
+// with native F16 arithmetic a single accumulator per dot product would lose too much precision
+#if defined(GGML_SIMD) && !defined(__ARM_FEATURE_FP16_VECTOR_ARITHMETIC)
+    const int np = (n & ~(GGML_F16_STEP - 1));
+
+    GGML_F16_VEC sum[GGML_GEMM_MR][GGML_GEMM_NR];
+
+    for (int r = 0; r < GGML_GEMM_MR; ++r) {
+        for (int c = 0; c < GGML_GEMM_NR; ++c) {
+            sum[r][c] = GGML_F16_VEC_ZERO;
+        }
+    }
+
+    GGML_F16_VEC ay[GGML_GEMM_NR];
+
+    for (int i = 0; i < np; i += GGML_F16_STEP) {
+        for (int j = 0; j < GGML_F16_ARR; j++) {
+            for (int c = 0; c < GGML_GEMM_NR; ++c) {
+                ay[c] = GGML_F16_VEC_LOAD(y + c*ys + i + j*GGML_F16_EPR, j);
+            }
+            for (int r = 0; r < GGML_GEMM_MR; ++r) {
+                const GGML_F16_VEC ax = GGML_F16_VEC_LOAD(x + r*xs + i + j*GGML_F16_EPR, j);
+                for (int c = 0; c < GGML_GEMM_NR; ++c) {
+                    sum[r][c] = GGML_F16_VEC_FMA(sum[r][c], ax, ay[c]);
+                }
+            }
+        }
+    }
+
+    for (int r = 0; r < GGML_GEMM_MR; ++r) {
+        for (int c = 0; c < GGML_GEMM_NR; ++c) {
+            GGML_F16_VEC acc[GGML_F16_ARR] = { GGML_F16_VEC_ZERO };
+            acc[0] = sum[r][c];
+
+            ggml_float sumf = 0.0;
+            GGML_F16_VEC_REDUCE(sumf, acc);
+
+            // leftovers
+            for (int i = np; i < n; ++i) {
+                sumf += (ggml_float)(GGML_FP16_TO_FP32(x[r*xs + i])*GGML_FP16_TO_FP32(y[c*ys + i]));
+            }
+
+            s[c*ss + r] = sumf;
+        }
+    }
+#else
+    for (int r = 0; r < GGML_GEMM_MR; ++r) {
+        for (int c = 0; c < GGML_GEMM_NR; ++c) {
+            ggml_vec_dot_f16(n, s + c*ss + r, x + r*xs, y + c*ys);
+        }
+    }
+#endif
+}
+
 inline static void ggml_vec_mad_f32(const int n, float * restrict y, const float * restrict x, const float v) {
 #if defined(GGML_SIMD)
     const int np = (n & ~(GGML_F32_STEP - 1));
@@ -1608,6 +1789,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "TRANSPOSE",
     "GET_ROWS",
     "GET_ROWS_BACK",
+    "SET_ROWS",
     "DIAG",
     "DIAG_MASK_INF",
     "DIAG_MASK_ZERO",
@@ -1628,6 +1810,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "LEAKY_RELU",
 
     "FLASH_ATTN",
+    "FLASH_ATTN_EXT",
     "FLASH_FF",
     "FLASH_ATTN_BACK",
     "WIN_PART",
@@ -1652,7 +1835,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 72, "GGML_OP_COUNT != 72");
+static_assert(GGML_OP_COUNT == 74, "GGML_OP_COUNT != 74");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -1694,6 +1877,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "transpose(x)",
     "get_rows(x)",
     "get_rows_back(x)",
+    "set_rows(x)",
     "diag(x)",
     "diag_mask_inf(x)",
     "diag_mask_zero(x)",
@@ -1714,6 +1898,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "leaky_relu(x)",
 
     "flash_attn(x)",
+    "flash_attn_ext(x)",
     "flash_ff(x)",
     "flash_attn_back(x)",
     "win_part(x)",
@@ -1738,7 +1923,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 72, "GGML_OP_COUNT != 72");
+static_assert(GGML_OP_COUNT == 74, "GGML_OP_COUNT != 74");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -1828,6 +2013,10 @@ struct ggml_context_container {
 // NUMA support
 //
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
 #define GGML_NUMA_MAX_NODES 8
 #define GGML_NUMA_MAX_CPUS 512
 
@@ -1942,6 +2131,119 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+// rows [*ir0, *ir1) of a matrix with nr rows that belong to node k of n_nodes, in whole groups of blck interleaved rows
+// ggml_compute_forward_mul_mat computes them with the threads of the node and ggml_numa_place_rows places them on it
+static void ggml_numa_node_rows(int64_t nr, int64_t blck, int k, int n_nodes, int64_t * ir0, int64_t * ir1) {
+    const int64_t ng = nr/blck;
+
+    *ir0 = blck*(ng*k/n_nodes);
+    *ir1 = blck*(ng*(k + 1)/n_nodes);
+}
+
+// the first padding byte of a tensor flags the rows placed by ggml_numa_place_rows, the public struct keeps its layout
+static inline bool ggml_numa_rows(const struct ggml_tensor * tensor) {
+    return tensor->padding[0] != 0;
+}
+
+bool ggml_numa_place_rows(struct ggml_tensor * tensor) {
+#if defined(__linux__) && defined(SYS_mbind)
+    if (!ggml_is_numa() || tensor->data == NULL) {
+        return false;
+    }
+
+    const int n_nodes = g_state.numa.n_nodes;
+
+    const uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+
+    bool ok = true;
+
+    for (int64_t i3 = 0; i3 < tensor->ne[3]; ++i3) {
+        for (int64_t i2 = 0; i2 < tensor->ne[2]; ++i2) {
+            const uintptr_t base = (uintptr_t) tensor->data + i2*tensor->nb[2] + i3*tensor->nb[3];
+
+            for (int k = 0; k < n_nodes; ++k) {
+                int64_t ir0, ir1;
+                ggml_numa_node_rows(tensor->ne[1], ggml_type_nrows(tensor->type), k, n_nodes, &ir0, &ir1);
+
+                // a page shared by two slices goes to the node of its first row
+                uintptr_t p0 = (base + ir0*tensor->nb[1] + page - 1) & ~(page - 1);
+                uintptr_t p1 = (base + ir1*tensor->nb[1] + page - 1) & ~(page - 1);
+                if (k == 0) {
+                    p0 = base & ~(page - 1);
+                }
+
+                if (p0 >= p1) {
+                    continue;
+                }
+
+                // MPOL_BIND, MPOL_MF_MOVE - pages that are resident already are migrated
+                unsigned long mask = 1ul << k;
+                if (syscall(SYS_mbind, (void *) p0, (unsigned long) (p1 - p0), 2, &mask, sizeof(mask)*8, 1 << 1) != 0) {
+                    ok = false;
+                } else {
+                    tensor->padding[0] = 1;
+                }
+            }
+        }
+    }
+
+    return ok;
+#else
+    UNUSED(tensor);
+    return false;
+#endif
+}
+
+enum ggml_type ggml_repack_type(enum ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_Q4_0: return GGML_TYPE_Q4_0_4X;
+        case GGML_TYPE_Q8_0: return GGML_TYPE_Q8_0_4X;
+        default:             return GGML_TYPE_COUNT;
+    }
+}
+
+bool ggml_is_repacked(enum ggml_type type) {
+    return type == GGML_TYPE_Q4_0_4X || type == GGML_TYPE_Q8_0_4X;
+}
+
+bool ggml_repack_tensor(struct ggml_tensor * tensor) {
+    const enum ggml_type type = ggml_repack_type(tensor->type);
+
+    if (type == GGML_TYPE_COUNT || tensor->data == NULL || !ggml_is_contiguous(tensor)) {
+        return false;
+    }
+
+    const int64_t nrows = type_traits[type].nrows;
+
+    if (tensor->ne[1] % nrows != 0) {
+        return false;
+    }
+
+    // a group of rows has the same size in both layouts, so the groups are repacked in place through a copy
+    const size_t size_group = nrows*tensor->nb[1];
+
+    void * tmp = malloc(size_group);
+    GGML_ASSERT(tmp);
+
+    for (int64_t ig = 0; ig < ggml_nrows(tensor)/nrows; ++ig) {
+        char * group = (char *) tensor->data + ig*size_group;
+
+        memcpy(tmp, group, size_group);
+
+        switch (type) {
+            case GGML_TYPE_Q4_0_4X: repack_rows_q4_0x4(tmp, (block_q4_0x4 *) group, tensor->ne[0]); break;
+            case GGML_TYPE_Q8_0_4X: repack_rows_q8_0x4(tmp, (block_q8_0x4 *) group, tensor->ne[0]); break;
+            default: GGML_ASSERT(false);
+        }
+    }
+
+    free(tmp);
+
+    tensor->type = type;
+
+    return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -4810,6 +5112,36 @@ struct ggml_tensor * ggml_get_rows_back(
     return result;
 }
 
+// ggml_set_rows
+
+struct ggml_tensor * ggml_set_rows(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c) {
+    GGML_ASSERT(a->ne[0] == b->ne[0] && a->ne[2] == b->ne[2] && a->ne[3] == b->ne[3]);
+    GGML_ASSERT(ggml_is_vector(c) && c->ne[0] == b->ne[1]);
+    GGML_ASSERT(b->type == GGML_TYPE_F32 && b->nb[0] == sizeof(float));
+    GGML_ASSERT(c->type == GGML_TYPE_I32);
+    GGML_ASSERT(a->nb[0] == ggml_type_size(a->type) && a->ne[0] % ggml_blck_size(a->type) == 0);
+    GGML_ASSERT(a->type == GGML_TYPE_F32 || type_traits[a->type].from_float);
+
+    if (a->grad || b->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+    }
+
+    // make a view of the destination
+    struct ggml_tensor * result = ggml_view_tensor(ctx, a);
+
+    result->op     = GGML_OP_SET_ROWS;
+    result->grad   = NULL;
+    result->src[0] = a;
+    result->src[1] = b;
+    result->src[2] = c;
+
+    return result;
+}
+
 // ggml_diag
 
 struct ggml_tensor * ggml_diag(
@@ -5650,6 +5982,52 @@ struct ggml_tensor * ggml_flash_attn(
     return result;
 }
 
+// ggml_flash_attn_ext
+
+struct ggml_tensor * ggml_flash_attn_ext(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * mask,
+        float                 scale) {
+    GGML_ASSERT(ggml_can_mul_mat(k, q));
+    GGML_ASSERT(q->type == GGML_TYPE_F32);
+    GGML_ASSERT(v->ne[0] == k->ne[0] && v->ne[1] == k->ne[1] && v->ne[2] == k->ne[2] && v->ne[3] == k->ne[3]);
+    // V is read either by rows or, for a transposed view, by columns
+    GGML_ASSERT(v->nb[0] == ggml_type_size(v->type) || v->nb[1] == ggml_type_size(v->type));
+    GGML_ASSERT(v->nb[0] == ggml_type_size(v->type) || v->type == GGML_TYPE_F32 || v->type == GGML_TYPE_F16);
+
+    if (mask) {
+        GGML_ASSERT(mask->type == GGML_TYPE_F32);
+        GGML_ASSERT(ggml_is_contiguous(mask));
+        GGML_ASSERT(mask->ne[0] == k->ne[1]);
+        GGML_ASSERT(mask->ne[1] >= q->ne[1]);
+    }
+
+    bool is_node = false;
+
+    if (q->grad || k->grad || v->grad) {
+        is_node = true;
+    }
+
+    // permute(0, 2, 1, 3)
+    const int64_t ne[4] = { q->ne[0], q->ne[2], q->ne[1], q->ne[3] };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne);
+
+    float params[] = { scale };
+    ggml_set_op_params(result, params, sizeof(params));
+
+    result->op   = GGML_OP_FLASH_ATTN_EXT;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = q;
+    result->src[1] = k;
+    result->src[2] = v;
+    result->src[3] = mask;
+
+    return result;
+}
+
 // ggml_flash_ff
 
 struct ggml_tensor * ggml_flash_ff(
@@ -6411,8 +6789,8 @@ static void ggml_compute_forward_dup_same_cont(
     const int ith = params->ith; // thread index
     const int nth = params->nth; // number of threads
 
-    // parallelize by elements
-    const int ne = ggml_nelements(dst);
+    // parallelize by blocks (elements for the non-quantized types)
+    const int ne = ggml_nelements(dst)/ggml_blck_size(dst->type);
     const int dr = (ne + nth - 1) / nth;
     const int ie0 = dr * ith;
     const int ie1 = MIN(ie0 + dr, ne);
@@ -6945,6 +7323,49 @@ static void ggml_compute_forward_dup_f32(
     }
 }
 
+// dequantize to F32 by rows
+static void ggml_compute_forward_dup_q(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src0));
+    GGML_ASSERT(dst->type == GGML_TYPE_F32);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    GGML_ASSERT(ne00 == ne0 && ne01 == ne1 && ne02 == ne2 && ne03 == ne3);
+    GGML_ASSERT(nb00 == ggml_type_size(src0->type));
+    GGML_ASSERT(nb0  == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    ggml_to_float_t const dequantize_row_q = type_traits[src0->type].to_float;
+
+    const int64_t nr = ne01*ne02*ne03;
+
+    // rows per thread
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        dequantize_row_q(
+                (const char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03,
+                (float *)     ((char *) dst->data + i01*nb1  + i02*nb2  + i03*nb3), ne00);
+    }
+}
+
 static void ggml_compute_forward_dup(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -6964,6 +7385,10 @@ static void ggml_compute_forward_dup(
             } break;
         default:
             {
+                if (ggml_is_quantized(src0->type)) {
+                    ggml_compute_forward_dup_q(params, src0, dst);
+                    break;
+                }
                 GGML_ASSERT(false);
             } break;
     }
@@ -9281,12 +9706,18 @@ static void ggml_compute_forward_rms_norm(
     }
 }
 
-static void ggml_compute_forward_rms_norm_back_f32(
+// ggml_compute_forward_rms_norm_mul
+
+// rms_norm followed by a mul with a row of weights, as built by llm_build_norm, in a single pass over each row
+// that writes the result converted to vec_dot_type into the work buffer for the mul_mats that consume it
+// the F32 results of the rms_norm and the mul are not stored, see ggml_graph_compute_fuse()
+static void ggml_compute_forward_rms_norm_mul_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
-        const struct ggml_tensor * src1,
-        struct ggml_tensor * dst) {
-    GGML_ASSERT(ggml_are_same_shape(src0, dst) && ggml_are_same_shape(src0, src1));
+        struct ggml_tensor * norm,
+        struct ggml_tensor * dst,
+        const enum ggml_type vec_dot_type) {
+    GGML_ASSERT(ggml_are_same_shape(src0, norm) && ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
@@ -9297,42 +9728,106 @@ static void ggml_compute_forward_rms_norm_back_f32(
     const int ith = params->ith;
     const int nth = params->nth;
 
-    GGML_TENSOR_BINARY_OP_LOCALS
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    const float * w = (const float *) dst->src[1]->data;
+
+    ggml_from_float_t const from_float_to_vec_dot = type_traits[vec_dot_type].from_float;
+
+    const size_t row_size = ggml_row_size(vec_dot_type, ne00);
+
+    GGML_ASSERT(params->wsize >= ggml_nrows(dst)*row_size);
 
     float eps;
-    memcpy(&eps, dst->op_params, sizeof(float));
+    memcpy(&eps, norm->op_params, sizeof(float));
+
+    // the row is converted in pieces of whole blocks of all vec_dot_types
+    float tmp[256];
+    const int64_t n_tmp = sizeof(tmp)/sizeof(float);
 
-    // TODO: optimize
     for (int64_t i03 = 0; i03 < ne03; i03++) {
         for (int64_t i02 = 0; i02 < ne02; i02++) {
             for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
-                // src1 is same shape as src0 => same indices
-                const int64_t i11 = i01;
-                const int64_t i12 = i02;
-                const int64_t i13 = i03;
-
                 const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
-                const float * dz = (float *) ((char *) src1->data + i11*nb11 + i12*nb12 + i13*nb13);
-
-                ggml_float sum_xx  = 0.0;
-                ggml_float sum_xdz = 0.0;
 
+                ggml_float sum = 0.0;
                 for (int64_t i00 = 0; i00 < ne00; i00++) {
-                    sum_xx  += (ggml_float)(x[i00] * x[i00]);
-                    sum_xdz += (ggml_float)(x[i00] * dz[i00]);
+                    sum += (ggml_float)(x[i00] * x[i00]);
                 }
 
-                //const float mean     = (float)(sum_xx)/ne00;
-                const float mean_eps = (float)(sum_xx)/ne00 + eps;
-                const float sum_eps  = (float)(sum_xx) + eps*ne00;
-                //const float mean_xdz = (float)(sum_xdz)/ne00;
-                // we could cache rms from forward pass to improve performance.
-                // to do this implement ggml_rms and compose ggml_rms_norm using ggml_rms.
-                //const float rms      = sqrtf(mean_eps);
-                const float rrms     = 1.0f / sqrtf(mean_eps);
-                //const float scale    = -rrms/(ne00 * mean_eps); // -1/(n*rms**3)
+                const float mean = sum/ne00;
 
-                {
+                const float scale = 1.0f/sqrtf(mean + eps);
+
+                char * y = (char *) params->wdata + (i01 + i02*ne01 + i03*ne02*ne01)*row_size;
+
+                for (int64_t i00 = 0; i00 < ne00; i00 += n_tmp) {
+                    const int64_t n = MIN(n_tmp, ne00 - i00);
+
+                    // the same products as ggml_vec_scale_f32 and ggml_vec_mul_f32 in the unfused nodes
+                    for (int64_t i = 0; i < n; i++) {
+                        tmp[i] = (x[i00 + i]*scale)*w[i00 + i];
+                    }
+
+                    from_float_to_vec_dot(tmp, y + ggml_row_size(vec_dot_type, i00), n);
+                }
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_rms_norm_back_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_are_same_shape(src0, dst) && ggml_are_same_shape(src0, src1));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    float eps;
+    memcpy(&eps, dst->op_params, sizeof(float));
+
+    // TODO: optimize
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                // src1 is same shape as src0 => same indices
+                const int64_t i11 = i01;
+                const int64_t i12 = i02;
+                const int64_t i13 = i03;
+
+                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                const float * dz = (float *) ((char *) src1->data + i11*nb11 + i12*nb12 + i13*nb13);
+
+                ggml_float sum_xx  = 0.0;
+                ggml_float sum_xdz = 0.0;
+
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    sum_xx  += (ggml_float)(x[i00] * x[i00]);
+                    sum_xdz += (ggml_float)(x[i00] * dz[i00]);
+                }
+
+                //const float mean     = (float)(sum_xx)/ne00;
+                const float mean_eps = (float)(sum_xx)/ne00 + eps;
+                const float sum_eps  = (float)(sum_xx) + eps*ne00;
+                //const float mean_xdz = (float)(sum_xdz)/ne00;
+                // we could cache rms from forward pass to improve performance.
+                // to do this implement ggml_rms and compose ggml_rms_norm using ggml_rms.
+                //const float rms      = sqrtf(mean_eps);
+                const float rrms     = 1.0f / sqrtf(mean_eps);
+                //const float scale    = -rrms/(ne00 * mean_eps); // -1/(n*rms**3)
+
+                {
                     // z = rms_norm(x)
                     //
                     // rms_norm(src0) =
@@ -9566,6 +10061,7 @@ static bool ggml_compute_forward_mul_mat_use_blas(
     //       all the experts for each batch element and the processing would become incredibly slow
     // TODO: find the optimal values for these
     if (dst->op != GGML_OP_MUL_MAT_ID &&
+        type_traits[src0->type].nrows == 0 &&
         ggml_is_contiguous(src0) &&
         ggml_is_contiguous(src1) &&
       //src0->type == GGML_TYPE_F32 &&
@@ -9580,6 +10076,276 @@ static bool ggml_compute_forward_mul_mat_use_blas(
 }
 #endif
 
+// prompt processing - large 2D products go through the GEMM path
+static bool ggml_compute_forward_mul_mat_use_gemm(const struct ggml_tensor * src0, const struct ggml_tensor * src1) {
+    if (src1->ne[1] < GGML_GEMM_MIN_NE11 || src0->ne[2]*src0->ne[3] != 1 || src1->ne[2]*src1->ne[3] != 1) {
+        return false;
+    }
+
+    if (src0->type == GGML_TYPE_F32 || src0->type == GGML_TYPE_F16) {
+        return true;
+    }
+
+#if defined(__AVX2__)
+    return gemm_panel_traits[src0->type].gemm != NULL;
+#else
+    // the scalar panel kernels do not beat the SIMD vec_dot of the other platforms
+    return false;
+#endif
+}
+
+// bytes of the panels of GGML_GEMM_MR rows of src0, 0 if src0 is not packed
+static size_t ggml_mul_mat_gemm_panel_size(const struct ggml_tensor * src0) {
+    return gemm_panel_traits[src0->type].panel_size*(src0->ne[0]/ggml_blck_size(src0->type));
+}
+
+// rows of src0 per L2-sized block of the GEMM path
+static int64_t ggml_mul_mat_gemm_block_rows(const struct ggml_tensor * src0) {
+    const size_t panel_size = ggml_mul_mat_gemm_panel_size(src0);
+    const size_t size       = panel_size > 0 ? panel_size : GGML_GEMM_MR*src0->nb[1];
+
+    return MAX(1, GGML_GEMM_L2_BYTES/size)*GGML_GEMM_MR;
+}
+
+// bytes of the work buffer for the src0 panels of a task of the GEMM path, they follow the converted src1
+static size_t ggml_mul_mat_gemm_panels_size(const struct ggml_tensor * src0, const struct ggml_tensor * src1) {
+    if (!ggml_compute_forward_mul_mat_use_gemm(src0, src1)) {
+        return 0;
+    }
+
+    const size_t panel_size = ggml_mul_mat_gemm_panel_size(src0);
+
+    return GGML_PAD(ggml_mul_mat_gemm_block_rows(src0)/GGML_GEMM_MR*panel_size, CACHE_LINE_SIZE);
+}
+
+static size_t ggml_mul_mat_gemm_panels_offs(const struct ggml_tensor * src0, const struct ggml_tensor * src1) {
+    const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
+
+    return src1->type != vec_dot_type ? GGML_PAD(ggml_row_size(vec_dot_type, ggml_nelements(src1)), CACHE_LINE_SIZE) : 0;
+}
+
+// cache-blocked, register-tiled GEMM for a 2D mul_mat over the [ir00, ir01) x [ir10, ir11) range of dst
+// src0 is processed in L2-sized blocks of rows that are reused for all src1 rows of the range, instead of
+// being re-streamed from memory for every 16 src1 rows, and dst is computed in GGML_GEMM_MR x GGML_GEMM_NR tiles
+// quantized src0 is first packed to the panels of gemm_panel_traits, once per block, and its tiles are
+// GGML_GEMM_MR x QK_PANEL_N
+// wdata points to the src1 rows in vec_dot_type with a stride of row_size bytes
+static void ggml_compute_forward_mul_mat_gemm(
+        const struct ggml_tensor * src0,
+              char * wdata,
+        const size_t row_size,
+              char * panels,
+              struct ggml_tensor * dst,
+        const int64_t ir00, const int64_t ir01,
+        const int64_t ir10, const int64_t ir11) {
+    const enum ggml_type type = src0->type;
+
+    ggml_vec_dot_t const vec_dot = type_traits[type].vec_dot;
+
+    const int64_t ne00 = src0->ne[0];
+    const size_t  nb01 = src0->nb[1];
+    const size_t  nb1  = dst->nb[1];
+
+    const size_t  panel_size = ggml_mul_mat_gemm_panel_size(src0);
+    const int64_t nr         = panel_size > 0 ? QK_PANEL_N : GGML_GEMM_NR;
+
+    GGML_ASSERT(type == GGML_TYPE_F32 || type == GGML_TYPE_F16 || panel_size > 0);
+
+    const int64_t blck_0 = ggml_mul_mat_gemm_block_rows(src0);
+
+    for (int64_t iir0 = ir00; iir0 < ir01; iir0 += blck_0) {
+        const int64_t iir0_end  = MIN(iir0 + blck_0, ir01);
+        const int64_t iir0_tile = iir0 + (iir0_end - iir0)/GGML_GEMM_MR*GGML_GEMM_MR;
+
+        if (panel_size > 0) {
+            for (int64_t ir0 = iir0; ir0 < iir0_tile; ir0 += GGML_GEMM_MR) {
+                gemm_panel_traits[type].pack((const char *) src0->data + ir0*nb01, nb01,
+                        panels + (ir0 - iir0)/GGML_GEMM_MR*panel_size, ne00);
+            }
+        }
+
+        int64_t ir1 = ir10;
+
+        for (; ir1 + nr <= ir11; ir1 += nr) {
+            char * src1_col = wdata + ir1*row_size;
+            float * dst_col = (float *) ((char *) dst->data + ir1*nb1);
+
+            int64_t ir0 = iir0;
+            for (; ir0 < iir0_tile; ir0 += GGML_GEMM_MR) {
+                char * src0_row = (char *) src0->data + ir0*nb01;
+                if (panel_size > 0) {
+                    gemm_panel_traits[type].gemm(ne00, dst_col + ir0, nb1/sizeof(float),
+                            panels + (ir0 - iir0)/GGML_GEMM_MR*panel_size, src1_col, row_size);
+                } else if (type == GGML_TYPE_F32) {
+                    ggml_vec_dot_f32_tile(ne00, dst_col + ir0, nb1/sizeof(float),
+                            (const float *) src0_row, nb01/sizeof(float), (const float *) src1_col, row_size/sizeof(float));
+                } else {
+                    ggml_vec_dot_f16_tile(ne00, dst_col + ir0, nb1/sizeof(float),
+                            (ggml_fp16_t *) src0_row, nb01/sizeof(ggml_fp16_t), (ggml_fp16_t *) src1_col, row_size/sizeof(ggml_fp16_t));
+                }
+            }
+
+            // rows that do not fill a tile
+            for (; ir0 < iir0_end; ++ir0) {
+                for (int64_t c = 0; c < nr; ++c) {
+                    float * dst_c = (float *) ((char *) dst_col + c*nb1);
+                    vec_dot(ne00, &dst_c[ir0], (const char *) src0->data + ir0*nb01, src1_col + c*row_size);
+                }
+            }
+        }
+
+        // src1 rows that do not fill a tile
+        for (; ir1 < ir11; ++ir1) {
+            const char * src1_col = wdata + ir1*row_size;
+            float * dst_col = (float *) ((char *) dst->data + ir1*nb1);
+
+            for (int64_t ir0 = iir0; ir0 < iir0_end; ++ir0) {
+                vec_dot(ne00, &dst_col[ir0], (const char *) src0->data + ir0*nb01, src1_col);
+            }
+        }
+    }
+}
+
+// convert the src1 rows [ir0, ir1) to vec_dot_type, rows are counted over dims 1, 2 and 3
+static void ggml_compute_forward_mul_mat_convert_src1(
+        const struct ggml_tensor * src1,
+        const enum ggml_type vec_dot_type,
+              char * wdata,
+        const int64_t ir0, const int64_t ir1) {
+    GGML_TENSOR_LOCALS(int64_t, ne1, src1, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb1, src1, nb)
+
+    ggml_from_float_t const from_float_to_vec_dot = type_traits[vec_dot_type].from_float;
+
+    const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+
+    assert(src1->type == GGML_TYPE_F32);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i13 = ir/(ne12*ne11);
+        const int64_t i12 = (ir - i13*ne12*ne11)/ne11;
+        const int64_t i11 = (ir - i13*ne12*ne11 - i12*ne11);
+
+        from_float_to_vec_dot((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), (void *) (wdata + ir*row_size), ne10);
+    }
+}
+
+// COMPUTE part of the src1 conversion when the tasks run concurrently: every task converts its share of the rows
+// and then waits for the others, instead of thread 0 converting all of src1 in INIT while the others wait
+static void ggml_compute_forward_mul_mat_convert_src1_parallel(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src1,
+        const enum ggml_type vec_dot_type) {
+    struct ggml_compute_chunk * chunk = params->chunk;
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    if (!chunk->src1_ready) {
+        const int64_t nr = ggml_nrows(src1);
+        const int64_t dr = (nr + nth - 1)/nth;
+
+        const int64_t ir0 = dr*ith;
+        const int64_t ir1 = MIN(ir0 + dr, nr);
+
+        assert(params->wsize >= nr*ggml_row_size(vec_dot_type, src1->ne[0]));
+
+        if (ir0 < ir1) {
+            ggml_compute_forward_mul_mat_convert_src1(src1, vec_dot_type, params->wdata, ir0, ir1);
+        }
+
+        ggml_compute_chunk_barrier(chunk, nth);
+    }
+}
+
+// compute dst rows [ir010, ir011) x src1 rows [ir110, ir111)
+static void ggml_compute_forward_mul_mat_one_chunk(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst,
+        const int64_t ir010, const int64_t ir011,
+        const int64_t ir110, const int64_t ir111) {
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const enum ggml_type type = src0->type;
+
+    const bool src1_cont = ggml_is_contiguous(src1);
+
+    ggml_vec_dot_t const vec_dot      = type_traits[type].vec_dot;
+    enum ggml_type const vec_dot_type = type_traits[type].vec_dot_type;
+
+    // interleaved layouts: vec_dot computes nrows rows from the start of their group, ir010 is a multiple of nrows
+    const int64_t nrows = ggml_type_nrows(type);
+
+    // broadcast factors
+    const int64_t r2 = ne12/ne02;
+    const int64_t r3 = ne13/ne03;
+
+    const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+    const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+
+    if (ggml_compute_forward_mul_mat_use_gemm(src0, src1)) {
+        const size_t panels_offs = ggml_mul_mat_gemm_panels_offs(src0, src1);
+        const size_t panels_size = ggml_mul_mat_gemm_panels_size(src0, src1);
+
+        GGML_ASSERT(params->wsize >= panels_offs + (params->ith + 1)*panels_size);
+
+        ggml_compute_forward_mul_mat_gemm(src0, (src1->type == vec_dot_type) ? src1->data : params->wdata,
+                src1_cont || src1->type != vec_dot_type ? row_size : nb11,
+                (char *) params->wdata + panels_offs + params->ith*panels_size,
+                dst, ir010, ir011, ir110, ir111);
+        return;
+    }
+
+    // block-tiling attempt
+    const int64_t blck_0 = 16;
+    const int64_t blck_1 = 16;
+
+    // attempt to reduce false-sharing (does not seem to make a difference)
+    float tmp[16];
+
+    for (int64_t iir1 = ir110; iir1 < ir111; iir1 += blck_1) {
+        for (int64_t iir0 = ir010; iir0 < ir011; iir0 += blck_0) {
+            for (int64_t ir1 = iir1; ir1 < iir1 + blck_1 && ir1 < ir111; ++ir1) {
+                const int64_t i13 = (ir1/(ne12*ne1));
+                const int64_t i12 = (ir1 - i13*ne12*ne1)/ne1;
+                const int64_t i11 = (ir1 - i13*ne12*ne1 - i12*ne1);
+
+                // broadcast src0 into src1
+                const int64_t i03 = i13/r3;
+                const int64_t i02 = i12/r2;
+
+                const int64_t i1 = i11;
+                const int64_t i2 = i12;
+                const int64_t i3 = i13;
+
+                const char * src0_row = (const char *) src0->data + (0 + i02*nb02 + i03*nb03);
+
+                // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
+                //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
+                //       the original src1 data pointer, so we should index using the indices directly
+                // TODO: this is a bit of a hack, we should probably have a better way to handle this
+                const char * src1_col = (const char *) wdata +
+                    (src1_cont || src1->type != vec_dot_type
+                     ? (i11      + i12*ne11 + i13*ne12*ne11)*row_size
+                     : (i11*nb11 + i12*nb12 + i13*nb13));
+
+                float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3));
+
+                //for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
+                //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
+                //}
+
+                for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ir0 += nrows) {
+                    vec_dot(ne00, &tmp[ir0 - iir0], src0_row + ir0*nb01, src1_col);
+                }
+                memcpy(&dst_col[iir0], tmp, (MIN(iir0 + blck_0, ir011) - iir0)*sizeof(float));
+            }
+        }
+    }
+}
+
 static void ggml_compute_forward_mul_mat(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -9595,11 +10361,7 @@ static void ggml_compute_forward_mul_mat(
 
     const enum ggml_type type = src0->type;
 
-    const bool src1_cont = ggml_is_contiguous(src1);
-
-    ggml_vec_dot_t    const vec_dot               = type_traits[type].vec_dot;
-    enum ggml_type    const vec_dot_type          = type_traits[type].vec_dot_type;
-    ggml_from_float_t const from_float_to_vec_dot = type_traits[vec_dot_type].from_float;
+    enum ggml_type const vec_dot_type = type_traits[type].vec_dot_type;
 
     GGML_ASSERT(ne0 == ne01);
     GGML_ASSERT(ne1 == ne11);
@@ -9616,10 +10378,6 @@ static void ggml_compute_forward_mul_mat(
     GGML_ASSERT(nb1 <= nb2);
     GGML_ASSERT(nb2 <= nb3);
 
-    // broadcast factors
-    const int64_t r2 = ne12/ne02;
-    const int64_t r3 = ne13/ne03;
-
     // nb01 >= nb00 - src0 is not transposed
     //   compute by src0 rows
 
@@ -9638,6 +10396,10 @@ static void ggml_compute_forward_mul_mat(
             return;
         }
 
+        // broadcast factors
+        const int64_t r2 = ne12/ne02;
+        const int64_t r3 = ne13/ne03;
+
         if (params->type == GGML_TASK_INIT) {
             return;
         }
@@ -9684,22 +10446,19 @@ static void ggml_compute_forward_mul_mat(
     }
 #endif
 
+    // the tasks convert src1 together in COMPUTE when they can wait for each other, otherwise it is converted in INIT
+    const bool convert_parallel = ggml_compute_chunk_concurrent(params->chunk, nth);
+
     if (params->type == GGML_TASK_INIT) {
-        if (src1->type != vec_dot_type) {
-            char * wdata = params->wdata;
-            const size_t row_size = ggml_row_size(vec_dot_type, ne10);
-
-            assert(params->wsize >= ne11*ne12*ne13*row_size);
-            assert(src1->type == GGML_TYPE_F32);
-
-            for (int64_t i13 = 0; i13 < ne13; ++i13) {
-                for (int64_t i12 = 0; i12 < ne12; ++i12) {
-                    for (int64_t i11 = 0; i11 < ne11; ++i11) {
-                        from_float_to_vec_dot((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), (void *) wdata, ne10);
-                        wdata += row_size;
-                    }
-                }
-            }
+        if (params->chunk) {
+            // the first nth chunks are taken by the tasks themselves
+            atomic_store(&params->chunk->current, nth);
+            atomic_store(&params->chunk->n_ready, 0);
+        }
+        if (!convert_parallel && (params->chunk == NULL || !params->chunk->src1_ready) && src1->type != vec_dot_type) {
+            assert(params->wsize >= ggml_nrows(src1)*ggml_row_size(vec_dot_type, ne10));
+
+            ggml_compute_forward_mul_mat_convert_src1(src1, vec_dot_type, params->wdata, 0, ggml_nrows(src1));
         }
 
         return;
@@ -9709,87 +10468,95 @@ static void ggml_compute_forward_mul_mat(
         return;
     }
 
-    const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
-    const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+    if (convert_parallel && src1->type != vec_dot_type) {
+        ggml_compute_forward_mul_mat_convert_src1_parallel(params, src1, vec_dot_type);
+    }
 
     const int64_t nr0 = ne01;          // src0 rows
     const int64_t nr1 = ne1*ne12*ne13; // src1 rows
 
+    const int64_t nrows = ggml_type_nrows(type); // interleaved src0 rows
+
     //printf("nr0 = %lld, nr1 = %lld\n", nr0, nr1);
 
-    // distribute the thread work across the inner or outer loop based on which one is larger
+    // split dst into chunks of GGML_MUL_MAT_CHUNK_SIZE x GGML_MUL_MAT_CHUNK_SIZE rows
+    // every task starts with the chunk of its index, the remaining chunks are taken from the shared counter
+    // by whichever task finishes first, so a slow thread does not hold up the others
+    int64_t nchunk0 = (nr0 + GGML_MUL_MAT_CHUNK_SIZE - 1)/GGML_MUL_MAT_CHUNK_SIZE;
+    int64_t nchunk1 = (nr1 + GGML_MUL_MAT_CHUNK_SIZE - 1)/GGML_MUL_MAT_CHUNK_SIZE;
+
+    const bool use_gemm = ggml_compute_forward_mul_mat_use_gemm(src0, src1);
 
-    const int64_t nth0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
-    const int64_t nth1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
+    if (use_gemm) {
+        // the GEMM path blocks the src0 rows of its whole range: chunks of L2-sized blocks of src0 rows that are
+        // (packed and) multiplied with all src1 rows, src1 is only split when there are too few blocks for the threads
+        const int64_t blck_0 = ggml_mul_mat_gemm_block_rows(src0);
 
-    const int64_t ith0 = ith % nth0;
-    const int64_t ith1 = ith / nth0;
+        nchunk0 = (nr0 + blck_0 - 1)/blck_0;
+        nchunk1 = MAX(1, MIN((4*nth + nchunk0 - 1)/nchunk0, nr1/GGML_GEMM_MIN_NE11));
+    }
 
-    const int64_t dr0 = (nr0 + nth0 - 1)/nth0;
-    const int64_t dr1 = (nr1 + nth1 - 1)/nth1;
+    if (ggml_numa_rows(src0) && nr0 >= nth) {
+        // the threads of each node compute the rows of src0 that ggml_numa_place_rows put on the node
+        // threads are pinned to nodes in groups, see set_numa_thread_affinity()
+        const int n_per_node = (nth + g_state.numa.n_nodes - 1)/g_state.numa.n_nodes;
+        const int n_nodes    = (nth + n_per_node - 1)/n_per_node;
 
-    const int64_t ir010 = dr0*ith0;
-    const int64_t ir011 = MIN(ir010 + dr0, nr0);
+        const int k = ith/n_per_node;
+        const int j = ith%n_per_node;
+        const int m = MIN(n_per_node, nth - k*n_per_node);
 
-    const int64_t ir110 = dr1*ith1;
-    const int64_t ir111 = MIN(ir110 + dr1, nr1);
+        int64_t ir0, ir1;
+        ggml_numa_node_rows(nr0, nrows, k, n_nodes, &ir0, &ir1);
 
-    //printf("ir010 = %6lld, ir011 = %6lld, ir110 = %6lld, ir111 = %6lld\n", ir010, ir011, ir110, ir111);
+        const int64_t ng = (ir1 - ir0)/nrows;
+
+        const int64_t ir010 = ir0 + nrows*(ng*j/m);
+        const int64_t ir011 = ir0 + nrows*(ng*(j + 1)/m);
+
+        if (ir010 < ir011) {
+            ggml_compute_forward_mul_mat_one_chunk(params, src0, src1, dst, ir010, ir011, 0, nr1);
+        }
 
-    // threads with no work simply yield (not sure if it helps)
-    if (ir010 >= ir011 || ir110 >= ir111) {
-        sched_yield();
         return;
     }
 
-    assert(ne12 % ne02 == 0);
-    assert(ne13 % ne03 == 0);
-
-    // block-tiling attempt
-    const int64_t blck_0 = 16;
-    const int64_t blck_1 = 16;
+    // too few chunks to balance anything, or the threads should stay on the memory of their node:
+    // one chunk per thread across the inner or outer loop based on which one is larger
+    if (params->chunk == NULL || nchunk0*nchunk1 < 4*nth || ggml_numa_rows(src0)) {
+        nchunk0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
+        nchunk1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
+    }
 
-    // attempt to reduce false-sharing (does not seem to make a difference)
-    float tmp[16];
+    const int64_t nchunk = nchunk0*nchunk1;
 
-    for (int64_t iir1 = ir110; iir1 < ir111; iir1 += blck_1) {
-        for (int64_t iir0 = ir010; iir0 < ir011; iir0 += blck_0) {
-            for (int64_t ir1 = iir1; ir1 < iir1 + blck_1 && ir1 < ir111; ++ir1) {
-                const int64_t i13 = (ir1/(ne12*ne1));
-                const int64_t i12 = (ir1 - i13*ne12*ne1)/ne1;
-                const int64_t i11 = (ir1 - i13*ne12*ne1 - i12*ne1);
+    // the chunks of src0 rows start at a group of interleaved rows, or at a GEMM tile
+    const int64_t dr0 = GGML_PAD((nr0 + nchunk0 - 1)/nchunk0, use_gemm ? GGML_GEMM_MR : nrows);
+    const int64_t dr1 = (nr1 + nchunk1 - 1)/nchunk1;
 
-                // broadcast src0 into src1
-                const int64_t i03 = i13/r3;
-                const int64_t i02 = i12/r2;
+    int64_t current_chunk = ith;
 
-                const int64_t i1 = i11;
-                const int64_t i2 = i12;
-                const int64_t i3 = i13;
+    while (current_chunk < nchunk) {
+        const int64_t ith0 = current_chunk % nchunk0;
+        const int64_t ith1 = current_chunk / nchunk0;
 
-                const char * src0_row = (const char *) src0->data + (0 + i02*nb02 + i03*nb03);
+        const int64_t ir010 = dr0*ith0;
+        const int64_t ir011 = MIN(ir010 + dr0, nr0);
 
-                // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
-                //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
-                //       the original src1 data pointer, so we should index using the indices directly
-                // TODO: this is a bit of a hack, we should probably have a better way to handle this
-                const char * src1_col = (const char *) wdata +
-                    (src1_cont || src1->type != vec_dot_type
-                     ? (i11      + i12*ne11 + i13*ne12*ne11)*row_size
-                     : (i11*nb11 + i12*nb12 + i13*nb13));
+        const int64_t ir110 = dr1*ith1;
+        const int64_t ir111 = MIN(ir110 + dr1, nr1);
 
-                float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3));
+        //printf("ir010 = %6lld, ir011 = %6lld, ir110 = %6lld, ir111 = %6lld\n", ir010, ir011, ir110, ir111);
 
-                //for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
-                //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
-                //}
+        if (ir010 < ir011 && ir110 < ir111) {
+            ggml_compute_forward_mul_mat_one_chunk(params, src0, src1, dst, ir010, ir011, ir110, ir111);
+        }
 
-                for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
-                    vec_dot(ne00, &tmp[ir0 - iir0], src0_row + ir0*nb01, src1_col);
-                }
-                memcpy(&dst_col[iir0], tmp, (MIN(iir0 + blck_0, ir011) - iir0)*sizeof(float));
-            }
+        if (nth >= nchunk) {
+            break;
         }
+
+        current_chunk = atomic_fetch_add(&params->chunk->current, 1);
     }
 }
 
@@ -9810,11 +10577,13 @@ static void ggml_compute_forward_mul_mat_id(
 
     const enum ggml_type type = src0->type;
 
+    // the experts are computed one row at a time
+    GGML_ASSERT(type_traits[type].nrows == 0);
+
     const bool src1_cont = ggml_is_contiguous(src1);
 
-    ggml_vec_dot_t    const vec_dot               = type_traits[type].vec_dot;
-    enum ggml_type    const vec_dot_type          = type_traits[type].vec_dot_type;
-    ggml_from_float_t const from_float_to_vec_dot = type_traits[vec_dot_type].from_float;
+    ggml_vec_dot_t const vec_dot      = type_traits[type].vec_dot;
+    enum ggml_type const vec_dot_type = type_traits[type].vec_dot_type;
 
     GGML_ASSERT(ne0 == ne01);
     GGML_ASSERT(ne1 == ne11);
@@ -9848,26 +10617,18 @@ static void ggml_compute_forward_mul_mat_id(
 
     #define MMID_MATRIX_ROW(row_id, i1) matrix_rows[(row_id)*ne11 + (i1)]
 
+    // the tasks convert src1 together in COMPUTE when they can wait for each other, otherwise it is converted in INIT
+    const bool convert_parallel = ggml_compute_chunk_concurrent(params->chunk, params->nth);
+
    if (params->type == GGML_TASK_INIT) {
-        char * wdata = params->wdata;
-        if (src1->type != vec_dot_type) {
-            const size_t row_size = ggml_row_size(vec_dot_type, ne10);
-
-            assert(params->wsize >= ne11*ne12*ne13*row_size);
-            assert(src1->type == GGML_TYPE_F32);
-
-            for (int64_t i13 = 0; i13 < ne13; ++i13) {
-                for (int64_t i12 = 0; i12 < ne12; ++i12) {
-                    for (int64_t i11 = 0; i11 < ne11; ++i11) {
-                        from_float_to_vec_dot((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), (void *) wdata, ne10);
-                        wdata += row_size;
-                    }
-                }
-            }
+        if (params->chunk) {
+            atomic_store(&params->chunk->n_ready, 0);
+        }
+        if (!convert_parallel && (params->chunk == NULL || !params->chunk->src1_ready) && src1->type != vec_dot_type) {
+            ggml_compute_forward_mul_mat_convert_src1(src1, vec_dot_type, params->wdata, 0, ggml_nrows(src1));
         }
 
         // initialize matrix_row_counts
-        GGML_ASSERT(wdata == wdata_src1_end);
         memset(matrix_row_counts, 0, n_as*sizeof(int64_t));
 
         // group rows by src0 matrix
@@ -9886,6 +10647,10 @@ static void ggml_compute_forward_mul_mat_id(
         return;
     }
 
+    if (convert_parallel && src1->type != vec_dot_type) {
+        ggml_compute_forward_mul_mat_convert_src1_parallel(params, src1, vec_dot_type);
+    }
+
     // compute each matrix multiplication in sequence
     for (int cur_a = 0; cur_a < n_as; ++cur_a) {
         const int64_t cne1 = matrix_row_counts[cur_a];
@@ -10816,6 +11581,63 @@ static void ggml_compute_forward_get_rows_back(
     //}
 }
 
+// ggml_compute_forward_set_rows
+
+static void ggml_compute_forward_set_rows(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t nc = ne00;
+    const int64_t nr = ne01*ne02*ne03;
+
+    assert(ne0 == nc);
+    assert(ne2 == ne02 && ne3 == ne03);
+    assert(nb00 == sizeof(float));
+
+    const enum ggml_type type = dst->type;
+
+    ggml_from_float_t const from_float = type_traits[type].from_float;
+
+    // rows per thread
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        const int64_t i1 = *(int32_t *) ((char *) src1->data + i01*nb10);
+
+        GGML_ASSERT(i1 >= 0 && i1 < ne1);
+
+        const float * src_row = (const float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+              void  * dst_row = (void *)        ((char *)  dst->data +  i1*nb1  + i02*nb2  + i03*nb3);
+
+        if (type == GGML_TYPE_F32) {
+            memcpy(dst_row, src_row, nc*sizeof(float));
+        } else if (type == GGML_TYPE_F16 && nc == 1) {
+            // single elements of a transposed destination
+            *(ggml_fp16_t *) dst_row = GGML_FP32_TO_FP16(*src_row);
+        } else {
+            from_float(src_row, dst_row, nc);
+        }
+    }
+}
+
 // ggml_compute_forward_diag
 
 static void ggml_compute_forward_diag_f32(
@@ -11310,6 +12132,8 @@ static void ggml_compute_forward_alibi(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_4X:
+        case GGML_TYPE_Q8_0_4X:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -11384,6 +12208,8 @@ static void ggml_compute_forward_clamp(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_4X:
+        case GGML_TYPE_Q8_0_4X:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -12973,6 +13799,321 @@ static void ggml_compute_forward_flash_attn(
     }
 }
 
+// ggml_compute_forward_flash_attn_ext
+
+#define GGML_FA_TILE_KV 64
+#define GGML_FA_ROWS    8 // q rows processed together, so that the heads of a KV row are read together
+
+// a transposed V view is contiguous along the KV dimension
+static bool ggml_flash_attn_ext_v_trans(const struct ggml_tensor * v) {
+    return v->nb[0] != ggml_type_size(v->type);
+}
+
+// number of scores kept per q row: one KV tile, or the whole row for a transposed V
+// so that V can be read with dot products over its contiguous columns
+static int64_t ggml_flash_attn_ext_n_scores(const struct ggml_tensor * k, const struct ggml_tensor * v) {
+    return ggml_flash_attn_ext_v_trans(v) ? GGML_PAD(k->ne[1], GGML_FA_TILE_KV) : GGML_FA_TILE_KV;
+}
+
+// per-thread scratch: for each q row of a group the row converted to the K dot type,
+// the V*softmax(KQ) accumulator and the scores as F32 and F16, plus one V row converted to F32
+static size_t ggml_flash_attn_ext_wsize(const struct ggml_tensor * k, const struct ggml_tensor * v) {
+    const int64_t D  = k->ne[0];
+    const int64_t NS = ggml_flash_attn_ext_n_scores(k, v);
+
+    size_t cur = 0;
+
+    cur += GGML_PAD(ggml_row_size(type_traits[k->type].vec_dot_type, D), 16)*GGML_FA_ROWS;
+    cur += GGML_PAD(sizeof(float)*D, 16)*GGML_FA_ROWS;
+    cur += GGML_PAD(sizeof(float)*NS, 16)*GGML_FA_ROWS;
+    cur += GGML_PAD(sizeof(ggml_fp16_t)*NS, 16)*GGML_FA_ROWS;
+    cur += GGML_PAD(sizeof(float)*D, 16);
+
+    return GGML_PAD(cur, CACHE_LINE_SIZE);
+}
+
+static void ggml_compute_forward_flash_attn_ext_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t D = neq0;
+    const int64_t N = neq1;
+
+    GGML_ASSERT(ne0 == D);
+    GGML_ASSERT(ne1 == neq2);
+    GGML_ASSERT(ne2 == N);
+
+    GGML_ASSERT(nek0 == D);
+    GGML_ASSERT(nev0 == D);
+    GGML_ASSERT(nev1 == nek1);
+
+    GGML_ASSERT(nbq0 == sizeof(float));
+    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
+
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
+
+    if (params->type == GGML_TASK_INIT) {
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    // broadcast factors for grouped-query attention
+    const int64_t rk2 = neq2/nek2;
+    const int64_t rk3 = neq3/nek3;
+
+    float scale = 1.0f;
+    memcpy(&scale, (float *) dst->op_params + 0, sizeof(float));
+
+    const enum ggml_type k_vec_dot_type = type_traits[k->type].vec_dot_type;
+
+    ggml_from_float_t const q_to_vec_dot = type_traits[k_vec_dot_type].from_float;
+    ggml_vec_dot_t    const kq_vec_dot   = type_traits[k->type].vec_dot;
+    ggml_to_float_t   const v_to_float   = type_traits[v->type].to_float;
+
+    const bool v_trans = ggml_flash_attn_ext_v_trans(v);
+
+    const int64_t NS = ggml_flash_attn_ext_n_scores(k, v);
+
+    const size_t qc_size  = GGML_PAD(ggml_row_size(k_vec_dot_type, D), 16);
+    const size_t vkq_size = GGML_PAD(sizeof(float)*D, 16);
+    const size_t ss_size  = GGML_PAD(sizeof(float)*NS, 16);
+    const size_t s16_size = GGML_PAD(sizeof(ggml_fp16_t)*NS, 16);
+
+    char * wdata = (char *) params->wdata + ith*ggml_flash_attn_ext_wsize(k, v);
+
+    char  * qc   = wdata;
+    char  * VKQc = qc   + qc_size*GGML_FA_ROWS;
+    char  * ssc  = VKQc + vkq_size*GGML_FA_ROWS;
+    char  * s16c = ssc  + ss_size*GGML_FA_ROWS;
+    float * vs   = (float *) (s16c + s16_size*GGML_FA_ROWS);
+
+    // parallelize by q rows
+
+    // total rows in q
+    const int nr = neq1*neq2*neq3;
+
+    // a group of rows shares either the head, so the K/V rows are reused across the tokens,
+    // or with too few tokens the token, so the heads of a KV row are read together
+    const bool heads_inner = neq1 < GGML_FA_ROWS;
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    uint16_t scvt;
+
+    for (int ir = ir0; ir < ir1; ir += GGML_FA_ROWS) {
+        const int nq = MIN(GGML_FA_ROWS, ir1 - ir);
+
+        const void  * qv [GGML_FA_ROWS];
+        const char  * pk [GGML_FA_ROWS];
+        char        * pv [GGML_FA_ROWS];
+        const float * mp [GGML_FA_ROWS];
+        float       * dp [GGML_FA_ROWS];
+        float       * VKQ[GGML_FA_ROWS];
+        float       * ss [GGML_FA_ROWS];
+        ggml_fp16_t * s16[GGML_FA_ROWS];
+
+        // running maximum and sum of the softmax
+        float      M[GGML_FA_ROWS];
+        ggml_float S[GGML_FA_ROWS];
+
+        for (int iq = 0; iq < nq; ++iq) {
+            // q indices
+            const int iq3 = (ir + iq)/(neq2*neq1);
+            const int iq1 = heads_inner ? (ir + iq - iq3*neq2*neq1)/neq2 : (ir + iq - iq3*neq2*neq1)%neq1;
+            const int iq2 = heads_inner ? (ir + iq - iq3*neq2*neq1)%neq2 : (ir + iq - iq3*neq2*neq1)/neq1;
+
+            const int ik2 = iq2/rk2;
+            const int ik3 = iq3/rk3;
+
+            const float * pq = (const float *) ((char *) q->data + iq1*nbq1 + iq2*nbq2 + iq3*nbq3);
+
+            qv[iq] = pq;
+            if (k_vec_dot_type != GGML_TYPE_F32) {
+                q_to_vec_dot(pq, qc + iq*qc_size, D);
+                qv[iq] = qc + iq*qc_size;
+            }
+
+            pk[iq] = (const char *) k->data + ik2*nbk2 + ik3*nbk3;
+            pv[iq] = (char *) v->data + ik2*nbv2 + ik3*nbv3;
+            mp[iq] = mask ? (const float *) ((char *) mask->data + iq1*mask->nb[1]) : NULL;
+
+            // dst is [D, n_head, n_batch]
+            dp[iq] = (float *) ((char *) dst->data + iq2*nb1 + iq1*nb2 + iq3*nb3);
+
+            VKQ[iq] = (float *) (VKQc + iq*vkq_size);
+            ss [iq] = (float *)       (ssc  + iq*ss_size);
+            s16[iq] = (ggml_fp16_t *) (s16c + iq*s16_size);
+
+            M[iq] = -INFINITY;
+            S[iq] = 0.0;
+
+            memset(VKQ[iq], 0, D*sizeof(float));
+        }
+
+        for (int64_t ic0 = 0; ic0 < nek1; ic0 += GGML_FA_TILE_KV) {
+            const int nc = MIN(GGML_FA_TILE_KV, nek1 - ic0);
+
+            // with a transposed V the scores of the whole row are kept
+            const int64_t is0 = v_trans ? ic0 : 0;
+
+            for (int ic = 0; ic < nc; ++ic) {
+                for (int iq = 0; iq < nq; ++iq) {
+                    const float mv = mp[iq] ? mp[iq][ic0 + ic] : 0.0f;
+                    if (mv == -INFINITY) {
+                        ss[iq][is0 + ic] = -INFINITY;
+                        continue;
+                    }
+
+                    float s;
+                    kq_vec_dot(D, &s, pk[iq] + (ic0 + ic)*nbk1, qv[iq]);
+
+                    ss[iq][is0 + ic] = s*scale + mv;
+                }
+            }
+
+            for (int iq = 0; iq < nq; ++iq) {
+                float * st = ss[iq] + is0;
+
+                float Mt = -INFINITY;
+                for (int ic = 0; ic < nc; ++ic) {
+                    Mt = MAX(Mt, st[ic]);
+                }
+
+                if (v_trans) {
+                    M[iq] = MAX(M[iq], Mt);
+                    continue;
+                }
+
+                if (Mt == -INFINITY) {
+                    // the whole tile is masked out
+                    continue;
+                }
+
+                if (Mt > M[iq]) {
+                    // rescale what has been accumulated so far to the new maximum
+                    const float ms = expf(M[iq] - Mt);
+                    ggml_vec_scale_f32(D, VKQ[iq], ms);
+                    S[iq] *= (ggml_float) ms;
+                    M[iq]  = Mt;
+                }
+
+                for (int ic = 0; ic < nc; ++ic) {
+                    if (st[ic] == -INFINITY) {
+                        continue;
+                    }
+
+                    ggml_fp16_t sd = GGML_FP32_TO_FP16(st[ic] - M[iq]);
+                    memcpy(&scvt, &sd, sizeof(scvt));
+                    const float p = GGML_FP16_TO_FP32(ggml_table_exp_f16[scvt]);
+                    S[iq] += (ggml_float) p;
+
+                    const char * pvr = pv[iq] + (ic0 + ic)*nbv1;
+
+                    if (v->type == GGML_TYPE_F32) {
+                        ggml_vec_mad_f32(D, VKQ[iq], (const float *) pvr, p);
+                    } else {
+                        v_to_float(pvr, vs, D);
+                        ggml_vec_mad_f32(D, VKQ[iq], vs, p);
+                    }
+                }
+            }
+        }
+
+        if (v_trans) {
+            for (int iq = 0; iq < nq; ++iq) {
+                for (int64_t ic = 0; ic < nek1; ++ic) {
+                    if (ss[iq][ic] == -INFINITY) {
+                        ss[iq][ic] = 0.0f;
+                    } else {
+                        ggml_fp16_t sd = GGML_FP32_TO_FP16(ss[iq][ic] - M[iq]);
+                        memcpy(&scvt, &sd, sizeof(scvt));
+                        ss[iq][ic] = GGML_FP16_TO_FP32(ggml_table_exp_f16[scvt]);
+                        S[iq] += (ggml_float) ss[iq][ic];
+                    }
+                }
+
+                if (v->type == GGML_TYPE_F16) {
+                    ggml_fp32_to_fp16_row(ss[iq], s16[iq], nek1);
+                }
+            }
+
+            // rows of the group sharing a head reuse each column of V while it is in cache
+            for (int64_t d = 0; d < D; ++d) {
+                for (int iq = 0; iq < nq; ++iq) {
+                    if (S[iq] == 0.0) {
+                        continue;
+                    }
+
+                    if (v->type == GGML_TYPE_F16) {
+                        ggml_vec_dot_f16(nek1, VKQ[iq] + d, (ggml_fp16_t *) (pv[iq] + d*nbv0), s16[iq]);
+                    } else {
+                        ggml_vec_dot_f32(nek1, VKQ[iq] + d, (const float *) (pv[iq] + d*nbv0), ss[iq]);
+                    }
+                }
+            }
+        }
+
+        for (int iq = 0; iq < nq; ++iq) {
+            if (S[iq] > 0.0) {
+                ggml_vec_cpy_f32  (D, dp[iq], VKQ[iq]);
+                ggml_vec_scale_f32(D, dp[iq], (float) (1.0/S[iq]));
+            } else {
+                // every KV row is masked out
+                memset(dp[iq], 0, D*sizeof(float));
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_flash_attn_ext(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        struct ggml_tensor * dst) {
+    switch (q->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_flash_attn_ext_f32(params, q, k, v, mask, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_flash_ff
 
 static void ggml_compute_forward_flash_ff_f16(
@@ -14399,6 +15540,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_get_rows_back(params, tensor->src[0], tensor->src[1], tensor);
             } break;
+        case GGML_OP_SET_ROWS:
+            {
+                ggml_compute_forward_set_rows(params, tensor->src[1], tensor->src[2], tensor);
+            } break;
         case GGML_OP_DIAG:
             {
                 ggml_compute_forward_diag(params, tensor->src[0], tensor);
@@ -14478,6 +15623,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
                 const bool masked = t != 0;
                 ggml_compute_forward_flash_attn(params, tensor->src[0], tensor->src[1], tensor->src[2], masked, tensor);
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                ggml_compute_forward_flash_attn_ext(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], tensor);
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 ggml_compute_forward_flash_ff(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], tensor->src[4], tensor);
@@ -15310,6 +16459,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
+        case GGML_OP_SET_ROWS:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_DIAG:
             {
                 GGML_ASSERT(false); // TODO: not implemented
@@ -15529,6 +16682,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                             zero_table);
                 }
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                GGML_ASSERT(false); // not supported
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 GGML_ASSERT(false); // not supported
@@ -15815,17 +16972,21 @@ struct ggml_cgraph * ggml_new_graph_custom(struct ggml_context * ctx, size_t siz
     memset(hash_keys_ptr, 0, hash_size * sizeof(struct ggml_tensor *));
 
     *cgraph = (struct ggml_cgraph) {
-        /*.size         =*/ size,
-        /*.n_nodes      =*/ 0,
-        /*.n_leafs      =*/ 0,
-        /*.nodes        =*/ nodes_ptr,
-        /*.grads        =*/ grads_ptr,
-        /*.leafs        =*/ leafs_ptr,
-        /*.hash_table   =*/ { hash_size, hash_keys_ptr },
-        /*.order        =*/ GGML_CGRAPH_EVAL_ORDER_LEFT_TO_RIGHT,
-        /*.perf_runs    =*/ 0,
-        /*.perf_cycles  =*/ 0,
-        /*.perf_time_us =*/ 0,
+        /*.size             =*/ size,
+        /*.n_nodes          =*/ 0,
+        /*.n_leafs          =*/ 0,
+        /*.nodes            =*/ nodes_ptr,
+        /*.grads            =*/ grads_ptr,
+        /*.leafs            =*/ leafs_ptr,
+        /*.hash_table       =*/ { hash_size, hash_keys_ptr },
+        /*.order            =*/ GGML_CGRAPH_EVAL_ORDER_LEFT_TO_RIGHT,
+        /*.perf_runs        =*/ 0,
+        /*.perf_cycles      =*/ 0,
+        /*.perf_time_us     =*/ 0,
+        /*.perf_wait_us     =*/ 0,
+        /*.perf_n_sleep     =*/ 0,
+        /*.perf_busy_us     =*/ 0,
+        /*.perf_busy_max_us =*/ 0,
     };
 
     return cgraph;
@@ -15837,17 +16998,21 @@ struct ggml_cgraph * ggml_new_graph(struct ggml_context * ctx) {
 
 struct ggml_cgraph ggml_graph_view(struct ggml_cgraph * cgraph0, int i0, int i1) {
     struct ggml_cgraph cgraph = {
-        /*.size         =*/ 0,
-        /*.n_nodes      =*/ i1 - i0,
-        /*.n_leafs      =*/ 0,
-        /*.nodes        =*/ cgraph0->nodes + i0,
-        /*.grads        =*/ cgraph0->grads ? cgraph0->grads + i0 : NULL,
-        /*.leafs        =*/ NULL,
-        /*.hash_table   =*/ { 0, NULL },
-        /*.order        =*/ cgraph0->order,
-        /*.perf_runs    =*/ 0,
-        /*.perf_cycles  =*/ 0,
-        /*.perf_time_us =*/ 0,
+        /*.size             =*/ 0,
+        /*.n_nodes          =*/ i1 - i0,
+        /*.n_leafs          =*/ 0,
+        /*.nodes            =*/ cgraph0->nodes + i0,
+        /*.grads            =*/ cgraph0->grads ? cgraph0->grads + i0 : NULL,
+        /*.leafs            =*/ NULL,
+        /*.hash_table       =*/ { 0, NULL },
+        /*.order            =*/ cgraph0->order,
+        /*.perf_runs        =*/ 0,
+        /*.perf_cycles      =*/ 0,
+        /*.perf_time_us     =*/ 0,
+        /*.perf_wait_us     =*/ 0,
+        /*.perf_n_sleep     =*/ 0,
+        /*.perf_busy_us     =*/ 0,
+        /*.perf_busy_max_us =*/ 0,
     };
 
     return cgraph;
@@ -15971,16 +17136,51 @@ typedef pthread_t ggml_thread_t;
 
 #endif
 
-// Android's libc implementation "bionic" does not support setting affinity
-#if defined(__linux__) && !defined(__BIONIC__)
-static void set_numa_thread_affinity(int thread_n, int n_threads) {
-    if (!ggml_is_numa()) {
-        return;
-    }
+// mutex + condition variable, used to park the workers of a ggml_threadpool between graphs
+#if defined(_WIN32)
 
-    // run thread on node_num thread_n / (threads per node)
-    const int node_num = thread_n / ((n_threads + g_state.numa.n_nodes - 1) / g_state.numa.n_nodes);
-    struct ggml_numa_node * node = &g_state.numa.nodes[node_num];
+typedef CRITICAL_SECTION   ggml_mutex_t;
+typedef CONDITION_VARIABLE ggml_cond_t;
+
+static void ggml_mutex_init   (ggml_mutex_t * m) { InitializeCriticalSection(m); }
+static void ggml_mutex_destroy(ggml_mutex_t * m) { DeleteCriticalSection(m); }
+static void ggml_mutex_lock   (ggml_mutex_t * m) { EnterCriticalSection(m); }
+static void ggml_mutex_unlock (ggml_mutex_t * m) { LeaveCriticalSection(m); }
+
+static void ggml_cond_init     (ggml_cond_t * c) { InitializeConditionVariable(c); }
+static void ggml_cond_destroy  (ggml_cond_t * c) { UNUSED(c); }
+static void ggml_cond_wait     (ggml_cond_t * c, ggml_mutex_t * m) { SleepConditionVariableCS(c, m, INFINITE); }
+static void ggml_cond_signal   (ggml_cond_t * c) { WakeConditionVariable(c); }
+static void ggml_cond_broadcast(ggml_cond_t * c) { WakeAllConditionVariable(c); }
+
+#else
+
+typedef pthread_mutex_t ggml_mutex_t;
+typedef pthread_cond_t  ggml_cond_t;
+
+static void ggml_mutex_init   (ggml_mutex_t * m) { pthread_mutex_init(m, NULL); }
+static void ggml_mutex_destroy(ggml_mutex_t * m) { pthread_mutex_destroy(m); }
+static void ggml_mutex_lock   (ggml_mutex_t * m) { pthread_mutex_lock(m); }
+static void ggml_mutex_unlock (ggml_mutex_t * m) { pthread_mutex_unlock(m); }
+
+static void ggml_cond_init     (ggml_cond_t * c) { pthread_cond_init(c, NULL); }
+static void ggml_cond_destroy  (ggml_cond_t * c) { pthread_cond_destroy(c); }
+static void ggml_cond_wait     (ggml_cond_t * c, ggml_mutex_t * m) { pthread_cond_wait(c, m); }
+static void ggml_cond_signal   (ggml_cond_t * c) { pthread_cond_signal(c); }
+static void ggml_cond_broadcast(ggml_cond_t * c) { pthread_cond_broadcast(c); }
+
+#endif
+
+// Android's libc implementation "bionic" does not support setting affinity
+#if defined(__linux__) && !defined(__BIONIC__)
+static void set_numa_thread_affinity(int thread_n, int n_threads) {
+    if (!ggml_is_numa()) {
+        return;
+    }
+
+    // run thread on node_num thread_n / (threads per node)
+    const int node_num = thread_n / ((n_threads + g_state.numa.n_nodes - 1) / g_state.numa.n_nodes);
+    struct ggml_numa_node * node = &g_state.numa.nodes[node_num];
     size_t setsize = CPU_ALLOC_SIZE(g_state.numa.total_cpus);
 
     cpu_set_t * cpus = CPU_ALLOC(g_state.numa.total_cpus);
@@ -16026,6 +17226,9 @@ static void set_numa_thread_affinity(int thread_n, int n_threads) { UNUSED(threa
 static void clear_numa_thread_affinity(void) {}
 #endif
 
+#define GGML_MAX_STEP_NODES   8  // max nodes computed together in one step
+#define GGML_SCHED_LOOKAHEAD 16  // max pending nodes considered when building a step
+
 struct ggml_compute_state_shared {
     const struct ggml_cgraph * cgraph;
     const struct ggml_cplan  * cplan;
@@ -16041,14 +17244,57 @@ struct ggml_compute_state_shared {
 
     bool (*abort_callback)(void * data); // abort ggml_graph_compute when true
     void * abort_callback_data;
+
+    // GGML_WAIT_POLICY_SPIN_SLEEP: threads blocked on cond until node_n changes
+    atomic_int     n_sleeping;
+    ggml_mutex_t * mutex;
+    ggml_cond_t  * cond;
+
+    // nodes computed concurrently in the current step, step_nodes[0] == node_n
+    // written only by the thread that finalizes a step, see ggml_graph_compute_next_step()
+    uint8_t * node_done; // [n_nodes], NULL when the nodes are computed strictly in order
+    int n_step_nodes;
+    int step_nodes[GGML_MAX_STEP_NODES];
+    struct ggml_compute_chunk step_chunks[GGML_MAX_STEP_NODES];
+
+    // src1 of the mul_mat whose converted src1 is in the work buffer, see ggml_graph_compute_src1_ready()
+    const struct ggml_tensor * wdata_src1;
+    enum ggml_type wdata_src1_type;
+
+    // mul node computed together with the rms_norm in step_nodes[0], -1 if none, see ggml_graph_compute_fuse()
+    int fused_mul;
+    enum ggml_type fused_type;
 };
 
 struct ggml_compute_state {
     ggml_thread_t thrd;
     int ith;
     struct ggml_compute_state_shared * shared;
+
+    struct ggml_threadpool * threadpool; // NULL if the thread was spawned for a single graph
+    int numa_n_threads;                  // n_threads the thread is currently pinned for, 0 if not pinned
+
+    // wait stats for the current graph
+    int64_t perf_wait_us;
+    int64_t perf_n_sleep;
+    int64_t perf_busy_us;
+};
+
+struct ggml_threadpool {
+    ggml_mutex_t mutex;
+    ggml_cond_t  cond_graph; // a new graph was posted or the pool is stopping
+    ggml_cond_t  cond_done;  // the last worker finished the current graph
+
+    struct ggml_compute_state * workers; // [n_threads], workers[0] is unused - the calling thread is worker 0
+
+    int  n_threads;
+    int  n_graph; // number of graphs posted so far
+    int  n_done;  // number of workers that finished the current graph
+    bool stop;
 };
 
+// the time is that of the whole step: nodes computed together in one step are each charged the wall time of the step
+// use ggml_profile_enable() for the time of the tasks of each node
 static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const struct ggml_compute_state_shared * st) {
     int64_t cycles_cur  = ggml_perf_cycles()  - st->perf_node_start_cycles;
     int64_t time_us_cur = ggml_perf_time_us() - st->perf_node_start_time_us;
@@ -16063,6 +17309,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
 
     switch (node->op) {
         case GGML_OP_CPY:
+        case GGML_OP_SET_ROWS:
         case GGML_OP_DUP:
         case GGML_OP_ADD:
         case GGML_OP_ADD1:
@@ -16222,6 +17469,10 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
             {
                 n_tasks = n_threads;
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                n_tasks = n_threads;
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 n_tasks = n_threads;
@@ -16296,9 +17547,856 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
             } break;
     }
 
-    assert(n_tasks > 0);
+    assert(n_tasks > 0);
+
+    return n_tasks;
+}
+
+// size of the work buffer needed to compute the node with n_tasks threads
+static size_t ggml_graph_node_work_size(struct ggml_tensor * node, int n_tasks) {
+    size_t cur = 0;
+
+    switch (node->op) {
+        case GGML_OP_CPY:
+        case GGML_OP_DUP:
+            {
+                if (ggml_is_quantized(node->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ACC:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_MUL_MAT:
+            {
+                const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
+
+#if defined(GGML_USE_CLBLAST)
+                if (ggml_cl_can_mul_mat(node->src[0], node->src[1], node)) {
+                    cur = ggml_cl_mul_mat_get_wsize(node->src[0], node->src[1], node);
+                } else
+#endif
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                if (ggml_compute_forward_mul_mat_use_blas(node->src[0], node->src[1], node)) {
+                    if (node->src[0]->type != GGML_TYPE_F32) {
+                        // here we need memory just for single 2D matrix from src0
+                        cur = ggml_type_size(GGML_TYPE_F32)*(node->src[0]->ne[0]*node->src[0]->ne[1]);
+                    }
+                } else
+#endif
+                {
+                    if (node->src[1]->type != vec_dot_type) {
+                        cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
+                    }
+
+                    // src0 panels of the tasks of the GEMM path
+                    const size_t panels_size = ggml_mul_mat_gemm_panels_size(node->src[0], node->src[1]);
+                    if (panels_size > 0) {
+                        cur = ggml_mul_mat_gemm_panels_offs(node->src[0], node->src[1]) + n_tasks*panels_size;
+                    }
+                }
+            } break;
+        case GGML_OP_MUL_MAT_ID:
+            {
+                const struct ggml_tensor * src0 = node->src[2];
+                const struct ggml_tensor * src1 = node->src[1];
+                const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
+                if (src1->type != vec_dot_type) {
+                    cur = ggml_row_size(vec_dot_type, ggml_nelements(src1));
+                }
+                const int n_as = ggml_get_op_params_i32(node, 1);
+                cur = GGML_PAD(cur, sizeof(int64_t));        // align
+                cur += n_as * sizeof(int64_t);               // matrix_row_counts
+                cur += n_as * src1->ne[1] * sizeof(int64_t); // matrix_rows
+            } break;
+        case GGML_OP_OUT_PROD:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_SOFT_MAX:
+            {
+                cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_1D:
+            {
+                GGML_ASSERT(node->src[0]->ne[3] == 1);
+                GGML_ASSERT(node->src[1]->ne[2] == 1);
+                GGML_ASSERT(node->src[1]->ne[3] == 1);
+
+                const int64_t ne00 = node->src[0]->ne[0];  // K
+                const int64_t ne01 = node->src[0]->ne[1];  // Cout
+                const int64_t ne02 = node->src[0]->ne[2];  // Cin
+
+                const int64_t ne10 = node->src[1]->ne[0];  // L
+                const int64_t ne11 = node->src[1]->ne[1];  // Cin
+
+                if (node->src[0]->type == GGML_TYPE_F16 &&
+                    node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
+                    cur += sizeof(ggml_fp16_t)*ne10*ne11;
+                } else if (node->src[0]->type == GGML_TYPE_F32 &&
+                           node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(float)*ne00*ne01*ne02;
+                    cur += sizeof(float)*ne10*ne11;
+                } else {
+                    GGML_ASSERT(false);
+                }
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_2D:
+            {
+                const int64_t ne00 = node->src[0]->ne[0]; // W
+                const int64_t ne01 = node->src[0]->ne[1]; // H
+                const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
+                const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+
+                const int64_t ne10 = node->src[1]->ne[0]; // W
+                const int64_t ne11 = node->src[1]->ne[1]; // H
+                const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+
+                cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
+                cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
+            } break;
+        case GGML_OP_FLASH_ATTN:
+            {
+                const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
+                }
+            } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                cur = ggml_flash_attn_ext_wsize(node->src[1], node->src[2])*n_tasks;
+            } break;
+        case GGML_OP_FLASH_FF:
+            {
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
+                }
+            } break;
+        case GGML_OP_FLASH_ATTN_BACK:
+            {
+                const int64_t    D = node->src[0]->ne[0];
+                const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+                const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                }
+            } break;
+
+        case GGML_OP_CROSS_ENTROPY_LOSS:
+            {
+                cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
+            } break;
+        case GGML_OP_COUNT:
+            {
+                GGML_ASSERT(false);
+            } break;
+        default:
+            break;
+    }
+
+    return cur;
+}
+
+//
+// step scheduling
+//
+// a step is a set of nodes whose tasks are dealt out to the threads together, so small independent nodes
+// (e.g. the Q/K/V projections or the two ropes of an attention layer) do not need a barrier each
+// dependencies are derived from the memory ranges the nodes touch rather than from the src links, since
+// ggml-alloc reuses the memory of freed tensors and the graph order is the only thing that protects it
+//
+
+// nodes that only create a view of their source and do no work at compute time
+static bool ggml_op_is_nop(enum ggml_op op) {
+    return op == GGML_OP_NONE || op == GGML_OP_RESHAPE || op == GGML_OP_VIEW || op == GGML_OP_PERMUTE || op == GGML_OP_TRANSPOSE;
+}
+
+static bool ggml_graph_node_can_share_step(const struct ggml_tensor * node) {
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST)
+    // the GPU paths in ggml_compute_forward() are not thread-safe
+    UNUSED(node);
+    return false;
+#else
+    if (node->backend != GGML_BACKEND_CPU) {
+        return false;
+    }
+
+    switch (node->op) {
+        case GGML_OP_MUL_MAT:
+            // the rows of a src0 placed on the NUMA nodes are split by the node of the thread, task ith has to run on thread ith
+            return !ggml_numa_rows(node->src[0]);
+        case GGML_OP_MAP_UNARY:
+        case GGML_OP_MAP_BINARY:
+        case GGML_OP_MAP_CUSTOM1_F32:
+        case GGML_OP_MAP_CUSTOM2_F32:
+        case GGML_OP_MAP_CUSTOM3_F32:
+        case GGML_OP_MAP_CUSTOM1:
+        case GGML_OP_MAP_CUSTOM2:
+        case GGML_OP_MAP_CUSTOM3:
+            // user callbacks may have side effects we cannot see
+            return false;
+        default:
+            return true;
+    }
+#endif
+}
+
+// mul_mats that convert the same src1 to the same vec_dot_type write identical data to the work buffer
+static bool ggml_graph_nodes_share_wdata(struct ggml_tensor * a, struct ggml_tensor * b) {
+    if (a->op != GGML_OP_MUL_MAT || b->op != GGML_OP_MUL_MAT || a->src[1] != b->src[1]) {
+        return false;
+    }
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+    // the BLAS path uses the work buffer to dequantize src0
+    if (ggml_compute_forward_mul_mat_use_blas(a->src[0], a->src[1], a) ||
+        ggml_compute_forward_mul_mat_use_blas(b->src[0], b->src[1], b)) {
+        return false;
+    }
+#endif
+    // the src0 panels of the GEMM path are per task, and the tasks of both nodes run concurrently
+    if (ggml_mul_mat_gemm_panels_size(a->src[0], a->src[1]) > 0 || ggml_mul_mat_gemm_panels_size(b->src[0], b->src[1]) > 0) {
+        return false;
+    }
+    return type_traits[a->src[0]->type].vec_dot_type == type_traits[b->src[0]->type].vec_dot_type;
+}
+
+// memory ranges read and written by a node
+struct ggml_node_mem {
+    const char * dst[2];
+    const char * src[GGML_MAX_SRC][2];
+    int n_src;
+};
+
+static void ggml_node_mem_init(struct ggml_node_mem * mem, const struct ggml_tensor * node) {
+    mem->dst[0] = (const char *) node->data;
+    mem->dst[1] = (const char *) node->data + ggml_nbytes(node);
+    mem->n_src  = 0;
+
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        const struct ggml_tensor * src = node->src[i];
+        if (src) {
+            mem->src[mem->n_src][0] = (const char *) src->data;
+            mem->src[mem->n_src][1] = (const char *) src->data + ggml_nbytes(src);
+            mem->n_src++;
+        }
+    }
+}
+
+static bool ggml_mem_overlap(const char * const a[2], const char * const b[2]) {
+    return a[0] < b[1] && b[0] < a[1];
+}
+
+// b comes after a in the graph - it can run concurrently with a if it does not
+// read a's result (RAW), overwrite a's sources (WAR) or a's result (WAW)
+static bool ggml_node_mem_independent(const struct ggml_node_mem * a, const struct ggml_node_mem * b) {
+    if (ggml_mem_overlap(a->dst, b->dst)) {
+        return false;
+    }
+    for (int i = 0; i < b->n_src; ++i) {
+        if (ggml_mem_overlap(b->src[i], a->dst)) {
+            return false;
+        }
+    }
+    for (int i = 0; i < a->n_src; ++i) {
+        if (ggml_mem_overlap(a->src[i], b->dst)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// rms_norm -> mul(weights) -> mul_mat chains (llm_build_norm followed by the Q, K, V or FFN projections) are computed
+// in one pass that also converts the mul result for the mul_mats, instead of three passes and three steps
+// returns true if the node at node_n starts such a chain - its mul is then stored in shared->fused_mul
+static bool ggml_graph_compute_fuse(struct ggml_compute_state_shared * shared, int node_n) {
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST)
+    // the nodes may be computed on the GPU
+    UNUSED(shared);
+    UNUSED(node_n);
+    return false;
+#else
+    const struct ggml_cgraph * cgraph = shared->cgraph;
+
+    if (!shared->cplan->fuse_ops || node_n + 1 >= cgraph->n_nodes) {
+        return false;
+    }
+
+    struct ggml_tensor * norm = cgraph->nodes[node_n];
+    struct ggml_tensor * mul  = cgraph->nodes[node_n + 1];
+
+    if (norm->op != GGML_OP_RMS_NORM || norm->backend != GGML_BACKEND_CPU || norm->src[0]->type != GGML_TYPE_F32 ||
+        norm->src[0]->nb[0] != sizeof(float) || !ggml_is_contiguous(norm)) {
+        return false;
+    }
+
+    // the weights are a single row that is broadcast over all rows
+    if (mul->op != GGML_OP_MUL || mul->src[0] != norm || mul->backend != GGML_BACKEND_CPU || !ggml_is_contiguous(mul) ||
+        mul->src[1]->type != GGML_TYPE_F32 || !ggml_is_contiguous(mul->src[1]) || ggml_nrows(mul->src[1]) != 1 ||
+        mul->src[1]->ne[0] != norm->ne[0]) {
+        return false;
+    }
+
+    if (shared->node_done && shared->node_done[node_n + 1]) {
+        return false;
+    }
+
+    // the F32 results are not stored: the mul may only be read by mul_mats that take the converted mul from the work
+    // buffer, and no other node may use the work buffer before the last of them - see also ggml_graph_compute_next_step()
+    enum ggml_type vec_dot_type = GGML_TYPE_COUNT;
+
+    int first_consumer = -1;
+    int last_consumer  = -1;
+    int first_wdata    = cgraph->n_nodes;
+
+    for (int j = node_n + 2; j < cgraph->n_nodes; ++j) {
+        struct ggml_tensor * node = cgraph->nodes[j];
+
+        bool reads = false;
+        for (int i = 0; i < GGML_MAX_SRC && node->src[i]; ++i) {
+            reads = reads || node->src[i] == norm || node->src[i] == mul;
+        }
+
+        if (!reads) {
+            if (j < first_wdata && !ggml_op_is_nop(node->op) && ggml_graph_node_work_size(node, ggml_get_n_tasks(node, shared->n_threads)) > 0) {
+                first_wdata = j;
+            }
+            continue;
+        }
+
+        if (node->op != GGML_OP_MUL_MAT || node->src[1] != mul || node->backend != GGML_BACKEND_CPU) {
+            return false;
+        }
+
+        if (first_consumer < 0) {
+            first_consumer = j;
+            vec_dot_type   = type_traits[node->src[0]->type].vec_dot_type;
+        }
+
+        if (type_traits[node->src[0]->type].vec_dot_type != vec_dot_type || vec_dot_type == GGML_TYPE_F32) {
+            return false;
+        }
+
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+        // the BLAS path reads src1 as F32 and does not size the work buffer for the converted src1
+        if (ggml_compute_forward_mul_mat_use_blas(node->src[0], node->src[1], node)) {
+            return false;
+        }
+#endif
+
+        last_consumer = j;
+    }
+
+    // the conversion only pays off if a mul_mat that needs it follows soon
+    if (first_consumer < 0 || first_consumer >= node_n + 2 + GGML_SCHED_LOOKAHEAD || last_consumer > first_wdata) {
+        return false;
+    }
+
+    // the converted mul goes to the work buffer of the mul_mat, see ggml_graph_node_work_size()
+    if (shared->cplan->work_size - shared->cplan->sched_size < ggml_nrows(mul)*ggml_row_size(vec_dot_type, mul->ne[0])) {
+        return false;
+    }
+
+    shared->fused_mul  = node_n + 1;
+    shared->fused_type = vec_dot_type;
+
+    return true;
+#endif
+}
+
+// mark the nodes of the finished step as done and select the nodes of the next step
+// returns the first node of the next step, which is the first node that is not done yet, or n_nodes when the graph is complete
+static int ggml_graph_compute_next_step(struct ggml_compute_state_shared * shared, int node_n) {
+    const struct ggml_cgraph * cgraph = shared->cgraph;
+    uint8_t * node_done = shared->node_done;
+
+    const int fused_mul = shared->fused_mul;
+    shared->fused_mul = -1;
+
+    if (node_done == NULL) {
+        // the fused mul directly follows the first node of the step
+        node_n = (fused_mul >= 0 ? fused_mul : node_n) + 1;
+
+        shared->step_nodes[0] = node_n;
+        shared->n_step_nodes  = 1;
+
+        if (node_n < cgraph->n_nodes) {
+            ggml_graph_compute_fuse(shared, node_n);
+        }
+
+        return node_n;
+    }
+
+    for (int k = 0; k < shared->n_step_nodes; ++k) {
+        node_done[shared->step_nodes[k]] = 1;
+    }
+    if (fused_mul >= 0) {
+        node_done[fused_mul] = 1;
+    }
+
+    node_n = MAX(node_n, 0);
+    while (node_n < cgraph->n_nodes && node_done[node_n]) {
+        node_n++;
+    }
+
+    shared->step_nodes[0] = node_n;
+    shared->n_step_nodes  = 1;
+
+    if (node_n >= cgraph->n_nodes) {
+        return node_n;
+    }
+
+    if (ggml_graph_compute_fuse(shared, node_n)) {
+        return node_n;
+    }
+
+    const int n_threads = shared->n_threads;
+    const int n_step_max = MIN(shared->cplan->n_parallel_nodes, GGML_MAX_STEP_NODES);
+
+    struct ggml_tensor * first = cgraph->nodes[node_n];
+
+    // single task nodes are computed directly by the thread that finalizes the step
+    if (ggml_get_n_tasks(first, n_threads) == 1 || !ggml_graph_node_can_share_step(first)) {
+        return node_n;
+    }
+
+    // nodes between node_n and the candidate that are not done yet - the candidate must be independent of all of them
+    struct ggml_node_mem pending[GGML_SCHED_LOOKAHEAD];
+    int n_pending = 0;
+
+    ggml_node_mem_init(&pending[n_pending++], first);
+
+    // at most one work buffer user per step
+    struct ggml_tensor * wdata_node = ggml_graph_node_work_size(first, ggml_get_n_tasks(first, n_threads)) > 0 ? first : NULL;
+
+    // the work buffer users run in graph order, so that a converted src1 stays in the work buffer until all the
+    // mul_mats that read it ran - after a fused mul, it is the only copy of its result
+    bool wdata_skipped = false;
+
+    for (int j = node_n + 1; j < cgraph->n_nodes && n_pending < GGML_SCHED_LOOKAHEAD && shared->n_step_nodes < n_step_max; ++j) {
+        struct ggml_tensor * node = cgraph->nodes[j];
+
+        if (node_done[j] || ggml_op_is_nop(node->op)) {
+            continue;
+        }
+
+        struct ggml_node_mem * mem = &pending[n_pending];
+        ggml_node_mem_init(mem, node);
+
+        bool ok = ggml_graph_node_can_share_step(node);
+        for (int i = 0; ok && i < n_pending; ++i) {
+            ok = ggml_node_mem_independent(&pending[i], mem);
+        }
+
+        n_pending++;
+
+        if (ggml_graph_node_work_size(node, ggml_get_n_tasks(node, n_threads)) > 0) {
+            if (!ok || wdata_skipped || (wdata_node && !ggml_graph_nodes_share_wdata(wdata_node, node))) {
+                ok = false;
+                wdata_skipped = true;
+            } else {
+                wdata_node = node;
+            }
+        }
+
+        if (ok) {
+            shared->step_nodes[shared->n_step_nodes++] = j;
+        }
+    }
+
+    return node_n;
+}
+
+// mul_mats that consume the same activation (Q, K and V, or the FFN gate and up projections) would each convert it
+// to vec_dot_type again - track which src1 the work buffer holds so that the conversion is done only once
+// called for every node in graph order by the thread that runs INIT, returns true if the node can skip the conversion
+static bool ggml_graph_compute_src1_ready(struct ggml_compute_state_shared * shared, struct ggml_tensor * node, int n_tasks) {
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST)
+    // the node may be computed on the GPU without touching the work buffer
+    UNUSED(shared);
+    UNUSED(node);
+    UNUSED(n_tasks);
+    return false;
+#else
+    if (ggml_op_is_nop(node->op)) {
+        return false;
+    }
+
+    const struct ggml_tensor * src1 = shared->wdata_src1;
+
+    // the cached src1 is overwritten in place
+    if (src1 &&
+        (char *) node->data < (char *) src1->data + ggml_nbytes(src1) &&
+        (char *) src1->data < (char *) node->data + ggml_nbytes(node)) {
+        shared->wdata_src1 = src1 = NULL;
+    }
+
+    if (ggml_graph_node_work_size(node, n_tasks) == 0) {
+        return false;
+    }
+
+    const enum ggml_type vec_dot_type = node->op == GGML_OP_MUL_MAT ? type_traits[node->src[0]->type].vec_dot_type : GGML_TYPE_COUNT;
+
+    bool converts_src1 = node->op == GGML_OP_MUL_MAT && node->src[1]->type != vec_dot_type;
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+    // the BLAS path uses the work buffer to dequantize src0
+    converts_src1 = converts_src1 && !ggml_compute_forward_mul_mat_use_blas(node->src[0], node->src[1], node);
+#endif
+
+    if (converts_src1 && node->src[1] == src1 && vec_dot_type == shared->wdata_src1_type) {
+        return true;
+    }
+
+    // the work buffer is overwritten by the node
+    shared->wdata_src1      = converts_src1 ? node->src[1] : NULL;
+    shared->wdata_src1_type = vec_dot_type;
+
+    return false;
+#endif
+}
+
+// compute a node of the current step, together with the mul fused into it by ggml_graph_compute_fuse()
+static void ggml_graph_compute_forward(struct ggml_compute_state_shared * shared, struct ggml_compute_params * params, struct ggml_tensor * node) {
+    if (shared->fused_mul >= 0 && node == shared->cgraph->nodes[shared->step_nodes[0]]) {
+        struct ggml_tensor * mul = shared->cgraph->nodes[shared->fused_mul];
+        ggml_compute_forward_rms_norm_mul_f32(params, node->src[0], node, mul, shared->fused_type);
+        return;
+    }
+
+    ggml_compute_forward(params, node);
+}
+
+#define GGML_DEFAULT_WAIT_SPIN_COUNT 16384
+
+// wait until *value is no longer `last`, with the wait policy of the graph compute, and return the new value
+// the thread that changes the value has to call ggml_graph_compute_wake(), *n_sleep counts the blocking waits
+static int ggml_graph_compute_wait_value(struct ggml_compute_state_shared * shared, atomic_int * value, int last, int64_t * n_sleep) {
+    int v = last;
+
+    switch (shared->cplan->wait_policy) {
+        case GGML_WAIT_POLICY_SPIN:
+            {
+                while ((v = atomic_load(value)) == last) {
+                    // spin
+                }
+            } break;
+        case GGML_WAIT_POLICY_YIELD:
+            {
+                while ((v = atomic_load(value)) == last) {
+                    sched_yield();
+                }
+            } break;
+        case GGML_WAIT_POLICY_SPIN_SLEEP:
+            {
+                const int n_spin = shared->cplan->wait_spin_count > 0 ? shared->cplan->wait_spin_count : GGML_DEFAULT_WAIT_SPIN_COUNT;
+
+                for (int i = 0; i < n_spin; ++i) {
+                    v = atomic_load(value);
+                    if (v != last) {
+                        break;
+                    }
+                }
+
+                if (v == last) {
+                    // n_sleeping is raised before re-checking the value, so the writer either sees a sleeper or we see the new value
+                    ggml_mutex_lock(shared->mutex);
+                    atomic_fetch_add(&shared->n_sleeping, 1);
+                    while ((v = atomic_load(value)) == last) {
+                        ggml_cond_wait(shared->cond, shared->mutex);
+                    }
+                    atomic_fetch_sub(&shared->n_sleeping, 1);
+                    ggml_mutex_unlock(shared->mutex);
+
+                    (*n_sleep)++;
+                }
+            } break;
+        default:
+            {
+                while ((v = atomic_load(value)) == last) {
+                    // this sched_yield can have significant impact on the performance - either positive or negative
+                    // depending on the workload and the operating system, use an explicit wait policy to tune it
+                    // ref: https://github.com/ggerganov/ggml/issues/291
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                    sched_yield();
+#endif
+                }
+            } break;
+    }
+
+    return v;
+}
+
+// wait for the thread that finalizes node `last` to publish the next node
+static int ggml_graph_compute_wait(struct ggml_compute_state * state, int last) {
+    const int64_t t_start_us = ggml_time_us();
+
+    const int node_n = ggml_graph_compute_wait_value(state->shared, &state->shared->node_n, last, &state->perf_n_sleep);
+
+    state->perf_wait_us += ggml_time_us() - t_start_us;
+
+    return node_n;
+}
+
+// wake up the threads that blocked in ggml_graph_compute_wait_value() after node_n or the n_ready of a node was updated
+static void ggml_graph_compute_wake(struct ggml_compute_state_shared * shared) {
+    if (atomic_load(&shared->n_sleeping) > 0) {
+        ggml_mutex_lock(shared->mutex);
+        ggml_cond_broadcast(shared->cond);
+        ggml_mutex_unlock(shared->mutex);
+    }
+}
+
+// the tasks of a step are dealt out round-robin, see ggml_graph_compute_thread(): up to n_threads tasks of a node
+// run on different threads, and every thread computes the tasks of the step in order, so a task can only wait on
+// tasks that are not blocked behind it
+static bool ggml_compute_chunk_concurrent(const struct ggml_compute_chunk * chunk, int nth) {
+    return chunk != NULL && chunk->shared != NULL && nth <= chunk->shared->n_threads;
+}
+
+static void ggml_compute_chunk_barrier(struct ggml_compute_chunk * chunk, int nth) {
+    struct ggml_compute_state_shared * shared = chunk->shared;
+
+    int64_t n_sleep = 0;
+
+    int n = atomic_fetch_add(&chunk->n_ready, 1) + 1;
+    ggml_graph_compute_wake(shared);
+
+    while (n < nth) {
+        n = ggml_graph_compute_wait_value(shared, &chunk->n_ready, n, &n_sleep);
+    }
+}
+
+//
+// profiling
+//
+
+// one event per node and thread that computed tasks of the node
+struct ggml_profile_event {
+    char    name[GGML_MAX_NAME];
+    int32_t op;         // enum ggml_op
+    int32_t type;       // enum ggml_type of the result
+    int32_t tid;        // thread
+    int32_t ith;        // first task computed by the thread
+    int32_t nth;        // number of tasks of the node
+    int32_t n_threads;  // number of threads of the graph
+    int64_t t_start_ns;
+    int64_t t_end_ns;   // 0 for an unused slot
+    int64_t flops;      // estimate for the whole node
+    int64_t bytes;      // estimate of the memory read and written by the whole node
+};
+
+#define GGML_PROFILE_DEFAULT_EVENTS (1 << 16)
+
+struct ggml_profile_state {
+    atomic_bool enabled;
+    atomic_int  n_recorded; // wraps around, the number of events is a power of 2
+
+    atomic_int  n_computing; // graphs being computed, which may record events
+    atomic_bool updating;    // the events are being reallocated or cleared
+
+    struct ggml_profile_event * events;
+    size_t n_events;
+};
+
+static struct ggml_profile_state g_profile;
+
+static int64_t ggml_profile_time_ns(void) {
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return (int64_t) ((double) (t.QuadPart - timer_start) * 1e9 / (double) timer_freq);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000 + (int64_t)ts.tv_nsec;
+#endif
+}
+
+static int64_t ggml_profile_flops(const struct ggml_tensor * node) {
+    const int64_t ne = ggml_nelements(node);
+
+    switch (node->op) {
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ID:
+            {
+                return 2*node->src[1]->ne[0]*ne;
+            }
+        case GGML_OP_OUT_PROD:
+            {
+                return 2*node->src[0]->ne[1]*ne;
+            }
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                // K*Q and V*softmax(K*Q)
+                return 4*node->src[0]->ne[0]*node->src[1]->ne[1]*ggml_nrows(node->src[0]);
+            }
+        case GGML_OP_SET_ROWS:
+            {
+                return ggml_nelements(node->src[1]);
+            }
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_SOFT_MAX:
+            {
+                return 3*ne;
+            }
+        default:
+            {
+                return ne;
+            }
+    }
+}
+
+static int64_t ggml_profile_bytes(const struct ggml_tensor * node) {
+    if (node->op == GGML_OP_SET_ROWS) {
+        // only the rows of b are written, not the whole destination
+        return ggml_nbytes(node->src[1]) + ggml_nbytes(node->src[2]) +
+            ggml_nelements(node->src[1])*ggml_type_size(node->type)/ggml_blck_size(node->type);
+    }
+
+    int64_t bytes = ggml_nbytes(node);
+
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        if (node->src[i]) {
+            bytes += ggml_nbytes(node->src[i]);
+        }
+    }
+
+    return bytes;
+}
+
+static void ggml_profile_record(const struct ggml_tensor * node, int tid, int ith, int nth, int n_threads, int64_t t_start_ns) {
+    const int64_t t_end_ns = ggml_profile_time_ns();
+
+    const unsigned int i = (unsigned int) atomic_fetch_add(&g_profile.n_recorded, 1) & (g_profile.n_events - 1);
+
+    struct ggml_profile_event * ev = &g_profile.events[i];
+
+    memcpy(ev->name, node->name, sizeof(ev->name));
+    ev->op         = node->op;
+    ev->type       = node->type;
+    ev->tid        = tid;
+    ev->ith        = ith;
+    ev->nth        = nth;
+    ev->n_threads  = n_threads;
+    ev->t_start_ns = t_start_ns;
+    ev->t_end_ns   = MAX(t_end_ns, t_start_ns + 1);
+    ev->flops      = ggml_profile_flops(node);
+    ev->bytes      = ggml_profile_bytes(node);
+}
+
+// a graph waits for an update of the events that started before it, an update is rejected while a graph is computed
+static void ggml_profile_compute_begin(void) {
+    atomic_fetch_add(&g_profile.n_computing, 1);
+
+    while (atomic_load(&g_profile.updating)) {
+        atomic_fetch_sub(&g_profile.n_computing, 1);
+        sched_yield();
+        atomic_fetch_add(&g_profile.n_computing, 1);
+    }
+}
+
+static void ggml_profile_compute_end(void) {
+    atomic_fetch_sub(&g_profile.n_computing, 1);
+}
+
+static bool ggml_profile_update_begin(void) {
+    if (atomic_exchange(&g_profile.updating, true)) {
+        return false;
+    }
+
+    if (atomic_load(&g_profile.n_computing) > 0) {
+        atomic_store(&g_profile.updating, false);
+        return false;
+    }
+
+    return true;
+}
+
+static void ggml_profile_update_end(void) {
+    atomic_store(&g_profile.updating, false);
+}
+
+static void ggml_profile_clear(void) {
+    if (g_profile.events) {
+        memset(g_profile.events, 0, g_profile.n_events*sizeof(struct ggml_profile_event));
+    }
+    atomic_store(&g_profile.n_recorded, 0);
+}
+
+bool ggml_profile_enable(size_t n_events) {
+    if (n_events == 0) {
+        n_events = GGML_PROFILE_DEFAULT_EVENTS;
+    }
 
-    return n_tasks;
+    size_t n = 1;
+    while (n < n_events) {
+        n <<= 1;
+    }
+
+    if (!ggml_profile_update_begin()) {
+        return false;
+    }
+
+    if (n != g_profile.n_events) {
+        free(g_profile.events);
+        g_profile.events   = malloc(n*sizeof(struct ggml_profile_event));
+        g_profile.n_events = n;
+        GGML_ASSERT(g_profile.events);
+
+        ggml_profile_clear();
+    }
+
+    atomic_store(&g_profile.enabled, true);
+
+    ggml_profile_update_end();
+
+    return true;
+}
+
+void ggml_profile_disable(void) {
+    atomic_store(&g_profile.enabled, false);
+}
+
+bool ggml_profile_enabled(void) {
+    return atomic_load(&g_profile.enabled);
+}
+
+bool ggml_profile_reset(void) {
+    if (!ggml_profile_update_begin()) {
+        return false;
+    }
+
+    ggml_profile_clear();
+
+    ggml_profile_update_end();
+
+    return true;
 }
 
 static thread_ret_t ggml_graph_compute_thread(void * data) {
@@ -16309,13 +18407,28 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
     const int   n_threads   = state->shared->n_threads;
 
-    set_numa_thread_affinity(state->ith, n_threads);
+    // sampled once per graph, the only cost when profiling is off
+    const bool profile = ggml_profile_enabled();
+
+    // pooled workers stay pinned across graphs as long as the thread count does not change
+    if (state->numa_n_threads != n_threads) {
+        set_numa_thread_affinity(state->ith, n_threads);
+        state->numa_n_threads = n_threads;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    state->perf_wait_us = 0;
+    state->perf_n_sleep = 0;
+    state->perf_busy_us = 0;
 
     int node_n = -1;
 
     while (true) {
         if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
             state->shared->node_n += 1;
+            ggml_graph_compute_wake(state->shared);
+            state->perf_busy_us = ggml_time_us() - t_start_us - state->perf_wait_us;
             return (thread_ret_t) GGML_EXIT_ABORTED;
         }
         if (atomic_fetch_sub(&state->shared->n_active, 1) == 1) {
@@ -16325,49 +18438,79 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                 /*.type  =*/ GGML_TASK_FINALIZE,
                 /*.ith   =*/ 0,
                 /*.nth   =*/ 0,
-                /*.wsize =*/ cplan->work_size,
+                /*.wsize =*/ cplan->work_size - cplan->sched_size,
                 /*.wdata =*/ cplan->work_data,
+                /*.chunk =*/ NULL,
             };
 
             if (node_n != -1) {
                 /* FINALIZE */
-                struct ggml_tensor * node = cgraph->nodes[node_n];
-                if (GGML_OP_HAS_FINALIZE[node->op]) {
-                    params.nth = ggml_get_n_tasks(node, n_threads);
-                    ggml_compute_forward(&params, node);
+                for (int k = 0; k < state->shared->n_step_nodes; ++k) {
+                    struct ggml_tensor * node = cgraph->nodes[state->shared->step_nodes[k]];
+                    if (GGML_OP_HAS_FINALIZE[node->op]) {
+                        params.nth = ggml_get_n_tasks(node, n_threads);
+                        ggml_compute_forward(&params, node);
+                    }
+                    ggml_graph_compute_perf_stats_node(node, state->shared);
                 }
-                ggml_graph_compute_perf_stats_node(node, state->shared);
             }
 
             // distribute new work or execute it direct if 1T
-            while (++node_n < cgraph->n_nodes) {
-                GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, node_n, cgraph->n_nodes);
-
-                struct ggml_tensor * node = cgraph->nodes[node_n];
-                const int n_tasks = ggml_get_n_tasks(node, n_threads);
+            while ((node_n = ggml_graph_compute_next_step(state->shared, node_n)) < cgraph->n_nodes) {
+                GGML_PRINT_DEBUG_5("%s: %d/%d (%d nodes)\n", __func__, node_n, cgraph->n_nodes, state->shared->n_step_nodes);
 
                 state->shared->perf_node_start_cycles  = ggml_perf_cycles();
                 state->shared->perf_node_start_time_us = ggml_perf_time_us();
 
-                params.nth = n_tasks;
+                int n_step_tasks = 0;
+
+                for (int k = 0; k < state->shared->n_step_nodes; ++k) {
+                    struct ggml_tensor * node = cgraph->nodes[state->shared->step_nodes[k]];
+                    const int n_tasks = ggml_get_n_tasks(node, n_threads);
+
+                    params.nth   = n_tasks;
+                    params.chunk = &state->shared->step_chunks[k];
+
+                    params.chunk->src1_ready = ggml_graph_compute_src1_ready(state->shared, node, n_tasks);
 
-                /* INIT */
-                if (GGML_OP_HAS_INIT[node->op]) {
-                    params.type = GGML_TASK_INIT;
-                    ggml_compute_forward(&params, node);
+                    /* INIT */
+                    if (GGML_OP_HAS_INIT[node->op]) {
+                        params.type = GGML_TASK_INIT;
+                        ggml_compute_forward(&params, node);
+                    }
+
+                    n_step_tasks += n_tasks;
+                }
+
+                if (state->shared->fused_mul >= 0) {
+                    // the fused step leaves the converted mul result in the work buffer
+                    struct ggml_tensor * mul = cgraph->nodes[state->shared->fused_mul];
+                    ggml_graph_compute_src1_ready(state->shared, mul, n_threads);
+
+                    state->shared->wdata_src1      = mul;
+                    state->shared->wdata_src1_type = state->shared->fused_type;
                 }
 
-                if (n_tasks == 1) {
+                if (n_step_tasks == 1) {
                     // TODO: maybe push node_n to the atomic but if other threads see n_tasks is 1,
                     // they do something more efficient than spinning (?)
-                    params.type = GGML_TASK_COMPUTE;
-                    ggml_compute_forward(&params, node);
+                    struct ggml_tensor * node = cgraph->nodes[node_n];
+
+                    const int64_t t_start_ns = profile ? ggml_profile_time_ns() : 0;
+
+                    params.type  = GGML_TASK_COMPUTE;
+                    params.chunk = &state->shared->step_chunks[0];
+                    ggml_graph_compute_forward(state->shared, &params, node);
 
                     if (GGML_OP_HAS_FINALIZE[node->op]) {
                         params.type = GGML_TASK_FINALIZE;
                         ggml_compute_forward(&params, node);
                     }
 
+                    if (profile) {
+                        ggml_profile_record(node, state->ith, 0, 1, n_threads, t_start_ns);
+                    }
+
                     ggml_graph_compute_perf_stats_node(node, state->shared);
                 } else {
                     break;
@@ -16380,46 +18523,171 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
             atomic_store(&state->shared->n_active, n_threads);
             atomic_store(&state->shared->node_n,   node_n);
+
+            ggml_graph_compute_wake(state->shared);
         } else {
             // wait for other threads to finish
-            const int last = node_n;
-            while (true) {
-                // TODO: this sched_yield can have significant impact on the performance - either positive or negative
-                //       depending on the workload and the operating system.
-                //       since it is not clear what is the best approach, it should potentially become user-configurable
-                //       ref: https://github.com/ggerganov/ggml/issues/291
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                sched_yield();
-#endif
-
-                node_n = atomic_load(&state->shared->node_n);
-                if (node_n != last) break;
-            };
+            node_n = ggml_graph_compute_wait(state, node_n);
         }
 
         // check if we should stop
         if (node_n >= cgraph->n_nodes) break;
 
         /* COMPUTE */
-        struct ggml_tensor * node = cgraph->nodes[node_n];
-        const int n_tasks = ggml_get_n_tasks(node, n_threads);
+        // the tasks of all nodes in the step are dealt out round-robin: task t of the step goes to thread t % n_threads
+        for (int k = 0, t0 = 0; k < state->shared->n_step_nodes; ++k) {
+            struct ggml_tensor * node = cgraph->nodes[state->shared->step_nodes[k]];
+            const int n_tasks = ggml_get_n_tasks(node, n_threads);
 
-        struct ggml_compute_params params = {
-            /*.type  =*/ GGML_TASK_COMPUTE,
-            /*.ith   =*/ state->ith,
-            /*.nth   =*/ n_tasks,
-            /*.wsize =*/ cplan->work_size,
-            /*.wdata =*/ cplan->work_data,
-        };
+            struct ggml_compute_params params = {
+                /*.type  =*/ GGML_TASK_COMPUTE,
+                /*.ith   =*/ 0,
+                /*.nth   =*/ n_tasks,
+                /*.wsize =*/ cplan->work_size - cplan->sched_size,
+                /*.wdata =*/ cplan->work_data,
+                /*.chunk =*/ &state->shared->step_chunks[k],
+            };
+
+            const int ith0 = ((state->ith - t0) % n_threads + n_threads) % n_threads;
+
+            const int64_t t_start_ns = profile && ith0 < n_tasks ? ggml_profile_time_ns() : 0;
+
+            for (int ith = ith0; ith < n_tasks; ith += n_threads) {
+                params.ith = ith;
+                ggml_graph_compute_forward(state->shared, &params, node);
+            }
+
+            if (t_start_ns != 0) {
+                ggml_profile_record(node, state->ith, ith0, n_tasks, n_threads, t_start_ns);
+            }
 
-        if (state->ith < n_tasks) {
-            ggml_compute_forward(&params, node);
+            t0 += n_tasks;
         }
     }
 
+    state->perf_busy_us = ggml_time_us() - t_start_us - state->perf_wait_us;
+
     return GGML_EXIT_SUCCESS;
 }
 
+static thread_ret_t ggml_threadpool_worker(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool * threadpool = state->threadpool;
+
+    int n_graph = 0;
+
+    while (true) {
+        ggml_mutex_lock(&threadpool->mutex);
+        while (threadpool->n_graph == n_graph && !threadpool->stop) {
+            ggml_cond_wait(&threadpool->cond_graph, &threadpool->mutex);
+        }
+        const bool stop = threadpool->stop;
+        n_graph = threadpool->n_graph;
+        ggml_mutex_unlock(&threadpool->mutex);
+
+        if (stop) {
+            break;
+        }
+
+        // the graph may use fewer threads than the pool has
+        if (state->ith < state->shared->n_threads) {
+            ggml_graph_compute_thread(state);
+        }
+
+        ggml_mutex_lock(&threadpool->mutex);
+        if (++threadpool->n_done == threadpool->n_threads - 1) {
+            ggml_cond_signal(&threadpool->cond_done);
+        }
+        ggml_mutex_unlock(&threadpool->mutex);
+    }
+
+    return 0;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = GGML_DEFAULT_N_THREADS;
+    }
+
+    struct ggml_threadpool * threadpool = GGML_ALIGNED_MALLOC(sizeof(struct ggml_threadpool));
+
+    ggml_mutex_init(&threadpool->mutex);
+    ggml_cond_init (&threadpool->cond_graph);
+    ggml_cond_init (&threadpool->cond_done);
+
+    threadpool->workers   = GGML_ALIGNED_MALLOC(sizeof(struct ggml_compute_state)*n_threads);
+    threadpool->n_threads = n_threads;
+    threadpool->n_graph   = 0;
+    threadpool->n_done    = 0;
+    threadpool->stop      = false;
+
+    for (int j = 0; j < n_threads; ++j) {
+        threadpool->workers[j] = (struct ggml_compute_state) {
+            .thrd           = 0,
+            .ith            = j,
+            .shared         = NULL,
+            .threadpool     = threadpool,
+            .numa_n_threads = 0,
+        };
+    }
+
+    for (int j = 1; j < n_threads; ++j) {
+        const int rc = ggml_thread_create(&threadpool->workers[j].thrd, NULL, ggml_threadpool_worker, &threadpool->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    return threadpool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * threadpool) {
+    if (!threadpool) {
+        return;
+    }
+
+    ggml_mutex_lock(&threadpool->mutex);
+    threadpool->stop = true;
+    ggml_cond_broadcast(&threadpool->cond_graph);
+    ggml_mutex_unlock(&threadpool->mutex);
+
+    for (int j = 1; j < threadpool->n_threads; ++j) {
+        const int rc = ggml_thread_join(threadpool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    ggml_cond_destroy (&threadpool->cond_done);
+    ggml_cond_destroy (&threadpool->cond_graph);
+    ggml_mutex_destroy(&threadpool->mutex);
+
+    GGML_ALIGNED_FREE(threadpool->workers);
+    GGML_ALIGNED_FREE(threadpool);
+}
+
+int ggml_threadpool_get_n_threads(const struct ggml_threadpool * threadpool) {
+    return threadpool->n_threads;
+}
+
+// hand the graph described by state_shared to the parked workers
+static void ggml_threadpool_post_graph(struct ggml_threadpool * threadpool, struct ggml_compute_state_shared * state_shared) {
+    ggml_mutex_lock(&threadpool->mutex);
+    for (int j = 1; j < threadpool->n_threads; ++j) {
+        threadpool->workers[j].shared = state_shared;
+    }
+    threadpool->n_done = 0;
+    threadpool->n_graph++;
+    ggml_cond_broadcast(&threadpool->cond_graph);
+    ggml_mutex_unlock(&threadpool->mutex);
+}
+
+static void ggml_threadpool_wait_graph(struct ggml_threadpool * threadpool) {
+    ggml_mutex_lock(&threadpool->mutex);
+    while (threadpool->n_done < threadpool->n_threads - 1) {
+        ggml_cond_wait(&threadpool->cond_done, &threadpool->mutex);
+    }
+    ggml_mutex_unlock(&threadpool->mutex);
+}
+
 struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
     if (n_threads <= 0) {
         n_threads = GGML_DEFAULT_N_THREADS;
@@ -16436,159 +18704,7 @@ struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
 
         const int n_tasks = ggml_get_n_tasks(node, n_threads);
 
-        size_t cur = 0;
-
-        switch (node->op) {
-            case GGML_OP_CPY:
-            case GGML_OP_DUP:
-                {
-                    if (ggml_is_quantized(node->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_ADD:
-            case GGML_OP_ADD1:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_ACC:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_MUL_MAT:
-                {
-                    const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
-
-#if defined(GGML_USE_CLBLAST)
-                    if (ggml_cl_can_mul_mat(node->src[0], node->src[1], node)) {
-                        cur = ggml_cl_mul_mat_get_wsize(node->src[0], node->src[1], node);
-                    } else
-#endif
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                    if (ggml_compute_forward_mul_mat_use_blas(node->src[0], node->src[1], node)) {
-                        if (node->src[0]->type != GGML_TYPE_F32) {
-                            // here we need memory just for single 2D matrix from src0
-                            cur = ggml_type_size(GGML_TYPE_F32)*(node->src[0]->ne[0]*node->src[0]->ne[1]);
-                        }
-                    } else
-#endif
-                    if (node->src[1]->type != vec_dot_type) {
-                        cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
-                    }
-                } break;
-            case GGML_OP_MUL_MAT_ID:
-                {
-                    const struct ggml_tensor * src0 = node->src[2];
-                    const struct ggml_tensor * src1 = node->src[1];
-                    const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
-                    if (src1->type != vec_dot_type) {
-                        cur = ggml_row_size(vec_dot_type, ggml_nelements(src1));
-                    }
-                    const int n_as = ggml_get_op_params_i32(node, 1);
-                    cur = GGML_PAD(cur, sizeof(int64_t));        // align
-                    cur += n_as * sizeof(int64_t);               // matrix_row_counts
-                    cur += n_as * src1->ne[1] * sizeof(int64_t); // matrix_rows
-                } break;
-            case GGML_OP_OUT_PROD:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_SOFT_MAX:
-                {
-                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_1D:
-                {
-                    GGML_ASSERT(node->src[0]->ne[3] == 1);
-                    GGML_ASSERT(node->src[1]->ne[2] == 1);
-                    GGML_ASSERT(node->src[1]->ne[3] == 1);
-
-                    const int64_t ne00 = node->src[0]->ne[0];  // K
-                    const int64_t ne01 = node->src[0]->ne[1];  // Cout
-                    const int64_t ne02 = node->src[0]->ne[2];  // Cin
-
-                    const int64_t ne10 = node->src[1]->ne[0];  // L
-                    const int64_t ne11 = node->src[1]->ne[1];  // Cin
-
-                    if (node->src[0]->type == GGML_TYPE_F16 &&
-                        node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
-                        cur += sizeof(ggml_fp16_t)*ne10*ne11;
-                    } else if (node->src[0]->type == GGML_TYPE_F32 &&
-                               node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(float)*ne00*ne01*ne02;
-                        cur += sizeof(float)*ne10*ne11;
-                    } else {
-                        GGML_ASSERT(false);
-                    }
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_2D:
-                {
-                    const int64_t ne00 = node->src[0]->ne[0]; // W
-                    const int64_t ne01 = node->src[0]->ne[1]; // H
-                    const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
-                    const int64_t ne03 = node->src[0]->ne[3]; // Channels In
-
-                    const int64_t ne10 = node->src[1]->ne[0]; // W
-                    const int64_t ne11 = node->src[1]->ne[1]; // H
-                    const int64_t ne12 = node->src[1]->ne[2]; // Channels In
-
-                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
-                    cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
-                } break;
-            case GGML_OP_FLASH_ATTN:
-                {
-                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
-
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
-                    }
-                } break;
-            case GGML_OP_FLASH_FF:
-                {
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
-                    }
-                } break;
-            case GGML_OP_FLASH_ATTN_BACK:
-                {
-                    const int64_t    D = node->src[0]->ne[0];
-                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
-                    const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    }
-                } break;
-
-            case GGML_OP_CROSS_ENTROPY_LOSS:
-                {
-                    cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
-                } break;
-            case GGML_OP_COUNT:
-                {
-                    GGML_ASSERT(false);
-                } break;
-            default:
-                break;
-        }
+        const size_t cur = ggml_graph_node_work_size(node, n_tasks);
 
         work_size = MAX(work_size, cur);
     }
@@ -16597,10 +18713,17 @@ struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
         work_size += CACHE_LINE_SIZE*(n_threads - 1);
     }
 
+    // done flags of the nodes for computing independent nodes together, see ggml_graph_compute_next_step()
+    const size_t sched_size = n_threads > 1 ? (size_t) cgraph->n_nodes : 0;
+
     cplan.n_threads = n_threads;
-    cplan.work_size = work_size;
+    cplan.work_size = work_size + sched_size;
     cplan.work_data = NULL;
 
+    cplan.n_parallel_nodes = GGML_DEFAULT_N_PARALLEL_NODES;
+    cplan.sched_size       = sched_size;
+    cplan.fuse_ops         = true;
+
     return cplan;
 }
 
@@ -16612,10 +18735,19 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
         if (cplan->work_size > 0) {
             GGML_ASSERT(cplan->work_data);
         }
+
+        GGML_ASSERT(cplan->sched_size <= cplan->work_size);
     }
 
     const int n_threads = cplan->n_threads;
 
+    ggml_profile_compute_begin();
+
+    ggml_mutex_t mutex;
+    ggml_cond_t  cond;
+    ggml_mutex_init(&mutex);
+    ggml_cond_init (&cond);
+
     struct ggml_compute_state_shared state_shared = {
         /*.cgraph                  =*/ cgraph,
         /*.cgraph_plan             =*/ cplan,
@@ -16626,16 +18758,48 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
         /*.node_n                  =*/ -1,
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
+        /*.n_sleeping              =*/ 0,
+        /*.mutex                   =*/ &mutex,
+        /*.cond                    =*/ &cond,
+        /*.node_done               =*/ NULL,
+        /*.n_step_nodes            =*/ 0,
+        /*.step_nodes              =*/ { 0 },
+        /*.step_chunks             =*/ { { 0 } },
+        /*.wdata_src1              =*/ NULL,
+        /*.wdata_src1_type         =*/ GGML_TYPE_COUNT,
+        /*.fused_mul               =*/ -1,
+        /*.fused_type              =*/ GGML_TYPE_COUNT,
     };
+
+    // the nodes are computed strictly in order if the plan did not reserve the done flags, e.g. it was made for 1 thread
+    if (n_threads > 1 && cplan->n_parallel_nodes > 1 && cplan->sched_size >= (size_t) cgraph->n_nodes) {
+        state_shared.node_done = cplan->work_data + cplan->work_size - cplan->sched_size;
+        memset(state_shared.node_done, 0, cgraph->n_nodes);
+    }
+
+    for (int k = 0; k < GGML_MAX_STEP_NODES; ++k) {
+        state_shared.step_chunks[k].shared = &state_shared;
+    }
+
     struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
 
+    // reuse the parked workers of the pool if it is large enough
+    struct ggml_threadpool * threadpool = cplan->threadpool;
+    if (threadpool && (n_threads == 1 || threadpool->n_threads < n_threads)) {
+        threadpool = NULL;
+    }
+
     // create thread pool
-    if (n_threads > 1) {
+    if (threadpool) {
+        ggml_threadpool_post_graph(threadpool, &state_shared);
+    } else if (n_threads > 1) {
         for (int j = 1; j < n_threads; ++j) {
             workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .ith = j,
-                .shared = &state_shared,
+                .thrd           = 0,
+                .ith            = j,
+                .shared         = &state_shared,
+                .threadpool     = NULL,
+                .numa_n_threads = 0,
             };
 
             const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
@@ -16644,8 +18808,10 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
         }
     }
 
-    workers[0].ith = 0;
-    workers[0].shared = &state_shared;
+    workers[0].ith            = 0;
+    workers[0].shared         = &state_shared;
+    workers[0].threadpool     = NULL;
+    workers[0].numa_n_threads = 0;
 
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
@@ -16657,13 +18823,41 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     clear_numa_thread_affinity();
 
     // join or kill thread pool
-    if (n_threads > 1) {
+    if (threadpool) {
+        ggml_threadpool_wait_graph(threadpool);
+    } else if (n_threads > 1) {
         for (int j = 1; j < n_threads; j++) {
             const int rc = ggml_thread_join(workers[j].thrd, NULL);
             GGML_ASSERT(rc == 0);
         }
     }
 
+    ggml_profile_compute_end();
+
+    ggml_cond_destroy (&cond);
+    ggml_mutex_destroy(&mutex);
+
+    // wait and load balance stats (graph), collected regardless of GGML_PERF so the scheduling can be tuned in release builds
+    {
+        struct ggml_compute_state * states = threadpool ? threadpool->workers : workers;
+
+        int64_t wait_us     = workers[0].perf_wait_us;
+        int64_t n_sleep     = workers[0].perf_n_sleep;
+        int64_t busy_us     = workers[0].perf_busy_us;
+        int64_t busy_max_us = workers[0].perf_busy_us;
+        for (int j = 1; j < n_threads; ++j) {
+            wait_us += states[j].perf_wait_us;
+            n_sleep += states[j].perf_n_sleep;
+            busy_us += states[j].perf_busy_us;
+            busy_max_us = MAX(busy_max_us, states[j].perf_busy_us);
+        }
+
+        cgraph->perf_wait_us     += wait_us;
+        cgraph->perf_n_sleep     += n_sleep;
+        cgraph->perf_busy_us     += busy_us;
+        cgraph->perf_busy_max_us += busy_max_us;
+    }
+
     // performance stats (graph)
     {
         int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
@@ -17219,9 +19413,136 @@ void ggml_graph_print(const struct ggml_cgraph * cgraph) {
         GGML_PRINT("perf_total_per_op_us[%16s] = %7.3f ms\n", ggml_op_name(i), (double) perf_total_per_op_us[i] / 1000.0);
     }
 
+    GGML_PRINT("perf_wait = %7.3f ms, perf_n_sleep = %" PRId64 "\n", (double) cgraph->perf_wait_us / 1000.0, cgraph->perf_n_sleep);
+    GGML_PRINT("perf_busy = %7.3f ms, perf_busy_max = %7.3f ms\n", (double) cgraph->perf_busy_us / 1000.0, (double) cgraph->perf_busy_max_us / 1000.0);
+
+    GGML_PRINT("========================================\n");
+}
+
+void ggml_profile_print(double peak_gflops, double peak_gbps) {
+    struct {
+        int64_t n_nodes;
+        double  time_ns; // wall time: the busy time of the threads that computed the node over their number
+        double  flops;
+        double  bytes;
+    } per_op[GGML_OP_COUNT];
+
+    memset(per_op, 0, sizeof(per_op));
+
+    int64_t n_events = 0;
+    double  time_ns  = 0.0;
+
+    for (size_t i = 0; i < g_profile.n_events; ++i) {
+        const struct ggml_profile_event * ev = &g_profile.events[i];
+        if (ev->t_end_ns == 0) {
+            continue;
+        }
+
+        // each of the threads that computed the node accounts for its share
+        const int n_share = MIN(ev->nth, ev->n_threads);
+
+        const double t = (double) (ev->t_end_ns - ev->t_start_ns)/n_share;
+
+        per_op[ev->op].time_ns += t;
+        per_op[ev->op].flops   += (double) ev->flops/n_share;
+        per_op[ev->op].bytes   += (double) ev->bytes/n_share;
+
+        if (ev->ith == 0) {
+            per_op[ev->op].n_nodes++;
+        }
+
+        time_ns += t;
+
+        n_events++;
+    }
+
+    const bool roofline = peak_gflops > 0.0 && peak_gbps > 0.0;
+
+    GGML_PRINT("=== PROFILE ===\n");
+
+    GGML_PRINT("n_events = %" PRId64 ", time = %.3f ms\n", n_events, time_ns/1e6);
+
+    GGML_PRINT("%16s %8s %10s %6s %10s %10s %8s%s\n",
+            "op", "nodes", "time ms", "%", "GFLOP/s", "GB/s", "FLOP/B", roofline ? "    bound   roof %" : "");
+
+    for (int i = 0; i < GGML_OP_COUNT; i++) {
+        if (per_op[i].time_ns == 0.0) {
+            continue;
+        }
+
+        // FLOP/ns == GFLOP/s
+        const double gflops = per_op[i].flops/per_op[i].time_ns;
+        const double gbps   = per_op[i].bytes/per_op[i].time_ns;
+        const double ai     = per_op[i].bytes > 0.0 ? per_op[i].flops/per_op[i].bytes : 0.0;
+
+        GGML_PRINT("%16s %8" PRId64 " %10.3f %6.2f %10.2f %10.2f %8.2f",
+                ggml_op_name(i), per_op[i].n_nodes, per_op[i].time_ns/1e6, 100.0*per_op[i].time_ns/time_ns, gflops, gbps, ai);
+
+        if (roofline) {
+            // attainable performance at this arithmetic intensity
+            const double roof = MIN(peak_gflops, ai*peak_gbps);
+
+            GGML_PRINT(" %8s %8.1f", ai*peak_gbps < peak_gflops ? "memory" : "compute", roof > 0.0 ? 100.0*gflops/roof : 0.0);
+        }
+
+        GGML_PRINT("\n");
+    }
+
     GGML_PRINT("========================================\n");
 }
 
+static void ggml_profile_write_json_string(FILE * fout, const char * str) {
+    for (; *str; ++str) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', fout);
+        } else if ((unsigned char) *str < 0x20) {
+            continue;
+        }
+        fputc(*str, fout);
+    }
+}
+
+bool ggml_profile_export_trace(const char * fname) {
+    FILE * fout = fopen(fname, "w");
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open %s\n", __func__, fname);
+        return false;
+    }
+
+    int64_t t0_ns = INT64_MAX;
+    for (size_t i = 0; i < g_profile.n_events; ++i) {
+        if (g_profile.events[i].t_end_ns != 0) {
+            t0_ns = MIN(t0_ns, g_profile.events[i].t_start_ns);
+        }
+    }
+
+    fprintf(fout, "{\"traceEvents\":[");
+
+    bool first = true;
+
+    for (size_t i = 0; i < g_profile.n_events; ++i) {
+        const struct ggml_profile_event * ev = &g_profile.events[i];
+        if (ev->t_end_ns == 0) {
+            continue;
+        }
+
+        fprintf(fout, "%s\n{\"name\":\"", first ? "" : ",");
+        ggml_profile_write_json_string(fout, ev->name[0] ? ev->name : ggml_op_name(ev->op));
+        fprintf(fout, "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%d,", ggml_op_name(ev->op),
+                (double) (ev->t_start_ns - t0_ns)/1e3, (double) (ev->t_end_ns - ev->t_start_ns)/1e3, ev->tid);
+        fprintf(fout, "\"args\":{\"type\":\"%s\",\"ith\":%d,\"nth\":%d,\"flops\":%" PRId64 ",\"bytes\":%" PRId64 "}}",
+                ggml_type_name(ev->type), ev->ith, ev->nth, ev->flops, ev->bytes);
+
+        first = false;
+    }
+
+    fprintf(fout, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    fclose(fout);
+
+    return true;
+}
+
 // check if node is part of the graph
 static bool ggml_graph_find(const struct ggml_cgraph * cgraph, const struct ggml_tensor * node) {
     if (cgraph == NULL) {
@@ -18842,6 +21163,14 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
                 (int64_t) info->ne[2] *
                 (int64_t) info->ne[3];
 
+            // the repacked types only exist in memory
+            if ((int) info->type < 0 || info->type >= GGML_TYPE_COUNT || ggml_is_repacked(info->type)) {
+                fprintf(stderr, "%s: tensor '%s' has invalid ggml type %d\n", __func__, info->name.data, info->type);
+                fclose(file);
+                gguf_free(ctx);
+                return NULL;
+            }
+
             if (ne % ggml_blck_size(info->type) != 0) {
                 fprintf(stderr, "%s: tensor '%s' number of elements (%" PRId64 ") is not a multiple of block size (%d)\n",
                         __func__, info->name.data, ne, ggml_blck_size(info->type));
@@ -19344,6 +21673,8 @@ void gguf_set_kv(struct gguf_context * ctx, struct gguf_context * src) {
 void gguf_add_tensor(
              struct gguf_context * ctx,
         const struct ggml_tensor * tensor) {
+    GGML_ASSERT(!ggml_is_repacked(tensor->type) && "repacked tensors cannot be written");
+
     const int idx = ctx->header.n_tensors;
     ctx->infos = realloc(ctx->infos, (idx + 1)*sizeof(struct gguf_tensor_info));
 
@@ -19377,6 +21708,8 @@ void gguf_set_tensor_type(struct gguf_context * ctx, const char * name, enum ggm
         GGML_ASSERT(false && "tensor not found");
     }
 
+    GGML_ASSERT(!ggml_is_repacked(type) && "repacked tensors cannot be written");
+
     ctx->infos[idx].type = type;
 }
 
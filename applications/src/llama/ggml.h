@@ -221,6 +221,7 @@
 #define GGML_MAX_NAME           64
 #define GGML_MAX_OP_PARAMS      64
 #define GGML_DEFAULT_N_THREADS  4
+#define GGML_DEFAULT_N_PARALLEL_NODES 4
 #define GGML_DEFAULT_GRAPH_SIZE 2048
 #if UINTPTR_MAX == 0xFFFFFFFF
     #define GGML_MEM_ALIGN 4
@@ -340,6 +341,10 @@ extern "C" {
         GGML_TYPE_I8,
         GGML_TYPE_I16,
         GGML_TYPE_I32,
+        // internal: interleaved layouts of 4 rows for the CPU ggml_mul_mat, only created by ggml_repack_tensor
+        // never stored in GGUF files and not supported by the GPU backends, see ggml_is_repacked
+        GGML_TYPE_Q4_0_4X,
+        GGML_TYPE_Q8_0_4X,
         GGML_TYPE_COUNT,
     };
 
@@ -408,6 +413,7 @@ extern "C" {
         GGML_OP_TRANSPOSE,
         GGML_OP_GET_ROWS,
         GGML_OP_GET_ROWS_BACK,
+        GGML_OP_SET_ROWS,
         GGML_OP_DIAG,
         GGML_OP_DIAG_MASK_INF,
         GGML_OP_DIAG_MASK_ZERO,
@@ -428,6 +434,7 @@ extern "C" {
         GGML_OP_LEAKY_RELU,
 
         GGML_OP_FLASH_ATTN,
+        GGML_OP_FLASH_ATTN_EXT,
         GGML_OP_FLASH_FF,
         GGML_OP_FLASH_ATTN_BACK,
         GGML_OP_WIN_PART,
@@ -519,7 +526,7 @@ extern "C" {
         struct ggml_tensor * grad;
         struct ggml_tensor * src[GGML_MAX_SRC];
 
-        // performance
+        // performance - wall time of the graph compute steps that included the node, see cplan.n_parallel_nodes
         int     perf_runs;
         int64_t perf_cycles;
         int64_t perf_time_us;
@@ -538,6 +545,21 @@ extern "C" {
 
     static const size_t GGML_TENSOR_SIZE = sizeof(struct ggml_tensor);
 
+    // persistent worker threads that can be reused across ggml_graph_compute() calls
+    struct ggml_threadpool;
+
+    // state shared by the threads that compute a node, e.g. for dynamic work distribution
+    struct ggml_compute_chunk;
+
+    // how threads that are done with the current graph node wait for the others
+    enum ggml_wait_policy {
+        GGML_WAIT_POLICY_DEFAULT = 0, // busy loop, yielding only in BLAS builds
+        GGML_WAIT_POLICY_SPIN,        // busy loop, lowest latency
+        GGML_WAIT_POLICY_YIELD,       // busy loop calling sched_yield()
+        GGML_WAIT_POLICY_SPIN_SLEEP,  // busy loop for wait_spin_count polls, then block until woken up
+        GGML_WAIT_POLICY_COUNT,
+    };
+
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -546,6 +568,21 @@ extern "C" {
 
         int n_threads;
 
+        // optional, run the graph on these workers instead of spawning n_threads - 1 new threads
+        struct ggml_threadpool * threadpool;
+
+        enum ggml_wait_policy wait_policy;
+        int                   wait_spin_count; // GGML_WAIT_POLICY_SPIN_SLEEP: polls before blocking, 0 = default
+
+        // max number of independent nodes whose tasks are computed together, <= 1 computes the nodes strictly in order
+        int n_parallel_nodes;
+        size_t sched_size; // bytes at the end of the work buffer for the done flags of the nodes, calculated by `ggml_graph_plan()`
+
+        // compute rms_norm -> mul -> mul_mat chains in one pass that writes the mul_mat input converted to vec_dot_type
+        // the F32 results of the fused rms_norm and mul are not stored: disable to read them after the compute, or to
+        // compare against the unfused graph
+        bool fuse_ops;
+
         // abort ggml_graph_compute when true
         bool (*abort_callback)(void * data);
         void * abort_callback_data;
@@ -580,6 +617,10 @@ extern "C" {
         int     perf_runs;
         int64_t perf_cycles;
         int64_t perf_time_us;
+        int64_t perf_wait_us;     // time spent by all threads waiting for each other
+        int64_t perf_n_sleep;     // number of times a thread blocked instead of spinning
+        int64_t perf_busy_us;     // time spent by all threads computing
+        int64_t perf_busy_max_us; // time spent computing by the busiest thread of each run, perf_busy_us/n_threads when balanced
     };
 
     // scratch buffer
@@ -616,6 +657,9 @@ extern "C" {
         // work buffer for all threads
         size_t wsize;
         void * wdata;
+
+        // state shared by the tasks of the node, NULL when the tasks may not run concurrently
+        struct ggml_compute_chunk * chunk;
     };
 
     // misc
@@ -631,6 +675,21 @@ extern "C" {
     GGML_API void    ggml_numa_init(void); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
 
+    // move the rows of a weight matrix to the NUMA nodes whose threads compute them in ggml_mul_mat
+    // threads are grouped by node in order, use a thread count that is a multiple of the number of nodes
+    // returns false if NUMA is not initialized or some pages could not be moved
+    // ggml_mul_mat only splits its rows by node for tensors of which some pages were moved
+    GGML_API bool    ggml_numa_place_rows(struct ggml_tensor * tensor);
+
+    // interleave the rows of a quantized weight matrix in place, block by block, so that the CPU ggml_mul_mat
+    // computes several rows per load of src1 - the tensor can only be used as src0 of ggml_mul_mat afterwards
+    // returns the repacked type of type, or GGML_TYPE_COUNT if it has none
+    GGML_API enum ggml_type ggml_repack_type(enum ggml_type type);
+    // returns false if the tensor has no repacked type or its shape does not allow it, the tensor is unchanged then
+    GGML_API bool    ggml_repack_tensor(struct ggml_tensor * tensor);
+    // true for the internal types of the repacked tensors
+    GGML_API bool    ggml_is_repacked(enum ggml_type type);
+
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
 
@@ -1286,6 +1345,15 @@ extern "C" {
             struct ggml_tensor  * b,
             struct ggml_tensor  * c);
 
+    // a[c[i1], i2, i3] = b[i1, i2, i3], converting the F32 rows of b to the type of a
+    // c is a vector of I32 row indices, b->ne[1] == c->ne[0]
+    // return view(a)
+    GGML_API struct ggml_tensor * ggml_set_rows(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c);
+
     GGML_API struct ggml_tensor * ggml_diag(
         struct ggml_context     * ctx,
         struct ggml_tensor      * a);
@@ -1594,6 +1662,21 @@ extern "C" {
             struct ggml_tensor  * v,
             bool                  masked);
 
+    // fused scaled dot-product attention with an online softmax over the KV rows
+    // q:    [n_embd, n_batch, n_head,    1]
+    // k:    [n_embd, n_kv,    n_head_kv, 1]
+    // v:    [n_embd, n_kv,    n_head_kv, 1] !! any strides, a transposed view is ok !!
+    // mask: [n_kv,   n_batch, 1,         1] (optional, additive, F32)
+    // res:  [n_embd, n_head,  n_batch,   1]
+    // n_head must be a multiple of n_head_kv (grouped-query attention)
+    GGML_API struct ggml_tensor * ggml_flash_attn_ext(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * q,
+            struct ggml_tensor  * k,
+            struct ggml_tensor  * v,
+            struct ggml_tensor  * mask,
+            float                 scale);
+
     GGML_API struct ggml_tensor * ggml_flash_attn_back(
            struct ggml_context * ctx,
            struct ggml_tensor  * q,
@@ -1835,6 +1918,12 @@ extern "C" {
     GGML_API struct ggml_cplan ggml_graph_plan   (struct ggml_cgraph * cgraph, int n_threads /*= GGML_DEFAULT_N_THREADS*/);
     GGML_API int               ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan);
 
+    // the workers of a thread pool are parked between graphs and woken up by ggml_graph_compute()
+    // a pool created with n_threads can run any plan with cplan.n_threads <= n_threads, larger plans fall back to spawning threads
+    GGML_API struct ggml_threadpool * ggml_threadpool_new          (int n_threads);
+    GGML_API void                     ggml_threadpool_free         (struct ggml_threadpool * threadpool);
+    GGML_API int                      ggml_threadpool_get_n_threads(const struct ggml_threadpool * threadpool);
+
     // same as ggml_graph_compute() but the work data is allocated as a part of the context
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API void ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
@@ -1847,6 +1936,22 @@ extern "C" {
     // print info and performance information for the graph
     GGML_API void ggml_graph_print(const struct ggml_cgraph * cgraph);
 
+    // per-node profiling of ggml_graph_compute, can be switched at runtime and costs nothing while off
+    // each thread records one event per node it computed tasks of into a ring buffer of n_events
+    // (0 for the default, rounded up to a power of 2), the oldest events are overwritten
+    // enable and reset return false without changing the events while a graph is being computed
+    // do not read the profile while a graph is being computed
+    GGML_API bool ggml_profile_enable (size_t n_events);
+    GGML_API void ggml_profile_disable(void);
+    GGML_API bool ggml_profile_enabled(void);
+    GGML_API bool ggml_profile_reset  (void);
+
+    // per op summary: wall time, FLOP and byte estimates, and with the peaks of the machine (> 0) the roofline bound
+    GGML_API void ggml_profile_print(double peak_gflops, double peak_gbps);
+
+    // write the events in the Chrome trace event format (chrome://tracing, Perfetto)
+    GGML_API bool ggml_profile_export_trace(const char * fname);
+
     // dump the graph into a file using the dot format
     GGML_API void ggml_graph_dump_dot(const struct ggml_cgraph * gb, const struct ggml_cgraph * gf, const char * filename);
 
@@ -2225,6 +2330,7 @@ extern "C" {
         ggml_from_float_t from_float_reference;
         ggml_vec_dot_t    vec_dot;
         enum ggml_type    vec_dot_type;
+        int               nrows; // rows interleaved by the layout, vec_dot computes all of them at once (0 if row-major)
     } ggml_type_traits_t;
 
     GGML_API ggml_type_traits_t ggml_internal_get_type_traits(enum ggml_type type);
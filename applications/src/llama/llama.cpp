@@ -54,6 +54,7 @@
 #include <cinttypes>
 #include <climits>
 #include <cmath>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstddef>
 #include <cstdint>
@@ -71,7 +72,6 @@
 #include <queue>
 #include <random>
 #include <regex>
-#include <set>
 #include <sstream>
 #include <thread>
 #include <type_traits>
@@ -93,6 +93,28 @@
 
 #define LLAMA_MAX_NODES   8192
 #define LLAMA_MAX_EXPERTS 8
+#define LLAMA_MAX_GRAPHS  4 // graphs kept across decode calls
+
+#define LLAMA_GRAMMAR_MAX_STATES 512 // allowed-token bitmasks kept per grammar before they are dropped
+
+#define LLAMA_KV_BLOCK_SIZE 32 // cells per block of the KV cache
+
+#define LLAMA_TOKENIZE_CHUNK (64*1024) // bytes of text per chunk when llama_tokenize_parallel() uses several threads
+
+// sequence ids below LLAMA_MAX_SEQ are kept in a bitmask in each KV cell, larger ids in a slower list
+#ifndef LLAMA_MAX_SEQ
+#define LLAMA_MAX_SEQ 64
+#endif
+
+// internal sequence holding the cells of the prefix index, its bit follows the ones of the regular ids
+#define LLAMA_KV_SEQ_PREFIX -2
+
+#define LLAMA_KV_SEQ_WORDS ((LLAMA_MAX_SEQ + 64)/64)
+
+// file with the repacked weights of a model, see llama_model_loader::open_repack_cache()
+#define LLAMA_REPACK_MAGIC   0x67677270u // 'ggrp'
+#define LLAMA_REPACK_VERSION 1
+#define LLAMA_REPACK_ALIGN   32
 
 //
 // logging
@@ -682,9 +704,7 @@ static std::string gguf_kv_to_str(const struct gguf_context * ctx_gguf, int i) {
 // ggml helpers
 //
 
-static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads) {
-    struct ggml_cplan plan = ggml_graph_plan(graph, n_threads);
-
+static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, struct ggml_cplan & plan) {
     if (plan.work_size > 0) {
         buf.resize(plan.work_size);
         plan.work_data = buf.data();
@@ -693,6 +713,16 @@ static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph *
     ggml_graph_compute(graph, &plan);
 }
 
+static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads,
+        ggml_threadpool * threadpool = nullptr, ggml_wait_policy wait_policy = GGML_WAIT_POLICY_DEFAULT, bool fuse_ops = true) {
+    struct ggml_cplan plan = ggml_graph_plan(graph, n_threads);
+    plan.threadpool  = threadpool;
+    plan.wait_policy = wait_policy;
+    plan.fuse_ops    = fuse_ops;
+
+    ggml_graph_compute_helper(buf, graph, plan);
+}
+
 //
 // llama helpers
 //
@@ -729,6 +759,110 @@ inline void llama_host_free(void * ptr) {
 #endif
 }
 
+// the memory of llama_host_malloc() that a backend needs, NULL if it is plain malloc: pinned for the copies to and from
+// the GPU, shared with Metal buffers, or high bandwidth memory
+inline const char * llama_host_malloc_kind() {
+#ifdef GGML_USE_CUBLAS
+    return ggml_cublas_loaded() ? "CUDA pinned memory" : NULL;
+#elif GGML_USE_METAL
+    return "Metal host memory";
+#elif GGML_USE_CPU_HBM
+    return "high bandwidth memory";
+#else
+    return NULL;
+#endif
+}
+
+// backing of an anonymous buffer mapped with llama_huge_malloc()
+enum llama_huge_type {
+    LLAMA_HUGE_NONE, // regular pages
+    LLAMA_HUGE_TLB,  // huge pages reserved by the system (MAP_HUGETLB)
+    LLAMA_HUGE_THP,  // transparent huge pages (MADV_HUGEPAGE)
+};
+
+static const char * llama_huge_type_name(llama_huge_type type) {
+    switch (type) {
+        case LLAMA_HUGE_TLB: return "hugetlb";
+        case LLAMA_HUGE_THP: return "THP";
+        default:             return "none";
+    }
+}
+
+#define LLAMA_HUGE_PAGE_SIZE ((size_t) 2*1024*1024)
+
+#if defined(__linux__) && defined(_POSIX_MAPPED_FILES)
+static bool llama_thp_enabled() {
+    std::ifstream f("/sys/kernel/mm/transparent_hugepage/enabled");
+    std::string mode;
+    std::getline(f, mode);
+    return f.good() && mode.find("[never]") == std::string::npos;
+}
+#endif
+
+// map n bytes of anonymous memory on huge pages - the reserved ones if there are enough, otherwise transparent ones
+// returns NULL if neither is available, *size is set to the size of the mapping
+static void * llama_huge_malloc(size_t n, size_t * size, llama_huge_type * type) {
+#if defined(__linux__) && defined(_POSIX_MAPPED_FILES)
+    const size_t n_huge = GGML_PAD(n, LLAMA_HUGE_PAGE_SIZE);
+
+#ifdef MAP_HUGETLB
+    void * addr = mmap(NULL, n_huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED) {
+        *size = n_huge;
+        *type = LLAMA_HUGE_TLB;
+        return addr;
+    }
+#endif
+
+#ifdef MADV_HUGEPAGE
+    if (!llama_thp_enabled()) {
+        return NULL;
+    }
+
+    // align the mapping to a huge page so that all of it can be backed by huge pages
+    const size_t n_map = n_huge + LLAMA_HUGE_PAGE_SIZE;
+
+    uint8_t * map = (uint8_t *) mmap(NULL, n_map, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    uint8_t * data = (uint8_t *) GGML_PAD((uintptr_t) map, LLAMA_HUGE_PAGE_SIZE);
+    if (data > map) {
+        munmap(map, data - map);
+    }
+    if (data + n_huge < map + n_map) {
+        munmap(data + n_huge, map + n_map - (data + n_huge));
+    }
+
+    if (madvise(data, n_huge, MADV_HUGEPAGE) != 0) {
+        munmap(data, n_huge);
+        return NULL;
+    }
+
+    *size = n_huge;
+    *type = LLAMA_HUGE_THP;
+    return data;
+#else
+    return NULL;
+#endif
+#else
+    (void) n;
+    (void) size;
+    (void) type;
+    return NULL;
+#endif
+}
+
+static void llama_huge_free(void * data, size_t size) {
+#if defined(__linux__) && defined(_POSIX_MAPPED_FILES)
+    munmap(data, size);
+#else
+    (void) data;
+    (void) size;
+#endif
+}
+
 #if defined(_WIN32)
 static std::string llama_format_win_err(DWORD err) {
     LPSTR buf;
@@ -751,8 +885,22 @@ struct llama_buffer {
     // useful in cases where CUDA can try to allocate PINNED memory
     bool fallback = false;
 
-    void resize(size_t n) {
-        llama_host_free(data);
+    // mapped with llama_huge_malloc(), huge_size is the size of the mapping
+    llama_huge_type huge = LLAMA_HUGE_NONE;
+    size_t huge_size = 0;
+
+    // huge_pages: try to back the buffer with huge pages first, unless the backend needs the memory of llama_host_malloc()
+    void resize(size_t n, bool huge_pages = false) {
+        free_data();
+
+        if (huge_pages && n > 0 && !llama_host_malloc_kind()) {
+            data = llama_huge_malloc(n, &huge_size, &huge);
+            if (data) {
+                fallback = false;
+                size = n;
+                return;
+            }
+        }
 
         data = llama_host_malloc(n);
         if (!data) {
@@ -766,9 +914,11 @@ struct llama_buffer {
         size = n;
     }
 
-    ~llama_buffer() {
+    void free_data() {
         if (data) {
-            if (fallback) { // NOLINT
+            if (huge != LLAMA_HUGE_NONE) {
+                llama_huge_free(data, huge_size);
+            } else if (fallback) { // NOLINT
                 free(data);
             } else {
                 llama_host_free(data);
@@ -776,6 +926,23 @@ struct llama_buffer {
         }
 
         data = NULL;
+        huge = LLAMA_HUGE_NONE;
+        huge_size = 0;
+    }
+
+    // for the log of the huge_pages option
+    std::string backing() const {
+        if (huge != LLAMA_HUGE_NONE) {
+            return llama_huge_type_name(huge);
+        }
+        if (data && !fallback && llama_host_malloc_kind()) {
+            return std::string("none (") + llama_host_malloc_kind() + ")";
+        }
+        return "none";
+    }
+
+    ~llama_buffer() {
+        free_data();
     }
 };
 
@@ -827,6 +994,40 @@ struct llama_file {
         }
     }
 
+    // read at an offset without moving the file position, so that several threads can read the file at once
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        uint8_t * dst = (uint8_t *) ptr;
+
+        while (len > 0) {
+#ifdef _WIN32
+            OVERLAPPED ov = {};
+            ov.Offset     = (DWORD) (offset & 0xFFFFFFFF);
+            ov.OffsetHigh = (DWORD) (offset >> 32);
+
+            DWORD ret = 0;
+            if (!ReadFile((HANDLE) _get_osfhandle(_fileno(fp)), dst, (DWORD) std::min(len, (size_t) 1 << 30), &ret, &ov)) {
+                throw std::runtime_error(format("read error: %s", llama_format_win_err(GetLastError()).c_str()));
+            }
+#else
+            errno = 0;
+            const ssize_t ret = pread(fileno(fp), dst, len, (off_t) offset);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+#endif
+            if (ret == 0) {
+                throw std::runtime_error(std::string("unexpectedly reached end of file"));
+            }
+
+            dst    += ret;
+            len    -= ret;
+            offset += ret;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -1254,6 +1455,12 @@ struct llama_cparams {
 
     bool mul_mat_q;
     bool offload_kqv;
+    bool fuse_ops;
+    bool flash_attn;
+    bool graph_cache;
+    bool huge_pages;
+
+    enum ggml_wait_policy wait_policy;
 };
 
 struct llama_layer {
@@ -1301,24 +1508,197 @@ struct llama_layer {
     struct ggml_tensor * ffn_up_b;   // b3
 };
 
+// set of sequence ids - a bitmask for the ids below LLAMA_MAX_SEQ and LLAMA_KV_SEQ_PREFIX, a sorted list for the others
+struct llama_kv_seq_set {
+    uint64_t bits[LLAMA_KV_SEQ_WORDS] = {};
+
+    std::vector<llama_seq_id> ext;
+
+    // bit of an id, -1 for the ids kept in the list
+    static int32_t bit(llama_seq_id id) {
+        if ((uint32_t) id < LLAMA_MAX_SEQ) {
+            return id;
+        }
+        return id == LLAMA_KV_SEQ_PREFIX ? LLAMA_MAX_SEQ : -1;
+    }
+
+    static llama_seq_id bit_id(int32_t b) {
+        return b == LLAMA_MAX_SEQ ? LLAMA_KV_SEQ_PREFIX : b;
+    }
+
+    bool has(llama_seq_id id) const {
+        const int32_t b = bit(id);
+        if (b >= 0) {
+            return (bits[b/64] >> (b%64)) & 1;
+        }
+        return std::binary_search(ext.begin(), ext.end(), id);
+    }
+
+    void insert(llama_seq_id id) {
+        const int32_t b = bit(id);
+        if (b >= 0) {
+            bits[b/64] |= uint64_t(1) << (b%64);
+            return;
+        }
+        auto it = std::lower_bound(ext.begin(), ext.end(), id);
+        if (it == ext.end() || *it != id) {
+            ext.insert(it, id);
+        }
+    }
+
+    void erase(llama_seq_id id) {
+        const int32_t b = bit(id);
+        if (b >= 0) {
+            bits[b/64] &= ~(uint64_t(1) << (b%64));
+            return;
+        }
+        auto it = std::lower_bound(ext.begin(), ext.end(), id);
+        if (it != ext.end() && *it == id) {
+            ext.erase(it);
+        }
+    }
+
+    void clear() {
+        std::fill(bits, bits + LLAMA_KV_SEQ_WORDS, 0);
+        ext.clear();
+    }
+
+    bool empty() const {
+        for (int w = 0; w < LLAMA_KV_SEQ_WORDS; ++w) {
+            if (bits[w]) {
+                return false;
+            }
+        }
+        return ext.empty();
+    }
+
+    size_t size() const {
+        size_t n = ext.size();
+        for (int w = 0; w < LLAMA_KV_SEQ_WORDS; ++w) {
+            for (uint64_t m = bits[w]; m; m &= m - 1) {
+                n++;
+            }
+        }
+        return n;
+    }
+
+    // the id of the lowest bit, then the lowest id of the list, -1 if empty
+    llama_seq_id first() const {
+        for (int w = 0; w < LLAMA_KV_SEQ_WORDS; ++w) {
+            if (bits[w]) {
+                int b = 0;
+                while (!((bits[w] >> b) & 1)) {
+                    b++;
+                }
+                return bit_id(w*64 + b);
+            }
+        }
+        return ext.empty() ? -1 : ext[0];
+    }
+
+    // calls f(id) for each id, in the order of first()
+    template <typename F>
+    void for_each(F && f) const {
+        for (int w = 0; w < LLAMA_KV_SEQ_WORDS; ++w) {
+            uint64_t m = bits[w];
+            for (int b = 0; m; ++b, m >>= 1) {
+                if (m & 1) {
+                    f(bit_id(w*64 + b));
+                }
+            }
+        }
+        for (const llama_seq_id id : ext) {
+            f(id);
+        }
+    }
+
+    void merge(const llama_kv_seq_set & other) {
+        for (int w = 0; w < LLAMA_KV_SEQ_WORDS; ++w) {
+            bits[w] |= other.bits[w];
+        }
+        for (const llama_seq_id id : other.ext) {
+            insert(id);
+        }
+    }
+
+    bool operator==(const llama_kv_seq_set & other) const {
+        return std::equal(bits, bits + LLAMA_KV_SEQ_WORDS, other.bits) && ext == other.ext;
+    }
+
+    bool operator!=(const llama_kv_seq_set & other) const {
+        return !(*this == other);
+    }
+};
+
 struct llama_kv_cell {
     llama_pos pos   = -1;
     llama_pos delta = 0;
 
-    std::set<llama_seq_id> seq_id;
+    llama_kv_seq_set seq_id;
+
+    // the K and V data of the cell is in the session file of the last checkpoint of the context
+    bool saved = false;
 
     bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return seq_id.has(id);
     }
 };
 
-// ring-buffer of cached KV data
+// a block of LLAMA_KV_BLOCK_SIZE consecutive cells
+struct llama_kv_block {
+    uint32_t used = 0; // used cells, the block is free when 0
+
+    // the only sequence with cells in the block, -1 if the cells belong to several sequences
+    // new tokens of a sequence are only placed in blocks it owns, so the cells of a sequence stay together
+    // and blocks shared with llama_kv_cache_seq_cp() are never written to
+    llama_seq_id owner = -1;
+
+    // the sequences of the cells in the block
+    llama_kv_seq_set seqs;
+
+    // hash of the prefix index entry of the block, 0 if it is not indexed
+    uint64_t prefix = 0;
+};
+
+// a full block of a prompt in the prefix index
+// the entries form a tree: the hash of a block chains the hash of the previous block of the prompt
+struct llama_kv_prefix_block {
+    uint32_t ib;            // block holding the tokens, its cells belong to LLAMA_KV_SEQ_PREFIX
+    uint64_t parent;        // hash of the previous block, 0 for the first block of a prompt
+    uint32_t n_children = 0;
+    uint64_t t_used     = 0; // for the LRU eviction
+
+    std::vector<llama_token> tokens; // to tell hash collisions apart
+};
+
+// the cells of a sequence
+struct llama_kv_seq {
+    std::vector<uint32_t> blocks; // blocks holding cells of the sequence, in ascending order
+
+    // block of the last position of the sequence if the sequence owns it alone, -1 otherwise
+    // new tokens of the sequence are appended to it, see llama_kv_cache_find_slot()
+    int32_t tail = -1;
+
+    // range of the positions of the cells
+    llama_pos pos_min = -1;
+    llama_pos pos_max = -1;
+};
+
+// paged cache of KV data
 struct llama_kv_cache {
     bool has_shift = false;
 
-    // Note: The value of head isn't only used to optimize searching
-    // for a free KV slot. llama_decode_internal also uses it, so it
-    // cannot be freely changed after a slot has been allocated.
+    // place the tokens of a batch in the blocks of their sequences
+    // otherwise the batch is stored in n_tokens contiguous cells starting at head (backends without ggml_set_rows)
+    bool paged = true;
+
+    // V is stored transposed, one row per channel, so that KQ*V is a plain matrix multiplication
+    // otherwise V has one row per cell like K, which allows block-quantized V but requires flash attention
+    bool v_trans = true;
+
+    // Note: When the cache is not paged, the value of head isn't only used
+    // to optimize searching for a free KV slot. llama_decode_internal also
+    // uses it, so it cannot be freely changed after a slot has been allocated.
     uint32_t head = 0;
     uint32_t size = 0;
     uint32_t used = 0; // used cells (i.e. at least one seq_id)
@@ -1328,6 +1708,19 @@ struct llama_kv_cache {
 
     std::vector<llama_kv_cell> cells;
 
+    std::vector<llama_kv_block> blocks;
+    std::vector<uint32_t>       free_blocks; // in descending order, the lowest free block is taken first
+
+    // the sequences with cells in the cache
+    std::map<llama_seq_id, llama_kv_seq> seqs;
+
+    // indexed prompt blocks by hash, kept after the sequences that decoded them are removed
+    std::unordered_map<uint64_t, llama_kv_prefix_block> prefixes;
+    uint64_t prefix_clock = 0;
+
+    // cells of the tokens of the last batch, set by llama_kv_cache_find_slot()
+    std::vector<int32_t> slots;
+
     std::vector<struct ggml_tensor *> k_l; // per layer
     std::vector<struct ggml_tensor *> v_l;
 
@@ -1371,6 +1764,27 @@ struct llama_vocab {
 
     std::map<std::pair<std::string, std::string>, int> bpe_ranks;
 
+    // bpe_ranks of the merges of two tokens, keyed by (id_left << 32 | id_right)
+    std::unordered_map<uint64_t, int> bpe_ranks_id;
+
+    // byte trie of the token texts, so the tokenizers can look up text in place without building strings
+    struct trie_node {
+        uint32_t edges_offs; // children in trie_edges, sorted by byte
+        uint32_t n_edges;
+        id       token;      // token with the text of the path to this node, -1 if none
+    };
+
+    struct trie_edge {
+        uint8_t  byte;
+        uint32_t node;
+    };
+
+    std::vector<trie_node> trie;
+    std::vector<trie_edge> trie_edges;
+
+    // no SPM token continues past the start of a word, so long texts can be tokenized in chunks
+    bool spm_chunkable = false;
+
     // default LLaMA special tokens
     id special_bos_id = 1;
     id special_eos_id = 2;
@@ -1387,6 +1801,19 @@ struct llama_vocab {
     id special_suffix_id = 32008;
     id special_eot_id    = 32010;
 
+    // the pieces of the tokens and their code points, decoded once at load for the grammar sampling
+    struct piece_data {
+        uint32_t text_offs;        // piece in piece_text, as returned by llama_token_to_piece
+        uint32_t text_len;
+        uint32_t cpts_offs;        // code points in piece_cpts, terminated by 0
+        uint32_t partial_value;    // incomplete UTF-8 sequence at the end of the piece
+        int32_t  partial_n_remain;
+    };
+
+    std::vector<piece_data> pieces;
+    std::vector<char>       piece_text;
+    std::vector<uint32_t>   piece_cpts;
+
     int find_bpe_rank(std::string token_left, std::string token_right) const {
         GGML_ASSERT(token_left.find(" ") == std::string::npos);
         GGML_ASSERT(token_left.find("\n") == std::string::npos);
@@ -1469,6 +1896,35 @@ struct llama_model {
     }
 };
 
+// input tensors of a graph built by llama_build_graph()
+struct llama_graph_inputs {
+    struct ggml_tensor * tokens   = nullptr;
+    struct ggml_tensor * embd     = nullptr;
+    struct ggml_tensor * pos      = nullptr;
+    struct ggml_tensor * KQ_scale = nullptr;
+    struct ggml_tensor * KQ_mask  = nullptr;
+    struct ggml_tensor * K_shift  = nullptr;
+    struct ggml_tensor * KV_slots = nullptr;
+};
+
+// a graph of a previous decode call, together with its allocation and plan
+// the graph only depends on the shape of the batch and the number of KV cells attended to,
+// so it can be computed again for a new batch once its inputs are set
+struct llama_graph_cache_entry {
+    // key
+    int32_t  n_tokens = 0;
+    uint32_t n_kv     = 0;
+    bool     embd     = false; // the batch has embeddings instead of tokens
+
+    llama_buffer buf; // graph and tensor metadata
+
+    ggml_cgraph        * gf = nullptr;
+    llama_graph_inputs   inp;
+    struct ggml_cplan    plan = {}; // n_threads == 0 until planned
+
+    uint64_t t_used = 0; // 0 for an unused entry
+};
+
 struct llama_context {
     llama_context(const llama_model & model) : model(model), t_start_us(model.t_start_us), t_load_us(model.t_load_us) {}
     ~llama_context() {
@@ -1480,6 +1936,7 @@ struct llama_context {
         if (alloc) {
             ggml_allocr_free(alloc);
         }
+        ggml_threadpool_free(threadpool);
     }
 
     llama_cparams cparams;
@@ -1517,9 +1974,21 @@ struct llama_context {
     // reusable buffer for `struct ggml_graph_plan.work_data`
     std::vector<uint8_t> work_buffer;
 
+    // persistent CPU workers for graph computation, sized for max(n_threads, n_threads_batch)
+    ggml_threadpool * threadpool = NULL;
+
+    // session file of the last checkpoint, llama_append_session_file() appends the new cells to it
+    std::string              session_path;
+    size_t                   session_size = 0; // size of the file after the last record
+    std::vector<llama_token> session_tokens;
+
     // memory buffers used to evaluate the model
     llama_buffer buf_compute;
 
+    // graphs of previous decode calls, evicted in LRU order
+    llama_graph_cache_entry graph_cache[LLAMA_MAX_GRAPHS];
+    uint64_t                graph_cache_clock = 0;
+
     llama_buffer buf_alloc;
     ggml_allocr * alloc = NULL;
 
@@ -1542,6 +2011,8 @@ static bool llama_kv_cache_init(
                          ggml_type   ktype,
                          ggml_type   vtype,
                           uint32_t   n_ctx,
+                              bool   v_trans,
+                              bool   huge_pages,
                                int   n_gpu_layers,
                               bool   offload) {
     const uint32_t n_embd  = hparams.n_embd_gqa();
@@ -1551,6 +2022,7 @@ static bool llama_kv_cache_init(
     const int64_t n_elements = n_embd*n_mem;
 
     cache.has_shift = false;
+    cache.v_trans   = v_trans;
 
     cache.head = 0;
     cache.size = n_ctx;
@@ -1559,7 +2031,27 @@ static bool llama_kv_cache_init(
     cache.cells.clear();
     cache.cells.resize(n_ctx);
 
-    cache.buf.resize(ggml_row_size(ktype, n_elements) + ggml_row_size(vtype, n_elements) + 2u*n_layer*ggml_tensor_overhead());
+    cache.blocks.clear();
+    cache.blocks.resize((n_ctx + LLAMA_KV_BLOCK_SIZE - 1)/LLAMA_KV_BLOCK_SIZE);
+
+    cache.free_blocks.clear();
+    for (uint32_t ib = cache.blocks.size(); ib-- > 0;) {
+        cache.free_blocks.push_back(ib);
+    }
+
+    cache.seqs.clear();
+
+    cache.prefixes.clear();
+    cache.prefix_clock = 0;
+
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_METAL) || defined(GGML_USE_MPI)
+    // the GPU backends cannot scatter the K and V rows of a batch
+    cache.paged = false;
+#else
+    cache.paged = true;
+#endif
+
+    cache.buf.resize(ggml_row_size(ktype, n_elements) + ggml_row_size(vtype, n_elements) + 2u*n_layer*ggml_tensor_overhead(), huge_pages);
     memset(cache.buf.data, 0, cache.buf.size);
 
     struct ggml_init_params params;
@@ -1611,182 +2103,1051 @@ static bool llama_kv_cache_init(
     return true;
 }
 
-// find an empty slot of size "n_tokens" in the cache
-// updates the cache head
-// Note: On success, it's important that cache.head points
-// to the first cell of the slot.
-static bool llama_kv_cache_find_slot(
-           struct llama_kv_cache & cache,
-        const struct llama_batch & batch) {
-    const uint32_t n_ctx    = cache.size;
-    const uint32_t n_tokens = batch.n_tokens;
+static void llama_kv_cache_seq_add_block(struct llama_kv_cache & cache, llama_seq_id seq_id, uint32_t ib) {
+    auto & blocks = cache.seqs[seq_id].blocks;
 
-    if (n_tokens > n_ctx) {
-        LLAMA_LOG_ERROR("%s: n_tokens=%d > n_ctx=%d\n", __func__, n_tokens, n_ctx);
-        return false;
+    auto it = std::lower_bound(blocks.begin(), blocks.end(), ib);
+    if (it == blocks.end() || *it != ib) {
+        blocks.insert(it, ib);
     }
+}
 
-    uint32_t n_tested = 0;
+static void llama_kv_cache_seq_rm_block(struct llama_kv_cache & cache, llama_seq_id seq_id, uint32_t ib) {
+    auto it_seq = cache.seqs.find(seq_id);
+    if (it_seq == cache.seqs.end()) {
+        return;
+    }
 
-    while (true) {
-        if (cache.head + n_tokens > n_ctx) {
-            n_tested += n_ctx - cache.head;
-            cache.head = 0;
-            continue;
-        }
+    auto & blocks = it_seq->second.blocks;
 
-        bool found = true;
-        for (uint32_t i = 0; i < n_tokens; i++) {
-            if (cache.cells[cache.head + i].pos >= 0) {
-                found = false;
-                cache.head += i + 1;
-                n_tested   += i + 1;
-                break;
-            }
-        }
+    auto it = std::lower_bound(blocks.begin(), blocks.end(), ib);
+    if (it != blocks.end() && *it == ib) {
+        blocks.erase(it);
+    }
 
-        if (found) {
-            break;
-        }
+    if (it_seq->second.tail == (int32_t) ib) {
+        it_seq->second.tail = -1;
+    }
 
-        if (n_tested >= n_ctx) {
-            //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
-            return false;
-        }
+    if (blocks.empty()) {
+        cache.seqs.erase(it_seq);
     }
+}
 
-    for (uint32_t i = 0; i < n_tokens; i++) {
-        cache.cells[cache.head + i].pos = batch.pos[i];
+// recompute the range of positions and the tail block of a sequence from the cells in its blocks
+static void llama_kv_cache_update_seq_pos(const struct llama_kv_cache & cache, llama_seq_id seq_id, llama_kv_seq & seq) {
+    seq.pos_min = -1;
+    seq.pos_max = -1;
+    seq.tail    = -1;
+
+    for (const uint32_t ib : seq.blocks) {
+        const uint32_t i0 = ib*LLAMA_KV_BLOCK_SIZE;
+        const uint32_t i1 = std::min(i0 + LLAMA_KV_BLOCK_SIZE, cache.size);
 
-        for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
+        for (uint32_t i = i0; i < i1; ++i) {
+            const llama_kv_cell & cell = cache.cells[i];
+
+            if (cell.pos < 0 || !cell.has_seq_id(seq_id)) {
+                continue;
+            }
+
+            if (seq.pos_min < 0 || cell.pos < seq.pos_min) {
+                seq.pos_min = cell.pos;
+            }
+            if (cell.pos > seq.pos_max) {
+                seq.pos_max = cell.pos;
+                seq.tail    = ib;
+            }
         }
     }
 
-    cache.used += n_tokens;
-
-    return true;
+    if (seq.tail >= 0 && cache.blocks[seq.tail].owner != seq_id) {
+        seq.tail = -1;
+    }
 }
 
-// find how many cells are currently in use
-static int32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
-    for (uint32_t i = cache.size - 1; i > 0; --i) {
-        if (cache.cells[i].pos >= 0 && !cache.cells[i].seq_id.empty()) {
-            return i + 1;
-        }
+static void llama_kv_cache_update_seq_pos(struct llama_kv_cache & cache, llama_seq_id seq_id) {
+    auto it = cache.seqs.find(seq_id);
+    if (it != cache.seqs.end()) {
+        llama_kv_cache_update_seq_pos(cache, seq_id, it->second);
     }
+}
 
-    return 0;
+static void llama_kv_cache_free_block(struct llama_kv_cache & cache, uint32_t ib) {
+    auto it = std::lower_bound(cache.free_blocks.begin(), cache.free_blocks.end(), ib, std::greater<uint32_t>());
+    if (it == cache.free_blocks.end() || *it != ib) {
+        cache.free_blocks.insert(it, ib);
+    }
 }
 
-static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
-    for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
-        cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
+static void llama_kv_cache_take_block(struct llama_kv_cache & cache, uint32_t ib) {
+    auto it = std::lower_bound(cache.free_blocks.begin(), cache.free_blocks.end(), ib, std::greater<uint32_t>());
+    if (it != cache.free_blocks.end() && *it == ib) {
+        cache.free_blocks.erase(it);
     }
-    cache.head = 0;
-    cache.used = 0;
 }
 
-static void llama_kv_cache_seq_rm(
-        struct llama_kv_cache & cache,
-                 llama_seq_id   seq_id,
-                    llama_pos   p0,
-                    llama_pos   p1) {
-    uint32_t new_head = cache.size;
+// recompute a block from its cells after a sequence operation changed them
+// the block tables and the free list are updated for the sequences that left or joined the block
+static void llama_kv_cache_update_block(struct llama_kv_cache & cache, uint32_t ib) {
+    llama_kv_block & block = cache.blocks[ib];
 
-    if (p0 < 0) p0 = 0;
-    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+    const uint32_t         used_old = block.used;
+    const llama_kv_seq_set seqs_old = block.seqs;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
-            } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
-            } else {
+    block.used = 0;
+    block.seqs.clear();
+
+    const uint32_t i0 = ib*LLAMA_KV_BLOCK_SIZE;
+    const uint32_t i1 = std::min(i0 + LLAMA_KV_BLOCK_SIZE, cache.size);
+
+    for (uint32_t i = i0; i < i1; ++i) {
+        const llama_kv_cell & cell = cache.cells[i];
+
+        if (cell.pos < 0 || cell.seq_id.empty()) {
+            continue;
+        }
+
+        block.used++;
+        block.seqs.merge(cell.seq_id);
+    }
+
+    block.owner = block.seqs.size() == 1 ? block.seqs.first() : -1;
+
+    if (block.seqs != seqs_old) {
+        seqs_old.for_each([&](llama_seq_id seq_id) {
+            if (!block.seqs.has(seq_id)) {
+                llama_kv_cache_seq_rm_block(cache, seq_id, ib);
+            }
+        });
+        block.seqs.for_each([&](llama_seq_id seq_id) {
+            if (!seqs_old.has(seq_id)) {
+                llama_kv_cache_seq_add_block(cache, seq_id, ib);
+            }
+        });
+    }
+
+    if (used_old > 0 && block.used == 0) {
+        llama_kv_cache_free_block(cache, ib);
+    } else if (used_old == 0 && block.used > 0) {
+        llama_kv_cache_take_block(cache, ib);
+    }
+}
+
+// recompute all blocks, the free list, the block tables and the position ranges from the cells
+static void llama_kv_cache_update_blocks(struct llama_kv_cache & cache) {
+    cache.seqs.clear();
+    cache.free_blocks.clear();
+
+    for (uint32_t ib = 0; ib < cache.blocks.size(); ++ib) {
+        llama_kv_block & block = cache.blocks[ib];
+
+        block.used = 0;
+        block.seqs.clear();
+
+        const uint32_t i0 = ib*LLAMA_KV_BLOCK_SIZE;
+        const uint32_t i1 = std::min(i0 + LLAMA_KV_BLOCK_SIZE, cache.size);
+
+        for (uint32_t i = i0; i < i1; ++i) {
+            const llama_kv_cell & cell = cache.cells[i];
+
+            if (cell.pos < 0 || cell.seq_id.empty()) {
                 continue;
             }
-            if (cache.cells[i].seq_id.empty()) {
+
+            block.used++;
+            block.seqs.merge(cell.seq_id);
+        }
+
+        block.owner = block.seqs.size() == 1 ? block.seqs.first() : -1;
+
+        block.seqs.for_each([&](llama_seq_id seq_id) {
+            cache.seqs[seq_id].blocks.push_back(ib);
+        });
+    }
+
+    for (uint32_t ib = cache.blocks.size(); ib-- > 0;) {
+        if (cache.blocks[ib].used == 0) {
+            cache.free_blocks.push_back(ib);
+        }
+    }
+
+    for (auto & it : cache.seqs) {
+        llama_kv_cache_update_seq_pos(cache, it.first, it.second);
+    }
+}
+
+// store token i_batch of the batch in cell i
+static void llama_kv_cache_cell_add(
+           struct llama_kv_cache & cache,
+                        uint32_t   i,
+        const struct llama_batch & batch,
+                        uint32_t   i_batch) {
+    const uint32_t ib = i/LLAMA_KV_BLOCK_SIZE;
+
+    llama_kv_cell  & cell  = cache.cells[i];
+    llama_kv_block & block = cache.blocks[ib];
+
+    const llama_pos pos = batch.pos[i_batch];
+
+    const llama_seq_id owner = batch.n_seq_id[i_batch] == 1 ? batch.seq_id[i_batch][0] : -1;
+
+    if (block.used == 0) {
+        block.owner = owner;
+        llama_kv_cache_take_block(cache, ib);
+    } else if (block.owner != owner) {
+        block.owner = -1;
+    }
+    block.used++;
+
+    cell.pos   = pos;
+    cell.saved = false;
+
+    for (int32_t j = 0; j < batch.n_seq_id[i_batch]; j++) {
+        const llama_seq_id seq_id = batch.seq_id[i_batch][j];
+
+        cell.seq_id.insert(seq_id);
+
+        if (!block.seqs.has(seq_id)) {
+            block.seqs.insert(seq_id);
+            llama_kv_cache_seq_add_block(cache, seq_id, ib);
+        }
+
+        llama_kv_seq & seq = cache.seqs[seq_id];
+        if (seq.pos_min < 0 || pos < seq.pos_min) {
+            seq.pos_min = pos;
+        }
+        if (pos >= seq.pos_max) {
+            seq.pos_max = pos;
+            seq.tail    = block.owner == seq_id ? (int32_t) ib : -1;
+        }
+    }
+
+    cache.slots[i_batch] = i;
+}
+
+// remove a block from the prefix index - its cells are freed unless a sequence uses them
+static void llama_kv_cache_prefix_drop(struct llama_kv_cache & cache, uint32_t ib) {
+    llama_kv_block & block = cache.blocks[ib];
+
+    const auto it = cache.prefixes.find(block.prefix);
+    if (it != cache.prefixes.end()) {
+        const auto it_parent = cache.prefixes.find(it->second.parent);
+        if (it_parent != cache.prefixes.end()) {
+            it_parent->second.n_children--;
+        }
+        cache.prefixes.erase(it);
+    }
+
+    block.prefix = 0;
+
+    const uint32_t i0 = ib*LLAMA_KV_BLOCK_SIZE;
+    const uint32_t i1 = std::min(i0 + LLAMA_KV_BLOCK_SIZE, cache.size);
+
+    for (uint32_t i = i0; i < i1; ++i) {
+        llama_kv_cell & cell = cache.cells[i];
+
+        if (!cell.has_seq_id(LLAMA_KV_SEQ_PREFIX)) {
+            continue;
+        }
+
+        cell.seq_id.erase(LLAMA_KV_SEQ_PREFIX);
+        if (cell.seq_id.empty()) {
+            cache.used--;
+            cell.pos = -1;
+            if (i < cache.head) cache.head = i;
+        }
+    }
+
+    llama_kv_cache_update_block(cache, ib);
+}
+
+// drop the least recently used indexed block that no sequence uses and that no other indexed block continues
+// returns false if there is none
+static bool llama_kv_cache_prefix_evict(struct llama_kv_cache & cache) {
+    const llama_kv_prefix_block * lru = nullptr;
+
+    for (const auto & it : cache.prefixes) {
+        const llama_kv_prefix_block & pb = it.second;
+
+        if (pb.n_children > 0 || cache.blocks[pb.ib].owner != LLAMA_KV_SEQ_PREFIX) {
+            continue;
+        }
+
+        if (!lru || pb.t_used < lru->t_used) {
+            lru = &pb;
+        }
+    }
+
+    if (!lru) {
+        return false;
+    }
+
+    llama_kv_cache_prefix_drop(cache, lru->ib);
+
+    return true;
+}
+
+// first free cell of a block, -1 if the block is full
+static int32_t llama_kv_cache_block_find_free(const struct llama_kv_cache & cache, uint32_t ib) {
+    const uint32_t i0 = ib*LLAMA_KV_BLOCK_SIZE;
+    const uint32_t i1 = std::min(i0 + LLAMA_KV_BLOCK_SIZE, cache.size);
+
+    for (uint32_t i = i0; i < i1; ++i) {
+        if (cache.cells[i].pos < 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static bool llama_kv_cache_same_seqs(const struct llama_batch & batch, uint32_t i0, uint32_t i1) {
+    if (batch.n_seq_id[i0] != batch.n_seq_id[i1]) {
+        return false;
+    }
+
+    for (int32_t j = 0; j < batch.n_seq_id[i0]; ++j) {
+        if (batch.seq_id[i0][j] != batch.seq_id[i1][j]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// find an empty slot of size "n_tokens" in the cache
+// updates the cache head
+// Note: On success, it's important that cache.head points
+// to the first cell of the slot.
+static bool llama_kv_cache_find_slot_contiguous(
+           struct llama_kv_cache & cache,
+        const struct llama_batch & batch) {
+    const uint32_t n_ctx    = cache.size;
+    const uint32_t n_tokens = batch.n_tokens;
+
+    uint32_t n_tested = 0;
+
+    while (true) {
+        if (cache.head + n_tokens > n_ctx) {
+            n_tested += n_ctx - cache.head;
+            cache.head = 0;
+            continue;
+        }
+
+        bool found = true;
+        for (uint32_t i = 0; i < n_tokens; i++) {
+            if (cache.cells[cache.head + i].pos >= 0) {
+                found = false;
+                cache.head += i + 1;
+                n_tested   += i + 1;
+                break;
+            }
+        }
+
+        if (found) {
+            break;
+        }
+
+        if (n_tested >= n_ctx) {
+            //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < n_tokens; i++) {
+        llama_kv_cache_cell_add(cache, cache.head + i, batch, i);
+    }
+
+    cache.used += n_tokens;
+
+    return true;
+}
+
+// find a cell for each token of the batch and store the tokens in them
+// the cells are in cache.slots
+static bool llama_kv_cache_find_slot(
+           struct llama_kv_cache & cache,
+        const struct llama_batch & batch) {
+    const uint32_t n_ctx    = cache.size;
+    const uint32_t n_tokens = batch.n_tokens;
+
+    if (n_tokens > n_ctx) {
+        LLAMA_LOG_ERROR("%s: n_tokens=%d > n_ctx=%d\n", __func__, n_tokens, n_ctx);
+        return false;
+    }
+
+    cache.slots.resize(n_tokens);
+
+    // make room by evicting indexed prompt blocks that are not in use
+    while (cache.used + n_tokens > n_ctx && llama_kv_cache_prefix_evict(cache)) {}
+
+    if (!cache.paged) {
+        while (!llama_kv_cache_find_slot_contiguous(cache, batch)) {
+            if (!llama_kv_cache_prefix_evict(cache)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    if (cache.used + n_tokens > n_ctx) {
+        return false;
+    }
+
+    // block of the last tokens that belong to several sequences
+    int32_t ib_shared = -1;
+
+    // start of the search for free cells once there are no free blocks left
+    uint32_t i_free = 0;
+
+    for (uint32_t i = 0; i < n_tokens; i++) {
+        int32_t cell = -1;
+
+        if (batch.n_seq_id[i] == 1) {
+            // continue the block of the last position of the sequence if it owns it alone
+            // the lowest free block is taken otherwise, so this is not necessarily the last block of the table
+            const llama_seq_id seq_id = batch.seq_id[i][0];
+
+            const auto it = cache.seqs.find(seq_id);
+            if (it != cache.seqs.end() && it->second.tail >= 0 && cache.blocks[it->second.tail].owner == seq_id) {
+                cell = llama_kv_cache_block_find_free(cache, it->second.tail);
+            }
+        } else if (ib_shared >= 0 && llama_kv_cache_same_seqs(batch, i - 1, i)) {
+            cell = llama_kv_cache_block_find_free(cache, ib_shared);
+        }
+
+        if (cell < 0 && cache.free_blocks.empty()) {
+            llama_kv_cache_prefix_evict(cache);
+        }
+
+        if (cell < 0 && !cache.free_blocks.empty()) {
+            // taken off the free list by llama_kv_cache_cell_add()
+            cell = cache.free_blocks.back()*LLAMA_KV_BLOCK_SIZE;
+        }
+
+        // the cache is full of partially used blocks - take any free cell
+        for (; cell < 0 && i_free < n_ctx; ++i_free) {
+            if (cache.cells[i_free].pos < 0) {
+                cell = i_free;
+            }
+        }
+
+        GGML_ASSERT(cell >= 0);
+
+        ib_shared = batch.n_seq_id[i] == 1 ? -1 : cell/LLAMA_KV_BLOCK_SIZE;
+
+        llama_kv_cache_cell_add(cache, cell, batch, i);
+    }
+
+    cache.used += n_tokens;
+
+    return true;
+}
+
+// find how many cells are currently in use
+static int32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
+    for (uint32_t i = cache.size; i > 0; --i) {
+        if (cache.cells[i - 1].pos >= 0 && !cache.cells[i - 1].seq_id.empty()) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+// find how many cells the batch has to attend to - up to the last block of the sequences in the batch
+static int32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache, const struct llama_batch & batch) {
+    uint32_t n = 0;
+
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        for (int32_t j = 0; j < batch.n_seq_id[i]; ++j) {
+            if (i > 0 && batch.n_seq_id[i - 1] > j && batch.seq_id[i - 1][j] == batch.seq_id[i][j]) {
+                continue;
+            }
+
+            const auto it = cache.seqs.find(batch.seq_id[i][j]);
+            if (it != cache.seqs.end() && !it->second.blocks.empty()) {
+                n = std::max(n, (it->second.blocks.back() + 1)*LLAMA_KV_BLOCK_SIZE);
+            }
+        }
+    }
+
+    return std::min(n, cache.size);
+}
+
+static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
+    for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
+        cache.cells[i].pos = -1;
+        cache.cells[i].seq_id.clear();
+    }
+    cache.head = 0;
+    cache.used = 0;
+
+    for (auto & block : cache.blocks) {
+        block.prefix = 0;
+    }
+    cache.prefixes.clear();
+
+    llama_kv_cache_update_blocks(cache);
+}
+
+static void llama_kv_cache_seq_rm(
+        struct llama_kv_cache & cache,
+                 llama_seq_id   seq_id,
+                    llama_pos   p0,
+                    llama_pos   p1) {
+    uint32_t new_head = cache.size;
+
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+
+    if (seq_id < 0) {
+        for (uint32_t i = 0; i < cache.size; ++i) {
+            if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+                if (cache.cells[i].has_seq_id(LLAMA_KV_SEQ_PREFIX)) {
+                    // the prefix index keeps its cells
+                    cache.cells[i].seq_id.clear();
+                    cache.cells[i].seq_id.insert(LLAMA_KV_SEQ_PREFIX);
+                    continue;
+                }
+
                 // keep count of the number of used cells
-                if (cache.cells[i].pos >= 0) cache.used--;
+                cache.used--;
+
+                cache.cells[i].pos = -1;
+                cache.cells[i].seq_id.clear();
+                if (new_head == cache.size) new_head = i;
+            }
+        }
+
+        llama_kv_cache_update_blocks(cache);
+    } else {
+        const auto it = cache.seqs.find(seq_id);
+        if (it == cache.seqs.end() || p1 <= it->second.pos_min || p0 > it->second.pos_max) {
+            return;
+        }
+
+        // only the blocks of the sequence have to be scanned
+        const std::vector<uint32_t> blocks = it->second.blocks;
+
+        for (const uint32_t ib : blocks) {
+            const uint32_t i0 = ib*LLAMA_KV_BLOCK_SIZE;
+            const uint32_t i1 = std::min(i0 + LLAMA_KV_BLOCK_SIZE, cache.size);
+
+            for (uint32_t i = i0; i < i1; ++i) {
+                llama_kv_cell & cell = cache.cells[i];
+
+                if (cell.pos < p0 || cell.pos >= p1 || !cell.has_seq_id(seq_id)) {
+                    continue;
+                }
+
+                cell.seq_id.erase(seq_id);
+                if (cell.seq_id.empty()) {
+                    // keep count of the number of used cells
+                    cache.used--;
+
+                    cell.pos = -1;
+                    if (new_head == cache.size) new_head = i;
+                }
+            }
+
+            llama_kv_cache_update_block(cache, ib);
+        }
+
+        llama_kv_cache_update_seq_pos(cache, seq_id);
+    }
+
+    // If we freed up a slot, set head to it so searching can start there.
+    if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
+}
+
+static void llama_kv_cache_seq_cp(
+        struct llama_kv_cache & cache,
+                 llama_seq_id   seq_id_src,
+                 llama_seq_id   seq_id_dst,
+                    llama_pos   p0,
+                    llama_pos   p1) {
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+
+    cache.head = 0;
+
+    const auto it = cache.seqs.find(seq_id_src);
+    if (it == cache.seqs.end() || p1 <= it->second.pos_min || p0 > it->second.pos_max) {
+        return;
+    }
+
+    const std::vector<uint32_t> blocks = it->second.blocks;
+
+    for (const uint32_t ib : blocks) {
+        const uint32_t i0 = ib*LLAMA_KV_BLOCK_SIZE;
+        const uint32_t i1 = std::min(i0 + LLAMA_KV_BLOCK_SIZE, cache.size);
+
+        for (uint32_t i = i0; i < i1; ++i) {
+            if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+                cache.cells[i].seq_id.insert(seq_id_dst);
+            }
+        }
+
+        // the copied cells are shared - the blocks holding them become read-only for both sequences
+        llama_kv_cache_update_block(cache, ib);
+    }
+
+    llama_kv_cache_update_seq_pos(cache, seq_id_dst);
+}
+
+static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
+    uint32_t new_head = cache.size;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        // the prefix index keeps its cells
+        const bool prefix = cache.cells[i].has_seq_id(LLAMA_KV_SEQ_PREFIX);
+
+        if (!cache.cells[i].has_seq_id(seq_id) && !prefix) {
+            if (cache.cells[i].pos >= 0) cache.used--;
+            cache.cells[i].pos = -1;
+            cache.cells[i].seq_id.clear();
+            if (new_head == cache.size) new_head = i;
+        } else {
+            const bool keep = cache.cells[i].has_seq_id(seq_id);
+
+            cache.cells[i].seq_id.clear();
+            if (keep) {
+                cache.cells[i].seq_id.insert(seq_id);
+            }
+            if (prefix) {
+                cache.cells[i].seq_id.insert(LLAMA_KV_SEQ_PREFIX);
+            }
+        }
+    }
+
+    // If we freed up a slot, set head to it so searching can start there.
+    if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
+
+    llama_kv_cache_update_blocks(cache);
+}
+
+static void llama_kv_cache_seq_shift(
+        struct llama_kv_cache & cache,
+                 llama_seq_id   seq_id,
+                    llama_pos   p0,
+                    llama_pos   p1,
+                    llama_pos   delta) {
+    uint32_t new_head = cache.size;
+
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+
+    const auto it = cache.seqs.find(seq_id);
+    if (it == cache.seqs.end() || p1 <= it->second.pos_min || p0 > it->second.pos_max) {
+        cache.head = 0;
+        return;
+    }
+
+    const std::vector<uint32_t> blocks = it->second.blocks;
+
+    // the shifted cells can be shared with other sequences, their positions change too
+    llama_kv_seq_set seqs;
+
+    for (const uint32_t ib : blocks) {
+        const uint32_t i0 = ib*LLAMA_KV_BLOCK_SIZE;
+        const uint32_t i1 = std::min(i0 + LLAMA_KV_BLOCK_SIZE, cache.size);
+
+        if (cache.blocks[ib].prefix) {
+            // an indexed block no longer matches its prompt once its cells move
+            for (uint32_t i = i0; i < i1; ++i) {
+                if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+                    llama_kv_cache_prefix_drop(cache, ib);
+                    break;
+                }
+            }
+        }
+
+        seqs.merge(cache.blocks[ib].seqs);
+
+        for (uint32_t i = i0; i < i1; ++i) {
+            if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+                cache.has_shift = true;
+                cache.cells[i].pos   += delta;
+                cache.cells[i].delta += delta;
+
+                if (cache.cells[i].pos < 0) {
+                    if (!cache.cells[i].seq_id.empty()) cache.used--;
+                    cache.cells[i].pos = -1;
+                    cache.cells[i].seq_id.clear();
+                    if (new_head == cache.size) new_head = i;
+                }
+            }
+        }
+
+        llama_kv_cache_update_block(cache, ib);
+    }
+
+    seqs.for_each([&](llama_seq_id id) {
+        llama_kv_cache_update_seq_pos(cache, id);
+    });
+
+    // If we freed up a slot, set head to it so searching can start there.
+    // Otherwise we just start the next search from the beginning.
+    cache.head = new_head != cache.size ? new_head : 0;
+}
+
+static uint64_t llama_kv_prefix_hash(uint64_t parent, const llama_token * tokens) {
+    // FNV-1a over the tokens of the block, seeded with the hash of the previous block
+    uint64_t h = parent ^ 14695981039346656037ULL;
+
+    for (int i = 0; i < LLAMA_KV_BLOCK_SIZE; ++i) {
+        h ^= (uint32_t) tokens[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h ? h : 1; // 0 means no parent
+}
+
+// add the full blocks holding tokens [0, n_tokens) of a sequence to the prefix index
+// returns the number of indexed tokens
+static int32_t llama_kv_cache_prefix_store(
+        struct llama_kv_cache & cache,
+                 llama_seq_id   seq_id,
+            const llama_token * tokens,
+                      int32_t   n_tokens) {
+    const auto it_seq = cache.seqs.find(seq_id);
+    if (it_seq == cache.seqs.end() || n_tokens < LLAMA_KV_BLOCK_SIZE) {
+        return 0;
+    }
+
+    const int32_t n_blocks = n_tokens/LLAMA_KV_BLOCK_SIZE;
+
+    // the block of the sequence holding positions [j*LLAMA_KV_BLOCK_SIZE, (j + 1)*LLAMA_KV_BLOCK_SIZE) in order
+    std::vector<int32_t> block_of(n_blocks, -1);
+
+    for (const uint32_t ib : it_seq->second.blocks) {
+        const uint32_t i0 = ib*LLAMA_KV_BLOCK_SIZE;
+
+        if (i0 + LLAMA_KV_BLOCK_SIZE > cache.size) {
+            continue;
+        }
+
+        const llama_pos p0 = cache.cells[i0].pos;
+        if (p0 < 0 || p0 % LLAMA_KV_BLOCK_SIZE != 0 || p0/LLAMA_KV_BLOCK_SIZE >= n_blocks) {
+            continue;
+        }
+
+        bool ok = true;
+        for (uint32_t k = 0; k < LLAMA_KV_BLOCK_SIZE && ok; ++k) {
+            const llama_kv_cell & cell = cache.cells[i0 + k];
+            ok = cell.pos == p0 + (llama_pos) k && cell.delta == 0 && cell.has_seq_id(seq_id);
+        }
+
+        if (ok) {
+            block_of[p0/LLAMA_KV_BLOCK_SIZE] = ib;
+        }
+    }
+
+    uint64_t parent = 0;
+
+    int32_t j = 0;
+    for (; j < n_blocks; ++j) {
+        const llama_token * block_tokens = tokens + j*LLAMA_KV_BLOCK_SIZE;
+
+        const uint64_t h = llama_kv_prefix_hash(parent, block_tokens);
+
+        auto it = cache.prefixes.find(h);
+        if (it != cache.prefixes.end()) {
+            // already indexed, possibly in another block
+            if (it->second.parent != parent || !std::equal(block_tokens, block_tokens + LLAMA_KV_BLOCK_SIZE, it->second.tokens.begin())) {
+                break;
+            }
+            it->second.t_used = ++cache.prefix_clock;
+            parent = h;
+            continue;
+        }
+
+        const int32_t ib = block_of[j];
+        if (ib < 0 || cache.blocks[ib].prefix != 0) {
+            break;
+        }
+
+        llama_kv_prefix_block pb;
+        pb.ib     = ib;
+        pb.parent = parent;
+        pb.t_used = ++cache.prefix_clock;
+        pb.tokens.assign(block_tokens, block_tokens + LLAMA_KV_BLOCK_SIZE);
 
-                cache.cells[i].pos = -1;
-                if (new_head == cache.size) new_head = i;
-            }
+        cache.prefixes[h] = std::move(pb);
+        cache.blocks[ib].prefix = h;
+
+        if (parent) {
+            cache.prefixes[parent].n_children++;
         }
+
+        const uint32_t i0 = ib*LLAMA_KV_BLOCK_SIZE;
+
+        for (uint32_t i = i0; i < i0 + LLAMA_KV_BLOCK_SIZE; ++i) {
+            cache.cells[i].seq_id.insert(LLAMA_KV_SEQ_PREFIX);
+        }
+
+        llama_kv_cache_update_block(cache, ib);
+
+        parent = h;
     }
 
-    // If we freed up a slot, set head to it so searching can start there.
-    if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
+    llama_kv_cache_update_seq_pos(cache, LLAMA_KV_SEQ_PREFIX);
+
+    return j*LLAMA_KV_BLOCK_SIZE;
 }
 
-static void llama_kv_cache_seq_cp(
+// add the cells of the longest indexed prefix of the tokens to a sequence
+// returns the number of tokens added
+static int32_t llama_kv_cache_prefix_attach(
         struct llama_kv_cache & cache,
-                 llama_seq_id   seq_id_src,
-                 llama_seq_id   seq_id_dst,
-                    llama_pos   p0,
-                    llama_pos   p1) {
-    if (p0 < 0) p0 = 0;
-    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+                 llama_seq_id   seq_id,
+            const llama_token * tokens,
+                      int32_t   n_tokens) {
+    uint64_t parent = 0;
 
-    cache.head = 0;
+    int32_t j = 0;
+    for (; (j + 1)*LLAMA_KV_BLOCK_SIZE <= n_tokens; ++j) {
+        const llama_token * block_tokens = tokens + j*LLAMA_KV_BLOCK_SIZE;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+        const uint64_t h = llama_kv_prefix_hash(parent, block_tokens);
+
+        auto it = cache.prefixes.find(h);
+        if (it == cache.prefixes.end() || it->second.parent != parent ||
+            !std::equal(block_tokens, block_tokens + LLAMA_KV_BLOCK_SIZE, it->second.tokens.begin())) {
+            break;
         }
+
+        llama_kv_prefix_block & pb = it->second;
+
+        pb.t_used = ++cache.prefix_clock;
+
+        for (uint32_t i = pb.ib*LLAMA_KV_BLOCK_SIZE; i < (pb.ib + 1)*LLAMA_KV_BLOCK_SIZE; ++i) {
+            cache.cells[i].seq_id.insert(seq_id);
+        }
+
+        llama_kv_cache_update_block(cache, pb.ib);
+
+        parent = h;
     }
+
+    llama_kv_cache_update_seq_pos(cache, seq_id);
+
+    return j*LLAMA_KV_BLOCK_SIZE;
 }
 
-static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
-    uint32_t new_head = cache.size;
+// n consecutive cells moved from src to dst by llama_kv_cache_defrag()
+struct llama_kv_move {
+    uint32_t src;
+    uint32_t dst;
+    uint32_t n;
+};
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (!cache.cells[i].has_seq_id(seq_id)) {
-            if (cache.cells[i].pos >= 0) cache.used--;
-            cache.cells[i].pos = -1;
-            cache.cells[i].seq_id.clear();
-            if (new_head == cache.size) new_head = i;
-        } else {
-            cache.cells[i].seq_id.clear();
-            cache.cells[i].seq_id.insert(seq_id);
+// move the cells of the last used blocks to the first free blocks, keeping their layout so the prefix index stays valid
+// returns the number of used cells moved
+static uint32_t llama_kv_cache_defrag_blocks(struct llama_kv_cache & cache, uint32_t n_max, std::vector<llama_kv_move> & moves) {
+    uint32_t n_moved = 0;
+
+    uint32_t ib_src = cache.blocks.size();
+
+    while (n_moved < n_max && !cache.free_blocks.empty()) {
+        while (ib_src > 0 && cache.blocks[ib_src - 1].used == 0) {
+            ib_src--;
+        }
+
+        if (ib_src == 0 || cache.free_blocks.back() >= ib_src - 1) {
+            break;
+        }
+
+        const uint32_t ib  = ib_src - 1;
+        const uint32_t ib0 = cache.free_blocks.back();
+
+        const uint32_t i0 = ib*LLAMA_KV_BLOCK_SIZE;
+        const uint32_t i1 = std::min(i0 + LLAMA_KV_BLOCK_SIZE, cache.size);
+
+        for (uint32_t i = i0; i < i1; ++i) {
+            cache.cells[ib0*LLAMA_KV_BLOCK_SIZE + (i - i0)] = cache.cells[i];
+            cache.cells[ib0*LLAMA_KV_BLOCK_SIZE + (i - i0)].saved = false;
+            cache.cells[i] = llama_kv_cell();
+        }
+
+        const uint64_t prefix = cache.blocks[ib].prefix;
+        if (prefix) {
+            cache.prefixes[prefix].ib = ib0;
         }
+        cache.blocks[ib0].prefix = prefix;
+        cache.blocks[ib].prefix  = 0;
+
+        n_moved += cache.blocks[ib].used;
+
+        llama_kv_cache_update_block(cache, ib);
+        llama_kv_cache_update_block(cache, ib0);
+
+        moves.push_back({ i0, ib0*LLAMA_KV_BLOCK_SIZE, i1 - i0 });
     }
 
-    // If we freed up a slot, set head to it so searching can start there.
-    if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
+    return n_moved;
 }
 
-static void llama_kv_cache_seq_shift(
-        struct llama_kv_cache & cache,
-                 llama_seq_id   seq_id,
-                    llama_pos   p0,
-                    llama_pos   p1,
-                    llama_pos   delta) {
-    uint32_t new_head = cache.size;
+// move the last used cells to the first free cells, in runs of consecutive cells
+// the cells of indexed blocks stay in place
+// returns the number of used cells moved
+static uint32_t llama_kv_cache_defrag_cells(struct llama_kv_cache & cache, uint32_t n_max, std::vector<llama_kv_move> & moves) {
+    const auto is_free = [&](uint32_t i) {
+        return cache.cells[i].pos < 0 && !cache.blocks[i/LLAMA_KV_BLOCK_SIZE].prefix;
+    };
+    const auto is_used = [&](uint32_t i) {
+        return cache.cells[i].pos >= 0 && !cache.blocks[i/LLAMA_KV_BLOCK_SIZE].prefix;
+    };
 
-    if (p0 < 0) p0 = 0;
-    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+    uint32_t n_moved = 0;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.has_shift = true;
-            cache.cells[i].pos   += delta;
-            cache.cells[i].delta += delta;
+    uint32_t i_dst = 0;
+    uint32_t i_src = cache.size;
 
-            if (cache.cells[i].pos < 0) {
-                if (!cache.cells[i].seq_id.empty()) cache.used--;
-                cache.cells[i].pos = -1;
-                cache.cells[i].seq_id.clear();
-                if (new_head == cache.size) new_head = i;
+    std::vector<bool> touched(cache.blocks.size(), false);
+
+    while (n_moved < n_max) {
+        while (i_dst < i_src && !is_free(i_dst)) {
+            i_dst++;
+        }
+        while (i_src > i_dst && !is_used(i_src - 1)) {
+            i_src--;
+        }
+
+        if (i_dst >= i_src) {
+            break;
+        }
+
+        // the free cells starting at i_dst and the used cells ending at i_src
+        uint32_t n = 1;
+        while (n < n_max - n_moved && i_dst + n < i_src - n && is_free(i_dst + n) && is_used(i_src - n - 1)) {
+            n++;
+        }
+
+        for (uint32_t k = 0; k < n; ++k) {
+            cache.cells[i_dst + k] = cache.cells[i_src - n + k];
+            cache.cells[i_dst + k].saved = false;
+            cache.cells[i_src - n + k] = llama_kv_cell();
+
+            touched[(i_dst + k)/LLAMA_KV_BLOCK_SIZE]     = true;
+            touched[(i_src - n + k)/LLAMA_KV_BLOCK_SIZE] = true;
+        }
+
+        moves.push_back({ i_src - n, i_dst, n });
+
+        n_moved += n;
+        i_dst   += n;
+        i_src   -= n;
+    }
+
+    for (uint32_t ib = 0; ib < cache.blocks.size(); ++ib) {
+        if (touched[ib]) {
+            llama_kv_cache_update_block(cache, ib);
+        }
+    }
+
+    return n_moved;
+}
+
+// compact the used cells of the cache towards its start, moving at most about n_max cells (all if n_max <= 0)
+// the K and V rows are moved with graphs of ggml_cpy ops computed on the CPU, so a cache offloaded to the GPU is left as is
+// returns the number of used cells moved, 0 once the cache is compact
+static int32_t llama_kv_cache_defrag(struct llama_context & lctx, int32_t n_max) {
+    const auto & hparams = lctx.model.hparams;
+    const auto & cparams = lctx.cparams;
+
+    auto & kv_self = lctx.kv_self;
+
+    if (kv_self.used == 0) {
+        return 0;
+    }
+
+    for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+        if (kv_self.k_l[il]->backend != GGML_BACKEND_CPU || kv_self.v_l[il]->backend != GGML_BACKEND_CPU) {
+            LLAMA_LOG_WARN("%s: the KV cache is offloaded, defragmentation is not supported\n", __func__);
+            return 0;
+        }
+    }
+
+    std::vector<llama_kv_move> moves;
+
+    const uint32_t n_budget = n_max > 0 ? (uint32_t) n_max : kv_self.size;
+
+    // whole blocks first, then the cells of the blocks that are partially used
+    uint32_t n_moved = llama_kv_cache_defrag_blocks(kv_self, n_budget, moves);
+    if (n_moved < n_budget) {
+        n_moved += llama_kv_cache_defrag_cells(kv_self, n_budget - n_moved, moves);
+    }
+
+    if (moves.empty()) {
+        return 0;
+    }
+
+    kv_self.head = 0;
+
+    const int64_t n_layer    = hparams.n_layer;
+    const int64_t n_embd_gqa = hparams.n_embd_gqa();
+    const int64_t n_ctx      = kv_self.size;
+
+    // two views and a copy for K and for V per move and layer - the moves are copied with graphs of bounded size
+    const int n_nodes_max = LLAMA_MAX_NODES;
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ n_nodes_max*ggml_tensor_overhead() + ggml_graph_overhead_custom(n_nodes_max, false),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context * ctx0 = nullptr;
+    ggml_cgraph  * gf   = nullptr;
+
+    // the moves of a layer are copied in order, a later move may read the cells written by an earlier one
+    for (int il = 0; il < (int) n_layer; ++il) {
+        ggml_tensor * k = kv_self.k_l[il];
+        ggml_tensor * v = kv_self.v_l[il];
+
+        const size_t k_row = ggml_row_size(k->type, n_embd_gqa);
+        const size_t v_row = ggml_row_size(v->type, kv_self.v_trans ? n_ctx : n_embd_gqa);
+
+        for (const llama_kv_move & mv : moves) {
+            if (ctx0 == nullptr) {
+                ctx0 = ggml_init(params);
+                gf   = ggml_new_graph_custom(ctx0, n_nodes_max, false);
+            }
+
+            ggml_tensor * k_src = ggml_view_2d(ctx0, k, n_embd_gqa, mv.n, k_row, k_row*mv.src);
+            ggml_tensor * k_dst = ggml_view_2d(ctx0, k, n_embd_gqa, mv.n, k_row, k_row*mv.dst);
+
+            ggml_tensor * v_src;
+            ggml_tensor * v_dst;
+
+            if (kv_self.v_trans) {
+                v_src = ggml_view_2d(ctx0, v, mv.n, n_embd_gqa, v_row, ggml_row_size(v->type, mv.src));
+                v_dst = ggml_view_2d(ctx0, v, mv.n, n_embd_gqa, v_row, ggml_row_size(v->type, mv.dst));
+            } else {
+                v_src = ggml_view_2d(ctx0, v, n_embd_gqa, mv.n, v_row, v_row*mv.src);
+                v_dst = ggml_view_2d(ctx0, v, n_embd_gqa, mv.n, v_row, v_row*mv.dst);
+            }
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_src, k_dst));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, v_src, v_dst));
+
+            if (gf->n_nodes + 6 > n_nodes_max) {
+                ggml_graph_compute_helper(lctx.work_buffer, gf, cparams.n_threads, lctx.threadpool, cparams.wait_policy, cparams.fuse_ops);
+                ggml_free(ctx0);
+                ctx0 = nullptr;
             }
         }
     }
 
-    // If we freed up a slot, set head to it so searching can start there.
-    // Otherwise we just start the next search from the beginning.
-    cache.head = new_head != cache.size ? new_head : 0;
+    if (ctx0 != nullptr) {
+        ggml_graph_compute_helper(lctx.work_buffer, gf, cparams.n_threads, lctx.threadpool, cparams.wait_policy, cparams.fuse_ops);
+        ggml_free(ctx0);
+    }
+
+    return n_moved;
 }
 
 //
@@ -2007,6 +3368,10 @@ struct llama_model_loader {
     std::unique_ptr<llama_mmap> mapping;
     std::unordered_map<std::string, struct llama_model_kv_override> kv_overrides;
 
+    // repacked tensors that are read from the repack cache instead of the model file, see open_repack_cache()
+    std::unique_ptr<llama_file>             file_repack;
+    std::unordered_map<std::string, size_t> offs_repack;
+
     struct gguf_context * ctx_gguf = NULL;
     struct ggml_context * ctx_meta = NULL;
 
@@ -2271,109 +3636,370 @@ struct llama_model_loader {
             }
         }
 
-        return create_tensor_for(ctx, cur, backend);
-    }
+        return create_tensor_for(ctx, cur, backend);
+    }
+
+    void done_getting_tensors() const {
+        if (n_created != n_tensors) {
+            throw std::runtime_error(format("%s: wrong number of tensors; expected %d, got %d", __func__, n_tensors, n_created));
+        }
+    }
+
+    size_t file_offset(const char * name) const {
+        const int idx = gguf_find_tensor(ctx_gguf, name);
+
+        if (idx < 0) {
+            throw std::runtime_error(format("%s: tensor '%s' not found in the file", __func__, name));
+        }
+
+        return gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, idx);
+    }
+
+    // identifies the model for the repack cache: FNV-1a over the header, which holds the meta data and the tensor infos
+    uint64_t model_key() const {
+        std::vector<uint8_t> header(gguf_get_data_offset(ctx_gguf));
+        file.read_raw_at(header.data(), header.size(), 0);
+
+        uint64_t h = 14695981039346656037ULL ^ file.size;
+        for (uint8_t c : header) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+
+        return h;
+    }
+
+    // read the tensors from the repack cache, which holds them in their repacked layout, if it matches the model
+    // returns false if there is no cache or it is stale, the tensors are then read from the model file
+    bool open_repack_cache(const char * fname, const std::vector<struct ggml_tensor *> & tensors) {
+        std::unique_ptr<llama_file> f;
+        try {
+            f.reset(new llama_file(fname, "rb"));
+        } catch (const std::exception & e) {
+            LLAMA_LOG_INFO("%s: no repack cache: %s\n", __func__, e.what());
+            return false;
+        }
+
+        std::unordered_map<std::string, size_t> offs;
+
+        try {
+            uint64_t key;
+            const uint32_t magic   = f->read_u32();
+            const uint32_t version = f->read_u32();
+            f->read_raw(&key, sizeof(key));
+            const uint32_t n       = f->read_u32();
+
+            if (magic != LLAMA_REPACK_MAGIC || version != LLAMA_REPACK_VERSION || key != model_key() || n != tensors.size()) {
+                LLAMA_LOG_INFO("%s: repack cache %s does not match the model\n", __func__, fname);
+                return false;
+            }
+
+            std::unordered_map<std::string, const struct ggml_tensor *> by_name;
+            for (const auto * cur : tensors) {
+                by_name[ggml_get_name(cur)] = cur;
+            }
+
+            for (uint32_t i = 0; i < n; ++i) {
+                const uint32_t n_name = f->read_u32();
+                if (n_name > GGML_MAX_NAME) {
+                    throw std::runtime_error("invalid tensor name");
+                }
+
+                std::string name(n_name, 0);
+                f->read_raw(&name[0], n_name);
+
+                uint64_t offs_data;
+                uint64_t size;
+                const uint32_t type = f->read_u32();
+                f->read_raw(&offs_data, sizeof(offs_data));
+                f->read_raw(&size,      sizeof(size));
+
+                auto it = by_name.find(name);
+                if (it == by_name.end() || type != (uint32_t) ggml_repack_type(it->second->type) ||
+                    size != ggml_nbytes(it->second) || offs_data + size > f->size) {
+                    LLAMA_LOG_INFO("%s: repack cache %s does not match the model\n", __func__, fname);
+                    return false;
+                }
+
+                offs[name] = offs_data;
+            }
+        } catch (const std::exception & e) {
+            LLAMA_LOG_WARN("%s: failed to read the repack cache %s: %s\n", __func__, fname, e.what());
+            return false;
+        }
+
+        file_repack = std::move(f);
+        offs_repack = std::move(offs);
+
+        return true;
+    }
+
+    void load_data_for(struct ggml_tensor * cur) const {
+        const size_t offs = file_offset(ggml_get_name(cur));
+
+        if (use_mmap) {
+            cur->data = (uint8_t *) mapping->addr + offs;
+        } else {
+            file.seek(offs, SEEK_SET);
+            file.read_raw(cur->data, ggml_nbytes(cur));
+        }
+    }
+
+    // hand a loaded tensor to its backend
+    // returns false if the tensor stays where it was loaded
+    bool upload_tensor(struct ggml_tensor * cur, llama_mlock * lmlock, size_t & size_lock) const {
+        switch (cur->backend) {
+            case GGML_BACKEND_CPU:
+                if (use_mmap && lmlock) {
+                    size_lock += ggml_nbytes(cur);
+                    lmlock->grow_to(size_lock);
+                }
+                break;
+#ifdef GGML_USE_CUBLAS
+            case GGML_BACKEND_GPU:
+            case GGML_BACKEND_GPU_SPLIT:
+                // old code:
+                //ggml_cuda_transform_tensor(lt.data, lt.ggml_tensor);
+
+                // TODO: test if this works !!
+                ggml_cuda_transform_tensor(cur->data, cur);
+                if (!use_mmap) {
+                    free(cur->data);
+                }
+                break;
+#elif defined(GGML_USE_CLBLAST)
+            case GGML_BACKEND_GPU:
+                ggml_cl_transform_tensor(cur->data, cur);
+                if (!use_mmap) {
+                    free(cur->data);
+                }
+                break;
+#endif
+            default:
+                return false;
+        }
+
+        return true;
+    }
+
+    // allocate temp buffer if not using mmap
+    static void alloc_tensor_data(struct ggml_tensor * cur) {
+        if (cur->data == NULL) {
+            GGML_ASSERT(cur->backend != GGML_BACKEND_CPU);
+            #ifdef GGML_USE_CPU_HBM
+            cur->data = (uint8_t*)hbw_malloc(ggml_nbytes(cur));
+            #else
+            cur->data = (uint8_t*)malloc(ggml_nbytes(cur));
+            #endif
+        }
+    }
+
+    // read the tensors without mmap: a pool of threads reads the file in large chunks, in file order, with positioned reads
+    // each tensor is uploaded by the calling thread as soon as it is complete, while the threads read the next ones
+    // at most size_ahead bytes of tensors that are not uploaded yet are read ahead, which bounds the temp buffers
+    void read_all_data(
+            const std::vector<struct ggml_tensor *> & tensors,
+            int n_threads,
+            llama_progress_callback progress_callback, void * progress_callback_user_data,
+            size_t size_data) {
+        const size_t size_chunk = 16u*1024*1024;
+        const size_t size_ahead = 512u*1024*1024;
+
+        const size_t n = tensors.size();
+
+        struct chunk {
+            size_t it;   // index of the tensor
+            size_t offs; // offset in the tensor
+            size_t size;
+        };
+
+        std::vector<chunk>  chunks;
+        std::vector<const llama_file *> files(n);
+        std::vector<size_t> offs_file(n);
+        std::vector<size_t> n_pending(n); // bytes left to read
+
+        for (size_t it = 0; it < n; ++it) {
+            const size_t nbytes = ggml_nbytes(tensors[it]);
+
+            auto it_repack = offs_repack.find(ggml_get_name(tensors[it]));
+            if (it_repack != offs_repack.end()) {
+                files[it]     = file_repack.get();
+                offs_file[it] = it_repack->second;
+            } else {
+                files[it]     = &file;
+                offs_file[it] = file_offset(ggml_get_name(tensors[it]));
+            }
+            n_pending[it] = nbytes;
+
+            for (size_t offs = 0; offs < nbytes; offs += size_chunk) {
+                chunks.push_back({ it, offs, std::min(size_chunk, nbytes - offs) });
+            }
+        }
+
+        std::mutex              mutex;
+        std::condition_variable cv_read;   // signaled when tensors become ready to be read
+        std::condition_variable cv_loaded; // signaled when a tensor has been read
+
+        size_t      n_ready = 0; // tensors [0, n_ready) have their buffers and may be read
+        size_t      i_chunk = 0; // next chunk to read
+        bool        stop    = false;
+        std::string error;
+
+        auto worker = [&]() {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            while (true) {
+                cv_read.wait(lock, [&]() {
+                    return stop || i_chunk == chunks.size() || chunks[i_chunk].it < n_ready;
+                });
+
+                if (stop || i_chunk == chunks.size()) {
+                    break;
+                }
+
+                const chunk c = chunks[i_chunk++];
+
+                lock.unlock();
+
+                std::string err;
+                try {
+                    files[c.it]->read_raw_at((uint8_t *) tensors[c.it]->data + c.offs, c.size, offs_file[c.it] + c.offs);
+                } catch (const std::exception & e) {
+                    err = e.what();
+                }
+
+                lock.lock();
+
+                if (!err.empty()) {
+                    error = err;
+                    stop  = true;
+                    cv_read.notify_all();
+                    cv_loaded.notify_one();
+                    break;
+                }
+
+                n_pending[c.it] -= c.size;
+                if (n_pending[c.it] == 0) {
+                    cv_loaded.notify_one();
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int i = 0; i < std::max(1, n_threads); ++i) {
+            workers.emplace_back(worker);
+        }
+
+        size_t size_lock = 0;
+        size_t done_size = 0;
+        size_t read_size = 0; // read but not yet uploaded
+
+        size_t it = 0;
+        for (; it < n; ++it) {
+            struct ggml_tensor * cur = tensors[it];
+
+            if (progress_callback) {
+                progress_callback((float) done_size / size_data, progress_callback_user_data);
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+
+                // let the threads read ahead
+                const size_t n_ready_old = n_ready;
+                while (n_ready < n && (n_ready <= it || read_size + ggml_nbytes(tensors[n_ready]) <= size_ahead)) {
+                    alloc_tensor_data(tensors[n_ready]);
+                    read_size += ggml_nbytes(tensors[n_ready]);
+                    n_ready++;
+                }
+                if (n_ready > n_ready_old) {
+                    cv_read.notify_all();
+                }
+
+                cv_loaded.wait(lock, [&]() { return stop || n_pending[it] == 0; });
 
-    void done_getting_tensors() const {
-        if (n_created != n_tensors) {
-            throw std::runtime_error(format("%s: wrong number of tensors; expected %d, got %d", __func__, n_tensors, n_created));
-        }
-    }
+                if (stop) {
+                    break;
+                }
+            }
 
-    size_t file_offset(const char * name) const {
-        const int idx = gguf_find_tensor(ctx_gguf, name);
+            read_size -= ggml_nbytes(cur);
 
-        if (idx < 0) {
-            throw std::runtime_error(format("%s: tensor '%s' not found in the file", __func__, name));
+            if (upload_tensor(cur, nullptr, size_lock)) {
+                done_size += ggml_nbytes(cur);
+            }
         }
 
-        return gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, idx);
-    }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_read.notify_all();
 
-    void load_data_for(struct ggml_tensor * cur) const {
-        const size_t offs = file_offset(ggml_get_name(cur));
+        for (auto & w : workers) {
+            w.join();
+        }
 
-        if (use_mmap) {
-            cur->data = (uint8_t *) mapping->addr + offs;
-        } else {
-            file.seek(offs, SEEK_SET);
-            file.read_raw(cur->data, ggml_nbytes(cur));
+        if (!error.empty()) {
+            // free the temp buffers of the tensors that were not uploaded
+            for (; it < n_ready; ++it) {
+                if (tensors[it]->backend != GGML_BACKEND_CPU) {
+                    free(tensors[it]->data);
+                    tensors[it]->data = NULL;
+                }
+            }
+            throw std::runtime_error(error);
         }
     }
 
-    void load_all_data(struct ggml_context * ctx, llama_progress_callback progress_callback, void * progress_callback_user_data, llama_mlock * lmlock) {
+    void load_all_data(
+            struct ggml_context * ctx,
+            int n_threads,
+            llama_progress_callback progress_callback, void * progress_callback_user_data,
+            llama_mlock * lmlock) {
         size_t size_data = 0;
         size_t size_lock = 0;
         size_t size_pref = 0; // prefetch
 
+        std::vector<struct ggml_tensor *> tensors;
+
         for (int i = 0; i < gguf_get_n_tensors(ctx_gguf); i++) {
             struct ggml_tensor * cur = ggml_get_tensor(ctx, gguf_get_tensor_name(ctx_gguf, i));
+            GGML_ASSERT(cur); // unused tensors should have been caught by load_data already
+            tensors.push_back(cur);
             size_data += ggml_nbytes(cur);
             if (cur->backend == GGML_BACKEND_CPU) {
                 size_pref += ggml_nbytes(cur);
             }
         }
 
-        if (use_mmap) {
-            mapping.reset(new llama_mmap(&file, size_pref, ggml_is_numa()));
-            if (lmlock) {
-                lmlock->init(mapping->addr);
-            }
+        if (!use_mmap) {
+            const int64_t t_start_us = ggml_time_us();
+
+            read_all_data(tensors, n_threads, progress_callback, progress_callback_user_data, size_data);
+
+            const double t_s = (ggml_time_us() - t_start_us)/1e6;
+            LLAMA_LOG_INFO("%s: read %.2f MiB in %.2f s (%.2f GB/s) with %d threads\n", __func__,
+                    size_data/1024.0/1024.0, t_s, t_s > 0 ? size_data/t_s/1e9 : 0.0, std::max(1, n_threads));
+            return;
         }
 
-        size_t done_size = 0;
-        for (int i = 0; i < gguf_get_n_tensors(ctx_gguf); i++) {
-            struct ggml_tensor * cur = ggml_get_tensor(ctx, gguf_get_tensor_name(ctx_gguf, i));
-            GGML_ASSERT(cur); // unused tensors should have been caught by load_data already
+        mapping.reset(new llama_mmap(&file, size_pref, ggml_is_numa()));
+        if (lmlock) {
+            lmlock->init(mapping->addr);
+        }
 
+        size_t done_size = 0;
+        for (struct ggml_tensor * cur : tensors) {
             if (progress_callback) {
                 progress_callback((float) done_size / size_data, progress_callback_user_data);
             }
 
-            // allocate temp buffer if not using mmap
-            if (!use_mmap && cur->data == NULL) {
-                GGML_ASSERT(cur->backend != GGML_BACKEND_CPU);
-                #ifdef GGML_USE_CPU_HBM
-                cur->data = (uint8_t*)hbw_malloc(ggml_nbytes(cur));
-                #else
-                cur->data = (uint8_t*)malloc(ggml_nbytes(cur));
-                #endif
-            }
-
             load_data_for(cur);
 
-            switch (cur->backend) {
-                case GGML_BACKEND_CPU:
-                    if (use_mmap && lmlock) {
-                        size_lock += ggml_nbytes(cur);
-                        lmlock->grow_to(size_lock);
-                    }
-                    break;
-#ifdef GGML_USE_CUBLAS
-                case GGML_BACKEND_GPU:
-                case GGML_BACKEND_GPU_SPLIT:
-                    // old code:
-                    //ggml_cuda_transform_tensor(lt.data, lt.ggml_tensor);
-
-                    // TODO: test if this works !!
-                    ggml_cuda_transform_tensor(cur->data, cur);
-                    if (!use_mmap) {
-                        free(cur->data);
-                    }
-                    break;
-#elif defined(GGML_USE_CLBLAST)
-                case GGML_BACKEND_GPU:
-                    ggml_cl_transform_tensor(cur->data, cur);
-                    if (!use_mmap) {
-                        free(cur->data);
-                    }
-                    break;
-#endif
-                default:
-                    continue;
+            if (upload_tensor(cur, lmlock, size_lock)) {
+                done_size += ggml_nbytes(cur);
             }
-
-            done_size += ggml_nbytes(cur);
         }
     }
 };
@@ -2438,6 +4064,17 @@ static const char * llama_model_type_name(e_model type) {
     }
 }
 
+// the models that apply ALiBi to KQ in llm_build_kqv(), which the fused attention op does not support
+static bool llama_model_has_alibi(const llama_model & model) {
+    switch (model.arch) {
+        case LLM_ARCH_BAICHUAN: return model.type == MODEL_13B;
+        case LLM_ARCH_REFACT:
+        case LLM_ARCH_BLOOM:    return true;
+        case LLM_ARCH_MPT:      return model.hparams.f_max_alibi_bias > 0.0f;
+        default:                return false;
+    }
+}
+
 static void llm_load_arch(llama_model_loader & ml, llama_model & model) {
     model.arch = ml.get_arch();
     if (model.arch == LLM_ARCH_UNKNOWN) {
@@ -2643,8 +4280,10 @@ static void llm_load_hparams(
 }
 
 // TODO: This should probably be in llama.h
-static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool bos, bool special = false);
+static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool bos, bool special = false, int n_threads = 1);
 static llama_token llama_byte_to_token(const llama_vocab & vocab, uint8_t ch);
+static void llama_vocab_init_pieces(llama_model & model);
+static void llama_vocab_init_trie(llama_vocab & vocab);
 
 static void llm_load_vocab(
         llama_model_loader & ml,
@@ -2746,6 +4385,8 @@ static void llm_load_vocab(
     }
     GGML_ASSERT(vocab.id_to_token.size() == vocab.token_to_id.size());
 
+    llama_vocab_init_trie(vocab);
+
     // determine the newline token: LLaMA "<0x0A>" == 10 == '\n', Falcon 193 == '\n'
     if (vocab.type == LLAMA_VOCAB_TYPE_SPM) {
         vocab.linefeed_id = llama_byte_to_token(vocab, '\n');
@@ -2888,6 +4529,8 @@ static void llm_load_vocab(
             );
         }
     }
+
+    llama_vocab_init_pieces(model);
 }
 
 static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
@@ -2942,13 +4585,104 @@ static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
     if (vocab.linefeed_id    != -1) { LLAMA_LOG_INFO( "%s: LF token         = %d '%s'\n", __func__, vocab.linefeed_id,    vocab.id_to_token[vocab.linefeed_id].text.c_str() );    }
 }
 
+// the weights that are only used as src0 of ggml_mul_mat, in a layout that ggml_repack_tensor can interleave
+static bool llama_repack_candidate(const struct ggml_tensor * cur) {
+    static const char * names[] = {
+        "attn_q", "attn_k", "attn_v", "attn_qkv", "attn_output", "ffn_gate", "ffn_up", "ffn_down",
+    };
+
+    const enum ggml_type type = ggml_repack_type(cur->type);
+
+    if (cur->backend != GGML_BACKEND_CPU || ggml_n_dims(cur) != 2 || type == GGML_TYPE_COUNT ||
+        cur->ne[1] % ggml_internal_get_type_traits(type).nrows != 0) {
+        return false;
+    }
+
+    const std::string name = ggml_get_name(cur);
+
+    if (name == "output.weight") {
+        return true;
+    }
+
+    for (const char * n : names) {
+        const std::string suffix = std::string(".") + n + ".weight";
+        if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// the repack cache: header, one entry per tensor (name, type, offset, size), then the aligned data of the tensors
+static void llama_write_repack_cache(const char * fname, uint64_t key, const std::vector<struct ggml_tensor *> & tensors) {
+    const std::string fname_tmp = std::string(fname) + ".tmp";
+
+    try {
+        llama_file file(fname_tmp.c_str(), "wb");
+
+        size_t size_header = 3*sizeof(uint32_t) + sizeof(uint64_t);
+        for (const auto * cur : tensors) {
+            size_header += 2*sizeof(uint32_t) + strlen(ggml_get_name(cur)) + 2*sizeof(uint64_t);
+        }
+
+        file.write_u32(LLAMA_REPACK_MAGIC);
+        file.write_u32(LLAMA_REPACK_VERSION);
+        file.write_raw(&key, sizeof(key));
+        file.write_u32((uint32_t) tensors.size());
+
+        uint64_t offs = GGML_PAD(size_header, LLAMA_REPACK_ALIGN);
+        for (const auto * cur : tensors) {
+            const uint64_t size = ggml_nbytes(cur);
+
+            file.write_u32((uint32_t) strlen(ggml_get_name(cur)));
+            file.write_raw(ggml_get_name(cur), strlen(ggml_get_name(cur)));
+            file.write_u32((uint32_t) cur->type);
+            file.write_raw(&offs, sizeof(offs));
+            file.write_raw(&size, sizeof(size));
+
+            offs = GGML_PAD(offs + size, LLAMA_REPACK_ALIGN);
+        }
+
+        static const char zeros[LLAMA_REPACK_ALIGN] = {};
+
+        file.write_raw(zeros, GGML_PAD(size_header, LLAMA_REPACK_ALIGN) - size_header);
+        for (const auto * cur : tensors) {
+            file.write_raw(cur->data, ggml_nbytes(cur));
+            file.write_raw(zeros, GGML_PAD(ggml_nbytes(cur), LLAMA_REPACK_ALIGN) - ggml_nbytes(cur));
+        }
+
+        if (std::fflush(file.fp) != 0) {
+            throw std::runtime_error(format("write error: %s", strerror(errno)));
+        }
+    } catch (const std::exception & e) {
+        LLAMA_LOG_WARN("%s: failed to write the repack cache %s: %s\n", __func__, fname, e.what());
+        std::remove(fname_tmp.c_str());
+        return;
+    }
+
+    // a cache is never seen half written
+    if (std::rename(fname_tmp.c_str(), fname) != 0) {
+        LLAMA_LOG_WARN("%s: failed to write the repack cache %s: %s\n", __func__, fname, strerror(errno));
+        std::remove(fname_tmp.c_str());
+        return;
+    }
+
+    LLAMA_LOG_INFO("%s: wrote the repack cache %s\n", __func__, fname);
+}
+
 static void llm_load_tensors(
         llama_model_loader & ml,
         llama_model & model,
         int n_gpu_layers,
         int main_gpu,
         const float * tensor_split,
+        int n_threads_load,
         bool use_mlock,
+        bool numa_split,
+        bool huge_pages,
+        bool repack,
+        const char * repack_cache,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
     model.t_start_us = ggml_time_us();
@@ -2967,7 +4701,15 @@ static void llm_load_tensors(
 
     // create the ggml context
     {
-        model.buf.resize(ctx_size);
+        // with mmap the buffer only holds the tensor structs
+        model.buf.resize(ctx_size, huge_pages && !ml.use_mmap);
+        if (huge_pages) {
+            if (ml.use_mmap) {
+                LLAMA_LOG_WARN("%s: huge pages are only used for the weights without mmap\n", __func__);
+            } else {
+                LLAMA_LOG_INFO("%s: huge pages: weights %s\n", __func__, model.buf.backing().c_str());
+            }
+        }
         if (use_mlock) {
             model.mlock_buf.init   (model.buf.data);
             model.mlock_buf.grow_to(model.buf.size);
@@ -3683,7 +5425,78 @@ static void llm_load_tensors(
     }
 #endif
 
-    ml.load_all_data(ctx, progress_callback, progress_callback_user_data, use_mlock ? &model.mlock_mmap : NULL);
+    std::vector<struct ggml_tensor *> tensors_repack;
+    bool repack_cached = false;
+
+    if (repack) {
+        if (ml.use_mmap) {
+            LLAMA_LOG_WARN("%s: the weights are only repacked without mmap\n", __func__);
+        } else {
+            for (int i = 0; i < ml.n_tensors; ++i) {
+                struct ggml_tensor * cur = ggml_get_tensor(ctx, ml.get_tensor_name(i));
+                if (llama_repack_candidate(cur)) {
+                    tensors_repack.push_back(cur);
+                }
+            }
+
+            if (repack_cache && !tensors_repack.empty()) {
+                repack_cached = ml.open_repack_cache(repack_cache, tensors_repack);
+            }
+        }
+    }
+
+    ml.load_all_data(ctx, n_threads_load, progress_callback, progress_callback_user_data, use_mlock ? &model.mlock_mmap : NULL);
+
+    if (!tensors_repack.empty()) {
+        const int64_t t_start_us = ggml_time_us();
+
+        size_t size_repack = 0;
+        for (struct ggml_tensor * cur : tensors_repack) {
+            if (repack_cached) {
+                // read in the repacked layout already
+                cur->type = ggml_repack_type(cur->type);
+            } else {
+                GGML_ASSERT(ggml_repack_tensor(cur));
+            }
+            size_repack += ggml_nbytes(cur);
+        }
+
+        LLAMA_LOG_INFO("%s: repacked %zu tensors (%.2f MiB)%s in %.2f ms\n", __func__, tensors_repack.size(),
+                size_repack/1024.0/1024.0, repack_cached ? " from the repack cache" : "", (ggml_time_us() - t_start_us)/1000.0);
+
+        if (repack_cache && !repack_cached) {
+            llama_write_repack_cache(repack_cache, ml.model_key(), tensors_repack);
+        }
+    }
+
+    if (numa_split) {
+        if (!ggml_is_numa()) {
+            LLAMA_LOG_WARN("%s: NUMA is not initialized or there is a single node, not splitting the weights\n", __func__);
+        } else {
+            // pages that are not resident yet (mmap without prefetch) are faulted in by the threads of the right node
+            size_t size_split = 0;
+            int    n_failed   = 0;
+
+            for (int i = 0; i < ml.n_tensors; ++i) {
+                struct ggml_tensor * cur = ggml_get_tensor(ctx, ml.get_tensor_name(i));
+
+                if (cur->backend != GGML_BACKEND_CPU || ggml_n_dims(cur) < 2) {
+                    continue;
+                }
+
+                if (!ggml_numa_place_rows(cur)) {
+                    n_failed++;
+                }
+                size_split += ggml_nbytes(cur);
+            }
+
+            LLAMA_LOG_INFO("%s: split %.2f MiB of weights across the NUMA nodes", __func__, size_split/1024.0/1024.0);
+            if (n_failed > 0) {
+                LLAMA_LOG_INFO(" (%d tensors not fully moved)", n_failed);
+            }
+            LLAMA_LOG_INFO("\n");
+        }
+    }
 
     if (progress_callback) {
         progress_callback(1.0f, progress_callback_user_data);
@@ -3718,8 +5531,8 @@ static bool llama_model_load(const std::string & fname, llama_model & model, con
         }
 
         llm_load_tensors(
-            ml, model, params.n_gpu_layers, params.main_gpu, params.tensor_split, params.use_mlock,
-            params.progress_callback, params.progress_callback_user_data
+            ml, model, params.n_gpu_layers, params.main_gpu, params.tensor_split, params.n_threads_load, params.use_mlock, params.numa_split, params.huge_pages,
+            params.repack, params.repack_cache, params.progress_callback, params.progress_callback_user_data
         );
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("error loading model: %s\n", err.what());
@@ -3822,13 +5635,37 @@ static void llm_build_k_shift(
     }
 
     for (int il = 0; il < n_layer; ++il) {
+        struct ggml_tensor * k = kv.k_l[il];
+
+        if (ggml_is_quantized(k->type)) {
+            // rotate a dequantized copy of the layer and quantize it back
+            struct ggml_tensor * k_2d = ggml_view_2d(ctx, k, n_embd_gqa, n_ctx, ggml_row_size(k->type, n_embd_gqa), 0);
+
+            k = ggml_cpy(ctx, k_2d, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd_gqa, n_ctx));
+            cb(k, "K_f32", il);
+
+            struct ggml_tensor * tmp =
+                ggml_rope_custom_inplace(ctx,
+                        ggml_view_3d(ctx, k,
+                            n_embd_head, n_head_kv, n_ctx,
+                            ggml_row_size(k->type, n_embd_head),
+                            ggml_row_size(k->type, n_embd_gqa),
+                            0),
+                        K_shift, n_rot, rope_type, 0, n_orig_ctx, freq_base, freq_scale,
+                        ext_factor, attn_factor, beta_fast, beta_slow);
+            cb(tmp, "K_shifted", il);
+
+            ggml_build_forward_expand(graph, ggml_cpy(ctx, tmp, k_2d));
+            continue;
+        }
+
         struct ggml_tensor * tmp =
             // we rotate only the first n_rot dimensions
             ggml_rope_custom_inplace(ctx,
-                    ggml_view_3d(ctx, kv.k_l[il],
+                    ggml_view_3d(ctx, k,
                         n_embd_head, n_head_kv, n_ctx,
-                        ggml_row_size(kv.k_l[il]->type, n_embd_head),
-                        ggml_row_size(kv.k_l[il]->type, n_embd_gqa),
+                        ggml_row_size(k->type, n_embd_head),
+                        ggml_row_size(k->type, n_embd_gqa),
                         0),
                     K_shift, n_rot, rope_type, 0, n_orig_ctx, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow);
@@ -3847,10 +5684,61 @@ static void llm_build_kv_store(
                     int64_t   n_ctx,
                     int32_t   n_tokens,
                     int32_t   kv_head,
+         struct ggml_tensor * kv_slots,
          const llm_build_cb & cb,
                     int64_t   il) {
     const int64_t n_embd_gqa = hparams.n_embd_gqa();
 
+    if (kv.paged) {
+        // scatter the K and V of the tokens to their cells
+        struct ggml_tensor * k_cache = ggml_view_2d(ctx, kv.k_l[il], n_embd_gqa, n_ctx,
+                ggml_row_size(kv.k_l[il]->type, n_embd_gqa), 0);
+        cb(k_cache, "k_cache_view", il);
+
+        // important: storing RoPE-ed version of K in the KV cache!
+        ggml_build_forward_expand(graph, ggml_set_rows(ctx, k_cache, ggml_reshape_2d(ctx, k_cur, n_embd_gqa, n_tokens), kv_slots));
+
+        if (!kv.v_trans) {
+            struct ggml_tensor * v_cache = ggml_view_2d(ctx, kv.v_l[il], n_embd_gqa, n_ctx,
+                    ggml_row_size(kv.v_l[il]->type, n_embd_gqa), 0);
+            cb(v_cache, "v_cache_view", il);
+
+            ggml_build_forward_expand(graph, ggml_set_rows(ctx, v_cache, ggml_reshape_2d(ctx, v_cur, n_embd_gqa, n_tokens), kv_slots));
+
+            return;
+        }
+
+        struct ggml_tensor * v_cache = ggml_view_3d(ctx, kv.v_l[il], 1, n_ctx, n_embd_gqa,
+                ggml_element_size(kv.v_l[il]),
+                ggml_element_size(kv.v_l[il])*n_ctx, 0);
+        cb(v_cache, "v_cache_view", il);
+
+        // [1, n_tokens, n_embd] view of V, one element per row
+        struct ggml_tensor * v_cur_2d = ggml_reshape_2d(ctx, v_cur, n_embd_gqa, n_tokens);
+        struct ggml_tensor * v_cur_t  = ggml_view_3d(ctx, v_cur_2d, 1, n_tokens, n_embd_gqa,
+                v_cur_2d->nb[1], v_cur_2d->nb[0], 0);
+        cb(v_cur_t, "v_cur_t", il);
+
+        ggml_build_forward_expand(graph, ggml_set_rows(ctx, v_cache, v_cur_t, kv_slots));
+
+        return;
+    }
+
+    if (!kv.v_trans) {
+        struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_gqa,
+                (ggml_row_size(kv.k_l[il]->type, n_embd_gqa))*kv_head);
+        cb(k_cache_view, "k_cache_view", il);
+
+        struct ggml_tensor * v_cache_view = ggml_view_1d(ctx, kv.v_l[il], n_tokens*n_embd_gqa,
+                (ggml_row_size(kv.v_l[il]->type, n_embd_gqa))*kv_head);
+        cb(v_cache_view, "v_cache_view", il);
+
+        ggml_build_forward_expand(graph, ggml_cpy(ctx, k_cur, k_cache_view));
+        ggml_build_forward_expand(graph, ggml_cpy(ctx, v_cur, v_cache_view));
+
+        return;
+    }
+
     // compute the transposed [n_tokens, n_embd] V matrix
     struct ggml_tensor * v_cur_t = ggml_transpose(ctx, ggml_reshape_2d(ctx, v_cur, n_embd_gqa, n_tokens));
     //struct ggml_tensor * v_cur_t = ggml_transpose(ctx, v_cur); // TODO: reshape above is likely not needed
@@ -3992,6 +5880,7 @@ static struct ggml_tensor * llm_build_ffn(
 static struct ggml_tensor * llm_build_kqv(
         struct ggml_context * ctx,
         const llama_hparams & hparams,
+        const llama_cparams & cparams,
        const llama_kv_cache & kv,
          struct ggml_tensor * wo,
          struct ggml_tensor * wo_b,
@@ -4021,49 +5910,78 @@ static struct ggml_tensor * llm_build_kqv(
                 0);
     cb(k, "k", il);
 
-    struct ggml_tensor * kq = ggml_mul_mat(ctx, k, q);
-    cb(kq, "kq", il);
-
-    if (max_alibi_bias > 0.0f) {
-        // temporary branch until we figure out how to handle ggml_alibi through ggml_add
-        kq = ggml_scale(ctx, kq, kq_scale);
-        cb(kq, "kq_scaled", il);
+    struct ggml_tensor * cur;
+
+    if (cparams.flash_attn) {
+        GGML_ASSERT(max_alibi_bias <= 0.0f);
+
+        // stream over the KV cache with an online softmax instead of materializing KQ
+        // V stored by rows can be quantized, the kernel converts one row at a time to F32
+        struct ggml_tensor * v = kv.v_trans ?
+            ggml_transpose(ctx, ggml_view_3d(ctx, kv.v_l[il],
+                    n_kv, n_embd_head, n_head_kv,
+                    ggml_element_size(kv.v_l[il])*n_ctx,
+                    ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head,
+                    0)) :
+            ggml_view_3d(ctx, kv.v_l[il],
+                    n_embd_head, n_kv, n_head_kv,
+                    ggml_row_size(kv.v_l[il]->type, n_embd_gqa),
+                    ggml_row_size(kv.v_l[il]->type, n_embd_head),
+                    0);
+        cb(v, "v", il);
+
+        cur = ggml_flash_attn_ext(ctx, q, k, v, kq_mask, 1.0f/sqrtf(float(n_embd_head)));
+        cb(cur, "kqv_fa", il);
+
+        cur = ggml_reshape_2d(ctx, cur, n_embd, n_tokens);
+        cb(cur, "kqv_merged_cont", il);
+    } else {
+        struct ggml_tensor * kq = ggml_mul_mat(ctx, k, q);
+        cb(kq, "kq", il);
 
         if (max_alibi_bias > 0.0f) {
-            // TODO: n_head or n_head_kv
-            // TODO: K-shift is likely not working
-            // TODO: change to ggml_add
-            kq = ggml_alibi(ctx, kq, /*n_past*/ 0, n_head, max_alibi_bias);
-            cb(kq, "kq_scaled_alibi", il);
-        }
+            // temporary branch until we figure out how to handle ggml_alibi through ggml_add
+            kq = ggml_scale(ctx, kq, kq_scale);
+            cb(kq, "kq_scaled", il);
 
-        kq = ggml_add(ctx, kq, kq_mask);
-        cb(kq, "kq_masked", il);
+            if (max_alibi_bias > 0.0f) {
+                // TODO: n_head or n_head_kv
+                // TODO: K-shift is likely not working
+                // TODO: change to ggml_add
+                kq = ggml_alibi(ctx, kq, /*n_past*/ 0, n_head, max_alibi_bias);
+                cb(kq, "kq_scaled_alibi", il);
+            }
 
-        kq = ggml_soft_max(ctx, kq);
-        cb(kq, "kq_soft_max", il);
-    } else {
-        kq = ggml_soft_max_ext(ctx, kq, kq_mask, 1.0f/sqrtf(float(n_embd_head)));
-        cb(kq, "kq_soft_max_ext", il);
-    }
+            kq = ggml_add(ctx, kq, kq_mask);
+            cb(kq, "kq_masked", il);
 
-    // split cached v into n_head heads
-    struct ggml_tensor * v =
-        ggml_view_3d(ctx, kv.v_l[il],
-                n_kv, n_embd_head, n_head_kv,
-                ggml_element_size(kv.v_l[il])*n_ctx,
-                ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head,
-                0);
-    cb(v, "v", il);
+            kq = ggml_soft_max(ctx, kq);
+            cb(kq, "kq_soft_max", il);
+        } else {
+            kq = ggml_soft_max_ext(ctx, kq, kq_mask, 1.0f/sqrtf(float(n_embd_head)));
+            cb(kq, "kq_soft_max_ext", il);
+        }
+
+        GGML_ASSERT(kv.v_trans);
 
-    struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
-    cb(kqv, "kqv", il);
+        // split cached v into n_head heads
+        struct ggml_tensor * v =
+            ggml_view_3d(ctx, kv.v_l[il],
+                    n_kv, n_embd_head, n_head_kv,
+                    ggml_element_size(kv.v_l[il])*n_ctx,
+                    ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head,
+                    0);
+        cb(v, "v", il);
 
-    struct ggml_tensor * kqv_merged = ggml_permute(ctx, kqv, 0, 2, 1, 3);
-    cb(kqv_merged, "kqv_merged", il);
+        struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
+        cb(kqv, "kqv", il);
 
-    struct ggml_tensor * cur = ggml_cont_2d(ctx, kqv_merged, n_embd, n_tokens);
-    cb(cur, "kqv_merged_cont", il);
+        struct ggml_tensor * kqv_merged = ggml_permute(ctx, kqv, 0, 2, 1, 3);
+        cb(kqv_merged, "kqv_merged", il);
+
+        cur = ggml_cont_2d(ctx, kqv_merged, n_embd, n_tokens);
+        cb(cur, "kqv_merged_cont", il);
+    }
 
     cur = ggml_mul_mat(ctx, wo, cur);
     if (wo_b) {
@@ -4196,6 +6114,10 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_slots - cells of the KV cache the tokens are stored in
+        struct ggml_tensor * KV_slots = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_slots, "KV_slots", -1);
+
         // shift the entire K-cache if needed
         if (do_rope_shift) {
             llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE, n_ctx, n_embd_head, freq_base, freq_scale, cb);
@@ -4248,9 +6170,9 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_slots, cb, il);
 
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, model.layers[il].bo,
                         Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
                 cb(cur, "kqv_out", il);
@@ -4381,6 +6303,10 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_slots - cells of the KV cache the tokens are stored in
+        struct ggml_tensor * KV_slots = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_slots, "KV_slots", -1);
+
         // shift the entire K-cache if needed
         if (do_rope_shift) {
             llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE, n_ctx, n_embd_head, freq_base, freq_scale, cb);
@@ -4428,12 +6354,12 @@ struct llm_build_context {
                 cb(Qcur, "Qcur", il);
                 cb(Kcur, "Kcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_slots, cb, il);
 
                 // apply ALiBi for 13B model
                 const float max_alibi_bias = model.type == MODEL_13B ? 8.0f : -1.0f;
 
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, NULL,
                         Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, max_alibi_bias, cb, il);
                 cb(cur, "kqv_out", il);
@@ -4501,6 +6427,10 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_slots - cells of the KV cache the tokens are stored in
+        struct ggml_tensor * KV_slots = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_slots, "KV_slots", -1);
+
         // shift the entire K-cache if needed
         if (do_rope_shift) {
             llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE_NEOX, n_ctx, n_embd_head, freq_base, freq_scale, cb);
@@ -4555,9 +6485,9 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_slots, cb, il);
 
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, NULL,
                         Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
                 cb(cur, "kqv_out", il);
@@ -4624,6 +6554,10 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_slots - cells of the KV cache the tokens are stored in
+        struct ggml_tensor * KV_slots = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_slots, "KV_slots", -1);
+
         pos = ggml_get_rows(ctx0, model.pos_embd, inp_pos);
         cb(pos, "pos_embd", -1);
 
@@ -4655,9 +6589,9 @@ struct llm_build_context {
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_slots, cb, il);
 
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, model.layers[il].bo,
                         Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
                 cb(cur, "kqv_out", il);
@@ -4724,6 +6658,10 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_slots - cells of the KV cache the tokens are stored in
+        struct ggml_tensor * KV_slots = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_slots, "KV_slots", -1);
+
         if (do_rope_shift) {
             llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE_NEOX, n_ctx, n_embd_head, freq_base, freq_scale, cb);
         }
@@ -4863,10 +6801,10 @@ struct llm_build_context {
                         );
                 cb(Vcur, "Vcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_slots, cb, il);
 
                 // TODO: not tested, could be broken
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, model.layers[il].bo,
                         Q, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
                 cb(cur, "kqv_out", il);
@@ -4930,6 +6868,10 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_slots - cells of the KV cache the tokens are stored in
+        struct ggml_tensor * KV_slots = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_slots, "KV_slots", -1);
+
         for (int il = 0; il < n_layer; ++il) {
             struct ggml_tensor * inpSA = inpL;
 
@@ -4955,9 +6897,9 @@ struct llm_build_context {
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens);
                 cb(Qcur, "Qcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_slots, cb, il);
 
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, NULL,
                         Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, 8.0f, cb, il);
                 cb(cur, "kqv_out", il);
@@ -5021,6 +6963,10 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_slots - cells of the KV cache the tokens are stored in
+        struct ggml_tensor * KV_slots = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_slots, "KV_slots", -1);
+
         inpL = llm_build_norm(ctx0, inpL, hparams,
                 model.tok_norm,
                 model.tok_norm_b,
@@ -5052,9 +6998,9 @@ struct llm_build_context {
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_slots, cb, il);
 
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, model.layers[il].bo,
                         Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, 8.0f, cb, il);
                 cb(cur, "kqv_out", il);
@@ -5115,6 +7061,10 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_slots - cells of the KV cache the tokens are stored in
+        struct ggml_tensor * KV_slots = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_slots, "KV_slots", -1);
+
         for (int il = 0; il < n_layer; ++il) {
             struct ggml_tensor * attn_norm;
 
@@ -5146,9 +7096,9 @@ struct llm_build_context {
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_slots, cb, il);
 
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, NULL,
                         Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, hparams.f_max_alibi_bias, cb, il);
                 cb(cur, "kqv_out", il);
@@ -5218,6 +7168,10 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_slots - cells of the KV cache the tokens are stored in
+        struct ggml_tensor * KV_slots = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_slots, "KV_slots", -1);
+
         // shift the entire K-cache if needed
         if (do_rope_shift) {
             llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE_NEOX, n_ctx, hparams.n_rot, freq_base, freq_scale, cb);
@@ -5259,9 +7213,9 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_slots, cb, il);
 
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, NULL,
                         Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
                 cb(cur, "kqv_out", il);
@@ -5331,6 +7285,10 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask= ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_slots - cells of the KV cache the tokens are stored in
+        struct ggml_tensor * KV_slots = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_slots, "KV_slots", -1);
+
         // shift the entire K-cache if needed
         if (do_rope_shift) {
             llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE_NEOX, n_ctx, n_embd_head, freq_base, freq_scale, cb);
@@ -5376,9 +7334,9 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_slots, cb, il);
 
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, NULL,
                         Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
                 cb(cur, "kqv_out", il);
@@ -5611,137 +7569,157 @@ static const std::unordered_map<const char *, llm_offload_func_e> k_offload_map
 
 static llm_offload_trie k_offload_func_trie(k_offload_map);
 
-static struct ggml_cgraph * llama_build_graph(
-         llama_context & lctx,
-     const llama_batch & batch) {
-    const auto & model = lctx.model;
+// set the data of the input tensors of a graph built by llama_build_graph()
+static void llama_set_inputs(
+               llama_context & lctx,
+           const llama_batch & batch,
+    const llama_graph_inputs & inp) {
+    const auto & hparams = lctx.model.hparams;
+    const auto & kv_self = lctx.kv_self;
 
-    // check if we should build the worst-case graph (for memory measurement)
-    const bool worst_case = ggml_allocr_is_measure(lctx.alloc);
+    if (inp.tokens && batch.token) {
+        const int64_t n_tokens = inp.tokens->ne[0];
 
-    // keep track of the input that has already been allocated
-    bool alloc_inp_tokens   = false;
-    bool alloc_inp_embd     = false;
-    bool alloc_inp_pos      = false;
-    bool alloc_inp_KQ_scale = false;
-    bool alloc_inp_KQ_mask  = false;
-    bool alloc_inp_K_shift  = false;
+        memcpy(inp.tokens->data, batch.token, n_tokens*ggml_element_size(inp.tokens));
+    }
 
-#ifdef GGML_USE_CUBLAS
-    const bool do_offload = true;
-#else
-    const bool do_offload = true; // TODO: set to false after finishing refactoring
-#endif
+    if (inp.embd && batch.embd) {
+        const int64_t n_embd   = inp.embd->ne[0];
+        const int64_t n_tokens = inp.embd->ne[1];
 
-    int n_non_view = 0; // number of non-view tensors that have been processed by the callback
+        memcpy(inp.embd->data, batch.embd, n_tokens*n_embd*ggml_element_size(inp.embd));
+    }
 
-    // this callback allows us to apply custom logic to each tensor (e.g. ggml-alloc, offloading, etc.)
-    // TODO: will be removed with backend v2
-    llm_build_cb cb = [&](struct ggml_tensor * cur, const char * name, int il) {
-        if (il >= 0) {
-            ggml_format_name(cur, "%s-%d", name, il);
-        } else {
-            ggml_set_name(cur, name);
-        }
+    if (inp.pos && batch.pos) {
+        const int64_t n_tokens = inp.pos->ne[0];
 
-        //
-        // allocate input tensors and set input data
-        //
-        // TODO: will be removed with backend v2
+        int32_t * data = (int32_t *) inp.pos->data;
 
-        if (!alloc_inp_tokens && strcmp(name, "inp_tokens") == 0) {
-            ggml_allocr_alloc(lctx.alloc, cur);
+        for (int i = 0; i < n_tokens; ++i) {
+            data[i] = batch.pos[i];
+        }
+    }
 
-            if (!ggml_allocr_is_measure(lctx.alloc) && batch.token) {
-                const int64_t n_tokens = cur->ne[0];
+    if (inp.KQ_scale) {
+        const int64_t n_embd_head = hparams.n_embd_head();
+        ggml_set_f32(inp.KQ_scale, 1.0f/sqrtf(float(n_embd_head)));
+    }
 
-                memcpy(cur->data, batch.token, n_tokens*ggml_element_size(cur));
-            }
+    if (inp.KQ_mask) {
+        const int64_t n_kv     = inp.KQ_mask->ne[0];
+        const int64_t n_tokens = inp.KQ_mask->ne[1];
 
-            alloc_inp_tokens = true;
-        }
+        float * data = (float *) inp.KQ_mask->data;
 
-        if (!alloc_inp_embd && strcmp(name, "inp_embd") == 0) {
-            ggml_allocr_alloc(lctx.alloc, cur);
+        std::fill(data, data + n_kv*n_tokens, -INFINITY);
 
-            if (!ggml_allocr_is_measure(lctx.alloc) && batch.embd) {
-                const int64_t n_embd   = cur->ne[0];
-                const int64_t n_tokens = cur->ne[1];
+        // only the blocks of the sequence of each token can be attended to
+        for (int j = 0; j < n_tokens; ++j) {
+            const llama_pos    pos    = batch.pos[j];
+            const llama_seq_id seq_id = batch.seq_id[j][0];
 
-                memcpy(cur->data, batch.embd, n_tokens*n_embd*ggml_element_size(cur));
+            const auto it = kv_self.seqs.find(seq_id);
+            if (it == kv_self.seqs.end()) {
+                continue;
             }
 
-            alloc_inp_embd = true;
+            for (const uint32_t ib : it->second.blocks) {
+                const int64_t i0 = ib*LLAMA_KV_BLOCK_SIZE;
+                const int64_t i1 = std::min(i0 + LLAMA_KV_BLOCK_SIZE, n_kv);
+
+                for (int64_t i = i0; i < i1; ++i) {
+                    if (kv_self.cells[i].pos <= pos && kv_self.cells[i].has_seq_id(seq_id)) {
+                        data[j*n_kv + i] = 0.0f;
+                    }
+                }
+            }
         }
+    }
 
-        if (!alloc_inp_pos && strcmp(name, "inp_pos") == 0) {
-            ggml_allocr_alloc(lctx.alloc, cur);
+    if (inp.K_shift) {
+        const int64_t n_ctx = inp.K_shift->ne[0];
 
-            if (!ggml_allocr_is_measure(lctx.alloc) && batch.pos) {
-                const int64_t n_tokens = cur->ne[0];
+        int32_t * data = (int32_t *) inp.K_shift->data;
 
-                int32_t * data = (int32_t *) cur->data;
+        for (int i = 0; i < n_ctx; ++i) {
+            data[i] = kv_self.cells[i].delta;
+        }
+    }
 
-                for (int i = 0; i < n_tokens; ++i) {
-                    data[i] = batch.pos[i];
-                }
-            }
+    if (inp.KV_slots) {
+        const int64_t n_tokens = inp.KV_slots->ne[0];
 
-            alloc_inp_pos = true;
-        }
+        memcpy(inp.KV_slots->data, kv_self.slots.data(), n_tokens*ggml_element_size(inp.KV_slots));
+    }
+}
 
-        if (!alloc_inp_KQ_scale && strcmp(name, "KQ_scale") == 0) {
-            ggml_allocr_alloc(lctx.alloc, cur);
+static struct ggml_cgraph * llama_build_graph(
+         llama_context & lctx,
+     const llama_batch & batch,
+    llama_graph_inputs & inp) {
+    const auto & model = lctx.model;
 
-            if (!ggml_allocr_is_measure(lctx.alloc)) {
-                const int64_t n_embd_head = model.hparams.n_embd_head();
-                ggml_set_f32(cur, 1.0f/sqrtf(float(n_embd_head)));
-            }
+    // check if we should build the worst-case graph (for memory measurement)
+    const bool worst_case = ggml_allocr_is_measure(lctx.alloc);
 
-            alloc_inp_KQ_scale = true;
-        }
+    // keep track of the input that has already been allocated
+    inp = {};
 
-        if (!alloc_inp_KQ_mask && strcmp(name, "KQ_mask") == 0) {
-            ggml_allocr_alloc(lctx.alloc, cur);
+#ifdef GGML_USE_CUBLAS
+    const bool do_offload = true;
+#else
+    const bool do_offload = true; // TODO: set to false after finishing refactoring
+#endif
 
-            if (!ggml_allocr_is_measure(lctx.alloc)) {
-                const int64_t n_kv     = cur->ne[0];
-                const int64_t n_tokens = cur->ne[1];
+    int n_non_view = 0; // number of non-view tensors that have been processed by the callback
 
-                float * data = (float *) cur->data;
-                memset(data, 0, ggml_nbytes(cur));
+    // this callback allows us to apply custom logic to each tensor (e.g. ggml-alloc, offloading, etc.)
+    // TODO: will be removed with backend v2
+    llm_build_cb cb = [&](struct ggml_tensor * cur, const char * name, int il) {
+        if (il >= 0) {
+            ggml_format_name(cur, "%s-%d", name, il);
+        } else {
+            ggml_set_name(cur, name);
+        }
 
-                for (int h = 0; h < 1; ++h) {
-                    for (int j = 0; j < n_tokens; ++j) {
-                        const llama_pos    pos    = batch.pos[j];
-                        const llama_seq_id seq_id = batch.seq_id[j][0];
+        //
+        // allocate input tensors, their data is set by llama_set_inputs()
+        //
+        // TODO: will be removed with backend v2
 
-                        for (int i = 0; i < n_kv; ++i) {
-                            if (!lctx.kv_self.cells[i].has_seq_id(seq_id) || lctx.kv_self.cells[i].pos > pos) {
-                                data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                            }
-                        }
-                    }
-                }
-            }
+        if (!inp.tokens && strcmp(name, "inp_tokens") == 0) {
+            ggml_allocr_alloc(lctx.alloc, cur);
+            inp.tokens = cur;
+        }
 
-            alloc_inp_KQ_mask = true;
+        if (!inp.embd && strcmp(name, "inp_embd") == 0) {
+            ggml_allocr_alloc(lctx.alloc, cur);
+            inp.embd = cur;
         }
 
-        if (!alloc_inp_K_shift && strcmp(name, "K_shift") == 0) {
+        if (!inp.pos && strcmp(name, "inp_pos") == 0) {
             ggml_allocr_alloc(lctx.alloc, cur);
+            inp.pos = cur;
+        }
 
-            if (!ggml_allocr_is_measure(lctx.alloc)) {
-                const int64_t n_ctx = cur->ne[0];
+        if (!inp.KQ_scale && strcmp(name, "KQ_scale") == 0) {
+            ggml_allocr_alloc(lctx.alloc, cur);
+            inp.KQ_scale = cur;
+        }
 
-                int32_t * data = (int32_t *) cur->data;
+        if (!inp.KQ_mask && strcmp(name, "KQ_mask") == 0) {
+            ggml_allocr_alloc(lctx.alloc, cur);
+            inp.KQ_mask = cur;
+        }
 
-                for (int i = 0; i < n_ctx; ++i) {
-                    data[i] = lctx.kv_self.cells[i].delta;
-                }
-            }
+        if (!inp.K_shift && strcmp(name, "K_shift") == 0) {
+            ggml_allocr_alloc(lctx.alloc, cur);
+            inp.K_shift = cur;
+        }
 
-            alloc_inp_K_shift = true;
+        if (!inp.KV_slots && strcmp(name, "KV_slots") == 0) {
+            ggml_allocr_alloc(lctx.alloc, cur);
+            inp.KV_slots = cur;
         }
 
         // view tensors are not processed further
@@ -5952,6 +7930,77 @@ static struct ggml_cgraph * llama_build_graph(
     return result;
 }
 
+//
+// graph cache
+//
+
+static bool llama_graph_cache_usable(const llama_context & lctx) {
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_METAL) || defined(GGML_USE_MPI)
+    // the backends keep their own per-graph state (scratch offsets, command buffers)
+    GGML_UNUSED(lctx);
+    return false;
+#else
+    // the K-shift graph is only built once, it is not worth keeping
+    // the graph must not depend on where the batch is stored in the KV cache
+    return lctx.cparams.graph_cache && !lctx.kv_self.has_shift && lctx.kv_self.paged;
+#endif
+}
+
+static llama_graph_cache_entry * llama_graph_cache_get(llama_context & lctx, const llama_batch & batch) {
+    const auto & kv_self = lctx.kv_self;
+
+    for (auto & entry : lctx.graph_cache) {
+        if (entry.t_used == 0) {
+            continue;
+        }
+
+        if (entry.n_tokens == batch.n_tokens && entry.n_kv == kv_self.n && entry.embd == (batch.embd != nullptr)) {
+            entry.t_used = ++lctx.graph_cache_clock;
+
+            return &entry;
+        }
+    }
+
+    return nullptr;
+}
+
+// take ownership of a graph that was just built and allocated, evicting the least recently used one
+static llama_graph_cache_entry * llama_graph_cache_put(
+         llama_context & lctx,
+     const llama_batch & batch,
+           ggml_cgraph * gf,
+    const llama_graph_inputs & inp) {
+    const auto & kv_self = lctx.kv_self;
+
+    llama_graph_cache_entry * entry = &lctx.graph_cache[0];
+    for (auto & e : lctx.graph_cache) {
+        if (e.t_used < entry->t_used) {
+            entry = &e;
+        }
+    }
+
+    // the graph lives in buf_compute - hand the buffer of the evicted entry over to the next graph
+    std::swap(entry->buf.data,      lctx.buf_compute.data);
+    std::swap(entry->buf.size,      lctx.buf_compute.size);
+    std::swap(entry->buf.fallback,  lctx.buf_compute.fallback);
+    std::swap(entry->buf.huge,      lctx.buf_compute.huge);
+    std::swap(entry->buf.huge_size, lctx.buf_compute.huge_size);
+
+    if (lctx.buf_compute.data == nullptr) {
+        lctx.buf_compute.resize(entry->buf.size);
+    }
+
+    entry->n_tokens = batch.n_tokens;
+    entry->n_kv     = kv_self.n;
+    entry->embd     = batch.embd != nullptr;
+    entry->gf       = gf;
+    entry->inp      = inp;
+    entry->plan     = {};
+    entry->t_used   = ++lctx.graph_cache_clock;
+
+    return entry;
+}
+
 // decode a batch of tokens by evaluating the transformer
 //
 //   - lctx:      llama context
@@ -6041,19 +8090,39 @@ static int llama_decode_internal(
         return 1;
     }
 
-    // a heuristic, to avoid attending the full cache if it is not yet utilized
-    // after enough generations, the benefit from this heuristic disappears
-    // if we start defragmenting the cache, the benefit from this will be more important
-    kv_self.n = std::min((int32_t) cparams.n_ctx, std::max(32, GGML_PAD(llama_kv_cache_cell_max(kv_self), 32)));
+    // attend only up to the last block of the sequences in the batch
+    // the K-shift is applied to all cells, so then the whole used part of the cache is needed
+    const int32_t n_cells = kv_self.has_shift ? llama_kv_cache_cell_max(kv_self) : llama_kv_cache_cell_max(kv_self, batch);
+
+    kv_self.n = std::min((int32_t) cparams.n_ctx, std::max(32, GGML_PAD(n_cells, 32)));
     //kv_self.n = llama_kv_cache_cell_max(kv_self);
 
     //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
 
-    ggml_allocr_reset(lctx.alloc);
+    // reuse the graph of a previous batch of the same shape, or build a new one
+    const bool use_graph_cache = llama_graph_cache_usable(lctx);
 
-    ggml_cgraph * gf = llama_build_graph(lctx, batch);
+    llama_graph_cache_entry * cached = use_graph_cache ? llama_graph_cache_get(lctx, batch) : nullptr;
 
-    ggml_allocr_alloc_graph(lctx.alloc, gf);
+    ggml_cgraph * gf;
+    llama_graph_inputs inp;
+
+    if (cached) {
+        gf  = cached->gf;
+        inp = cached->inp;
+    } else {
+        ggml_allocr_reset(lctx.alloc);
+
+        gf = llama_build_graph(lctx, batch, inp);
+
+        ggml_allocr_alloc_graph(lctx.alloc, gf);
+
+        if (use_graph_cache) {
+            cached = llama_graph_cache_put(lctx, batch, gf, inp);
+        }
+    }
+
+    llama_set_inputs(lctx, batch, inp);
 
     struct ggml_tensor * res        = gf->nodes[gf->n_nodes - 1];
     struct ggml_tensor * embeddings = gf->nodes[gf->n_nodes - 2];
@@ -6101,6 +8170,9 @@ static int llama_decode_internal(
         n_threads = 1;
     }
 
+    // the fused norm does not store its F32 result, and the embeddings are read from result_norm
+    const bool fuse_ops = cparams.fuse_ops && lctx.embedding.empty();
+
 #if GGML_USE_MPI
     const int64_t n_layer = hparams.n_layer;
     ggml_mpi_graph_compute_pre(lctx.ctx_mpi, gf, n_layer);
@@ -6111,10 +8183,25 @@ static int llama_decode_internal(
         ggml_metal_set_n_cb     (lctx.ctx_metal, n_threads);
         ggml_metal_graph_compute(lctx.ctx_metal, gf);
     } else {
-        ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads);
+        ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads, lctx.threadpool, cparams.wait_policy, fuse_ops);
     }
 #else
-    ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads);
+    {
+        struct ggml_cplan plan;
+        if (cached && cached->plan.n_threads == n_threads) {
+            plan = cached->plan;
+        } else {
+            plan = ggml_graph_plan(gf, n_threads);
+            if (cached) {
+                cached->plan = plan;
+            }
+        }
+        plan.threadpool  = lctx.threadpool;
+        plan.wait_policy = cparams.wait_policy;
+        plan.fuse_ops    = fuse_ops;
+
+        ggml_graph_compute_helper(lctx.work_buffer, gf, plan);
+    }
 #endif
 
 #if GGML_USE_MPI
@@ -6126,6 +8213,10 @@ static int llama_decode_internal(
         if (kv_self.has_shift) {
             kv_self.has_shift = false;
             for (uint32_t i = 0; i < kv_self.size; ++i) {
+                // K was rotated
+                if (kv_self.cells[i].delta != 0) {
+                    kv_self.cells[i].saved = false;
+                }
                 kv_self.cells[i].delta = 0;
             }
         }
@@ -6285,12 +8376,152 @@ static void llama_unescape_whitespace(std::string & word) {
     replace_all(word, "\xe2\x96\x81", " ");
 }
 
+static uint32_t llama_vocab_trie_build(
+        llama_vocab & vocab,
+        const std::vector<std::pair<const std::string *, llama_vocab::id>> & words,
+        size_t begin, size_t end, size_t depth) {
+    const uint32_t node = vocab.trie.size();
+    vocab.trie.push_back({ 0, 0, -1 });
+
+    // the words are sorted, so the one ending at this node comes first
+    if (begin < end && words[begin].first->size() == depth) {
+        vocab.trie[node].token = words[begin].second;
+        begin++;
+    }
+
+    uint32_t n_edges = 0;
+    for (size_t i = begin; i < end; i++) {
+        if (i == begin || (*words[i].first)[depth] != (*words[i - 1].first)[depth]) {
+            n_edges++;
+        }
+    }
+
+    const uint32_t edges_offs = vocab.trie_edges.size();
+    vocab.trie_edges.resize(edges_offs + n_edges);
+    vocab.trie[node].edges_offs = edges_offs;
+    vocab.trie[node].n_edges    = n_edges;
+
+    for (uint32_t e = 0; begin < end; e++) {
+        const uint8_t byte = (*words[begin].first)[depth];
+
+        size_t group_end = begin + 1;
+        while (group_end < end && (uint8_t) (*words[group_end].first)[depth] == byte) {
+            group_end++;
+        }
+
+        const uint32_t child = llama_vocab_trie_build(vocab, words, begin, group_end, depth + 1);
+        vocab.trie_edges[edges_offs + e] = { byte, child };
+
+        begin = group_end;
+    }
+
+    return node;
+}
+
+static void llama_vocab_init_trie(llama_vocab & vocab) {
+    std::vector<std::pair<const std::string *, llama_vocab::id>> words;
+    words.reserve(vocab.token_to_id.size());
+    for (const auto & it : vocab.token_to_id) {
+        words.emplace_back(&it.first, it.second);
+    }
+    std::sort(words.begin(), words.end(), [](const std::pair<const std::string *, llama_vocab::id> & a, const std::pair<const std::string *, llama_vocab::id> & b) {
+        return *a.first < *b.first;
+    });
+
+    vocab.trie.clear();
+    vocab.trie_edges.clear();
+    llama_vocab_trie_build(vocab, words, 0, words.size(), 0);
+
+    vocab.bpe_ranks_id.clear();
+    for (const auto & it : vocab.bpe_ranks) {
+        const auto left  = vocab.token_to_id.find(it.first.first);
+        const auto right = vocab.token_to_id.find(it.first.second);
+        if (left != vocab.token_to_id.end() && right != vocab.token_to_id.end()) {
+            vocab.bpe_ranks_id[(uint64_t) left->second << 32 | (uint32_t) right->second] = it.second;
+        }
+    }
+
+    // a chunk boundary is placed before a "▁" that follows another character, which no merge can cross
+    // unless a token has a "▁" after something else than "▁"
+    static const char * space = "\xe2\x96\x81";
+
+    vocab.spm_chunkable = true;
+    for (const auto & it : vocab.token_to_id) {
+        const std::string & text = it.first;
+        for (size_t pos = text.find(space, 1); pos != std::string::npos; pos = text.find(space, pos + 1)) {
+            if (pos < 3 || text.compare(pos - 3, 3, space) != 0) {
+                vocab.spm_chunkable = false;
+            }
+        }
+    }
+}
+
+// token with the given text, -1 if there is none
+static llama_vocab::id llama_vocab_find(const llama_vocab & vocab, const char * text, size_t n) {
+    uint32_t node = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        const auto & nd = vocab.trie[node];
+
+        const llama_vocab::trie_edge * first = vocab.trie_edges.data() + nd.edges_offs;
+        const llama_vocab::trie_edge * last  = first + nd.n_edges;
+
+        const uint8_t byte = text[i];
+        const llama_vocab::trie_edge * edge = std::lower_bound(first, last, byte, [](const llama_vocab::trie_edge & e, uint8_t b) {
+            return e.byte < b;
+        });
+
+        if (edge == last || edge->byte != byte) {
+            return -1;
+        }
+
+        node = edge->node;
+    }
+
+    return vocab.trie[node].token;
+}
+
+// first position at or after offs where a "▁" follows another character, walking the symbols of
+// llm_tokenizer_spm from the boundary begin so that the cut falls between two of them
+static size_t llama_tokenize_split_spm(const std::string & text, size_t begin, size_t offs) {
+    static const char * space = "\xe2\x96\x81";
+
+    bool prev_space = true;
+    for (size_t i = begin; i < text.size(); ) {
+        const bool is_space = text.compare(i, 3, space) == 0;
+        if (i >= offs && is_space && !prev_space) {
+            return i;
+        }
+        prev_space = is_space;
+        i += std::min(utf8_len(text[i]), text.size() - i);
+    }
+
+    return text.size();
+}
+
+// first position at or after offs of a space between ascii letters, "ab c", where bpe_gpt2_preprocess
+// ends a word and starts the next one the same way as at the start and the end of a text
+static size_t llama_tokenize_split_bpe(const std::string & text, size_t begin, size_t offs) {
+    auto is_letter = [](char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    };
+
+    for (size_t i = std::max(offs, begin + 2); i + 1 < text.size(); i++) {
+        if (text[i] == ' ' && is_letter(text[i - 2]) && is_letter(text[i - 1]) && is_letter(text[i + 1])) {
+            return i;
+        }
+    }
+
+    return text.size();
+}
+
 struct llm_symbol {
     using index = int;
     index prev;
     index next;
     const char * text;
     size_t n;
+    llama_vocab::id id; // token with the text of the symbol, -1 if none
 };
 
 static_assert(std::is_trivially_copyable<llm_symbol>::value, "llm_symbol is not trivially copyable");
@@ -6310,6 +8541,7 @@ struct llm_bigram_spm {
     llm_symbol::index left;
     llm_symbol::index right;
     float score;
+    llama_vocab::id id;
     size_t size;
 };
 
@@ -6317,17 +8549,35 @@ struct llm_tokenizer_spm {
     llm_tokenizer_spm(const llama_vocab & vocab): vocab(vocab) {}
 
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
+        if (!vocab.spm_chunkable) {
+            tokenize_words(text.c_str(), text.size(), output);
+            return;
+        }
+
+        // no merge crosses the start of a word, so the words are merged one at a time with a small work queue
+        for (size_t begin = 0; begin < text.size(); ) {
+            const size_t end = llama_tokenize_split_spm(text, begin, begin + 1);
+            tokenize_words(text.c_str() + begin, end - begin, output);
+            begin = end;
+        }
+    }
+
+private:
+    void tokenize_words(const char * text, size_t size, std::vector<llama_vocab::id> & output) {
+        symbols.clear();
+
         // split string into utf8 chars
         int index = 0;
         size_t offs = 0;
-        while (offs < text.size()) {
+        while (offs < size) {
             llm_symbol sym;
             size_t len = utf8_len(text[offs]);
-            sym.text = text.c_str() + offs;
-            sym.n = std::min(len, text.size() - offs);
+            sym.text = text + offs;
+            sym.n = std::min(len, size - offs);
+            sym.id = llama_vocab_find(vocab, sym.text, sym.n);
             offs += sym.n;
             sym.prev = index - 1;
-            sym.next = offs == text.size() ? -1 : index + 1;
+            sym.next = offs == size ? -1 : index + 1;
             index++;
             symbols.emplace_back(sym);
         }
@@ -6353,6 +8603,7 @@ struct llm_tokenizer_spm {
 
             // merge the right sym into the left one
             left_sym.n += right_sym.n;
+            left_sym.id = bigram.id;
             right_sym.n = 0;
 
             //LLAMA_LOG_INFO("left = '%*s' size = %zu\n", (int) left_sym.n, left_sym.text, bigram.size);
@@ -6374,30 +8625,19 @@ struct llm_tokenizer_spm {
         }
     }
 
-private:
     void resegment(llm_symbol & symbol, std::vector<llama_vocab::id> & output) {
-        auto text = std::string(symbol.text, symbol.n);
-        auto token = vocab.token_to_id.find(text);
-
         // Do we need to support is_unused?
-        if (token != vocab.token_to_id.end()) {
-            output.push_back((*token).second);
+        if (symbol.id >= 0) {
+            output.push_back(symbol.id);
             return;
         }
 
-        const auto p = rev_merge.find(text);
-
-        if (p == rev_merge.end()) {
-            // output any symbols that did not form tokens as bytes.
-            for (int j = 0; j < (int)symbol.n; ++j) {
-                llama_vocab::id token_id = llama_byte_to_token(vocab, symbol.text[j]);
-                output.push_back(token_id);
-            }
-            return;
+        // merged symbols are always tokens, so this is a single character missing from the vocab
+        // output any symbols that did not form tokens as bytes.
+        for (int j = 0; j < (int)symbol.n; ++j) {
+            llama_vocab::id token_id = llama_byte_to_token(vocab, symbol.text[j]);
+            output.push_back(token_id);
         }
-
-        resegment(symbols[p->second.first],  output);
-        resegment(symbols[p->second.second], output);
     }
 
     void try_add_bigram(int left, int right) {
@@ -6405,37 +8645,30 @@ private:
             return;
         }
 
-        const std::string text = std::string(symbols[left].text, symbols[left].n + symbols[right].n);
-        auto token = vocab.token_to_id.find(text);
-
-        if (token == vocab.token_to_id.end()) {
-            return;
-        }
+        // the symbols are adjacent in the text
+        const size_t size = symbols[left].n + symbols[right].n;
+        const llama_vocab::id id = llama_vocab_find(vocab, symbols[left].text, size);
 
-        if (static_cast<size_t>((*token).second) >= vocab.id_to_token.size()) {
+        if (id < 0) {
             return;
         }
 
-        const auto & tok_data = vocab.id_to_token[(*token).second];
+        const auto & tok_data = vocab.id_to_token[id];
 
         llm_bigram_spm bigram;
         bigram.left  = left;
         bigram.right = right;
         bigram.score = tok_data.score;
-        bigram.size  = text.size();
+        bigram.size  = size;
+        bigram.id    = id;
 
         work_queue.push(bigram);
-
-        // Do we need to support is_unused?
-        rev_merge[text] = std::make_pair(left, right);
     }
 
     const llama_vocab & vocab;
 
     std::vector<llm_symbol> symbols;
     llm_bigram_spm::queue work_queue;
-
-    std::map<std::string, std::pair<int, int>> rev_merge;
 };
 
 // BPE tokenizer
@@ -6455,7 +8688,6 @@ struct llm_bigram_bpe {
     using queue = std::priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
     int rank;
     size_t size;
 };
@@ -6470,7 +8702,6 @@ struct llm_tokenizer_bpe {
         symbols_final.clear();
 
         for (auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
             symbols.clear();
 
             int index = 0;
@@ -6481,6 +8712,7 @@ struct llm_tokenizer_bpe {
                 size_t char_len = std::min(word.size() - offset, (size_t) ::utf8_len(word[offset]));
                 sym.text = word.c_str() + offset;
                 sym.n = char_len;
+                sym.id = llama_vocab_find(vocab, sym.text, sym.n);
                 offset += sym.n;
                 sym.prev = index - 1;
                 sym.next = offset == word.size() ? -1 : index + 1;
@@ -6502,14 +8734,13 @@ struct llm_tokenizer_bpe {
                 if (left_symbol.n == 0 || right_symbol.n == 0) {
                     continue;
                 }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
+                if (left_symbol.n + right_symbol.n != bigram.size) {
                     continue;  // Skip this bigram if it's outdated
                 }
 
                 // merge the right sym into the left one
                 left_symbol.n += right_symbol.n;
+                left_symbol.id = llama_vocab_find(vocab, left_symbol.text, left_symbol.n);
                 right_symbol.n = 0;
 
                 // remove the right sym from the chain
@@ -6545,20 +8776,16 @@ struct llm_tokenizer_bpe {
                     continue;
                 }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
-
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.token_to_id.find(byte_str);
-                        if (token_multibyte == vocab.token_to_id.end()) {
+                if (symbol.id < 0) {
+                    for (size_t j = 0; j < symbol.n; ++j) {
+                        const llama_vocab::id token_multibyte = llama_vocab_find(vocab, symbol.text + j, 1);
+                        if (token_multibyte < 0) {
                             throw std::runtime_error("ERROR: byte not found in vocab");
                         }
-                        output.push_back((*token_multibyte).second);
+                        output.push_back(token_multibyte);
                     }
                 } else {
-                    output.push_back((*token).second);
+                    output.push_back(symbol.id);
                 }
             }
         }
@@ -6570,12 +8797,19 @@ private:
             return;
         }
 
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
+        const llm_symbol & left_symbol  = symbols[left];
+        const llm_symbol & right_symbol = symbols[right];
 
         int rank_found = -1;
 
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
+        if (left_symbol.id >= 0 && right_symbol.id >= 0) {
+            const auto it = vocab.bpe_ranks_id.find((uint64_t) left_symbol.id << 32 | (uint32_t) right_symbol.id);
+            if (it != vocab.bpe_ranks_id.end()) {
+                rank_found = it->second;
+            }
+        } else {
+            rank_found = vocab.find_bpe_rank(std::string(left_symbol.text, left_symbol.n), std::string(right_symbol.text, right_symbol.n));
+        }
 
         if (rank_found < 0) {
             return;
@@ -6585,8 +8819,7 @@ private:
 
         bigram.left  = left;
         bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
+        bigram.size  = left_symbol.n + right_symbol.n;
         bigram.rank  = rank_found;
 
         work_queue.push(bigram);
@@ -6604,34 +8837,51 @@ private:
         bool collecting_whitespace_lookahead = false;
         bool collecting = false;
 
-        std::vector<std::string> text_utf;
+        const auto cps = codepoints_from_utf8(text);
+        const int n_cps = cps.size();
+
+        // the utf8 of the code points back to back and their types, with an unidentified one past the end
+        std::string text_utf;
+        std::vector<size_t> utf_offs(n_cps + 1);
+        std::vector<int> types(n_cps + 1, CODEPOINT_TYPE_UNIDENTIFIED);
         text_utf.reserve(text.size());
         bpe_words.reserve(text.size());
         bpe_encoded_words.reserve(text.size());
 
-        auto cps = codepoints_from_utf8(text);
-        for (size_t i = 0; i < cps.size(); ++i)
-            text_utf.emplace_back(codepoint_to_utf8(cps[i]));
+        for (int i = 0; i < n_cps; ++i) {
+            utf_offs[i] = text_utf.size();
+            text_utf += codepoint_to_utf8(cps[i]);
+            types[i] = codepoint_type(cps[i]);
+        }
+        utf_offs[n_cps] = text_utf.size();
+
+        // the utf8 of code points [i, i + n)
+        auto utf_chars = [&](int i, int n) {
+            return text_utf.substr(utf_offs[i], utf_offs[i + n] - utf_offs[i]);
+        };
 
-        for (int i = 0; i < (int)text_utf.size(); i++) {
-            const std::string & utf_char = text_utf[i];
+        for (int i = 0; i < n_cps; i++) {
+            const uint32_t cp = cps[i];
             bool split_condition = false;
-            int bytes_remain = text_utf.size() - i;
+            int bytes_remain = n_cps - i;
             // forward backward lookups
-            const std::string & utf_char_next = (i + 1 < (int)text_utf.size()) ? text_utf[i + 1] : "";
-            const std::string & utf_char_next_next = (i + 2 < (int)text_utf.size()) ? text_utf[i + 2] : "";
+            const uint32_t cp_next      = i + 1 < n_cps ? cps[i + 1] : 0;
+            const uint32_t cp_next_next = i + 2 < n_cps ? cps[i + 2] : 0;
+            const bool     has_next     = i + 1 < n_cps;
+            const int      type         = types[i];
+            const int      type_next    = types[i + 1];
 
             // handling contractions
             if (!split_condition && bytes_remain >= 2) {
                 // 's|'t|'m|'d
-                if (utf_char == "\'" && (utf_char_next == "s" || utf_char_next == "t" || utf_char_next == "m" || utf_char_next == "d")) {
+                if (cp == '\'' && (cp_next == 's' || cp_next == 't' || cp_next == 'm' || cp_next == 'd')) {
                     split_condition = true;
                 }
                 if (split_condition) {
                     if (token.size()) {
                         bpe_words.emplace_back(token); // push previous content as token
                     }
-                    token = utf_char + utf_char_next;
+                    token = utf_chars(i, 2);
                     bpe_words.emplace_back(token);
                     token = "";
                     i++;
@@ -6640,10 +8890,10 @@ private:
             }
             if (!split_condition && bytes_remain >= 3) {
                 // 're|'ve|'ll
-                if (utf_char == "\'" && (
-                    (utf_char_next == "r" && utf_char_next_next == "e") ||
-                    (utf_char_next == "v" && utf_char_next_next == "e") ||
-                    (utf_char_next == "l" && utf_char_next_next == "l"))
+                if (cp == '\'' && (
+                    (cp_next == 'r' && cp_next_next == 'e') ||
+                    (cp_next == 'v' && cp_next_next == 'e') ||
+                    (cp_next == 'l' && cp_next_next == 'l'))
                     ) {
                     split_condition = true;
                 }
@@ -6652,7 +8902,7 @@ private:
                     if (token.size()) {
                         bpe_words.emplace_back(token); // push previous content as token
                     }
-                    token = utf_char + utf_char_next + utf_char_next_next;
+                    token = utf_chars(i, 3);
                     bpe_words.emplace_back(token); // the contraction
                     token = "";
                     i += 2;
@@ -6661,54 +8911,54 @@ private:
             }
 
             if (!split_condition && !collecting) {
-                if (codepoint_type(utf_char) == CODEPOINT_TYPE_LETTER || (!token.size() && utf_char == " " && codepoint_type(utf_char_next) == CODEPOINT_TYPE_LETTER)) {
+                if (type == CODEPOINT_TYPE_LETTER || (!token.size() && cp == ' ' && type_next == CODEPOINT_TYPE_LETTER)) {
                     collecting_letter = true;
                     collecting = true;
                 }
-                else if (codepoint_type(utf_char) == CODEPOINT_TYPE_DIGIT || (!token.size() && utf_char == " " && codepoint_type(utf_char_next) == CODEPOINT_TYPE_DIGIT)) {
+                else if (type == CODEPOINT_TYPE_DIGIT || (!token.size() && cp == ' ' && type_next == CODEPOINT_TYPE_DIGIT)) {
                     collecting_numeric = true;
                     collecting = true;
                 }
                 else if (
-                    ((codepoint_type(utf_char) != CODEPOINT_TYPE_LETTER && codepoint_type(utf_char) != CODEPOINT_TYPE_DIGIT) && (codepoint_type(utf_char) != CODEPOINT_TYPE_WHITESPACE)) ||
-                    (!token.size() && utf_char == " " && codepoint_type(utf_char_next) != CODEPOINT_TYPE_LETTER && codepoint_type(utf_char_next) != CODEPOINT_TYPE_DIGIT && codepoint_type(utf_char_next) != CODEPOINT_TYPE_WHITESPACE)
+                    ((type != CODEPOINT_TYPE_LETTER && type != CODEPOINT_TYPE_DIGIT) && (type != CODEPOINT_TYPE_WHITESPACE)) ||
+                    (!token.size() && cp == ' ' && type_next != CODEPOINT_TYPE_LETTER && type_next != CODEPOINT_TYPE_DIGIT && type_next != CODEPOINT_TYPE_WHITESPACE)
                     ) {
                     collecting_special = true;
                     collecting = true;
                 }
-                else if (codepoint_type(utf_char) == CODEPOINT_TYPE_WHITESPACE && codepoint_type(utf_char_next) == CODEPOINT_TYPE_WHITESPACE) {
+                else if (type == CODEPOINT_TYPE_WHITESPACE && type_next == CODEPOINT_TYPE_WHITESPACE) {
                     collecting_whitespace_lookahead = true;
                     collecting = true;
                 }
-                else if (codepoint_type(utf_char) == CODEPOINT_TYPE_WHITESPACE) {
+                else if (type == CODEPOINT_TYPE_WHITESPACE) {
                     split_condition = true;
                 }
             }
             else if (!split_condition && collecting) {
-                if (collecting_letter && codepoint_type(utf_char) != CODEPOINT_TYPE_LETTER) {
+                if (collecting_letter && type != CODEPOINT_TYPE_LETTER) {
                     split_condition = true;
                 }
-                else if (collecting_numeric && codepoint_type(utf_char) != CODEPOINT_TYPE_DIGIT) {
+                else if (collecting_numeric && type != CODEPOINT_TYPE_DIGIT) {
                     split_condition = true;
                 }
-                else if (collecting_special && (codepoint_type(utf_char) == CODEPOINT_TYPE_LETTER || codepoint_type(utf_char) == CODEPOINT_TYPE_DIGIT || codepoint_type(utf_char) == CODEPOINT_TYPE_WHITESPACE)) {
+                else if (collecting_special && (type == CODEPOINT_TYPE_LETTER || type == CODEPOINT_TYPE_DIGIT || type == CODEPOINT_TYPE_WHITESPACE)) {
                     split_condition = true;
                 }
-                else if (collecting_whitespace_lookahead && (codepoint_type(utf_char_next) == CODEPOINT_TYPE_LETTER || codepoint_type(utf_char_next) == CODEPOINT_TYPE_DIGIT)) {
+                else if (collecting_whitespace_lookahead && (type_next == CODEPOINT_TYPE_LETTER || type_next == CODEPOINT_TYPE_DIGIT)) {
                     split_condition = true;
                 }
             }
 
-            if (utf_char_next == "") {
+            if (!has_next) {
                 split_condition = true; // final
-                token += utf_char;
+                token.append(text_utf, utf_offs[i], utf_offs[i + 1] - utf_offs[i]);
             }
 
             if (split_condition) {
                 if (token.size()) {
                     bpe_words.emplace_back(token);
                 }
-                token = utf_char;
+                token = utf_chars(i, 1);
                 collecting = false;
                 collecting_letter = false;
                 collecting_numeric = false;
@@ -6716,14 +8966,22 @@ private:
                 collecting_whitespace_lookahead = false;
             }
             else {
-                token += utf_char;
+                token.append(text_utf, utf_offs[i], utf_offs[i + 1] - utf_offs[i]);
             }
         }
 
+        static const std::vector<std::string> byte_to_unicode = [] {
+            std::vector<std::string> result(256);
+            for (int c = 0; c < 256; ++c) {
+                result[c] = bytes_to_unicode_bpe(c);
+            }
+            return result;
+        }();
+
         for (std::string & word : bpe_words) {
             std::string encoded_token = "";
             for (char & c : word) {
-                encoded_token += bytes_to_unicode_bpe(c);
+                encoded_token += byte_to_unicode[(uint8_t) c];
             }
             bpe_encoded_words.emplace_back(encoded_token);
         }
@@ -6869,7 +9127,67 @@ static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<
     }
 }
 
-static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool bos, bool special) {
+// with n_threads > 1, long texts are cut into chunks of about LLAMA_TOKENIZE_CHUNK bytes at boundaries that no token
+// crosses, and the chunks are tokenized on n_threads threads - the result is the same as tokenizing the whole text
+// split(text, begin, offs) returns the first boundary at or after offs, or text.size(); nullptr disables chunking
+template <typename tokenizer_t>
+static void llama_tokenize_chunked(
+        const llama_vocab & vocab,
+        const std::string & text,
+        size_t (*split)(const std::string & text, size_t begin, size_t offs),
+        int n_threads,
+        std::vector<llama_vocab::id> & output) {
+    std::vector<size_t> bounds = { 0 };
+    if (split && n_threads > 1 && text.size() >= 2*LLAMA_TOKENIZE_CHUNK) {
+        for (size_t b = split(text, 0, LLAMA_TOKENIZE_CHUNK); b < text.size(); b = split(text, b, b + LLAMA_TOKENIZE_CHUNK)) {
+            bounds.push_back(b);
+        }
+    }
+    bounds.push_back(text.size());
+
+    const int n_chunks = bounds.size() - 1;
+
+    if (n_chunks == 1) {
+        tokenizer_t tokenizer(vocab);
+        tokenizer.tokenize(text, output);
+        return;
+    }
+
+    std::vector<std::vector<llama_vocab::id>> chunk_output(n_chunks);
+    std::vector<std::exception_ptr>           chunk_error(n_chunks);
+
+    auto compute = [&](int ith, int nth) {
+        for (int i = ith; i < n_chunks; i += nth) {
+            try {
+                tokenizer_t tokenizer(vocab);
+                tokenizer.tokenize(text.substr(bounds[i], bounds[i + 1] - bounds[i]), chunk_output[i]);
+            } catch (...) {
+                chunk_error[i] = std::current_exception();
+            }
+        }
+    };
+
+    const int nth = std::min(n_threads, n_chunks);
+
+    std::vector<std::thread> workers;
+    workers.reserve(nth - 1);
+    for (int ith = 1; ith < nth; ith++) {
+        workers.emplace_back(compute, ith, nth);
+    }
+    compute(0, nth);
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    for (int i = 0; i < n_chunks; i++) {
+        if (chunk_error[i]) {
+            std::rethrow_exception(chunk_error[i]);
+        }
+        output.insert(output.end(), chunk_output[i].begin(), chunk_output[i].end());
+    }
+}
+
+static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool bos, bool special, int n_threads) {
     std::vector<llama_vocab::id> output;
 
     // OG tokenizer behavior:
@@ -6911,9 +9229,8 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
 #ifdef PRETOKENIZERDEBUG
                         fprintf(stderr,"TT: (%ld %ld %ld) '%s'\n", raw_text.length(), fragment.offset, fragment.length, raw_text.c_str());
 #endif
-                        llm_tokenizer_spm tokenizer(vocab);
                         llama_escape_whitespace(raw_text);
-                        tokenizer.tokenize(raw_text, output);
+                        llama_tokenize_chunked<llm_tokenizer_spm>(vocab, raw_text, vocab.spm_chunkable ? llama_tokenize_split_spm : nullptr, n_threads, output);
                     }
                     else // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
                     {
@@ -6932,8 +9249,7 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
 #ifdef PRETOKENIZERDEBUG
                         fprintf(stderr,"TT: (%ld %ld %ld) '%s'\n", raw_text.length(), fragment.offset, fragment.length, raw_text.c_str());
 #endif
-                        llm_tokenizer_bpe tokenizer(vocab);
-                        tokenizer.tokenize(raw_text, output);
+                        llama_tokenize_chunked<llm_tokenizer_bpe>(vocab, raw_text, llama_tokenize_split_bpe, n_threads, output);
                     }
                     else // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
                     {
@@ -6961,6 +9277,10 @@ struct llama_grammar {
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8                                      partial_utf8;
+
+    // bitmasks of the tokens allowed in the states of the grammar seen so far, by llama_grammar_state_key
+    // the stacks are the state of the pushdown automaton, so it is determinised lazily as the states are reached
+    mutable std::unordered_map<std::string, std::vector<uint32_t>> allowed;
 };
 
 struct llama_grammar_candidate {
@@ -7029,6 +9349,42 @@ static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
     return std::make_pair(std::move(code_points), llama_partial_utf8{ value, n_remain });
 }
 
+static void llama_vocab_init_pieces(llama_model & model) {
+    auto & vocab = model.vocab;
+
+    const int n_vocab = (int) vocab.id_to_token.size();
+
+    vocab.pieces.resize(n_vocab);
+    vocab.piece_text.clear();
+    vocab.piece_cpts.clear();
+
+    std::vector<char> buf(64);
+    for (int id = 0; id < n_vocab; ++id) {
+        int n = llama_token_to_piece(&model, id, buf.data(), buf.size());
+        if (n < 0) {
+            buf.resize(-n);
+            n = llama_token_to_piece(&model, id, buf.data(), buf.size());
+        }
+
+        const auto decoded = decode_utf8(std::string(buf.data(), n), { 0, 0 });
+
+        auto & piece = vocab.pieces[id];
+        piece.text_offs        = vocab.piece_text.size();
+        piece.text_len         = n;
+        piece.cpts_offs        = vocab.piece_cpts.size();
+        piece.partial_value    = decoded.second.value;
+        piece.partial_n_remain = decoded.second.n_remain;
+
+        vocab.piece_text.insert(vocab.piece_text.end(), buf.data(), buf.data() + n);
+        vocab.piece_cpts.insert(vocab.piece_cpts.end(), decoded.first.begin(), decoded.first.end());
+    }
+}
+
+static std::string llama_vocab_piece(const llama_vocab & vocab, llama_token id) {
+    const auto & piece = vocab.pieces[id];
+    return std::string(vocab.piece_text.data() + piece.text_offs, piece.text_len);
+}
+
 // returns true iff pos points to the end of one of the definitions of a rule
 static bool llama_grammar_is_end_of_sequence(const llama_grammar_element * pos) {
     switch (pos->type) {
@@ -7276,6 +9632,50 @@ static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates(
     return rejects;
 }
 
+// the stacks of the grammar, which determine the tokens it allows when no UTF-8 sequence is pending
+static std::string llama_grammar_state_key(const llama_grammar * grammar) {
+    std::string key;
+    for (const auto & stack : grammar->stacks) {
+        const llama_grammar_element * end = nullptr;
+        key.append((const char *) stack.data(), stack.size()*sizeof(stack[0]));
+        key.append((const char *) &end, sizeof(end));
+    }
+    return key;
+}
+
+static bool llama_vocab_piece_empty(const llama_vocab & vocab, llama_token id) {
+    const auto & piece = vocab.pieces[id];
+    return piece.text_len == 0 || vocab.piece_text[piece.text_offs] == 0;
+}
+
+// bitmask over the vocabulary of the tokens the grammar allows in its current state
+static std::vector<uint32_t> llama_grammar_allowed_tokens(const llama_vocab & vocab, const llama_grammar * grammar, llama_token eos, bool allow_eos) {
+    const int n_vocab = (int) vocab.pieces.size();
+
+    std::vector<uint32_t> allowed((n_vocab + 31)/32, 0);
+
+    std::vector<llama_grammar_candidate> candidates;
+    candidates.reserve(n_vocab);
+
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        if (id == eos) {
+            if (allow_eos) {
+                allowed[id/32] |= 1u << (id%32);
+            }
+        } else if (!llama_vocab_piece_empty(vocab, id)) {
+            const auto & piece = vocab.pieces[id];
+            candidates.push_back({ (size_t) id, vocab.piece_cpts.data() + piece.cpts_offs, { piece.partial_value, piece.partial_n_remain } });
+            allowed[id/32] |= 1u << (id%32);
+        }
+    }
+
+    for (const auto & reject : llama_grammar_reject_candidates(grammar->rules, grammar->stacks, candidates)) {
+        allowed[reject.index/32] &= ~(1u << (reject.index%32));
+    }
+
+    return allowed;
+}
+
 //
 // grammar - external
 //
@@ -7317,7 +9717,7 @@ struct llama_grammar * llama_grammar_init(
         }
     } while (true);
 
-    return new llama_grammar{ std::move(vec_rules), std::move(stacks), {} };
+    return new llama_grammar{ std::move(vec_rules), std::move(stacks), {}, {} };
 }
 
 void llama_grammar_free(struct llama_grammar * grammar) {
@@ -7325,7 +9725,8 @@ void llama_grammar_free(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_copy(const struct llama_grammar * grammar) {
-    llama_grammar * result = new llama_grammar{ grammar->rules, grammar->stacks, grammar->partial_utf8 };
+    // the states of the copy are keyed by its own rules, so the allowed tokens are not copied
+    llama_grammar * result = new llama_grammar{ grammar->rules, grammar->stacks, grammar->partial_utf8, {} };
 
     // redirect elements in stacks to point to new rules
     for (size_t is = 0; is < result->stacks.size(); is++) {
@@ -7656,6 +10057,8 @@ void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * c
     GGML_ASSERT(ctx);
     const int64_t t_start_sample_us = ggml_time_us();
 
+    const auto & vocab = ctx->model.vocab;
+
     bool allow_eos = false;
     for (const auto & stack : grammar->stacks) {
         if (stack.empty()) {
@@ -7666,22 +10069,51 @@ void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * c
 
     const llama_token eos = llama_token_eos(&ctx->model);
 
+    // without a pending UTF-8 sequence, the allowed tokens are those of the state of the grammar
+    // a new state is only computed for the whole vocabulary when the candidates are the whole vocabulary
+    if (grammar->partial_utf8.n_remain == 0) {
+        const std::string key = llama_grammar_state_key(grammar);
+
+        auto it = grammar->allowed.find(key);
+        if (it == grammar->allowed.end() && candidates->size >= vocab.pieces.size()) {
+            if (grammar->allowed.size() >= LLAMA_GRAMMAR_MAX_STATES) {
+                grammar->allowed.clear();
+            }
+            it = grammar->allowed.emplace(key, llama_grammar_allowed_tokens(vocab, grammar, eos, allow_eos)).first;
+        }
+
+        if (it != grammar->allowed.end()) {
+            const auto & allowed = it->second;
+            for (size_t i = 0; i < candidates->size; ++i) {
+                const llama_token id = candidates->data[i].id;
+                if (!((allowed[id/32] >> (id%32)) & 1)) {
+                    candidates->data[i].logit = -INFINITY;
+                }
+            }
+
+            ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+            return;
+        }
+    }
+
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
-    candidates_decoded.reserve(candidates->size);
+    candidates_decoded.reserve(grammar->partial_utf8.n_remain == 0 ? 0 : candidates->size);
     std::vector<llama_grammar_candidate>                              candidates_grammar;
     candidates_grammar.reserve(candidates->size);
 
     for (size_t i = 0; i < candidates->size; ++i) {
-        const llama_token id    = candidates->data[i].id;
-        const std::string piece = llama_token_to_piece(ctx, id);
+        const llama_token id = candidates->data[i].id;
         if (id == eos) {
             if (!allow_eos) {
                 candidates->data[i].logit = -INFINITY;
             }
-        } else if (piece.empty() || piece[0] == 0) {
+        } else if (llama_vocab_piece_empty(vocab, id)) {
             candidates->data[i].logit = -INFINITY;
+        } else if (grammar->partial_utf8.n_remain == 0) {
+            const auto & piece = vocab.pieces[id];
+            candidates_grammar.push_back({ i, vocab.piece_cpts.data() + piece.cpts_offs, { piece.partial_value, piece.partial_n_remain } });
         } else {
-            candidates_decoded.push_back(decode_utf8(piece, grammar->partial_utf8));
+            candidates_decoded.push_back(decode_utf8(llama_vocab_piece(vocab, id), grammar->partial_utf8));
             candidates_grammar.push_back({ i, candidates_decoded.back().first.data(), candidates_decoded.back().second });
         }
     }
@@ -7885,15 +10317,24 @@ void llama_grammar_accept_token(struct llama_context * ctx, struct llama_grammar
         GGML_ASSERT(false);
     }
 
-    const std::string piece = llama_token_to_piece(ctx, token);
+    const auto & vocab = ctx->model.vocab;
 
-    // Note terminating 0 in decoded string
-    const auto   decoded     = decode_utf8(piece, grammar->partial_utf8);
-    const auto & code_points = decoded.first;
-    for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
-        grammar->stacks = llama_grammar_accept(grammar->rules, grammar->stacks, *it);
+    if (grammar->partial_utf8.n_remain == 0) {
+        // the code points of the token are decoded already, terminated by 0
+        const auto & piece = vocab.pieces[token];
+        for (const uint32_t * cpt = vocab.piece_cpts.data() + piece.cpts_offs; *cpt != 0; ++cpt) {
+            grammar->stacks = llama_grammar_accept(grammar->rules, grammar->stacks, *cpt);
+        }
+        grammar->partial_utf8 = { piece.partial_value, piece.partial_n_remain };
+    } else {
+        // Note terminating 0 in decoded string
+        const auto   decoded     = decode_utf8(llama_vocab_piece(vocab, token), grammar->partial_utf8);
+        const auto & code_points = decoded.first;
+        for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
+            grammar->stacks = llama_grammar_accept(grammar->rules, grammar->stacks, *it);
+        }
+        grammar->partial_utf8 = decoded.second;
     }
-    grammar->partial_utf8 = decoded.second;
     GGML_ASSERT(!grammar->stacks.empty());
 
     ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
@@ -8812,6 +11253,11 @@ static int llama_apply_lora_from_file_internal(
 
             ggml_tensor * dest_t = model_tensors[base_name];
 
+            if (ggml_internal_get_type_traits(dest_t->type).nrows > 0) {
+                LLAMA_LOG_ERROR("%s: error: tensor '%s' is repacked, load the model without repacking to apply a lora\n", __func__, base_name.c_str());
+                return 1;
+            }
+
             offload_func_t offload_func               = ggml_offload_nop;
             offload_func_t offload_func_force_inplace = ggml_offload_nop;
 
@@ -8927,12 +11373,17 @@ struct llama_model_params llama_model_default_params() {
         /*.n_gpu_layers                =*/ 0,
         /*.main_gpu                    =*/ 0,
         /*.tensor_split                =*/ nullptr,
+        /*.n_threads_load              =*/ 4,
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.repack_cache                =*/ nullptr,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
+        /*.numa_split                  =*/ false,
+        /*.huge_pages                  =*/ false,
+        /*.repack                      =*/ false,
     };
 
 #ifdef GGML_USE_METAL
@@ -8959,10 +11410,15 @@ struct llama_context_params llama_context_default_params() {
         /*.yarn_orig_ctx               =*/ 0,
         /*.type_k                      =*/ GGML_TYPE_F16,
         /*.type_v                      =*/ GGML_TYPE_F16,
+        /*.wait_policy                 =*/ GGML_WAIT_POLICY_DEFAULT,
         /*.mul_mat_q                   =*/ true,
         /*.logits_all                  =*/ false,
         /*.embedding                   =*/ false,
         /*.offload_kqv                 =*/ true,
+        /*.fuse_ops                    =*/ true,
+        /*.flash_attn                  =*/ false,
+        /*.graph_cache                 =*/ true,
+        /*.huge_pages                  =*/ false,
     };
 
     return result;
@@ -9080,6 +11536,11 @@ struct llama_context * llama_new_context_with_model(
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.mul_mat_q        = params.mul_mat_q;
     cparams.offload_kqv      = params.offload_kqv;
+    cparams.fuse_ops         = params.fuse_ops;
+    cparams.flash_attn       = params.flash_attn;
+    cparams.graph_cache      = params.graph_cache;
+    cparams.huge_pages       = params.huge_pages;
+    cparams.wait_policy      = params.wait_policy;
 
     cparams.n_ctx            = params.n_ctx           == 0    ? hparams.n_ctx_train           : params.n_ctx;
     cparams.rope_freq_base   = params.rope_freq_base  == 0.0f ? hparams.rope_freq_base_train  : params.rope_freq_base;
@@ -9102,6 +11563,19 @@ struct llama_context * llama_new_context_with_model(
         cparams.yarn_ext_factor = rope_scaling_type == LLAMA_ROPE_SCALING_YARN ? 1.0f : 0.0f;
     }
 
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_METAL)
+    if (cparams.flash_attn) {
+        // the fused attention op only has a CPU implementation
+        LLAMA_LOG_WARN("%s: flash_attn is not supported by this backend - disabling\n", __func__);
+        cparams.flash_attn = false;
+    }
+#endif
+
+    if (cparams.flash_attn && llama_model_has_alibi(*model)) {
+        LLAMA_LOG_WARN("%s: flash_attn does not support ALiBi - disabling\n", __func__);
+        cparams.flash_attn = false;
+    }
+
     if (params.seed == LLAMA_DEFAULT_SEED) {
         params.seed = time(NULL);
     }
@@ -9113,15 +11587,26 @@ struct llama_context * llama_new_context_with_model(
     ctx->rng = std::mt19937(params.seed);
     ctx->logits_all = params.logits_all;
 
+    ctx->threadpool = ggml_threadpool_new(std::max(cparams.n_threads, cparams.n_threads_batch));
+
     const ggml_type type_k = params.type_k;
     const ggml_type type_v = params.type_v;
 
     GGML_ASSERT(hparams.n_embd_head() % ggml_blck_size(type_k) == 0);
     GGML_ASSERT(hparams.n_embd_head() % ggml_blck_size(type_v) == 0);
 
+    // the fused attention op reads V by rows - only then V can be stored in quantized blocks
+    const bool v_trans = !cparams.flash_attn;
+
+    if (v_trans && ggml_is_quantized(type_v)) {
+        LLAMA_LOG_ERROR("%s: a quantized V cache requires flash_attn\n", __func__);
+        llama_free(ctx);
+        return nullptr;
+    }
+
     // reserve memory for context buffers
     if (!hparams.vocab_only) {
-        if (!llama_kv_cache_init(ctx->model.hparams, ctx->kv_self, type_k, type_v, cparams.n_ctx, model->n_gpu_layers, cparams.offload_kqv)) {
+        if (!llama_kv_cache_init(ctx->model.hparams, ctx->kv_self, type_k, type_v, cparams.n_ctx, v_trans, cparams.huge_pages, model->n_gpu_layers, cparams.offload_kqv)) {
             LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
@@ -9168,7 +11653,8 @@ struct llama_context * llama_new_context_with_model(
             int n_tokens = (int)std::min(cparams.n_ctx, cparams.n_batch);
             int n_past = cparams.n_ctx - n_tokens;
             llama_token token = llama_token_bos(&ctx->model); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
-            ggml_cgraph * gf = llama_build_graph(*ctx, llama_batch_get_one(&token, n_tokens, n_past, 0));
+            llama_graph_inputs inp;
+            ggml_cgraph * gf = llama_build_graph(*ctx, llama_batch_get_one(&token, n_tokens, n_past, 0), inp);
 
 #ifdef GGML_USE_METAL
             if (model->n_gpu_layers > 0) {
@@ -9190,7 +11676,12 @@ struct llama_context * llama_new_context_with_model(
             // recreate allocator with exact memory requirements
             ggml_allocr_free(ctx->alloc);
 
-            ctx->buf_alloc.resize(alloc_size);
+            ctx->buf_alloc.resize(alloc_size, cparams.huge_pages);
+
+            if (cparams.huge_pages) {
+                LLAMA_LOG_INFO("%s: huge pages: KV cache %s, compute buffer %s\n", __func__,
+                    ctx->kv_self.buf.backing().c_str(), ctx->buf_alloc.backing().c_str());
+            }
             ctx->alloc = ggml_allocr_new(ctx->buf_alloc.data, ctx->buf_alloc.size, tensor_alignment);
 #ifdef GGML_USE_METAL
             if (ctx->ctx_metal) {
@@ -9471,13 +11962,12 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
         }
 
         int seq_idx = 0;
-        for (const llama_seq_id it : kv_cells[i].seq_id) {
-            if (seq_idx >= view->n_max_seq) {
-                break;
+        kv_cells[i].seq_id.for_each([&](llama_seq_id it) {
+            if (seq_idx < view->n_max_seq) {
+                cs_curr[seq_idx] = it;
+                seq_idx++;
             }
-            cs_curr[seq_idx] = it;
-            seq_idx++;
-        }
+        });
         if (seq_idx != 0) {
             used_cells++;
         }
@@ -9536,6 +12026,18 @@ void llama_kv_cache_seq_shift(struct llama_context * ctx, llama_seq_id seq_id, l
     llama_kv_cache_seq_shift(ctx->kv_self, seq_id, p0, p1, delta);
 }
 
+int32_t llama_kv_cache_prefix_store(struct llama_context * ctx, llama_seq_id seq_id, const llama_token * tokens, int32_t n_tokens) {
+    return llama_kv_cache_prefix_store(ctx->kv_self, seq_id, tokens, n_tokens);
+}
+
+int32_t llama_kv_cache_prefix_attach(struct llama_context * ctx, llama_seq_id seq_id, const llama_token * tokens, int32_t n_tokens) {
+    return llama_kv_cache_prefix_attach(ctx->kv_self, seq_id, tokens, n_tokens);
+}
+
+int32_t llama_kv_cache_defrag(struct llama_context * ctx, int32_t n_max) {
+    return llama_kv_cache_defrag(*ctx, n_max);
+}
+
 // Returns the *maximum* size of the state
 size_t llama_get_state_size(const struct llama_context * ctx) {
     // we don't know size of rng until we actually serialize it. so reserve more than enough memory for its serialized state.
@@ -9578,11 +12080,27 @@ struct llama_data_buffer_context : llama_data_context {
     uint8_t * ptr;
     size_t size_written = 0;
 
-    llama_data_buffer_context(uint8_t * p) : ptr(p) {}
+    llama_data_buffer_context(uint8_t * p) : ptr(p) {}
+
+    void write(const void * src, size_t size) override {
+        memcpy(ptr, src, size);
+        ptr += size;
+        size_written += size;
+    }
+
+    size_t get_size_written() override {
+        return size_written;
+    }
+};
+
+struct llama_data_file_context : llama_data_context {
+    llama_file * file;
+    size_t size_written = 0;
+
+    llama_data_file_context(llama_file * f) : file(f) {}
 
     void write(const void * src, size_t size) override {
-        memcpy(ptr, src, size);
-        ptr += size;
+        file->write_raw(src, size);
         size_written += size;
     }
 
@@ -9591,14 +12109,12 @@ struct llama_data_buffer_context : llama_data_context {
     }
 };
 
-struct llama_data_file_context : llama_data_context {
-    llama_file * file;
+// only counts the bytes written
+struct llama_data_size_context : llama_data_context {
     size_t size_written = 0;
 
-    llama_data_file_context(llama_file * f) : file(f) {}
-
     void write(const void * src, size_t size) override {
-        file->write_raw(src, size);
+        (void) src;
         size_written += size;
     }
 
@@ -9678,9 +12194,17 @@ static void llama_copy_state_data_internal(struct llama_context * ctx, llama_dat
         const auto   n_ctx   = cparams.n_ctx;
 
         const size_t   kv_buf_size = kv_self.buf.size;
-        const uint32_t kv_head     = kv_self.head;
+        const uint32_t kv_head     = llama_kv_cache_cell_max(kv_self); // cells after the last used one are not saved
         const uint32_t kv_size     = kv_self.size;
-        const uint32_t kv_used     = kv_self.used;
+
+        // the prefix index is not saved, the cells only it holds are saved as free
+        uint32_t kv_used = 0;
+        for (uint32_t i = 0; i < kv_size; ++i) {
+            const auto & cell = kv_self.cells[i];
+            if (cell.pos >= 0 && cell.seq_id.size() > (cell.has_seq_id(LLAMA_KV_SEQ_PREFIX) ? 1u : 0u)) {
+                kv_used++;
+            }
+        }
 
         data_ctx->write(&kv_buf_size, sizeof(kv_buf_size));
         data_ctx->write(&kv_head,     sizeof(kv_head));
@@ -9688,8 +12212,6 @@ static void llama_copy_state_data_internal(struct llama_context * ctx, llama_dat
         data_ctx->write(&kv_used,     sizeof(kv_used));
 
         if (kv_buf_size) {
-            const size_t elt_size = ggml_element_size(kv_self.k_l[0]);
-
             ggml_context * cpy_ctx = ggml_init({ 6*n_layer*ggml_tensor_overhead() + ggml_graph_overhead(), NULL, /* no_alloc */ true });
             ggml_cgraph * gf = ggml_new_graph(cpy_ctx);
 
@@ -9697,21 +12219,30 @@ static void llama_copy_state_data_internal(struct llama_context * ctx, llama_dat
             std::vector<std::vector<uint8_t>> vout2d_data(n_layer);
 
             for (int il = 0; il < (int) n_layer; ++il) {
-                ggml_tensor * kout2d = ggml_new_tensor_2d(cpy_ctx, kv_self.k_l[il]->type, n_embd, kv_head);
+                const ggml_type type_k = kv_self.k_l[il]->type;
+                const ggml_type type_v = kv_self.v_l[il]->type;
+
+                ggml_tensor * kout2d = ggml_new_tensor_2d(cpy_ctx, type_k, n_embd, kv_head);
                 kout2d_data[il].resize(ggml_nbytes(kout2d));
                 kout2d->data = kout2d_data[il].data();
 
-                ggml_tensor * vout2d = ggml_new_tensor_2d(cpy_ctx, kv_self.v_l[il]->type, kv_head, n_embd);
+                ggml_tensor * vout2d = kv_self.v_trans ?
+                    ggml_new_tensor_2d(cpy_ctx, type_v, kv_head, n_embd) :
+                    ggml_new_tensor_2d(cpy_ctx, type_v, n_embd, kv_head);
                 vout2d_data[il].resize(ggml_nbytes(vout2d));
                 vout2d->data = vout2d_data[il].data();
 
                 ggml_tensor * k2d = ggml_view_2d(cpy_ctx, kv_self.k_l[il],
                         n_embd, kv_head,
-                        elt_size*n_embd, 0);
+                        ggml_row_size(type_k, n_embd), 0);
 
-                ggml_tensor * v2d = ggml_view_2d(cpy_ctx, kv_self.v_l[il],
+                ggml_tensor * v2d = kv_self.v_trans ?
+                    ggml_view_2d(cpy_ctx, kv_self.v_l[il],
                         kv_head, n_embd,
-                        elt_size*n_ctx, 0);
+                        ggml_element_size(kv_self.v_l[il])*n_ctx, 0) :
+                    ggml_view_2d(cpy_ctx, kv_self.v_l[il],
+                        n_embd, kv_head,
+                        ggml_row_size(type_v, n_embd), 0);
 
                 ggml_build_forward_expand(gf, ggml_cpy(cpy_ctx, k2d, kout2d));
                 ggml_build_forward_expand(gf, ggml_cpy(cpy_ctx, v2d, vout2d));
@@ -9732,15 +12263,17 @@ static void llama_copy_state_data_internal(struct llama_context * ctx, llama_dat
         for (uint32_t i = 0; i < kv_size; ++i) {
             const auto & cell = kv_self.cells[i];
 
-            const llama_pos pos         = cell.pos;
-            const size_t    seq_id_size = cell.seq_id.size();
+            const size_t    seq_id_size = cell.seq_id.size() - (cell.has_seq_id(LLAMA_KV_SEQ_PREFIX) ? 1 : 0);
+            const llama_pos pos         = seq_id_size > 0 ? cell.pos : -1;
 
             data_ctx->write(&pos,         sizeof(pos));
             data_ctx->write(&seq_id_size, sizeof(seq_id_size));
 
-            for (auto seq_id : cell.seq_id) {
-                data_ctx->write(&seq_id, sizeof(seq_id));
-            }
+            cell.seq_id.for_each([&](llama_seq_id seq_id) {
+                if (seq_id != LLAMA_KV_SEQ_PREFIX) {
+                    data_ctx->write(&seq_id, sizeof(seq_id));
+                }
+            });
         }
     }
 }
@@ -9826,27 +12359,34 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
         if (kv_buf_size) {
             GGML_ASSERT(kv_self.buf.size == kv_buf_size);
 
-            const size_t elt_size = ggml_element_size(kv_self.k_l[0]);
-
             ggml_context * cpy_ctx = ggml_init({ 6*n_layer*ggml_tensor_overhead() + ggml_graph_overhead(), NULL, /* no_alloc */ true });
             ggml_cgraph * gf = ggml_new_graph(cpy_ctx);
 
             for (int il = 0; il < n_layer; ++il) {
-                ggml_tensor * kin2d = ggml_new_tensor_2d(cpy_ctx, kv_self.k_l[il]->type, n_embd, kv_head);
+                const ggml_type type_k = kv_self.k_l[il]->type;
+                const ggml_type type_v = kv_self.v_l[il]->type;
+
+                ggml_tensor * kin2d = ggml_new_tensor_2d(cpy_ctx, type_k, n_embd, kv_head);
                 kin2d->data = (void *) inp;
                 inp += ggml_nbytes(kin2d);
 
-                ggml_tensor * vin2d = ggml_new_tensor_2d(cpy_ctx, kv_self.v_l[il]->type, kv_head, n_embd);
+                ggml_tensor * vin2d = kv_self.v_trans ?
+                    ggml_new_tensor_2d(cpy_ctx, type_v, kv_head, n_embd) :
+                    ggml_new_tensor_2d(cpy_ctx, type_v, n_embd, kv_head);
                 vin2d->data = (void *) inp;
                 inp += ggml_nbytes(vin2d);
 
                 ggml_tensor * k2d = ggml_view_2d(cpy_ctx, kv_self.k_l[il],
                     n_embd, kv_head,
-                    elt_size*n_embd, 0);
+                    ggml_row_size(type_k, n_embd), 0);
 
-                ggml_tensor * v2d = ggml_view_2d(cpy_ctx, kv_self.v_l[il],
-                    kv_head, n_embd,
-                    elt_size*n_ctx, 0);
+                ggml_tensor * v2d = kv_self.v_trans ?
+                    ggml_view_2d(cpy_ctx, kv_self.v_l[il],
+                        kv_head, n_embd,
+                        ggml_element_size(kv_self.v_l[il])*n_ctx, 0) :
+                    ggml_view_2d(cpy_ctx, kv_self.v_l[il],
+                        n_embd, kv_head,
+                        ggml_row_size(type_v, n_embd), 0);
 
                 ggml_build_forward_expand(gf, ggml_cpy(cpy_ctx, kin2d, k2d));
                 ggml_build_forward_expand(gf, ggml_cpy(cpy_ctx, vin2d, v2d));
@@ -9871,6 +12411,7 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
             memcpy(&seq_id_size, inp, sizeof(seq_id_size)); inp += sizeof(seq_id_size);
 
             ctx->kv_self.cells[i].pos = pos;
+            ctx->kv_self.cells[i].seq_id.clear();
 
             llama_seq_id seq_id;
 
@@ -9879,8 +12420,18 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
                 ctx->kv_self.cells[i].seq_id.insert(seq_id);
             }
         }
+
+        for (auto & block : ctx->kv_self.blocks) {
+            block.prefix = 0;
+        }
+        ctx->kv_self.prefixes.clear();
+
+        llama_kv_cache_update_blocks(ctx->kv_self);
     }
 
+    // the cache no longer matches the session file of the last checkpoint
+    ctx->session_path.clear();
+
     const size_t nread    = inp - src;
     const size_t max_size = llama_get_state_size(ctx);
 
@@ -9889,7 +12440,246 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
     return nread;
 }
 
+// Session files
+//
+// After the header, a session file is a sequence of records, one per checkpoint. A record holds the tokens
+// added since the previous record, the rng, logits and embedding, the position and sequences of each used
+// cell, and the K and V data of the cells that are not in the previous records only - so a checkpoint
+// appends the cells decoded since the last one instead of rewriting the whole cache.
+// The state is that of the last record, the data of a cell is that of the last record that has it.
+//
+// header: magic, version, hparams, u32 kv size, u32 K type, u32 V type, u32 V transposed
+// record: u64 size of the rest of the record
+//         u32 n_token_keep (tokens of the previous record kept), u32 n_token_new, n_token_new tokens
+//         u32 rng size, rng
+//         u64 n_logits,    n_logits floats
+//         u64 n_embedding, n_embedding floats
+//         u32 n_cells,     for each cell: u32 index, i32 pos, i32 delta, u32 n_seq_id, n_seq_id seq ids
+//         u32 n_runs,      for each run of consecutive cells with data: u32 first cell, u32 number of cells
+//         for each layer, for each run: the K rows of the cells, then their V rows
+//                                       (if V is transposed: n_embd_gqa rows of the run's cells)
+
+// cells that are saved as used - the cells that only the prefix index holds are saved as free
+static bool llama_session_cell_used(const llama_kv_cell & cell) {
+    return cell.pos >= 0 && cell.seq_id.size() > (cell.has_seq_id(LLAMA_KV_SEQ_PREFIX) ? 1u : 0u);
+}
+
+// consecutive cells whose data is in a record
+struct llama_session_run {
+    uint32_t i0;
+    uint32_t n;
+};
+
+// bytes of the K and V data of the runs of one layer in a record
+static size_t llama_session_layer_size(const struct llama_context * ctx, const std::vector<llama_session_run> & runs) {
+    const auto & kv_self = ctx->kv_self;
+
+    const int64_t n_embd = ctx->model.hparams.n_embd_gqa();
+
+    const size_t k_row = ggml_row_size(kv_self.k_l[0]->type, n_embd);
+    const size_t v_row = ggml_row_size(kv_self.v_l[0]->type, n_embd);
+
+    size_t size = 0;
+    for (const auto & run : runs) {
+        size += run.n*(k_row + v_row);
+    }
+
+    return size;
+}
+
+// copy the K and V data of the runs of layer il between the cache and data, in the layout of a record
+// the rows are copied with graphs of ggml_cpy ops of bounded size, so that a cache offloaded to the GPU is read and
+// written by its backend, as in llama_copy_state_data
+static void llama_session_copy_layer(struct llama_context * ctx, int il, const std::vector<llama_session_run> & runs, uint8_t * data, bool to_cache) {
+    const auto & kv_self = ctx->kv_self;
+    const auto & cparams = ctx->cparams;
+
+    const int64_t n_embd = ctx->model.hparams.n_embd_gqa();
+
+    ggml_tensor * k = kv_self.k_l[il];
+    ggml_tensor * v = kv_self.v_l[il];
+
+    const size_t k_row = ggml_row_size(k->type, n_embd);
+    const size_t v_row = ggml_row_size(v->type, kv_self.v_trans ? kv_self.size : n_embd);
+
+    // two views and two copies per run, and the two tensors of the data
+    const int n_nodes_max = LLAMA_MAX_NODES;
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ 2*n_nodes_max*ggml_tensor_overhead() + ggml_graph_overhead_custom(n_nodes_max, false),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context * ctx0 = nullptr;
+    ggml_cgraph  * gf   = nullptr;
+
+    for (const auto & run : runs) {
+        if (ctx0 == nullptr) {
+            ctx0 = ggml_init(params);
+            gf   = ggml_new_graph_custom(ctx0, n_nodes_max, false);
+        }
+
+        ggml_tensor * k_cache = ggml_view_2d(ctx0, k, n_embd, run.n, k_row, k_row*run.i0);
+        ggml_tensor * k_data  = ggml_new_tensor_2d(ctx0, k->type, n_embd, run.n);
+        k_data->data = data;
+        data += ggml_nbytes(k_data);
+
+        ggml_tensor * v_cache;
+        ggml_tensor * v_data;
+
+        if (kv_self.v_trans) {
+            v_cache = ggml_view_2d(ctx0, v, run.n, n_embd, v_row, ggml_row_size(v->type, run.i0));
+            v_data  = ggml_new_tensor_2d(ctx0, v->type, run.n, n_embd);
+        } else {
+            v_cache = ggml_view_2d(ctx0, v, n_embd, run.n, v_row, v_row*run.i0);
+            v_data  = ggml_new_tensor_2d(ctx0, v->type, n_embd, run.n);
+        }
+        v_data->data = data;
+        data += ggml_nbytes(v_data);
+
+        if (to_cache) {
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_data, k_cache));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, v_data, v_cache));
+        } else {
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_cache, k_data));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, v_cache, v_data));
+        }
+
+        if (gf->n_nodes + 4 > n_nodes_max) {
+            ggml_graph_compute_helper(ctx->work_buffer, gf, cparams.n_threads, ctx->threadpool, cparams.wait_policy, cparams.fuse_ops);
+            ggml_free(ctx0);
+            ctx0 = nullptr;
+        }
+    }
+
+    if (ctx0 != nullptr) {
+        ggml_graph_compute_helper(ctx->work_buffer, gf, cparams.n_threads, ctx->threadpool, cparams.wait_policy, cparams.fuse_ops);
+        ggml_free(ctx0);
+    }
+}
+
+// with_data is false when data_ctx only counts the size, the K and V data is not copied out of the cache then
+static void llama_session_write_record(
+        struct llama_context * ctx,
+          llama_data_context * data_ctx,
+           const llama_token * tokens,
+                    uint32_t   n_token_keep,
+                    uint32_t   n_token_count,
+        const std::vector<llama_session_run> & runs,
+                        bool   with_data) {
+    const auto & kv_self = ctx->kv_self;
+
+    // tokens
+    {
+        const uint32_t n_token_new = n_token_count - n_token_keep;
+
+        data_ctx->write(&n_token_keep, sizeof(n_token_keep));
+        data_ctx->write(&n_token_new,  sizeof(n_token_new));
+        data_ctx->write(tokens + n_token_keep, n_token_new*sizeof(llama_token));
+    }
+
+    // rng, logits and embedding, without padding
+    {
+        std::stringstream rng_ss;
+        rng_ss << ctx->rng;
+
+        const std::string rng      = rng_ss.str();
+        const uint32_t    rng_size = rng.size();
+
+        data_ctx->write(&rng_size,  sizeof(rng_size));
+        data_ctx->write(rng.data(), rng_size);
+
+        const uint64_t n_logits    = ctx->logits.size();
+        const uint64_t n_embedding = ctx->embedding.size();
+
+        data_ctx->write(&n_logits, sizeof(n_logits));
+        data_ctx->write(ctx->logits.data(), n_logits*sizeof(float));
+
+        data_ctx->write(&n_embedding, sizeof(n_embedding));
+        data_ctx->write(ctx->embedding.data(), n_embedding*sizeof(float));
+    }
+
+    // cells
+    {
+        uint32_t n_cells = 0;
+        for (uint32_t i = 0; i < kv_self.size; ++i) {
+            n_cells += llama_session_cell_used(kv_self.cells[i]);
+        }
+
+        data_ctx->write(&n_cells, sizeof(n_cells));
+
+        for (uint32_t i = 0; i < kv_self.size; ++i) {
+            const auto & cell = kv_self.cells[i];
+            if (!llama_session_cell_used(cell)) {
+                continue;
+            }
+
+            const uint32_t n_seq_id = cell.seq_id.size() - (cell.has_seq_id(LLAMA_KV_SEQ_PREFIX) ? 1 : 0);
+
+            data_ctx->write(&i,          sizeof(i));
+            data_ctx->write(&cell.pos,   sizeof(cell.pos));
+            data_ctx->write(&cell.delta, sizeof(cell.delta));
+            data_ctx->write(&n_seq_id,   sizeof(n_seq_id));
+
+            cell.seq_id.for_each([&](llama_seq_id seq_id) {
+                if (seq_id != LLAMA_KV_SEQ_PREFIX) {
+                    data_ctx->write(&seq_id, sizeof(seq_id));
+                }
+            });
+        }
+    }
+
+    // K and V data, copied out of the cache one layer at a time
+    {
+        const uint32_t n_runs = runs.size();
+
+        data_ctx->write(&n_runs, sizeof(n_runs));
+        for (const auto & run : runs) {
+            data_ctx->write(&run.i0, sizeof(run.i0));
+            data_ctx->write(&run.n,  sizeof(run.n));
+        }
+
+        const size_t layer_size = llama_session_layer_size(ctx, runs);
+
+        std::vector<uint8_t> layer_data;
+
+        for (size_t il = 0; il < kv_self.k_l.size(); ++il) {
+            if (with_data) {
+                layer_data.resize(layer_size);
+                llama_session_copy_layer(ctx, il, runs, layer_data.data(), false);
+            }
+
+            data_ctx->write(layer_data.data(), layer_size);
+        }
+    }
+}
+
+// reads a record from the mapped session file
+struct llama_session_reader {
+    const uint8_t * ptr;
+    const uint8_t * end;
+
+    const uint8_t * skip(size_t size) {
+        if ((size_t) (end - ptr) < size) {
+            throw std::runtime_error("corrupted session record");
+        }
+        const uint8_t * res = ptr;
+        ptr += size;
+        return res;
+    }
+
+    template <typename T>
+    T read() {
+        T res;
+        memcpy(&res, skip(sizeof(T)), sizeof(T));
+        return res;
+    }
+};
+
 static bool llama_load_session_file_internal(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    auto & kv_self = ctx->kv_self;
+
     llama_file file(path_session, "rb");
 
     // sanity checks
@@ -9909,37 +12699,225 @@ static bool llama_load_session_file_internal(struct llama_context * ctx, const c
             LLAMA_LOG_INFO("%s : model hparams didn't match from session file!\n", __func__);
             return false;
         }
+
+        const uint32_t kv_size = file.read_u32();
+        const uint32_t type_k  = file.read_u32();
+        const uint32_t type_v  = file.read_u32();
+        const uint32_t v_trans = file.read_u32();
+
+        if (kv_size != kv_self.size || type_k != (uint32_t) kv_self.k_l[0]->type || type_v != (uint32_t) kv_self.v_l[0]->type || v_trans != (uint32_t) kv_self.v_trans) {
+            LLAMA_LOG_ERROR("%s : the KV cache of the session file (%u cells, %s, %s) doesn't match the context (%u cells, %s, %s)\n", __func__,
+                    kv_size, ggml_type_name((ggml_type) type_k), ggml_type_name((ggml_type) type_v),
+                    kv_self.size, ggml_type_name(kv_self.k_l[0]->type), ggml_type_name(kv_self.v_l[0]->type));
+            return false;
+        }
+    }
+
+    // the records are read in place from a mapping of the file and validated, only then is the K and V data copied
+    // from it into the cache, so a corrupted file leaves the cache as it was
+    const size_t header_size = file.tell();
+
+    std::unique_ptr<llama_mmap> mapping;
+    std::vector<uint8_t>        buf;
+    const uint8_t *             data;
+
+    if (llama_mmap::SUPPORTED) {
+        mapping.reset(new llama_mmap(&file));
+        data = (const uint8_t *) mapping->addr;
+    } else {
+        buf.resize(file.size);
+        file.seek(0, SEEK_SET);
+        file.read_raw(buf.data(), file.size);
+        data = buf.data();
+    }
+
+    size_t n_token_count = 0;
+
+    // state of the last record
+    const uint8_t * rng         = nullptr;
+    uint32_t        rng_size    = 0;
+    const uint8_t * logits      = nullptr;
+    uint64_t        n_logits    = 0;
+    const uint8_t * embedding   = nullptr;
+    uint64_t        n_embedding = 0;
+
+    std::vector<llama_kv_cell> cells;
+    std::vector<bool>          has_data(kv_self.size, false);
+
+    // the runs of each record and their K and V data, in the order of the records
+    std::vector<std::pair<std::vector<llama_session_run>, const uint8_t *>> record_data;
+
+    size_t offs      = header_size;
+    bool   truncated = false;
+
+    while (offs < file.size) {
+        uint64_t record_size = 0;
+        if (file.size - offs >= sizeof(record_size)) {
+            memcpy(&record_size, data + offs, sizeof(record_size));
+        }
+        if (file.size - offs < sizeof(record_size) || file.size - offs - sizeof(record_size) < record_size) {
+            // an interrupted checkpoint, the previous records are complete
+            truncated = true;
+            break;
+        }
+
+        llama_session_reader reader = { data + offs + sizeof(record_size), data + offs + sizeof(record_size) + record_size };
+
+        // tokens
+        {
+            const uint32_t n_token_keep = reader.read<uint32_t>();
+            const uint32_t n_token_new  = reader.read<uint32_t>();
+
+            if (n_token_keep > n_token_count) {
+                throw std::runtime_error("corrupted session record");
+            }
+            if (n_token_keep + (size_t) n_token_new > n_token_capacity) {
+                LLAMA_LOG_ERROR("%s : token count in session file exceeded capacity! %zu > %zu\n", __func__, n_token_keep + (size_t) n_token_new, n_token_capacity);
+                return false;
+            }
+
+            memcpy(tokens_out + n_token_keep, reader.skip(n_token_new*sizeof(llama_token)), n_token_new*sizeof(llama_token));
+            n_token_count = n_token_keep + n_token_new;
+        }
+
+        rng_size    = reader.read<uint32_t>();
+        rng         = reader.skip(rng_size);
+        n_logits    = reader.read<uint64_t>();
+        logits      = reader.skip(n_logits*sizeof(float));
+        n_embedding = reader.read<uint64_t>();
+        embedding   = reader.skip(n_embedding*sizeof(float));
+
+        // cells
+        {
+            cells.assign(kv_self.size, llama_kv_cell());
+
+            const uint32_t n_cells = reader.read<uint32_t>();
+            for (uint32_t k = 0; k < n_cells; ++k) {
+                const uint32_t i = reader.read<uint32_t>();
+                if (i >= kv_self.size) {
+                    throw std::runtime_error("corrupted session record");
+                }
+
+                llama_kv_cell & cell = cells[i];
+
+                cell.pos   = reader.read<llama_pos>();
+                cell.delta = reader.read<llama_pos>();
+
+                const uint32_t n_seq_id = reader.read<uint32_t>();
+                for (uint32_t j = 0; j < n_seq_id; ++j) {
+                    cell.seq_id.insert(reader.read<llama_seq_id>());
+                }
+            }
+        }
+
+        // K and V data
+        {
+            const uint32_t n_runs = reader.read<uint32_t>();
+            if (n_runs > kv_self.size) {
+                throw std::runtime_error("corrupted session record");
+            }
+
+            std::vector<llama_session_run> runs(n_runs);
+            for (auto & run : runs) {
+                run.i0 = reader.read<uint32_t>();
+                run.n  = reader.read<uint32_t>();
+                if (run.i0 > kv_self.size || run.n > kv_self.size - run.i0) {
+                    throw std::runtime_error("corrupted session record");
+                }
+            }
+
+            const size_t layer_size = llama_session_layer_size(ctx, runs);
+
+            const uint8_t * kv_data = reader.skip(kv_self.k_l.size()*layer_size);
+
+            for (const auto & run : runs) {
+                std::fill(has_data.begin() + run.i0, has_data.begin() + run.i0 + run.n, true);
+            }
+
+            record_data.emplace_back(std::move(runs), kv_data);
+        }
+
+        offs += sizeof(record_size) + record_size;
+    }
+
+    if (!rng) {
+        LLAMA_LOG_ERROR("%s : no complete record in session file\n", __func__);
+        return false;
+    }
+    if (truncated) {
+        LLAMA_LOG_WARN("%s : ignoring the incomplete last record of the session file\n", __func__);
+    }
+
+    if (n_embedding != 0 && n_embedding != ctx->embedding.size()) {
+        LLAMA_LOG_ERROR("%s : embedding size in session file doesn't match! expected %zu, got %zu\n", __func__, ctx->embedding.size(), (size_t) n_embedding);
+        return false;
     }
 
-    // load the prompt
+    std::mt19937 session_rng;
     {
-        const uint32_t n_token_count = file.read_u32();
+        std::stringstream rng_ss;
+        rng_ss.str(std::string((const char *) rng, rng_size));
+        rng_ss >> session_rng;
 
-        if (n_token_count > n_token_capacity) {
-            LLAMA_LOG_ERROR("%s : token count in session file exceeded capacity! %u > %zu\n", __func__, n_token_count, n_token_capacity);
-            return false;
+        if (rng_ss.fail()) {
+            throw std::runtime_error("corrupted session record");
+        }
+    }
+
+    // the file is valid, copy the K and V data of the records in order - the data of a cell is that of the last record that has it
+    for (const auto & record : record_data) {
+        const std::vector<llama_session_run> & runs = record.first;
+
+        const size_t layer_size = llama_session_layer_size(ctx, runs);
+
+        for (size_t il = 0; il < kv_self.k_l.size(); ++il) {
+            // only read by the copies
+            uint8_t * layer_data = const_cast<uint8_t *>(record.second) + il*layer_size;
+
+            llama_session_copy_layer(ctx, il, runs, layer_data, true);
         }
+    }
+
+    // set rng, logits and embedding
+    {
+        ctx->rng = session_rng;
+
+        ctx->logits.resize(n_logits);
+        memcpy(ctx->logits.data(), logits, n_logits*sizeof(float));
 
-        file.read_raw(tokens_out, sizeof(llama_token) * n_token_count);
-        *n_token_count_out = n_token_count;
+        memcpy(ctx->embedding.data(), embedding, n_embedding*sizeof(float));
     }
 
-    // restore the context state
+    // set the cells
     {
-        const size_t n_state_size_cur = file.size - file.tell();
-        const size_t n_state_size_max = llama_get_state_size(ctx);
+        kv_self.used      = 0;
+        kv_self.has_shift = false;
 
-        if (n_state_size_cur > n_state_size_max) {
-            LLAMA_LOG_ERROR("%s : the state size in session file is too big! max %zu, got %zu\n", __func__, n_state_size_max, n_state_size_cur);
-            return false;
+        for (uint32_t i = 0; i < kv_self.size; ++i) {
+            cells[i].saved = has_data[i];
+
+            kv_self.used     += !cells[i].seq_id.empty();
+            kv_self.has_shift = kv_self.has_shift || cells[i].delta != 0;
         }
 
-        std::vector<uint8_t> state_data(n_state_size_max);
-        file.read_raw(state_data.data(), n_state_size_cur);
+        kv_self.cells = std::move(cells);
+        kv_self.head  = llama_kv_cache_cell_max(kv_self);
 
-        llama_set_state_data(ctx, state_data.data());
+        for (auto & block : kv_self.blocks) {
+            block.prefix = 0;
+        }
+        kv_self.prefixes.clear();
+
+        llama_kv_cache_update_blocks(kv_self);
     }
 
+    *n_token_count_out = n_token_count;
+
+    // the next checkpoint appends to this file, unless the last record is incomplete
+    ctx->session_path = truncated ? "" : path_session;
+    ctx->session_size = offs;
+    ctx->session_tokens.assign(tokens_out, tokens_out + n_token_count);
+
     return true;
 }
 
@@ -9952,25 +12930,128 @@ bool llama_load_session_file(struct llama_context * ctx, const char * path_sessi
     }
 }
 
-bool llama_save_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count) {
-    llama_file file(path_session, "wb");
+// runs of the used cells, only of those whose data is not in the session file if !all
+static std::vector<llama_session_run> llama_session_runs(const struct llama_kv_cache & kv_self, bool all) {
+    std::vector<llama_session_run> runs;
+
+    for (uint32_t i = 0; i < kv_self.size; ++i) {
+        const auto & cell = kv_self.cells[i];
+        if (!llama_session_cell_used(cell) || (!all && cell.saved)) {
+            continue;
+        }
+        if (!runs.empty() && runs.back().i0 + runs.back().n == i) {
+            runs.back().n++;
+        } else {
+            runs.push_back({ i, 1 });
+        }
+    }
+
+    return runs;
+}
 
-    file.write_u32(LLAMA_SESSION_MAGIC);
-    file.write_u32(LLAMA_SESSION_VERSION);
+// write the session file, or append a record with the new cells to it if it is the file of the last checkpoint
+static bool llama_save_session_file_internal(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count, bool append) {
+    auto & kv_self = ctx->kv_self;
 
-    file.write_raw(&ctx->model.hparams, sizeof(llama_hparams));
+    std::unique_ptr<llama_file> file;
 
-    // save the prompt
-    file.write_u32((uint32_t) n_token_count);
-    file.write_raw(tokens, sizeof(llama_token) * n_token_count);
+    std::vector<llama_session_run> runs;
+    uint32_t                       n_token_keep = 0;
 
-    // save the context state using stream saving
-    llama_data_file_context data_ctx(&file);
-    llama_copy_state_data_internal(ctx, &data_ctx);
+    // the file must not have changed since the last checkpoint
+    if (append && ctx->session_path == path_session) {
+        file.reset(new llama_file(path_session, "ab"));
+        if (file->size != ctx->session_size) {
+            file.reset();
+        }
+    }
+
+    if (file) {
+        runs = llama_session_runs(kv_self, false);
+
+        const size_t n_keep_max = std::min(n_token_count, ctx->session_tokens.size());
+        while (n_token_keep < n_keep_max && tokens[n_token_keep] == ctx->session_tokens[n_token_keep]) {
+            n_token_keep++;
+        }
+
+        // rewrite the file instead once most of it would be the data of cells overwritten or removed since
+        llama_data_size_context size_new;
+        llama_data_size_context size_all;
+        llama_session_write_record(ctx, &size_new, tokens, n_token_keep, n_token_count, runs, false);
+        llama_session_write_record(ctx, &size_all, tokens, 0, n_token_count, llama_session_runs(kv_self, true), false);
+
+        if (ctx->session_size + size_new.get_size_written() > 2*size_all.get_size_written()) {
+            file.reset();
+        }
+    }
+
+    const bool full = !file;
+
+    if (full) {
+        runs = llama_session_runs(kv_self, true);
+        n_token_keep = 0;
+
+        file.reset(new llama_file(path_session, "wb"));
+
+        file->write_u32(LLAMA_SESSION_MAGIC);
+        file->write_u32(LLAMA_SESSION_VERSION);
+
+        file->write_raw(&ctx->model.hparams, sizeof(llama_hparams));
+
+        file->write_u32(kv_self.size);
+        file->write_u32(kv_self.k_l[0]->type);
+        file->write_u32(kv_self.v_l[0]->type);
+        file->write_u32(kv_self.v_trans);
+    }
+
+    // the size of the record goes first, so that an interrupted checkpoint can be told apart
+    {
+        llama_data_size_context size_ctx;
+        llama_session_write_record(ctx, &size_ctx, tokens, n_token_keep, n_token_count, runs, false);
+
+        const uint64_t record_size = size_ctx.get_size_written();
+        file->write_raw(&record_size, sizeof(record_size));
+
+        llama_data_file_context data_ctx(file.get());
+        llama_session_write_record(ctx, &data_ctx, tokens, n_token_keep, n_token_count, runs, true);
+    }
+
+    if (full) {
+        for (uint32_t i = 0; i < kv_self.size; ++i) {
+            kv_self.cells[i].saved = false;
+        }
+    }
+    for (const auto & run : runs) {
+        for (uint32_t i = run.i0; i < run.i0 + run.n; ++i) {
+            kv_self.cells[i].saved = true;
+        }
+    }
+
+    ctx->session_path = path_session;
+    ctx->session_size = file->tell();
+    ctx->session_tokens.assign(tokens, tokens + n_token_count);
 
     return true;
 }
 
+bool llama_save_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count) {
+    try {
+        return llama_save_session_file_internal(ctx, path_session, tokens, n_token_count, false);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("error saving session file: %s\n", err.what());
+        return false;
+    }
+}
+
+bool llama_append_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count) {
+    try {
+        return llama_save_session_file_internal(ctx, path_session, tokens, n_token_count, true);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("error saving session file: %s\n", err.what());
+        return false;
+    }
+}
+
 int llama_eval(
         struct llama_context * ctx,
                  llama_token * tokens,
@@ -10006,6 +13087,13 @@ int llama_eval_embd(
 void llama_set_n_threads(struct llama_context * ctx, uint32_t n_threads, uint32_t n_threads_batch) {
     ctx->cparams.n_threads       = n_threads;
     ctx->cparams.n_threads_batch = n_threads_batch;
+
+    // grow the thread pool if needed, a larger pool can still run fewer threads
+    const int n_threads_max = std::max(n_threads, n_threads_batch);
+    if (ggml_threadpool_get_n_threads(ctx->threadpool) < n_threads_max) {
+        ggml_threadpool_free(ctx->threadpool);
+        ctx->threadpool = ggml_threadpool_new(n_threads_max);
+    }
 }
 
 struct llama_batch llama_batch_get_one(
@@ -10141,7 +13229,19 @@ int llama_tokenize(
                          int   n_max_tokens,
                         bool   add_bos,
                         bool   special) {
-    auto res = llama_tokenize_internal(model->vocab, std::string(text, text_len), add_bos, special);
+    return llama_tokenize_parallel(model, text, text_len, tokens, n_max_tokens, add_bos, special, 1);
+}
+
+int llama_tokenize_parallel(
+    const struct llama_model * model,
+                  const char * text,
+                         int   text_len,
+                 llama_token * tokens,
+                         int   n_max_tokens,
+                        bool   add_bos,
+                        bool   special,
+                         int   n_threads) {
+    auto res = llama_tokenize_internal(model->vocab, std::string(text, text_len), add_bos, special, n_threads);
 
     if (n_max_tokens < (int) res.size()) {
         // LLAMA_LOG_ERROR("%s: too many tokens\n", __func__);
@@ -43,7 +43,7 @@
 #define LLAMA_FILE_MAGIC_GGSN 0x6767736eu // 'ggsn'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
-#define LLAMA_SESSION_VERSION 3
+#define LLAMA_SESSION_VERSION 4
 
 #if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST) || defined(GGML_USE_METAL)
 // Defined when llama.cpp is compiled with support for offloading model layers to GPU.
@@ -179,6 +179,7 @@ extern "C" {
         int32_t n_gpu_layers; // number of layers to store in VRAM
         int32_t main_gpu;     // the GPU that is used for scratch and small tensors
         const float * tensor_split; // how to split layers across multiple GPUs (size: LLAMA_MAX_DEVICES)
+        int32_t n_threads_load;     // number of threads reading the model file when not using mmap
 
         // called with a progress value between 0 and 1, pass NULL to disable
         llama_progress_callback progress_callback;
@@ -189,10 +190,16 @@ extern "C" {
         // override key-value pairs of the model meta data
         const struct llama_model_kv_override * kv_overrides;
 
+        // file that keeps the repacked weights between loads, keyed by the model, NULL to repack on every load
+        const char * repack_cache;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only; // only load the vocabulary, no weights
         bool use_mmap;   // use mmap if possible
         bool use_mlock;  // force system to keep model in RAM
+        bool numa_split; // place the rows of each weight matrix on the NUMA nodes of the threads that compute them
+        bool huge_pages; // copy the weights into huge pages when not using mmap (Linux, not with pinned CUDA memory)
+        bool repack;     // interleave the rows of the Q4_0/Q8_0 weight matrices for the CPU when not using mmap
     };
 
     struct llama_context_params {
@@ -213,13 +220,19 @@ extern "C" {
         uint32_t yarn_orig_ctx;    // YaRN original context size
 
         enum ggml_type type_k; // data type for K cache
-        enum ggml_type type_v; // data type for V cache
+        enum ggml_type type_v; // data type for V cache, quantized types require flash_attn
+
+        enum ggml_wait_policy wait_policy; // how idle CPU threads wait for each other during graph compute
 
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool mul_mat_q;   // if true, use experimental mul_mat_q kernels (DEPRECATED - always true)
         bool logits_all;  // the llama_eval() call computes all logits, not just the last one (DEPRECATED - set llama_batch.logits instead)
         bool embedding;   // embedding mode only
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
+        bool fuse_ops;    // fuse the norm with the input conversion of the following matmuls on the CPU
+        bool flash_attn;  // compute attention with a single fused op instead of materializing KQ (CPU only)
+        bool graph_cache; // reuse the graphs of previous batches with the same shape (CPU only)
+        bool huge_pages;  // back the KV cache and the compute buffer with huge pages (Linux, not with pinned CUDA memory)
     };
 
     // model quantization parameters
@@ -481,6 +494,32 @@ extern "C" {
                        llama_pos   p1,
                        llama_pos   delta);
 
+    // Adds the KV cells holding tokens [0, n_tokens) of a sequence to the prefix index, in blocks of 32 tokens
+    // The tokens must have been decoded at positions 0 .. n_tokens - 1 of the sequence
+    // Indexed cells are kept after the sequence is removed, until the cache needs room for new tokens
+    // Returns the number of indexed tokens
+    LLAMA_API int32_t llama_kv_cache_prefix_store(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+               const llama_token * tokens,
+                         int32_t   n_tokens);
+
+    // Adds the cells of the longest indexed prefix of the tokens to an empty sequence
+    // Returns the number of tokens added - decoding continues at this position
+    // Pass n_tokens - 1 to still decode the last token of a prompt for its logits
+    LLAMA_API int32_t llama_kv_cache_prefix_attach(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+               const llama_token * tokens,
+                         int32_t   n_tokens);
+
+    // Moves the used KV cells to the free cells at the start of the cache, so that decoding attends to fewer cells
+    // At most about n_max cells are moved per call (all if n_max <= 0) - call it between decodes until it returns 0
+    // Returns the number of cells moved - always 0 when the cache is offloaded to the GPU
+    LLAMA_API int32_t llama_kv_cache_defrag(
+            struct llama_context * ctx,
+                         int32_t   n_max);
+
     //
     // State / sessions
     //
@@ -503,6 +542,8 @@ extern "C" {
                          uint8_t * src);
 
     // Save/load session file
+    // A session file holds the used cells of the KV cache only. It is read back through a memory mapping.
+    // The next llama_append_session_file() to the file saved or loaded last by the context appends to it.
     LLAMA_API bool llama_load_session_file(
             struct llama_context * ctx,
                       const char * path_session,
@@ -516,6 +557,16 @@ extern "C" {
                const llama_token * tokens,
                           size_t   n_token_count);
 
+    // Checkpoint to a session file: append the cells stored since the file was last saved or loaded
+    // by the context, along with the new tokens, the rng, logits and embedding, instead of rewriting it.
+    // The whole file is written if it is not the last one saved or loaded, was modified since, or would
+    // otherwise be mostly the data of cells removed or overwritten since.
+    LLAMA_API bool llama_append_session_file(
+            struct llama_context * ctx,
+                      const char * path_session,
+               const llama_token * tokens,
+                          size_t   n_token_count);
+
     //
     // Decoding
     //
@@ -640,6 +691,18 @@ extern "C" {
                             bool   add_bos,
                             bool   special);
 
+    // Same as llama_tokenize, texts of at least 128 KiB are cut into chunks that are tokenized on n_threads threads
+    // The tokens are the same as with llama_tokenize
+    LLAMA_API int llama_tokenize_parallel(
+        const struct llama_model * model,
+                      const char * text,
+                             int   text_len,
+                     llama_token * tokens,
+                             int   n_max_tokens,
+                            bool   add_bos,
+                            bool   special,
+                             int   n_threads);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -0,0 +1,288 @@
+// random allocation traces through ggml_tallocr give the offsets of the previous allocator, a best fit by linear scan
+// over the free blocks in address order, also when there are enough free blocks for the size classes to be used
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <unordered_map>
+#include <vector>
+
+static const size_t alignment  = 32;
+static const size_t graph_size = 4096;
+
+// the previous allocator, on offsets
+struct ref_allocr {
+    struct block {
+        size_t offs;
+        size_t size;
+    };
+
+    std::vector<block> blocks; // by offset, the last one is the unused end of the buffer
+    size_t max_size = 0;
+
+    bool size_classes = false;
+    int  n_switches   = 0;
+
+    explicit ref_allocr(size_t size) : blocks { { 0, size } } {}
+
+    size_t alloc(size_t size) {
+        size = GGML_PAD(size, alignment);
+
+        int best_fit_block = -1;
+        size_t best_fit_size = SIZE_MAX;
+        for (int i = 0; i < (int) blocks.size() - 1; i++) {
+            if (blocks[i].size >= size && blocks[i].size <= best_fit_size) {
+                best_fit_block = i;
+                best_fit_size = blocks[i].size;
+            }
+        }
+
+        if (best_fit_block == -1) {
+            assert(blocks.back().size >= size);
+            best_fit_block = blocks.size() - 1;
+        }
+
+        const size_t offs = blocks[best_fit_block].offs;
+        blocks[best_fit_block].offs += size;
+        blocks[best_fit_block].size -= size;
+        if (blocks[best_fit_block].size == 0) {
+            blocks.erase(blocks.begin() + best_fit_block);
+        }
+
+        max_size = std::max(max_size, offs + size);
+        track();
+
+        return offs;
+    }
+
+    void free(size_t offs, size_t size) {
+        size = GGML_PAD(size, alignment);
+
+        for (size_t i = 0; i < blocks.size(); i++) {
+            if (blocks[i].offs + blocks[i].size == offs) {
+                blocks[i].size += size;
+                if (i + 1 < blocks.size() && blocks[i].offs + blocks[i].size == blocks[i + 1].offs) {
+                    blocks[i].size += blocks[i + 1].size;
+                    blocks.erase(blocks.begin() + i + 1);
+                }
+                track();
+                return;
+            }
+            if (offs + size == blocks[i].offs) {
+                blocks[i].offs = offs;
+                blocks[i].size += size;
+                if (i > 0 && blocks[i - 1].offs + blocks[i - 1].size == blocks[i].offs) {
+                    blocks[i - 1].size += blocks[i].size;
+                    blocks.erase(blocks.begin() + i);
+                }
+                track();
+                return;
+            }
+        }
+
+        size_t pos = 0;
+        while (pos < blocks.size() && blocks[pos].offs < offs) {
+            pos++;
+        }
+        blocks.insert(blocks.begin() + pos, { offs, size });
+        track();
+    }
+
+    // the size classes of ggml_tallocr are used from 32 free blocks on, until there are fewer than 16 again
+    void track() {
+        const int n = blocks.size();
+        if (!size_classes && n >= 32) {
+            size_classes = true;
+            n_switches++;
+        } else if (size_classes && n < 16) {
+            size_classes = false;
+            n_switches++;
+        }
+    }
+};
+
+// rounds of n_nodes tensors of random sizes, each reading up to four of the last n_window ones, so that their lifetimes
+// overlap in many ways; the ops are only tags, the graph is allocated and never computed
+static ggml_cgraph * build_graph(ggml_context * ctx, int n_rounds, int n_nodes, int n_window) {
+    // a few common sizes, so that free blocks of the same size compete
+    static const int64_t common[] = { 64, 256, 1000, 4096 };
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx, graph_size, false);
+
+    for (int round = 0; round < n_rounds; ++round) {
+        std::vector<ggml_tensor *> tensors;
+
+        for (int i = 0; i < 8; ++i) {
+            tensors.push_back(ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1 + rand() % 4096));
+        }
+
+        for (int i = 0; i < n_nodes; ++i) {
+            const int64_t ne = rand() % 2 ? common[rand() % 4] : 1 + rand() % 4096;
+
+            ggml_tensor * node = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne);
+            node->op = GGML_OP_CONCAT; // cannot be computed in place of its sources
+
+            const int n = tensors.size();
+
+            // the tensor that leaves the window is read at the latest now, so that all but the last ones are freed
+            int n_src = 0;
+            if (n >= n_window) {
+                node->src[n_src++] = tensors[n - n_window];
+            }
+
+            for (int j = rand() % 3; j >= 0; --j) {
+                node->src[n_src++] = tensors[n - 1 - rand() % std::min(n, n_window)];
+            }
+
+            tensors.push_back(node);
+            ggml_build_forward_expand(gf, node);
+        }
+
+        // a chain of nodes reading the tensors that were not read yet, so that the round ends with few free blocks
+        std::vector<bool> read(tensors.size(), false);
+        for (ggml_tensor * t : tensors) {
+            for (int j = 0; j < GGML_MAX_SRC && t->src[j]; ++j) {
+                read[std::find(tensors.begin(), tensors.end(), t->src[j]) - tensors.begin()] = true;
+            }
+        }
+
+        ggml_tensor * last = NULL;
+        for (size_t i = 0; i < tensors.size(); ) {
+            ggml_tensor * node = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1 + rand() % 4096);
+            node->op = GGML_OP_CONCAT;
+
+            int n_src = 0;
+            if (last) {
+                node->src[n_src++] = last;
+            }
+            for (; i < tensors.size() && n_src < GGML_MAX_SRC; ++i) {
+                if (!read[i]) {
+                    node->src[n_src++] = tensors[i];
+                }
+            }
+
+            ggml_build_forward_expand(gf, node);
+            last = node;
+        }
+    }
+
+    return gf;
+}
+
+// the trace of ggml_gallocr_alloc_graph() on the reference allocator: the sources and the node are allocated in
+// the order of the nodes, and a tensor is freed once the last node reading it is done
+static std::vector<size_t> replay(ggml_cgraph * gf, ref_allocr & ref) {
+    std::vector<size_t> offs(gf->n_nodes + gf->n_leafs, SIZE_MAX);
+
+    std::unordered_map<const ggml_tensor *, int> indices;
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        indices[gf->nodes[i]] = i;
+    }
+    for (int i = 0; i < gf->n_leafs; ++i) {
+        indices[gf->leafs[i]] = gf->n_nodes + i;
+    }
+
+    auto index = [&](const ggml_tensor * t) {
+        return indices.at(t);
+    };
+
+    std::vector<int> n_children(offs.size(), 0);
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        for (int j = 0; j < GGML_MAX_SRC && gf->nodes[i]->src[j]; ++j) {
+            n_children[index(gf->nodes[i]->src[j])]++;
+        }
+    }
+
+    auto alloc = [&](const ggml_tensor * t) {
+        const int k = index(t);
+        if (offs[k] == SIZE_MAX) {
+            offs[k] = ref.alloc(ggml_nbytes(t));
+        }
+    };
+
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        ggml_tensor * node = gf->nodes[i];
+
+        for (int j = 0; j < GGML_MAX_SRC && node->src[j]; ++j) {
+            alloc(node->src[j]);
+        }
+        alloc(node);
+
+        for (int j = 0; j < GGML_MAX_SRC && node->src[j]; ++j) {
+            const int k = index(node->src[j]);
+            if (--n_children[k] == 0) {
+                ref.free(offs[k], ggml_nbytes(node->src[j]));
+            }
+        }
+    }
+
+    return offs;
+}
+
+static void test_alloc_replay(ggml_tallocr_t talloc, const uint8_t * base, size_t size, size_t & max_size,
+        int n_rounds, int n_nodes, int n_window, bool size_classes) {
+    ggml_init_params params = { ggml_tensor_overhead()*n_rounds*(2*n_nodes + 16) + ggml_graph_overhead_custom(graph_size, false), NULL, true };
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_cgraph * gf = build_graph(ctx, n_rounds, n_nodes, n_window);
+
+    ref_allocr ref(size);
+    const std::vector<size_t> offs = replay(gf, ref);
+
+    // the size classes were turned on and off again in each round, or never used
+    assert(ref.n_switches == (size_classes ? 2*n_rounds : 0));
+
+    ggml_tallocr_reset(talloc);
+
+    ggml_gallocr_t galloc = ggml_gallocr_new();
+    ggml_gallocr_alloc_graph(galloc, talloc, gf);
+    ggml_gallocr_free(galloc);
+
+    for (int i = 0; i < gf->n_nodes + gf->n_leafs; ++i) {
+        const ggml_tensor * t = i < gf->n_nodes ? gf->nodes[i] : gf->leafs[i - gf->n_nodes];
+        const size_t cur = (const uint8_t *) t->data - base;
+        if (cur != offs[i]) {
+            fprintf(stderr, "%s: n_nodes %d, n_window %d: tensor %d: expected offset %zu, got %zu\n",
+                    __func__, n_nodes, n_window, i, offs[i], cur);
+            assert(false);
+        }
+    }
+
+    // kept across the resets
+    max_size = std::max(max_size, ref.max_size);
+    assert(ggml_tallocr_max_size(talloc) == max_size);
+
+    ggml_free(ctx);
+}
+
+int main(void) {
+    const size_t size = 64u*1024*1024;
+
+    std::vector<uint8_t> buf(size + alignment);
+    uint8_t * base = (uint8_t *) GGML_PAD((uintptr_t) buf.data(), alignment);
+
+    // the allocator is reset between the graphs, with its size classes on or off
+    ggml_tallocr_t talloc = ggml_tallocr_new(base, size, alignment);
+
+    srand(42);
+
+    size_t max_size = 0;
+
+    for (int rep = 0; rep < 20; ++rep) {
+        // few free blocks, the linear scan only
+        test_alloc_replay(talloc, base, size, max_size, 1, 200, 4, false);
+
+        // long lifetimes: many free blocks between the live tensors, and few again at the end of each round
+        test_alloc_replay(talloc, base, size, max_size, 3, 800, 240, true);
+    }
+
+    ggml_tallocr_free(talloc);
+
+    return 0;
+}
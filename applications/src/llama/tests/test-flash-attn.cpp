@@ -0,0 +1,147 @@
+// ggml_flash_attn_ext() gives the attention of the mul_mat -> soft_max_ext -> mul_mat path, for V stored by rows,
+// transposed and quantized
+
+#include "ggml.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+static const int n_head    = 4;
+static const int n_head_kv = 2;
+
+// fills t with random values and returns them as stored, after the rounding of its type
+static std::vector<float> set_random(ggml_tensor * t) {
+    const int64_t n = ggml_nelements(t);
+
+    std::vector<float> data(n);
+    for (auto & v : data) {
+        v = 2.0f*rand()/RAND_MAX - 1.0f;
+    }
+
+    if (t->type == GGML_TYPE_F32) {
+        memcpy(t->data, data.data(), n*sizeof(float));
+        return data;
+    }
+
+    ggml_type_traits_t traits = ggml_internal_get_type_traits(t->type);
+    traits.from_float(data.data(), t->data, n);
+    traits.to_float(t->data, data.data(), n);
+
+    return data;
+}
+
+static void test_flash_attn(int D, int n_kv, int n_q, ggml_type type_k, ggml_type type_v, bool v_trans, int n_threads) {
+    ggml_init_params params = { 64u*1024*1024, NULL, false };
+    ggml_context * ctx = ggml_init(params);
+
+    srand(n_kv + n_q);
+
+    ggml_tensor * q = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, D, n_q,  n_head);
+    ggml_tensor * k = ggml_new_tensor_3d(ctx, type_k,        D, n_kv, n_head_kv);
+
+    set_random(q);
+    set_random(k);
+
+    // the values of V as stored, in the [n_kv, D, n_head_kv] layout of the soft_max_ext path
+    ggml_tensor * v_ref = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_kv, D, n_head_kv);
+    ggml_tensor * v;
+
+    if (v_trans) {
+        ggml_tensor * vt = ggml_new_tensor_3d(ctx, type_v, n_kv, D, n_head_kv);
+        const std::vector<float> data = set_random(vt);
+        memcpy(v_ref->data, data.data(), data.size()*sizeof(float));
+
+        v = ggml_transpose(ctx, vt);
+    } else {
+        v = ggml_new_tensor_3d(ctx, type_v, D, n_kv, n_head_kv);
+        const std::vector<float> data = set_random(v);
+
+        for (int h = 0; h < n_head_kv; ++h) {
+            for (int j = 0; j < n_kv; ++j) {
+                for (int d = 0; d < D; ++d) {
+                    ((float *) v_ref->data)[(h*D + d)*n_kv + j] = data[(h*n_kv + j)*D + d];
+                }
+            }
+        }
+    }
+
+    // causal, with some more holes
+    ggml_tensor * mask = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_kv, n_q);
+    for (int i = 0; i < n_q; ++i) {
+        for (int j = 0; j < n_kv; ++j) {
+            const bool masked = j > n_kv - n_q + i || (j > 0 && j % 7 == 3);
+            ((float *) mask->data)[i*n_kv + j] = masked ? -INFINITY : 0.0f;
+        }
+    }
+
+    const float scale = 1.0f/sqrtf((float) D);
+
+    // [D, n_head, n_q]
+    ggml_tensor * fa = ggml_flash_attn_ext(ctx, q, k, v, mask, scale);
+
+    ggml_tensor * kq  = ggml_soft_max_ext(ctx, ggml_mul_mat(ctx, k, q), mask, scale);
+    ggml_tensor * ref = ggml_cont(ctx, ggml_permute(ctx, ggml_mul_mat(ctx, v_ref, kq), 0, 2, 1, 3));
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, fa);
+    ggml_build_forward_expand(gf, ref);
+
+    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+
+    assert(ggml_are_same_shape(fa, ref));
+
+    // the scores are rounded to F16 for the product with a transposed F16 V, and the online softmax over the tiles
+    // of a long row sums in a different order
+    const float tol = 5e-4f;
+
+    for (int64_t i = 0; i < ggml_nelements(ref); ++i) {
+        const float r = ((float *) ref->data)[i];
+        const float c = ((float *) fa->data)[i];
+
+        if (!(std::fabs(c - r) <= tol*(1.0f + std::fabs(r)))) {
+            fprintf(stderr, "%s: D %d, n_kv %d, n_q %d, K %s, V %s%s, n_threads %d: value %lld: expected %f, got %f\n",
+                    __func__, D, n_kv, n_q, ggml_type_name(type_k), ggml_type_name(type_v), v_trans ? " transposed" : "",
+                    n_threads, (long long) i, r, c);
+            assert(false);
+        }
+    }
+
+    ggml_free(ctx);
+}
+
+int main(void) {
+    struct kv_types {
+        ggml_type type_k;
+        ggml_type type_v;
+        bool      v_trans;
+    };
+
+    const kv_types types[] = {
+        { GGML_TYPE_F32,  GGML_TYPE_F32,  false },
+        { GGML_TYPE_F32,  GGML_TYPE_F32,  true  },
+        { GGML_TYPE_F16,  GGML_TYPE_F16,  false },
+        { GGML_TYPE_F16,  GGML_TYPE_F16,  true  },
+        { GGML_TYPE_F16,  GGML_TYPE_Q8_0, false },
+        { GGML_TYPE_Q8_0, GGML_TYPE_Q8_0, false },
+    };
+
+    for (int D : { 32, 64 }) {
+        // one KV tile and several, decoding and batches below and above the rows that are processed together
+        for (int n_kv : { 40, 150 }) {
+            for (int n_q : { 1, 3, 16 }) {
+                for (const auto & t : types) {
+                    for (int n_threads : { 1, 3 }) {
+                        test_flash_attn(D, n_kv, n_q, t.type_k, t.type_v, t.v_trans, n_threads);
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
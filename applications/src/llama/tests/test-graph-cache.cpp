@@ -0,0 +1,107 @@
+// the graphs kept across llama_decode() calls give the logits of freshly built graphs, when the batch shape changes,
+// when a shape comes back and when an evicted graph is built again
+
+#include "llama.h"
+#include "common.h"
+#include "tiny-model.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct test_step {
+    int       n_tokens;
+    llama_pos p_rm; // >= 0: remove the positions from p_rm on first and continue from there
+};
+
+// the shapes are (n_tokens, number of KV cells attended to in steps of 32): more than LLAMA_MAX_GRAPHS (4) of them,
+// so that the least recently used graphs are evicted and built again when their shape comes back
+static const test_step steps[] = {
+    { 20, -1 }, {  1, -1 }, {  1, -1 }, {  7, -1 }, {  1, -1 }, // (20, 32) (1, 32) (7, 32)
+    { 13, -1 }, {  1, -1 }, {  1, -1 },                         // (13, 64) (1, 64)
+    {  2, -1 }, {  3, -1 }, {  4, -1 }, {  1, -1 },             // (2, 64) (3, 64) (4, 64) evict the first ones
+    {  1, 30 }, {  1, -1 }, {  7, -1 },                         // (1, 32) built again, (7, 64)
+    { 20,  0 }, {  1, -1 }, { 20, -1 }, { 20, -1 },             // (20, 32) built again, (20, 64)
+    {  1, 10 }, {  2, -1 }, {  1, -1 },                         // (2, 32)
+};
+
+struct test_state {
+    llama_context * ctx;
+    llama_batch     batch;
+    llama_pos       pos = 0;
+};
+
+// decodes the step and returns the logits of all its tokens
+static std::vector<float> decode(test_state & st, const test_step & step) {
+    if (step.p_rm >= 0) {
+        llama_kv_cache_seq_rm(st.ctx, 0, step.p_rm, -1);
+        st.pos = step.p_rm;
+    }
+
+    llama_batch_clear(st.batch);
+    for (int i = 0; i < step.n_tokens; ++i) {
+        llama_batch_add(st.batch, 3 + (7*st.pos + 5) % 256, st.pos, { 0 }, true);
+        st.pos++;
+    }
+
+    const int ret = llama_decode(st.ctx, st.batch);
+    assert(ret == 0);
+
+    const int n_vocab = llama_n_vocab(llama_get_model(st.ctx));
+
+    std::vector<float> res;
+    for (int i = 0; i < step.n_tokens; ++i) {
+        const float * logits = llama_get_logits_ith(st.ctx, i);
+        res.insert(res.end(), logits, logits + n_vocab);
+    }
+
+    return res;
+}
+
+static void test_graph_cache(llama_model * model) {
+    llama_context_params cparams = tiny_model_context_params(256, 32);
+
+    test_state cur;
+    cur.ctx   = llama_new_context_with_model(model, cparams);
+    cur.batch = llama_batch_init(32, 0, 1);
+
+    cparams.graph_cache = false;
+
+    test_state ref;
+    ref.ctx   = llama_new_context_with_model(model, cparams);
+    ref.batch = llama_batch_init(32, 0, 1);
+
+    assert(cur.ctx != NULL && ref.ctx != NULL);
+
+    // twice, the second time starting with the graphs left over from the first
+    for (int rep = 0; rep < 2; ++rep) {
+        llama_kv_cache_clear(cur.ctx);
+        llama_kv_cache_clear(ref.ctx);
+        cur.pos = ref.pos = 0;
+
+        for (size_t s = 0; s < sizeof(steps)/sizeof(steps[0]); ++s) {
+            const std::vector<float> logits_ref = decode(ref, steps[s]);
+            const std::vector<float> logits_cur = decode(cur, steps[s]);
+
+            for (size_t i = 0; i < logits_ref.size(); ++i) {
+                if (!(std::fabs(logits_cur[i] - logits_ref[i]) <= 1e-6f*(1.0f + std::fabs(logits_ref[i])))) {
+                    fprintf(stderr, "%s: rep %d, step %zu: logit %zu: expected %f, got %f\n",
+                            __func__, rep, s, i, logits_ref[i], logits_cur[i]);
+                    assert(false);
+                }
+            }
+        }
+    }
+
+    llama_batch_free(cur.batch);
+    llama_batch_free(ref.batch);
+    llama_free(cur.ctx);
+    llama_free(ref.ctx);
+}
+
+int main(void) {
+    return tiny_model_run("test-graph-cache.gguf", test_graph_cache);
+}
@@ -0,0 +1,251 @@
+// the step scheduler, the fused rms_norm -> mul -> mul_mat chains and the chunked mul_mat give the results of the
+// plain graph compute, for all thread counts and wait policies; the profile events are not replaced during a compute
+
+#include "ggml.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+static const int n_embd = 512; // two pieces of the fused conversion
+static const int n_ff   = 512;
+
+struct test_graph {
+    ggml_context * ctx;
+    ggml_cgraph  * gf;
+
+    ggml_tensor * x;
+    std::vector<ggml_tensor *> fused; // the mul nodes that are fused with their rms_norm
+    std::vector<ggml_tensor *> outs;
+};
+
+static ggml_tensor * new_weights(ggml_context * ctx, ggml_type type, int64_t ne0, int64_t ne1) {
+    ggml_tensor * t = ggml_new_tensor_2d(ctx, type, ne0, ne1);
+
+    std::vector<float> data(ne0*ne1);
+    for (auto & v : data) {
+        v = (2.0f*rand()/RAND_MAX - 1.0f)/sqrtf((float) ne0);
+    }
+
+    if (type == GGML_TYPE_F32) {
+        memcpy(t->data, data.data(), ggml_nbytes(t));
+    } else {
+        ggml_internal_get_type_traits(type).from_float(data.data(), t->data, data.size());
+    }
+
+    return t;
+}
+
+static ggml_tensor * new_norm_weights(ggml_context * ctx) {
+    ggml_tensor * t = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+    for (int i = 0; i < n_embd; ++i) {
+        ((float *) t->data)[i] = 1.0f + 0.1f*(2.0f*rand()/RAND_MAX - 1.0f);
+    }
+    return t;
+}
+
+// a llama layer: attention projections of one norm, the FFN of another, and a norm whose result is also read by an
+// op that is not a mul_mat, so that it is not fused
+static test_graph build_graph(int n_tokens) {
+    test_graph tg;
+
+    ggml_init_params params = { 64u*1024*1024, NULL, false };
+    tg.ctx = ggml_init(params);
+
+    ggml_context * ctx = tg.ctx;
+
+    srand(1);
+
+    tg.x = new_weights(ctx, GGML_TYPE_F32, n_embd, n_tokens);
+
+    ggml_tensor * wq = new_weights(ctx, GGML_TYPE_Q4_0, n_embd, n_embd);
+    ggml_tensor * wk = new_weights(ctx, GGML_TYPE_Q8_0, n_embd, n_embd);
+    ggml_tensor * wv = new_weights(ctx, GGML_TYPE_Q4_0, n_embd, n_embd);
+    ggml_tensor * wo = new_weights(ctx, GGML_TYPE_F16,  n_embd, n_embd);
+    ggml_tensor * wg = new_weights(ctx, GGML_TYPE_Q4_K, n_embd, n_ff);
+    ggml_tensor * wu = new_weights(ctx, GGML_TYPE_Q6_K, n_embd, n_ff);
+    ggml_tensor * wd = new_weights(ctx, GGML_TYPE_Q4_0, n_ff,   n_embd);
+    ggml_tensor * wr = new_weights(ctx, GGML_TYPE_F32,  n_embd, n_embd);
+
+    ggml_tensor * cur = ggml_mul(ctx, ggml_rms_norm(ctx, tg.x, 1e-5f), new_norm_weights(ctx));
+    tg.fused.push_back(cur);
+
+    ggml_tensor * q = ggml_mul_mat(ctx, wq, cur);
+    ggml_tensor * k = ggml_mul_mat(ctx, wk, cur);
+    ggml_tensor * v = ggml_mul_mat(ctx, wv, cur);
+
+    ggml_tensor * h = ggml_add(ctx, tg.x, ggml_mul_mat(ctx, wo, ggml_add(ctx, ggml_mul(ctx, q, k), v)));
+
+    cur = ggml_mul(ctx, ggml_rms_norm(ctx, h, 1e-5f), new_norm_weights(ctx));
+    tg.fused.push_back(cur);
+
+    ggml_tensor * g = ggml_mul_mat(ctx, wg, cur);
+    ggml_tensor * u = ggml_mul_mat(ctx, wu, cur);
+
+    h = ggml_add(ctx, h, ggml_mul_mat(ctx, wd, ggml_mul(ctx, ggml_silu(ctx, g), u)));
+
+    cur = ggml_mul(ctx, ggml_rms_norm(ctx, h, 1e-5f), new_norm_weights(ctx));
+
+    tg.outs.push_back(h);
+    tg.outs.push_back(ggml_mul_mat(ctx, wq, cur));
+    tg.outs.push_back(ggml_mul_mat(ctx, wr, cur));
+    tg.outs.push_back(ggml_soft_max(ctx, cur));
+
+    tg.gf = ggml_new_graph(ctx);
+    for (auto * out : tg.outs) {
+        ggml_build_forward_expand(tg.gf, out);
+    }
+
+    return tg;
+}
+
+struct test_config {
+    int  n_threads;
+    ggml_wait_policy wait_policy;
+    int  n_parallel_nodes;
+    bool fuse_ops;
+    bool threadpool;
+};
+
+static std::vector<std::vector<float>> compute(test_graph & tg, const test_config & tc, ggml_threadpool * threadpool) {
+    for (int i = 0; i < tg.gf->n_nodes; ++i) {
+        ggml_tensor * node = tg.gf->nodes[i];
+        for (int64_t j = 0; j < ggml_nelements(node); ++j) {
+            ((float *) node->data)[j] = NAN;
+        }
+    }
+
+    ggml_cplan plan = ggml_graph_plan(tg.gf, tc.n_threads);
+    plan.threadpool       = threadpool;
+    plan.wait_policy      = tc.wait_policy;
+    plan.n_parallel_nodes = tc.n_parallel_nodes;
+    plan.fuse_ops         = tc.fuse_ops;
+
+    std::vector<uint8_t> work(plan.work_size);
+    plan.work_data = work.data();
+
+    const int ret = ggml_graph_compute(tg.gf, &plan);
+    assert(ret == 0);
+
+    // the fused path ran: the F32 results of the fused muls are not stored
+    for (auto * mul : tg.fused) {
+        assert(std::isnan(((float *) mul->data)[0]) == tc.fuse_ops);
+    }
+
+    std::vector<std::vector<float>> res;
+    for (auto * out : tg.outs) {
+        const float * data = (const float *) out->data;
+        res.emplace_back(data, data + ggml_nelements(out));
+    }
+
+    return res;
+}
+
+static void test_graph_compute(int n_tokens) {
+    test_graph tg = build_graph(n_tokens);
+
+    const std::vector<std::vector<float>> ref = compute(tg, { 1, GGML_WAIT_POLICY_DEFAULT, 1, false, false }, NULL);
+
+    // busy waiting threads that do not have a core of their own spin until they are preempted
+    const int n_spin_max = std::max(2, (int) std::thread::hardware_concurrency());
+
+    std::vector<test_config> configs;
+    for (int n_threads : { 1, 2, 4 }) {
+        for (int wait_policy = 0; wait_policy < GGML_WAIT_POLICY_COUNT; ++wait_policy) {
+            if ((wait_policy == GGML_WAIT_POLICY_DEFAULT || wait_policy == GGML_WAIT_POLICY_SPIN) && n_threads > n_spin_max) {
+                continue;
+            }
+            for (int n_parallel_nodes : { 1, GGML_DEFAULT_N_PARALLEL_NODES }) {
+                for (bool fuse_ops : { false, true }) {
+                    configs.push_back({ n_threads, (ggml_wait_policy) wait_policy, n_parallel_nodes, fuse_ops, n_threads > 2 });
+                }
+            }
+        }
+    }
+
+    for (const auto & tc : configs) {
+        ggml_threadpool * threadpool = tc.threadpool ? ggml_threadpool_new(tc.n_threads) : NULL;
+
+        // twice, the second time on the parked workers of the thread pool
+        for (int rep = 0; rep < 2; ++rep) {
+            const std::vector<std::vector<float>> cur = compute(tg, tc, threadpool);
+
+            for (size_t i = 0; i < ref.size(); ++i) {
+                for (size_t j = 0; j < ref[i].size(); ++j) {
+                    if (!(std::fabs(cur[i][j] - ref[i][j]) <= 1e-5f*(1.0f + std::fabs(ref[i][j])))) {
+                        fprintf(stderr, "%s: n_tokens %d, n_threads %d, wait policy %d, n_parallel_nodes %d, fuse_ops %d: "
+                                "output %zu, value %zu: expected %f, got %f\n", __func__, n_tokens, tc.n_threads,
+                                tc.wait_policy, tc.n_parallel_nodes, tc.fuse_ops, i, j, ref[i][j], cur[i][j]);
+                        assert(false);
+                    }
+                }
+            }
+        }
+
+        if (threadpool) {
+            ggml_threadpool_free(threadpool);
+        }
+    }
+
+    ggml_free(tg.ctx);
+}
+
+// a node that tries to replace and clear the events of the profile while its graph records into them
+static void profile_update_op(ggml_tensor * dst, const ggml_tensor * a, int ith, int nth, void * userdata) {
+    bool * updated = (bool *) userdata;
+
+    if (ith == 0) {
+        updated[0] = ggml_profile_enable(1024);
+        updated[1] = ggml_profile_reset();
+    }
+
+    const int64_t n = ggml_nelements(dst);
+    for (int64_t i = ith*n/nth; i < (ith + 1)*n/nth; ++i) {
+        ((float *) dst->data)[i] = ((const float *) a->data)[i];
+    }
+}
+
+static void test_profile_update(void) {
+    ggml_init_params params = { 16*1024*1024, NULL, false };
+    ggml_context * ctx = ggml_init(params);
+
+    bool updated[2] = { true, true };
+
+    ggml_tensor * a = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1024);
+    ggml_set_f32(a, 1.0f);
+
+    ggml_tensor * out = ggml_map_custom1(ctx, ggml_neg(ctx, a), profile_update_op, GGML_N_TASKS_MAX, updated);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, ggml_neg(ctx, out));
+
+    assert(ggml_profile_enable(16));
+
+    for (int n_threads : { 1, 2 }) {
+        ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+        assert(!updated[0] && !updated[1]);
+    }
+
+    // updated again once no graph is computed
+    assert(ggml_profile_enable(1024) && ggml_profile_reset());
+    ggml_profile_disable();
+
+    ggml_free(ctx);
+}
+
+int main(void) {
+    test_profile_update();
+
+    // a single token, a batch below and one above GGML_GEMM_MIN_NE11
+    for (int n_tokens : { 1, 7, 40 }) {
+        test_graph_compute(n_tokens);
+    }
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+// placement of the tokens of a sequence in the blocks of the paged KV cache
+
+#include "llama.h"
+#include "common.h"
+#include "tiny-model.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <string>
+
+static const int n_block = 32; // LLAMA_KV_BLOCK_SIZE
+
+static void decode(llama_context * ctx, llama_batch & batch, llama_pos p0, llama_pos p1) {
+    llama_batch_clear(batch);
+    for (llama_pos p = p0; p < p1; ++p) {
+        llama_batch_add(batch, 3 + p % 256, p, { 0 }, false);
+    }
+    batch.logits[batch.n_tokens - 1] = true;
+
+    const int ret = llama_decode(ctx, batch);
+    assert(ret == 0);
+}
+
+// tokens appended after the lower blocks of a sequence were freed go to one new block at a time,
+// instead of a new block per token
+static void test_append_after_free(llama_context * ctx) {
+    llama_kv_cache_clear(ctx);
+
+    llama_batch batch = llama_batch_init(128, 0, 1);
+
+    decode(ctx, batch, 0, 3*n_block);                  // blocks 0, 1 and 2
+    llama_kv_cache_seq_rm(ctx, 0, 0, 2*n_block);       // free blocks 0 and 1
+
+    const llama_pos p_end = 4*n_block + 8;
+    for (llama_pos p = 3*n_block; p < p_end; ++p) {
+        decode(ctx, batch, p, p + 1);
+    }
+
+    llama_kv_cache_view view = llama_kv_cache_view_init(ctx, 1);
+    llama_kv_cache_view_update(ctx, &view);
+
+    for (int i = 0; i < view.n_cells; ++i) {
+        llama_pos expected = -1;
+        if (i < p_end - 3*n_block) {
+            expected = 3*n_block + i;           // the appended tokens fill block 0, then block 1
+        } else if (i >= 2*n_block && i < 3*n_block) {
+            expected = i;                       // block 2 is untouched
+        }
+
+        if (view.cells[i].pos != expected) {
+            fprintf(stderr, "%s: cell %d: expected pos %d, got %d\n", __func__, i, expected, view.cells[i].pos);
+        }
+        assert(view.cells[i].pos == expected);
+    }
+
+    llama_kv_cache_view_free(&view);
+    llama_batch_free(batch);
+}
+
+int main(void) {
+    return tiny_model_run_ctx("test-kv-cache-blocks.gguf", tiny_model_context_params(8*n_block, 128), test_append_after_free);
+}
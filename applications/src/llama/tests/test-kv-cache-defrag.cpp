@@ -0,0 +1,94 @@
+// moving the used cells of a fragmented KV cache to its start with llama_kv_cache_defrag()
+
+#include "llama.h"
+#include "common.h"
+#include "tiny-model.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static const int n_ctx   = 4096;
+static const int n_batch = 512;
+
+static void decode(llama_context * ctx, llama_batch & batch, llama_pos p0, llama_pos p1) {
+    for (llama_pos p = p0; p < p1; p += n_batch) {
+        llama_batch_clear(batch);
+        for (llama_pos i = p; i < std::min(p + n_batch, p1); ++i) {
+            llama_batch_add(batch, 3 + i % 256, i, { 0 }, false);
+        }
+        batch.logits[batch.n_tokens - 1] = true;
+
+        const int ret = llama_decode(ctx, batch);
+        assert(ret == 0);
+    }
+}
+
+// fill the cache and free every other cell
+static void fragment(llama_context * ctx, llama_batch & batch) {
+    llama_kv_cache_clear(ctx);
+
+    decode(ctx, batch, 0, n_ctx - 1);
+
+    for (llama_pos p = 1; p < n_ctx - 1; p += 2) {
+        llama_kv_cache_seq_rm(ctx, 0, p, p + 1);
+    }
+}
+
+static std::vector<float> next_logits(llama_context * ctx, llama_batch & batch) {
+    decode(ctx, batch, n_ctx - 1, n_ctx);
+
+    const float * logits = llama_get_logits_ith(ctx, batch.n_tokens - 1);
+
+    return std::vector<float>(logits, logits + llama_n_vocab(llama_get_model(ctx)));
+}
+
+// the runs of single cells give more moves than fit in one graph, so the copies are split across graphs
+static void test_defrag_fragmented(llama_context * ctx) {
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+
+    fragment(ctx, batch);
+    const std::vector<float> ref = next_logits(ctx, batch);
+
+    fragment(ctx, batch);
+
+    const int n_used = llama_get_kv_cache_used_cells(ctx);
+
+    int n_moved = 0;
+    for (int ret; (ret = llama_kv_cache_defrag(ctx, 0)) > 0; ) {
+        n_moved += ret;
+    }
+    assert(n_moved > 0);
+
+    llama_kv_cache_view view = llama_kv_cache_view_init(ctx, 1);
+    llama_kv_cache_view_update(ctx, &view);
+
+    for (int i = 0; i < view.n_cells; ++i) {
+        if ((i < n_used) != (view.cells[i].pos >= 0)) {
+            fprintf(stderr, "%s: cell %d: unexpected pos %d, %d cells used\n", __func__, i, view.cells[i].pos, n_used);
+        }
+        assert((i < n_used) == (view.cells[i].pos >= 0));
+    }
+
+    llama_kv_cache_view_free(&view);
+
+    // the moved K and V rows give the same attention, up to the summation order
+    const std::vector<float> cur = next_logits(ctx, batch);
+
+    for (size_t i = 0; i < ref.size(); ++i) {
+        if (std::fabs(cur[i] - ref[i]) > 1e-4f*(1.0f + std::fabs(ref[i]))) {
+            fprintf(stderr, "%s: logit %zu: expected %f, got %f\n", __func__, i, ref[i], cur[i]);
+            assert(false);
+        }
+    }
+
+    llama_batch_free(batch);
+}
+
+int main(void) {
+    return tiny_model_run_ctx("test-kv-cache-defrag.gguf", tiny_model_context_params(n_ctx, n_batch), test_defrag_fragmented);
+}
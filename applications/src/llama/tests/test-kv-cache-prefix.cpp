@@ -0,0 +1,128 @@
+// the prefix index: prompt blocks stored for one sequence are attached to others and give the logits of decoding the
+// whole prompt, and they are evicted when the cache needs room
+
+#include "llama.h"
+#include "common.h"
+#include "tiny-model.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static const int n_ctx    = 256; // 8 blocks of 32 cells
+static const int n_prompt = 70;  // 2 full blocks and 6 more tokens
+
+static std::vector<llama_token> make_prompt(int n_tokens, int seed) {
+    std::vector<llama_token> tokens(n_tokens);
+    for (int i = 0; i < n_tokens; ++i) {
+        tokens[i] = 3 + (17*i + seed) % 256;
+    }
+    return tokens;
+}
+
+// decodes tokens [p0, p1) of the prompt for the sequence at their positions, returns the logits of the last one
+static std::vector<float> decode(llama_context * ctx, llama_seq_id seq_id, const std::vector<llama_token> & tokens, int p0, int p1) {
+    llama_batch batch = llama_batch_init(p1 - p0, 0, 1);
+
+    for (int p = p0; p < p1; ++p) {
+        llama_batch_add(batch, tokens[p], p, { seq_id }, p + 1 == p1);
+    }
+
+    const int ret = llama_decode(ctx, batch);
+    assert(ret == 0);
+
+    llama_batch_free(batch);
+
+    const float * logits = llama_get_logits_ith(ctx, p1 - p0 - 1);
+
+    return std::vector<float>(logits, logits + llama_n_vocab(llama_get_model(ctx)));
+}
+
+// the logits of the prompt decoded from scratch
+static std::vector<float> decode_fresh(llama_context * ctx, const std::vector<llama_token> & tokens) {
+    llama_kv_cache_clear(ctx);
+    return decode(ctx, 0, tokens, 0, tokens.size());
+}
+
+// the cells of the attached prompt and of the new tokens are not in the order of a fresh decode, and the batches are split
+// differently, which changes the order of the sums
+static void compare(const char * name, const std::vector<float> & ref, const std::vector<float> & cur) {
+    for (size_t i = 0; i < ref.size(); ++i) {
+        if (!(std::fabs(cur[i] - ref[i]) <= 1e-3f*(1.0f + std::fabs(ref[i])))) {
+            fprintf(stderr, "%s: %s: logit %zu: expected %f, got %f\n", __func__, name, i, ref[i], cur[i]);
+            assert(false);
+        }
+    }
+}
+
+static void test_kv_cache_prefix(llama_model * model) {
+    const llama_context_params cparams = tiny_model_context_params(n_ctx, n_ctx);
+
+    llama_context * ctx     = llama_new_context_with_model(model, cparams);
+    llama_context * ctx_ref = llama_new_context_with_model(model, cparams);
+    assert(ctx != NULL && ctx_ref != NULL);
+
+    const std::vector<llama_token> a = make_prompt(n_prompt, 5);
+
+    // the same first block as a, then other tokens
+    std::vector<llama_token> b = make_prompt(n_prompt, 11);
+    std::copy(a.begin(), a.begin() + 40, b.begin());
+
+    const std::vector<float> ref_a = decode_fresh(ctx_ref, a);
+    const std::vector<float> ref_b = decode_fresh(ctx_ref, b);
+
+    // the full blocks of the prompt are indexed and kept after the sequence is removed
+    decode(ctx, 0, a, 0, n_prompt);
+    assert(llama_kv_cache_prefix_store(ctx, 0, a.data(), n_prompt) == 64);
+
+    llama_kv_cache_seq_rm(ctx, -1, -1, -1);
+    assert(llama_get_kv_cache_used_cells(ctx) == 64);
+
+    // only the first block of a diverging prompt matches
+    assert(llama_kv_cache_prefix_attach(ctx, 2, b.data(), n_prompt - 1) == 32);
+    compare("diverging", ref_b, decode(ctx, 2, b, 32, n_prompt));
+
+    // attached to two sequences, each continues the prompt in cells of its own
+    for (llama_seq_id s : { 1, 3 }) {
+        assert(llama_kv_cache_prefix_attach(ctx, s, a.data(), n_prompt - 1) == 64);
+        compare("attach", ref_a, decode(ctx, s, a, 64, n_prompt));
+    }
+    assert(llama_get_kv_cache_used_cells(ctx) == 64 + (n_prompt - 32) + 2*(n_prompt - 64));
+
+    // the sequences do not keep the indexed blocks from being evicted once they are removed, the last block of the
+    // prompt goes first although the first one was used less recently
+    llama_kv_cache_seq_rm(ctx, -1, -1, -1);
+    assert(llama_get_kv_cache_used_cells(ctx) == 64);
+
+    const std::vector<llama_token> c = make_prompt(n_ctx - 32, 23);
+
+    decode(ctx, 4, c, 0, 128);
+    compare("evict", decode_fresh(ctx_ref, c), decode(ctx, 4, c, 128, n_ctx - 32));
+
+    llama_kv_cache_seq_rm(ctx, 4, -1, -1);
+    assert(llama_kv_cache_prefix_attach(ctx, 5, a.data(), n_prompt - 1) == 32);
+    compare("evicted", ref_a, decode(ctx, 5, a, 32, n_prompt));
+
+    // a full cache evicts the rest
+    llama_kv_cache_seq_rm(ctx, -1, -1, -1);
+
+    const std::vector<llama_token> d = make_prompt(n_ctx, 29);
+
+    decode(ctx, 6, d, 0, 128);
+    compare("full", decode_fresh(ctx_ref, d), decode(ctx, 6, d, 128, n_ctx));
+
+    llama_kv_cache_seq_rm(ctx, 6, -1, -1);
+    assert(llama_get_kv_cache_used_cells(ctx) == 0);
+    assert(llama_kv_cache_prefix_attach(ctx, 7, a.data(), n_prompt - 1) == 0);
+
+    llama_free(ctx);
+    llama_free(ctx_ref);
+}
+
+int main(void) {
+    return tiny_model_run("test-kv-cache-prefix.gguf", test_kv_cache_prefix);
+}
@@ -0,0 +1,152 @@
+// Q8_0 and Q4_0 KV caches: logits close to the F16 cache, and the state, defrag and K-shift paths that move or
+// rewrite the quantized rows
+
+#include "llama.h"
+#include "common.h"
+#include "tiny-model.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static const int n_prompt = 40;
+
+static llama_token prompt_token(llama_pos pos) {
+    return 3 + (17*pos + 5) % 256;
+}
+
+// decodes the tokens of the positions [p0, p1) at the positions shifted by delta, returns the logits of the last one
+static std::vector<float> decode(llama_context * ctx, llama_pos p0, llama_pos p1, llama_pos delta = 0) {
+    llama_batch batch = llama_batch_init(p1 - p0, 0, 1);
+
+    for (llama_pos p = p0; p < p1; ++p) {
+        llama_batch_add(batch, prompt_token(p), p + delta, { 0 }, p + 1 == p1);
+    }
+
+    const int ret = llama_decode(ctx, batch);
+    assert(ret == 0);
+
+    llama_batch_free(batch);
+
+    const float * logits = llama_get_logits_ith(ctx, p1 - p0 - 1);
+
+    return std::vector<float>(logits, logits + llama_n_vocab(llama_get_model(ctx)));
+}
+
+// relative L2 error of the logits
+static void compare(const char * name, const std::vector<float> & ref, const std::vector<float> & cur, double tol) {
+    double sum_d = 0.0;
+    double sum_r = 0.0;
+    for (size_t i = 0; i < ref.size(); ++i) {
+        sum_d += (cur[i] - ref[i])*(cur[i] - ref[i]);
+        sum_r += ref[i]*ref[i];
+    }
+
+    const double err = sqrt(sum_d/sum_r);
+    if (!(err <= tol)) {
+        fprintf(stderr, "%s: %s: relative error %g, expected at most %g\n", __func__, name, err, tol);
+        assert(false);
+    }
+}
+
+static llama_context_params kv_params(ggml_type type_k, ggml_type type_v) {
+    llama_context_params cparams = tiny_model_context_params(256, 2*n_prompt);
+    cparams.flash_attn = true;
+    cparams.type_k     = type_k;
+    cparams.type_v     = type_v;
+    return cparams;
+}
+
+static void test_kv_quant(llama_model * model, ggml_type type, double tol) {
+    const char * name = ggml_type_name(type);
+
+    llama_context * ctx_ref = llama_new_context_with_model(model, kv_params(GGML_TYPE_F16, GGML_TYPE_F16));
+    llama_context * ctx     = llama_new_context_with_model(model, kv_params(type, type));
+    assert(ctx_ref != NULL && ctx != NULL);
+
+    // the rounding of K and V moves the logits a little
+    decode(ctx_ref, 0, n_prompt);
+    decode(ctx,     0, n_prompt);
+
+    const std::vector<float> ref = decode(ctx_ref, n_prompt, n_prompt + 1);
+    const std::vector<float> cur = decode(ctx,     n_prompt, n_prompt + 1);
+    compare(name, ref, cur, tol);
+
+    // the quantized rows are saved and restored as they are
+    {
+        llama_kv_cache_seq_rm(ctx, 0, n_prompt, -1);
+
+        std::vector<uint8_t> state(llama_get_state_size(ctx));
+        state.resize(llama_copy_state_data(ctx, state.data()));
+
+        const std::vector<float> a = decode(ctx, n_prompt, n_prompt + 1);
+
+        // one more token in the cache, which the restore drops again
+        decode(ctx, n_prompt, n_prompt + 1, 1);
+        llama_set_state_data(ctx, state.data());
+
+        compare(name, a, decode(ctx, n_prompt, n_prompt + 1), 1e-6);
+    }
+
+    // the quantized rows are moved whole by the defrag, only the order of the cells in the attention changes
+    {
+        llama_kv_cache_clear(ctx);
+        decode(ctx, 0, 2*n_prompt);
+
+        for (llama_pos p = 1; p < 2*n_prompt; p += 2) {
+            llama_kv_cache_seq_rm(ctx, 0, p, p + 1);
+        }
+
+        const std::vector<float> a = decode(ctx, 2*n_prompt, 2*n_prompt + 1);
+        llama_kv_cache_seq_rm(ctx, 0, 2*n_prompt, -1);
+
+        int n_moved = 0;
+        for (int ret; (ret = llama_kv_cache_defrag(ctx, 0)) > 0; ) {
+            n_moved += ret;
+        }
+        assert(n_moved > 0);
+
+        compare(name, a, decode(ctx, 2*n_prompt, 2*n_prompt + 1), 1e-2);
+    }
+
+    // the K-shift rotates the dequantized K rows and quantizes them again: the attention depends only on the distance
+    // of the positions, so the logits after shifting the whole sequence are close to the unshifted ones
+    {
+        const int n_shift = 8;
+
+        llama_kv_cache_clear(ctx);
+        decode(ctx, 0, n_prompt);
+
+        const std::vector<float> a = decode(ctx, n_prompt, n_prompt + 1);
+        llama_kv_cache_seq_rm(ctx, 0, n_prompt, -1);
+
+        llama_kv_cache_seq_shift(ctx, 0, 0, -1, n_shift);
+
+        compare(name, a, decode(ctx, n_prompt, n_prompt + 1, n_shift), tol);
+    }
+
+    llama_free(ctx);
+    llama_free(ctx_ref);
+}
+
+static void test_kv_cache_quant(llama_model * model) {
+    // measured: 0.017 for the Q8_0 cache and 0.18 for Q4_0, which its K-shift rounds a second time to 0.29
+    test_kv_quant(model, GGML_TYPE_Q8_0, 5e-2);
+    test_kv_quant(model, GGML_TYPE_Q4_0, 4e-1);
+
+    // without flash attention V is stored transposed, which cannot be quantized
+    llama_context_params cparams = kv_params(GGML_TYPE_F16, GGML_TYPE_Q8_0);
+    cparams.flash_attn = false;
+    assert(llama_new_context_with_model(model, cparams) == NULL);
+}
+
+int main(void) {
+    // heads of 32, a whole quantization block
+    return tiny_model_run("test-kv-cache-quant.gguf", test_kv_cache_quant, [](const std::string & path) {
+        tiny_model_write(path, 2, 1);
+    });
+}
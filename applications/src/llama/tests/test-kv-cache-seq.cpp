@@ -0,0 +1,218 @@
+// llama_kv_cache_seq_cp/rm/keep on the sequence sets of the KV cells, for ids in the bitmask and above LLAMA_MAX_SEQ
+
+#include "llama.h"
+#include "common.h"
+#include "tiny-model.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <string>
+#include <vector>
+
+static const int n_prompt = 64;
+
+// around the end of the bitmask (LLAMA_MAX_SEQ is 64) and in the list of the larger ids
+static const llama_seq_id seq_ids[] = { 0, 1, 2, 62, 63, 64, 65, 100, 1000 };
+static const int n_seq_ids = sizeof(seq_ids)/sizeof(seq_ids[0]);
+
+static llama_token prompt_token(llama_pos pos) {
+    return 3 + (13*pos + 7) % 256;
+}
+
+// decodes the prompt for seq 0 into the empty cache, to the cells 0 .. n_prompt - 1, and returns the logits
+static std::vector<float> decode_prompt(llama_context * ctx, llama_batch & batch, int n_tokens) {
+    llama_kv_cache_clear(ctx);
+
+    llama_batch_clear(batch);
+    for (llama_pos p = 0; p < n_tokens; ++p) {
+        llama_batch_add(batch, prompt_token(p), p, { 0 }, true);
+    }
+
+    const int ret = llama_decode(ctx, batch);
+    assert(ret == 0);
+
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    std::vector<float> logits;
+    for (int i = 0; i < n_tokens; ++i) {
+        logits.insert(logits.end(), llama_get_logits_ith(ctx, i), llama_get_logits_ith(ctx, i) + n_vocab);
+    }
+
+    return logits;
+}
+
+static void check_cells(llama_context * ctx, const std::vector<std::set<llama_seq_id>> & ref, int op) {
+    llama_kv_cache_view view = llama_kv_cache_view_init(ctx, n_seq_ids + 1);
+    llama_kv_cache_view_update(ctx, &view);
+
+    int n_tokens = 0;
+    int n_used   = 0;
+
+    for (int i = 0; i < view.n_cells; ++i) {
+        std::set<llama_seq_id> cur;
+        for (int j = 0; j < view.n_max_seq; ++j) {
+            const llama_seq_id id = view.cells_sequences[i*view.n_max_seq + j];
+            if (id >= 0) {
+                cur.insert(id);
+            }
+        }
+
+        const std::set<llama_seq_id> expected = i < (int) ref.size() ? ref[i] : std::set<llama_seq_id>();
+
+        if (cur != expected || (view.cells[i].pos >= 0) != !expected.empty() || (!expected.empty() && view.cells[i].pos != i)) {
+            fprintf(stderr, "%s: op %d: cell %d: pos %d, %zu sequences, expected %zu\n", __func__, op, i, view.cells[i].pos, cur.size(), expected.size());
+            assert(false);
+        }
+
+        n_tokens += expected.size();
+        n_used   += !expected.empty();
+    }
+
+    assert(llama_get_kv_cache_token_count(ctx) == n_tokens);
+    assert(llama_get_kv_cache_used_cells(ctx)  == n_used);
+
+    llama_kv_cache_view_free(&view);
+}
+
+// random copies, removals and keeps, checked against the sets of sequences of each cell
+static void test_seq_ops(llama_context * ctx) {
+    llama_batch batch = llama_batch_init(n_prompt, 0, 1);
+
+    srand(42);
+
+    std::vector<std::set<llama_seq_id>> ref;
+
+    for (int op = 0; op < 400; ++op) {
+        size_t n_used = 0;
+        for (const auto & seqs : ref) {
+            n_used += !seqs.empty();
+        }
+
+        if (n_used < 8) {
+            decode_prompt(ctx, batch, n_prompt);
+            ref.assign(n_prompt, { 0 });
+        }
+
+        const llama_seq_id seq_id = seq_ids[rand() % n_seq_ids];
+
+        llama_pos p0 = rand() % (n_prompt + 8) - 4;
+        llama_pos p1 = rand() % (n_prompt + 8) - 4;
+        if (p1 >= 0 && p0 > p1) {
+            std::swap(p0, p1);
+        }
+
+        const llama_pos r0 = std::max(p0, 0);
+        const llama_pos r1 = p1 < 0 ? n_prompt : std::min(p1, n_prompt);
+
+        switch (rand() % 20) {
+            case 0:
+                {
+                    llama_kv_cache_seq_keep(ctx, seq_id);
+                    for (auto & seqs : ref) {
+                        const bool has = seqs.count(seq_id) > 0;
+                        seqs.clear();
+                        if (has) {
+                            seqs.insert(seq_id);
+                        }
+                    }
+                } break;
+            case 1:
+                {
+                    llama_kv_cache_seq_rm(ctx, -1, p0, p1);
+                    for (llama_pos p = r0; p < r1; ++p) {
+                        ref[p].clear();
+                    }
+                } break;
+            case 2: case 3: case 4: case 5: case 6: case 7:
+                {
+                    llama_kv_cache_seq_rm(ctx, seq_id, p0, p1);
+                    for (llama_pos p = r0; p < r1; ++p) {
+                        ref[p].erase(seq_id);
+                    }
+                } break;
+            default:
+                {
+                    const llama_seq_id seq_id_dst = seq_ids[rand() % n_seq_ids];
+                    llama_kv_cache_seq_cp(ctx, seq_id, seq_id_dst, p0, p1);
+                    for (llama_pos p = r0; p < r1; ++p) {
+                        if (ref[p].count(seq_id)) {
+                            ref[p].insert(seq_id_dst);
+                        }
+                    }
+                } break;
+        }
+
+        check_cells(ctx, ref, op);
+    }
+
+    llama_batch_free(batch);
+}
+
+// the attention of a copied sequence is the attention of the original one, also after a removal
+static void test_seq_attention(llama_context * ctx) {
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    const llama_seq_id copies[] = { 1, 64, 1000 };
+
+    llama_batch batch = llama_batch_init(n_prompt, 0, 1);
+
+    const std::vector<float> ref = decode_prompt(ctx, batch, 40);
+
+    for (const llama_seq_id s : copies) {
+        llama_kv_cache_seq_cp(ctx, 0, s, -1, -1);
+    }
+
+    // the same token for seq 0 and the copies
+    llama_batch_clear(batch);
+    llama_batch_add(batch, prompt_token(40), 40, { 0 }, true);
+    for (const llama_seq_id s : copies) {
+        llama_batch_add(batch, prompt_token(40), 40, { s }, true);
+    }
+
+    int ret = llama_decode(ctx, batch);
+    assert(ret == 0);
+
+    for (int i = 1; i < batch.n_tokens; ++i) {
+        for (int j = 0; j < n_vocab; ++j) {
+            assert(std::fabs(llama_get_logits_ith(ctx, i)[j] - llama_get_logits_ith(ctx, 0)[j]) <= 1e-5f);
+        }
+    }
+
+    // a copy cut back to 20 tokens attends to the first 20 tokens of seq 0 only
+    for (const llama_seq_id s : copies) {
+        llama_kv_cache_seq_rm(ctx, s, 20, -1);
+    }
+
+    llama_batch_clear(batch);
+    for (const llama_seq_id s : copies) {
+        llama_batch_add(batch, prompt_token(20), 20, { s }, true);
+    }
+
+    ret = llama_decode(ctx, batch);
+    assert(ret == 0);
+
+    for (int i = 0; i < batch.n_tokens; ++i) {
+        for (int j = 0; j < n_vocab; ++j) {
+            const float expected = ref[20*n_vocab + j];
+            const float cur      = llama_get_logits_ith(ctx, i)[j];
+            if (!(std::fabs(cur - expected) <= 1e-5f*(1.0f + std::fabs(expected)))) {
+                fprintf(stderr, "%s: seq %d: logit %d: expected %f, got %f\n", __func__, copies[i], j, expected, cur);
+                assert(false);
+            }
+        }
+    }
+
+    llama_batch_free(batch);
+}
+
+int main(void) {
+    return tiny_model_run_ctx("test-kv-cache-seq.gguf", tiny_model_context_params(256, n_prompt), [](llama_context * ctx) {
+        test_seq_ops(ctx);
+        test_seq_attention(ctx);
+    });
+}
@@ -0,0 +1,98 @@
+// llama_sampling_sample_batch() draws the same tokens as llama_sampling_sample() per sequence, across calls
+
+#include "llama.h"
+#include "common.h"
+#include "sampling.h"
+#include "tiny-model.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static const int n_seq   = 6;
+static const int n_round = 8;
+
+static llama_sampling_params seq_params(int s) {
+    llama_sampling_params params;
+
+    switch (s % 3) {
+        case 0: params.temp = 0.0f; break;
+        case 1: params.top_k = 8; params.temp = 1.5f; params.penalty_repeat = 1.3f; break;
+        case 2: params.mirostat = 2; break;
+    }
+
+    return params;
+}
+
+static void test_sample_batch(llama_context * ctx, int n_threads) {
+    llama_kv_cache_clear(ctx);
+
+    std::vector<llama_sampling_context *> ref;
+    std::vector<llama_sampling_context *> cur;
+    for (int s = 0; s < n_seq; ++s) {
+        ref.push_back(llama_sampling_init(seq_params(s)));
+        cur.push_back(llama_sampling_init(seq_params(s)));
+    }
+
+    llama_batch_sampler * bsmpl = llama_batch_sampler_init(n_threads);
+
+    llama_batch batch = llama_batch_init(n_seq, 0, n_seq);
+
+    std::vector<llama_token> tokens(n_seq);
+    for (int s = 0; s < n_seq; ++s) {
+        tokens[s] = 3 + 17*s;
+    }
+
+    for (int r = 0; r < n_round; ++r) {
+        llama_batch_clear(batch);
+        for (int s = 0; s < n_seq; ++s) {
+            llama_batch_add(batch, tokens[s], r, { s }, true);
+        }
+
+        const int ret = llama_decode(ctx, batch);
+        assert(ret == 0);
+
+        std::vector<int> idxs(n_seq);
+        for (int s = 0; s < n_seq; ++s) {
+            idxs[s] = s;
+        }
+
+        llama_set_rng_seed(ctx, 1234 + r);
+        std::vector<llama_token> expected(n_seq);
+        for (int s = 0; s < n_seq; ++s) {
+            expected[s] = llama_sampling_sample(ref[s], ctx, nullptr, idxs[s]);
+        }
+
+        llama_set_rng_seed(ctx, 1234 + r);
+        const std::vector<llama_token> result = llama_sampling_sample_batch(bsmpl, cur, ctx, idxs);
+
+        for (int s = 0; s < n_seq; ++s) {
+            if (result[s] != expected[s]) {
+                fprintf(stderr, "%s: n_threads %d, round %d, seq %d: expected %d, got %d\n", __func__, n_threads, r, s, expected[s], result[s]);
+            }
+            assert(result[s] == expected[s]);
+
+            llama_sampling_accept(ref[s], ctx, expected[s], true);
+            llama_sampling_accept(cur[s], ctx, result[s], true);
+
+            tokens[s] = result[s];
+        }
+    }
+
+    llama_batch_free(batch);
+    llama_batch_sampler_free(bsmpl);
+
+    for (int s = 0; s < n_seq; ++s) {
+        llama_sampling_free(ref[s]);
+        llama_sampling_free(cur[s]);
+    }
+}
+
+int main(void) {
+    return tiny_model_run_ctx("test-sampling-batch.gguf", tiny_model_context_params(256, n_seq), [](llama_context * ctx) {
+        test_sample_batch(ctx, 1);
+        test_sample_batch(ctx, 3);
+    });
+}
@@ -0,0 +1,240 @@
+// llama_sampling_sample() draws the tokens of the full llama_sample_* chain, for random sampling parameters: the fused
+// top-k path and the allowed-token masks of the grammar states must not drift from the samplers they replace
+
+#include "llama.h"
+#include "common.h"
+#include "sampling.h"
+#include "tiny-model.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static const int n_configs = 200;
+static const int n_steps   = 50;
+
+// ASCII, 2 and 3 byte characters: the byte tokens leave UTF-8 sequences pending between the tokens
+static const char * grammar_str = R"(
+root ::= ( word | "é" | "日本" | "{" [0-9]+ "}" )+
+word ::= [a-z]+ " "
+)";
+
+static float rnd() {
+    return (float) rand()/RAND_MAX;
+}
+
+static void shuffle(std::string & str, size_t i0) {
+    for (size_t i = str.size(); i > i0 + 1; --i) {
+        std::swap(str[i - 1], str[i0 + rand() % (i - i0)]);
+    }
+}
+
+static llama_sampling_params random_params(int n_vocab) {
+    llama_sampling_params params;
+
+    const float temps[]     = { -1.0f, 0.0f, 0.5f, 0.8f, 1.5f };
+    const int   top_ks[]    = { 0, 1, 5, 40, n_vocab + 10 };
+    const int   last_ns[]   = { 0, 16, 64, -1 };
+    const int   n_probses[] = { 0, 3, 50 };
+
+    params.temp            = temps[rand() % 5];
+    params.top_k           = top_ks[rand() % 5];
+    params.top_p           = rand() % 2 ? 1.0f : 0.5f + 0.45f*rnd();
+    params.min_p           = rand() % 2 ? 0.0f : 0.2f*rnd();
+    params.tfs_z           = rand() % 3 ? 1.0f : 0.9f;
+    params.typical_p       = rand() % 3 ? 1.0f : 0.9f;
+    params.penalty_last_n  = last_ns[rand() % 4];
+    params.penalty_repeat  = rand() % 3 ? 1.0f + rnd() : 1.0f;
+    params.penalty_freq    = rand() % 2 ? 0.0f : 0.2f*rnd();
+    params.penalty_present = rand() % 2 ? 0.0f : 0.2f*rnd();
+    params.penalize_nl     = rand() % 2;
+    params.n_probs         = n_probses[rand() % 3];
+    params.mirostat        = rand() % 5 < 3 ? 0 : 1 + rand() % 2;
+
+    // mostly sequences that start with top_k, which take the fused path
+    shuffle(params.samplers_sequence, rand() % 4 ? 1 : 0);
+
+    for (int i = rand() % 4; i > 0; --i) {
+        params.logit_bias[rand() % n_vocab] = rand() % 4 ? 4.0f*rnd() - 2.0f : -INFINITY;
+    }
+
+    if (rand() % 10 < 3) {
+        params.grammar = grammar_str;
+    }
+
+    return params;
+}
+
+// llama_sample_grammar() on a copy of the grammar, whose states have no allowed-token masks yet, split so that the
+// candidates are never the whole vocabulary: the candidates are checked one by one against the grammar stacks
+static void sample_grammar_ref(llama_context * ctx, llama_token_data_array * cur_p, const llama_grammar * grammar) {
+    llama_grammar * copy = llama_grammar_copy(grammar);
+
+    llama_token_data_array head = { cur_p->data,                    cur_p->size - 1, false };
+    llama_token_data_array tail = { cur_p->data + cur_p->size - 1, 1,               false };
+
+    llama_sample_grammar(ctx, &head, copy);
+    llama_sample_grammar(ctx, &tail, copy);
+
+    llama_grammar_free(copy);
+}
+
+// the sampling of the whole candidate array, as llama_sampling_sample() did it before the fused path
+static llama_token sample_ref(llama_sampling_context * ctx_sampling, llama_context * ctx, float * logits, std::vector<llama_token_data> & cur) {
+    const llama_sampling_params & params = ctx_sampling->params;
+
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    const int32_t penalty_last_n = params.penalty_last_n < 0 ? params.n_prev : params.penalty_last_n;
+    const llama_token token_nl   = llama_token_nl(llama_get_model(ctx));
+
+    const auto & prev = ctx_sampling->prev;
+
+    size_t min_keep = std::max(1, params.n_probs);
+
+    for (const auto & it : params.logit_bias) {
+        logits[it.first] += it.second;
+    }
+
+    cur.clear();
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        cur.push_back(llama_token_data{ id, logits[id], 0.0f });
+    }
+
+    llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+
+    const float nl_logit = logits[token_nl];
+
+    llama_sample_repetition_penalties(ctx, &cur_p, prev.data() + prev.size() - penalty_last_n, penalty_last_n,
+            params.penalty_repeat, params.penalty_freq, params.penalty_present);
+
+    if (!params.penalize_nl) {
+        for (size_t i = 0; i < cur_p.size; ++i) {
+            if (cur_p.data[i].id == token_nl) {
+                cur_p.data[i].logit = nl_logit;
+                break;
+            }
+        }
+    }
+
+    if (ctx_sampling->grammar) {
+        sample_grammar_ref(ctx, &cur_p, ctx_sampling->grammar);
+    }
+
+    if (params.temp < 0.0f) {
+        llama_sample_softmax(ctx, &cur_p);
+        return cur_p.data[0].id;
+    }
+
+    if (params.temp == 0.0f) {
+        return llama_sample_token_greedy(ctx, &cur_p);
+    }
+
+    if (params.mirostat == 1) {
+        llama_sample_temp(ctx, &cur_p, params.temp);
+        return llama_sample_token_mirostat(ctx, &cur_p, params.mirostat_tau, params.mirostat_eta, 100, &ctx_sampling->mirostat_mu);
+    }
+
+    if (params.mirostat == 2) {
+        llama_sample_temp(ctx, &cur_p, params.temp);
+        return llama_sample_token_mirostat_v2(ctx, &cur_p, params.mirostat_tau, params.mirostat_eta, &ctx_sampling->mirostat_mu);
+    }
+
+    const int32_t top_k = params.top_k <= 0 ? n_vocab : params.top_k;
+
+    for (const char s : params.samplers_sequence) {
+        switch (s) {
+            case 'k': llama_sample_top_k    (ctx, &cur_p, top_k,            min_keep); break;
+            case 'f': llama_sample_tail_free(ctx, &cur_p, params.tfs_z,     min_keep); break;
+            case 'y': llama_sample_typical  (ctx, &cur_p, params.typical_p, min_keep); break;
+            case 'p': llama_sample_top_p    (ctx, &cur_p, params.top_p,     min_keep); break;
+            case 'm': llama_sample_min_p    (ctx, &cur_p, params.min_p,     min_keep); break;
+            case 't': llama_sample_temp     (ctx, &cur_p, params.temp); break;
+            default : break;
+        }
+    }
+
+    const llama_token id = llama_sample_token(ctx, &cur_p);
+
+    cur.resize(cur_p.size);
+
+    return id;
+}
+
+static void test_sampling_chain(llama_context * ctx) {
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    // the logits of one decoded token are overwritten with random ones at each step
+    llama_batch batch = llama_batch_init(1, 0, 1);
+    llama_batch_add(batch, 3, 0, { 0 }, true);
+
+    const int ret = llama_decode(ctx, batch);
+    assert(ret == 0);
+
+    llama_batch_free(batch);
+
+    float * logits = llama_get_logits_ith(ctx, 0);
+
+    srand(1234);
+
+    std::vector<float> logits_ref(n_vocab);
+    std::vector<llama_token_data> cur_ref;
+
+    for (int c = 0; c < n_configs; ++c) {
+        const llama_sampling_params params = random_params(n_vocab);
+
+        // equal logits at the top-k boundary take the full sort
+        const bool ties = rand() % 3 == 0;
+
+        llama_sampling_context * ctx_cur = llama_sampling_init(params);
+        llama_sampling_context * ctx_ref = llama_sampling_init(params);
+
+        for (int step = 0; step < n_steps; ++step) {
+            for (int i = 0; i < n_vocab; ++i) {
+                const float v = 10.0f*rnd() - 5.0f;
+                logits[i] = ties ? std::round(2.0f*v)/2.0f : v;
+            }
+
+            memcpy(logits_ref.data(), logits, n_vocab*sizeof(float));
+
+            llama_set_rng_seed(ctx, c*n_steps + step);
+            const llama_token id = llama_sampling_sample(ctx_cur, ctx, nullptr, 0);
+
+            llama_set_rng_seed(ctx, c*n_steps + step);
+            const llama_token id_ref = sample_ref(ctx_ref, ctx, logits_ref.data(), cur_ref);
+
+            if (id != id_ref) {
+                fprintf(stderr, "%s: config %d, step %d: expected token %d, got %d\n", __func__, c, step, id_ref, id);
+                assert(false);
+            }
+
+            // only the logit bias is added to the logits
+            assert(memcmp(logits, logits_ref.data(), n_vocab*sizeof(float)) == 0);
+
+            // the probabilities of the candidates that are left, as read for n_probs
+            if (params.temp > 0.0f && params.mirostat == 0) {
+                const auto & cur = ctx_cur->cur;
+
+                for (size_t i = 0; i < std::min<size_t>(cur_ref.size(), params.n_probs); ++i) {
+                    assert(cur[i].id == cur_ref[i].id && cur[i].p == cur_ref[i].p);
+                }
+            }
+
+            llama_sampling_accept(ctx_cur, ctx, id,     true);
+            llama_sampling_accept(ctx_ref, ctx, id_ref, true);
+        }
+
+        llama_sampling_free(ctx_cur);
+        llama_sampling_free(ctx_ref);
+    }
+}
+
+int main(void) {
+    return tiny_model_run_ctx("test-sampling-chain.gguf", tiny_model_context_params(64, 8), test_sampling_chain);
+}
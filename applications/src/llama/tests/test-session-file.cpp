@@ -0,0 +1,139 @@
+// saving, appending to and loading session files, and loading a corrupted one
+
+#include "llama.h"
+#include "common.h"
+#include "tiny-model.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static const std::string path_session = "test-session-file.session";
+
+static std::vector<llama_token> make_tokens(int n, int seed) {
+    std::vector<llama_token> tokens;
+    for (int i = 0; i < n; ++i) {
+        tokens.push_back(3 + (seed + 37*i) % 256);
+    }
+    return tokens;
+}
+
+// the last token is decoded alone, so that the context keeps the logits of a single token and the records stay small
+static void decode(llama_context * ctx, const std::vector<llama_token> & tokens, llama_pos p0) {
+    llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        if (i + 1 == tokens.size() && batch.n_tokens > 0) {
+            const int ret = llama_decode(ctx, batch);
+            assert(ret == 0);
+            llama_batch_clear(batch);
+        }
+        llama_batch_add(batch, tokens[i], p0 + i, { 0 }, i + 1 == tokens.size());
+    }
+
+    const int ret = llama_decode(ctx, batch);
+    assert(ret == 0);
+
+    llama_batch_free(batch);
+}
+
+static std::vector<float> next_logits(llama_context * ctx, llama_token token, llama_pos pos) {
+    decode(ctx, { token }, pos);
+
+    const float * logits = llama_get_logits_ith(ctx, 0);
+
+    return std::vector<float>(logits, logits + llama_n_vocab(llama_get_model(ctx)));
+}
+
+static std::vector<uint8_t> get_state(llama_context * ctx) {
+    std::vector<uint8_t> state(llama_get_state_size(ctx));
+    state.resize(llama_copy_state_data(ctx, state.data()));
+    return state;
+}
+
+static size_t file_size(const std::string & path) {
+    FILE * f = fopen(path.c_str(), "rb");
+    assert(f != NULL);
+    fseek(f, 0, SEEK_END);
+    const size_t size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+// a checkpoint, a second checkpoint appended to it, then the cache of a new context loaded from the file
+static void test_save_append_load(llama_model * model, const llama_context_params & cparams) {
+    const std::vector<llama_token> tokens = make_tokens(60, 1);
+
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+
+    decode(ctx, std::vector<llama_token>(tokens.begin(), tokens.begin() + 40), 0);
+    assert(llama_save_session_file(ctx, path_session.c_str(), tokens.data(), 40));
+    const size_t size_first = file_size(path_session);
+
+    decode(ctx, std::vector<llama_token>(tokens.begin() + 40, tokens.end()), 40);
+    assert(llama_append_session_file(ctx, path_session.c_str(), tokens.data(), tokens.size()));
+    assert(file_size(path_session) > size_first);
+
+    const std::vector<float> ref = next_logits(ctx, 7, tokens.size());
+
+    llama_free(ctx);
+
+    ctx = llama_new_context_with_model(model, cparams);
+
+    std::vector<llama_token> tokens_out(cparams.n_ctx);
+    size_t n_token_count = 0;
+    assert(llama_load_session_file(ctx, path_session.c_str(), tokens_out.data(), tokens_out.size(), &n_token_count));
+
+    tokens_out.resize(n_token_count);
+    assert(tokens_out == tokens);
+
+    const std::vector<float> cur = next_logits(ctx, 7, tokens.size());
+
+    for (size_t i = 0; i < ref.size(); ++i) {
+        if (std::fabs(cur[i] - ref[i]) > 1e-5f*(1.0f + std::fabs(ref[i]))) {
+            fprintf(stderr, "%s: logit %zu: expected %f, got %f\n", __func__, i, ref[i], cur[i]);
+            assert(false);
+        }
+    }
+
+    llama_free(ctx);
+
+    // the rng of the second record is corrupted: the load fails and leaves the state of the context as it was
+    {
+        FILE * f = fopen(path_session.c_str(), "r+b");
+        assert(f != NULL);
+
+        // size of the record, n_token_keep, n_token_new, the new tokens, rng size, then the rng
+        fseek(f, size_first + 2*sizeof(uint32_t) + sizeof(uint64_t) + 20*sizeof(llama_token) + sizeof(uint32_t), SEEK_SET);
+        fputc('x', f);
+        fclose(f);
+    }
+
+    ctx = llama_new_context_with_model(model, cparams);
+
+    decode(ctx, make_tokens(30, 2), 0);
+
+    const std::vector<uint8_t> state = get_state(ctx);
+
+    tokens_out.resize(cparams.n_ctx);
+    assert(!llama_load_session_file(ctx, path_session.c_str(), tokens_out.data(), tokens_out.size(), &n_token_count));
+
+    assert(get_state(ctx) == state);
+
+    llama_free(ctx);
+
+    remove(path_session.c_str());
+}
+
+int main(void) {
+    llama_context_params cparams = tiny_model_context_params(256, 128);
+    cparams.seed = 1234;
+
+    return tiny_model_run("test-session-file.gguf", [&](llama_model * model) {
+        test_save_append_load(model, cparams);
+    });
+}
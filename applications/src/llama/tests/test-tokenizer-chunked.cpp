@@ -0,0 +1,85 @@
+// tokenizing a long text in chunks on several threads gives the tokens of the whole text
+
+#include "llama.h"
+#include "common.h"
+#include "tiny-model.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// words, spaces and punctuation in the patterns that the BPE pre-tokenizer splits differently
+static std::string make_text(size_t size, unsigned seed) {
+    static const char * words[] = {
+        "the", "and", "The", "that", "is", "in", "thing", "on", "ORDER", "fall", "sound", "mother", "caf\xc3\xa9",
+        "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e", "\xf0\x9f\x99\x82", "it's", "don't", "we'll", "1234", "3.14",
+        "a", "b", "x", "(note)", "--", "...",
+    };
+    static const char * seps[] = {
+        " ", " ", " ", " ", " ", ", ", ". ", "\n", "\n\n", "  ", "   ", "\t", "! ", " - ",
+    };
+
+    const int n_words = sizeof(words)/sizeof(words[0]);
+    const int n_seps  = sizeof(seps)/sizeof(seps[0]);
+
+    srand(seed);
+
+    std::string text;
+    while (text.size() < size) {
+        text += words[rand() % n_words];
+        text += seps[rand() % n_seps];
+    }
+
+    return text;
+}
+
+static std::vector<llama_token> tokenize(const llama_model * model, const std::string & text, int n_threads) {
+    std::vector<llama_token> tokens(text.size() + 1);
+
+    const int n = llama_tokenize_parallel(model, text.data(), text.size(), tokens.data(), tokens.size(), true, false, n_threads);
+    assert(n >= 0);
+
+    tokens.resize(n);
+
+    return tokens;
+}
+
+static void test_chunked(const llama_model * model, const std::string & text) {
+    const std::vector<llama_token> whole = tokenize(model, text, 1);
+
+    for (int n_threads : { 2, 5 }) {
+        const std::vector<llama_token> chunked = tokenize(model, text, n_threads);
+
+        if (chunked != whole) {
+            size_t i = 0;
+            while (i < chunked.size() && i < whole.size() && chunked[i] == whole[i]) {
+                i++;
+            }
+            fprintf(stderr, "%s: size %zu, n_threads %d: %zu tokens instead of %zu, first difference at token %zu\n",
+                    __func__, text.size(), n_threads, chunked.size(), whole.size(), i);
+        }
+        assert(chunked == whole);
+    }
+}
+
+int main(void) {
+    return tiny_model_run("test-tokenizer-chunked.gguf", [](llama_model * model) {
+        assert(llama_vocab_type(model) == LLAMA_VOCAB_TYPE_BPE);
+
+        // short texts are never chunked, long ones are cut into several chunks
+        test_chunked(model, make_text(1000, 1));
+
+        // the chunk boundaries move with the start of the text
+        const std::string text = make_text(300*1024, 7);
+        for (size_t offs = 0; offs < 64; offs += 3) {
+            size_t begin = offs;
+            while ((text[begin] & 0xC0) == 0x80) {
+                begin++; // not in the middle of a utf-8 sequence
+            }
+            test_chunked(model, text.substr(begin));
+        }
+    }, tiny_model_write_vocab_bpe, true);
+}
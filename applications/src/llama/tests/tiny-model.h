@@ -0,0 +1,253 @@
+#pragma once
+
+// writes a tiny random llama model for the tests, so that they do not depend on model files
+
+#include "ggml.h"
+#include "llama.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+static void tiny_model_add_tensor(struct ggml_context * ctx, struct gguf_context * gguf, const std::string & name,
+        int64_t ne0, int64_t ne1, float scale, float bias) {
+    struct ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+    ggml_set_name(t, name.c_str());
+
+    float * data = (float *) t->data;
+    for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+        data[i] = bias + scale*(2.0f*rand()/RAND_MAX - 1.0f);
+    }
+
+    gguf_add_tensor(gguf, t);
+}
+
+// SPM vocab of <unk>, <s>, </s> and the 256 byte tokens
+static void tiny_model_add_vocab(struct gguf_context * gguf) {
+    std::vector<std::string> tokens = { "<unk>", "<s>", "</s>" };
+    std::vector<float>       scores = { 0.0f, 0.0f, 0.0f };
+    std::vector<int32_t>     types  = { LLAMA_TOKEN_TYPE_UNKNOWN, LLAMA_TOKEN_TYPE_CONTROL, LLAMA_TOKEN_TYPE_CONTROL };
+
+    for (int i = 0; i < 256; ++i) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "<0x%02X>", i);
+        tokens.push_back(buf);
+        scores.push_back(0.0f);
+        types.push_back(LLAMA_TOKEN_TYPE_BYTE);
+    }
+
+    std::vector<const char *> strs;
+    for (const auto & token : tokens) {
+        strs.push_back(token.c_str());
+    }
+
+    gguf_set_val_str (gguf, "tokenizer.ggml.model", "llama");
+    gguf_set_arr_str (gguf, "tokenizer.ggml.tokens", strs.data(), strs.size());
+    gguf_set_arr_data(gguf, "tokenizer.ggml.scores", GGUF_TYPE_FLOAT32, scores.data(), scores.size());
+    gguf_set_arr_data(gguf, "tokenizer.ggml.token_type", GGUF_TYPE_INT32, types.data(), types.size());
+    gguf_set_val_u32 (gguf, "tokenizer.ggml.bos_token_id", 1);
+    gguf_set_val_u32 (gguf, "tokenizer.ggml.eos_token_id", 2);
+    gguf_set_val_u32 (gguf, "tokenizer.ggml.unknown_token_id", 0);
+}
+
+// GPT-2 style BPE vocab of the 256 byte tokens and the tokens of a few merges of common english letters
+static void tiny_model_add_vocab_bpe(struct gguf_context * gguf) {
+    // the printable bytes stand for themselves, the others for the code points from 256 on, as in GPT-2
+    auto byte_to_str = [](int b) {
+        int cp = b;
+        if (!((b >= '!' && b <= '~') || (b >= 0xA1 && b <= 0xAC) || (b >= 0xAE && b <= 0xFF))) {
+            int n = 0;
+            for (int i = 0; i < b; ++i) {
+                n += !((i >= '!' && i <= '~') || (i >= 0xA1 && i <= 0xAC) || (i >= 0xAE && i <= 0xFF));
+            }
+            cp = 256 + n;
+        }
+
+        std::string str;
+        if (cp < 0x80) {
+            str += (char) cp;
+        } else {
+            str += (char) (0xC0 | (cp >> 6));
+            str += (char) (0x80 | (cp & 0x3F));
+        }
+        return str;
+    };
+
+    std::vector<std::string> tokens;
+    for (int b = 0; b < 256; ++b) {
+        tokens.push_back(byte_to_str(b));
+    }
+
+    const std::string sp = byte_to_str(' ');
+    const std::string nl = byte_to_str('\n');
+
+    const std::vector<std::pair<std::string, std::string>> merges = {
+        { sp, "t" }, { "h", "e" }, { "i", "n" }, { sp, "a" }, { "e", "r" }, { "o", "n" }, { sp + "t", "he" },
+        { "r", "e" }, { "a", "t" }, { sp, "s" }, { "e", "n" }, { "o", "r" }, { sp, "w" }, { "a", "n" },
+        { "an", "d" }, { sp + "a", "nd" }, { sp, "o" }, { sp, "c" }, { "i", "s" }, { "e", "s" }, { "in", "g" },
+        { sp, "b" }, { sp, "f" }, { "o", "u" }, { "l", "l" }, { sp, "m" }, { sp, sp }, { nl, nl },
+    };
+
+    std::vector<std::string> merge_strs;
+    for (const auto & merge : merges) {
+        tokens.push_back(merge.first + merge.second);
+        merge_strs.push_back(merge.first + " " + merge.second);
+    }
+
+    std::vector<const char *> strs;
+    for (const auto & token : tokens) {
+        strs.push_back(token.c_str());
+    }
+
+    std::vector<const char *> merge_cstrs;
+    for (const auto & merge : merge_strs) {
+        merge_cstrs.push_back(merge.c_str());
+    }
+
+    std::vector<float>   scores(tokens.size(), 0.0f);
+    std::vector<int32_t> types (tokens.size(), LLAMA_TOKEN_TYPE_NORMAL);
+
+    gguf_set_val_str (gguf, "tokenizer.ggml.model", "gpt2");
+    gguf_set_arr_str (gguf, "tokenizer.ggml.tokens", strs.data(), strs.size());
+    gguf_set_arr_data(gguf, "tokenizer.ggml.scores", GGUF_TYPE_FLOAT32, scores.data(), scores.size());
+    gguf_set_arr_data(gguf, "tokenizer.ggml.token_type", GGUF_TYPE_INT32, types.data(), types.size());
+    gguf_set_arr_str (gguf, "tokenizer.ggml.merges", merge_cstrs.data(), merge_cstrs.size());
+}
+
+static void tiny_model_set_hparams(struct gguf_context * gguf, int n_embd, int n_head, int n_head_kv, int n_layer, int n_ff) {
+    gguf_set_val_str(gguf, "general.architecture", "llama");
+    gguf_set_val_str(gguf, "general.name", "tiny");
+    gguf_set_val_u32(gguf, "general.file_type", 0);
+    gguf_set_val_u32(gguf, "llama.context_length", 4096);
+    gguf_set_val_u32(gguf, "llama.embedding_length", n_embd);
+    gguf_set_val_u32(gguf, "llama.block_count", n_layer);
+    gguf_set_val_u32(gguf, "llama.feed_forward_length", n_ff);
+    gguf_set_val_u32(gguf, "llama.rope.dimension_count", n_embd/n_head);
+    gguf_set_val_u32(gguf, "llama.attention.head_count", n_head);
+    gguf_set_val_u32(gguf, "llama.attention.head_count_kv", n_head_kv);
+    gguf_set_val_f32(gguf, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+}
+
+// the BPE vocab without weights, load it with vocab_only
+static void tiny_model_write_vocab_bpe(const std::string & path) {
+    struct gguf_context * gguf = gguf_init_empty();
+
+    tiny_model_set_hparams(gguf, 64, 4, 2, 2, 128);
+    tiny_model_add_vocab_bpe(gguf);
+
+    gguf_write_to_file(gguf, path.c_str(), false);
+
+    gguf_free(gguf);
+}
+
+// 2 layers of 64 embeddings with F32 weights, in n_head heads for the queries and n_head_kv for the keys and values
+static void tiny_model_write(const std::string & path, int n_head, int n_head_kv) {
+    const int n_embd    = 64;
+    const int n_layer   = 2;
+    const int n_ff      = 128;
+    const int n_vocab   = 3 + 256;
+
+    const int n_embd_gqa = n_embd/n_head*n_head_kv;
+
+    struct ggml_init_params params = { 16u*1024*1024, NULL, false };
+    struct ggml_context * ctx  = ggml_init(params);
+    struct gguf_context * gguf = gguf_init_empty();
+
+    tiny_model_set_hparams(gguf, n_embd, n_head, n_head_kv, n_layer, n_ff);
+    tiny_model_add_vocab(gguf);
+
+    srand(1);
+
+    const float s = 1.0f/sqrtf((float) n_embd);
+
+    tiny_model_add_tensor(ctx, gguf, "token_embd.weight",  n_embd, n_vocab, 1.0f, 0.0f);
+    tiny_model_add_tensor(ctx, gguf, "output_norm.weight", n_embd, 0,       0.1f, 1.0f);
+    tiny_model_add_tensor(ctx, gguf, "output.weight",      n_embd, n_vocab, 0.3f, 0.0f);
+
+    for (int il = 0; il < n_layer; ++il) {
+        const std::string blk = "blk." + std::to_string(il) + ".";
+
+        tiny_model_add_tensor(ctx, gguf, blk + "attn_norm.weight",   n_embd, 0,          0.1f,   1.0f);
+        tiny_model_add_tensor(ctx, gguf, blk + "attn_q.weight",      n_embd, n_embd,     3.0f*s, 0.0f);
+        tiny_model_add_tensor(ctx, gguf, blk + "attn_k.weight",      n_embd, n_embd_gqa, 3.0f*s, 0.0f);
+        tiny_model_add_tensor(ctx, gguf, blk + "attn_v.weight",      n_embd, n_embd_gqa, 3.0f*s, 0.0f);
+        tiny_model_add_tensor(ctx, gguf, blk + "attn_output.weight", n_embd, n_embd,     s,      0.0f);
+        tiny_model_add_tensor(ctx, gguf, blk + "ffn_norm.weight",    n_embd, 0,          0.1f,   1.0f);
+        tiny_model_add_tensor(ctx, gguf, blk + "ffn_gate.weight",    n_embd, n_ff,       2.0f*s, 0.0f);
+        tiny_model_add_tensor(ctx, gguf, blk + "ffn_down.weight",    n_ff,   n_embd,     s,      0.0f);
+        tiny_model_add_tensor(ctx, gguf, blk + "ffn_up.weight",      n_embd, n_ff,       2.0f*s, 0.0f);
+    }
+
+    gguf_write_to_file(gguf, path.c_str(), false);
+
+    gguf_free(gguf);
+    ggml_free(ctx);
+}
+
+// heads of 16
+static void tiny_model_write(const std::string & path) {
+    tiny_model_write(path, 4, 2);
+}
+
+// the fixture of the tests: writes the model to path, loads it and calls test(model), then frees everything and
+// removes the file again
+template <typename F>
+static int tiny_model_run(const std::string & path, F test,
+        void (*write)(const std::string &) = tiny_model_write, bool vocab_only = false) {
+    write(path);
+
+    llama_backend_init(false);
+
+    llama_model_params mparams = llama_model_default_params();
+    mparams.vocab_only = vocab_only;
+
+    llama_model * model = llama_load_model_from_file(path.c_str(), mparams);
+    if (model == NULL) {
+        fprintf(stderr, "%s: failed to load %s\n", __func__, path.c_str());
+        return 1;
+    }
+
+    test(model);
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    remove(path.c_str());
+
+    return 0;
+}
+
+// context params for the tests, on one thread also for the batches
+static llama_context_params tiny_model_context_params(int n_ctx, int n_batch) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = n_ctx;
+    cparams.n_batch         = n_batch;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+
+    return cparams;
+}
+
+// tiny_model_run() with a context made with cparams, calls test(ctx)
+template <typename F>
+static int tiny_model_run_ctx(const std::string & path, const llama_context_params & cparams, F test) {
+    bool ok = true;
+
+    const int ret = tiny_model_run(path, [&](llama_model * model) {
+        llama_context * ctx = llama_new_context_with_model(model, cparams);
+        if (ctx == NULL) {
+            fprintf(stderr, "%s: failed to create the context\n", __func__);
+            ok = false;
+            return;
+        }
+
+        test(ctx);
+
+        llama_free(ctx);
+    });
+
+    return ret != 0 || !ok ? 1 : 0;
+}
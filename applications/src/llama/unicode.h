@@ -391,8 +391,10 @@ static std::unordered_map<uint32_t, int> codepoint_type_map() {
 }
 
 static int codepoint_type(uint32_t cp) {
-    static std::unordered_map<uint32_t, int> codepoint_types = codepoint_type_map();
-    return codepoint_types[cp];
+    static const std::unordered_map<uint32_t, int> codepoint_types = codepoint_type_map();
+    // no insertion for unknown code points, so that texts can be tokenized concurrently
+    const auto it = codepoint_types.find(cp);
+    return it == codepoint_types.end() ? CODEPOINT_TYPE_UNIDENTIFIED : it->second;
 }
 
 static int codepoint_type(const std::string & utf8) {